@@ -1885,6 +1885,47 @@ PMOD_EXPORT void f_unicode_to_string(INT32 args)
   push_string(out);
 }
 
+/* string_to_utf8() for 8-bit strings. Returns NULL if the string
+ * only contains 7-bit characters, and thus already is valid UTF-8.
+ */
+static struct pike_string *narrow_string_to_utf8(struct pike_string *in)
+{
+  const p_wchar0 *src = STR0(in);
+  ptrdiff_t prefix = ascii_prefix_length(src, in->len);
+  ptrdiff_t len = in->len;
+  ptrdiff_t i, j;
+  struct pike_string *out;
+
+  if (prefix == in->len) return NULL;
+
+  for (i = prefix; i < in->len; i++)
+    len += src[i] >> 7;
+
+  out = begin_shared_string(len);
+  MEMCPY(out->str, src, prefix);
+  for (i = j = prefix; i < in->len;) {
+    unsigned INT32 c = src[i];
+    if (c & 0x80) {
+      /* 8bit */
+      out->str[j++] = 0xc0 | (c >> 6);
+      out->str[j++] = 0x80 | (c & 0x3f);
+      i++;
+    } else {
+      ptrdiff_t run = ascii_prefix_length(src + i, in->len - i);
+      MEMCPY(out->str + j, src + i, run);
+      i += run;
+      j += run;
+    }
+  }
+#ifdef PIKE_DEBUG
+  if (len != j) {
+    Pike_fatal("string_to_utf8(): Calculated and actual lengths differ: "
+	       "%"PRINTPTRDIFFT"d != %"PRINTPTRDIFFT"d\n", len, j);
+  }
+#endif /* PIKE_DEBUG */
+  return end_shared_string(out);
+}
+
 /*! @decl string(0..255) string_to_utf8(string s)
  *! @decl string(0..255) string_to_utf8(string s, int extended)
  *!
@@ -1913,10 +1954,26 @@ PMOD_EXPORT void f_string_to_utf8(INT32 args)
 
   get_all_args("string_to_utf8", args, "%W.%i", &in, &extended);
 
+  if (!in->size_shift) {
+    if (!(out = narrow_string_to_utf8(in))) {
+      /* 7bit string -- already valid utf8. */
+      pop_n_elems(args - 1);
+      return;
+    }
+    pop_n_elems(args);
+    push_string(out);
+    return;
+  }
+
+  /* Only wide strings from here on. */
+#define WIDE_INDEX(S, I)						\
+  ((S)->size_shift == 1 ? (unsigned INT32)STR1(S)[I] :			\
+   (unsigned INT32)STR2(S)[I])
+
   len = in->len;
 
   for(i=0; i < in->len; i++) {
-    unsigned INT32 c = index_shared_string(in, i);
+    unsigned INT32 c = WIDE_INDEX(in, i);
     if (c & ~0x7f) {
       /* 8bit or more. */
       len++;
@@ -1963,7 +2020,7 @@ PMOD_EXPORT void f_string_to_utf8(INT32 args)
   out = begin_shared_string(len);
 
   for(i=j=0; i < in->len; i++) {
-    unsigned INT32 c = index_shared_string(in, i);
+    unsigned INT32 c = WIDE_INDEX(in, i);
     if (!(c & ~0x7f)) {
       /* 7bit */
       out->str[j++] = c;
@@ -2008,6 +2065,7 @@ PMOD_EXPORT void f_string_to_utf8(INT32 args)
       out->str[j++] = 0x80 | (c & 0x3f);
     }
   }
+#undef WIDE_INDEX
 #ifdef PIKE_DEBUG
   if (len != j) {
     Pike_fatal("string_to_utf8(): Calculated and actual lengths differ: "
@@ -2045,14 +2103,29 @@ PMOD_EXPORT void f_utf8_to_string(INT32 args)
   ptrdiff_t len = 0;
   int shift = 0;
   ptrdiff_t i,j=0;
+  ptrdiff_t prefix;
   INT_TYPE extended = 0;
 
   get_all_args("utf8_to_string", args, "%S.%i", &in, &extended);
 
-  for(i=0; i < in->len; i++) {
+  prefix = ascii_prefix_length(STR0(in), in->len);
+  if (prefix == in->len) {
+    /* 7bit in == 7bit out */
+    pop_n_elems(args-1);
+    return;
+  }
+
+  for(i = len = prefix; i < in->len; i++) {
     unsigned int c = STR0(in)[i];
+    if (!(c & 0x80)) {
+      /* Skip the whole run of 7bit characters. */
+      ptrdiff_t run = ascii_prefix_length(STR0(in) + i, in->len - i);
+      len += run;
+      i += run - 1;
+      continue;
+    }
     len++;
-    if (c & 0x80) {
+    {
       int cont = 0;
 
       /* From table 3-6 in the Unicode standard 4.0: Well-Formed UTF-8
@@ -2227,7 +2300,8 @@ PMOD_EXPORT void f_utf8_to_string(INT32 args)
   switch (shift) {
     case 0: {
       p_wchar0 *out_str = STR0 (out);
-      for(i=0; i < in->len;) {
+      MEMCPY(out_str, STR0(in), prefix);
+      for(i = j = prefix; i < in->len;) {
 	unsigned int c = STR0(in)[i++];
 	/* NOTE: No tests here since we've already tested the string above. */
 	if (c & 0x80) {
@@ -2243,7 +2317,9 @@ PMOD_EXPORT void f_utf8_to_string(INT32 args)
 
     case 1: {
       p_wchar1 *out_str = STR1 (out);
-      for(i=0; i < in->len;) {
+      for (j = 0; j < prefix; j++)
+	out_str[j] = STR0(in)[j];
+      for(i = prefix; i < in->len;) {
 	unsigned int c = STR0(in)[i++];
 	/* NOTE: No tests here since we've already tested the string above. */
 	if (c & 0x80) {
@@ -2267,7 +2343,9 @@ PMOD_EXPORT void f_utf8_to_string(INT32 args)
 
     case 2: {
       p_wchar2 *out_str = STR2 (out);
-      for(i=0; i < in->len;) {
+      for (j = 0; j < prefix; j++)
+	out_str[j] = STR0(in)[j];
+      for(i = prefix; i < in->len;) {
 	unsigned int c = STR0(in)[i++];
 	/* NOTE: No tests here since we've already tested the string above. */
 	if (c & 0x80) {
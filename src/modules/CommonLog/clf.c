@@ -12,6 +12,7 @@
 #include "program.h"
 #include "interpret.h"
 #include "builtin_functions.h"
+#include "mapping.h"
 #include "module_support.h"
 #include "pike_error.h"
 #include "bignum.h"
@@ -21,12 +22,22 @@
 #include <stdio.h>
 #include <fcntl.h>
 
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#define CLF_USE_MMAP
+#ifndef MAP_FAILED
+#define MAP_FAILED	((void *)-1)
+#endif
+#endif
+
 
 #define sp Pike_sp
 
 /** Forward declarations of functions implementing Pike functions **/
 
 static void f_read( INT32 args );
+static void f_read_columns( INT32 args );
+static void f_read_counts( INT32 args );
 
 
 /** Global tables **/
@@ -79,6 +90,12 @@ PIKE_MODULE_INIT
   add_function_constant( "read", f_read,
 			 "function(function(array(string|int),int|void:void),"
 			 "string|object,int|void:int)", 0 );
+  add_function_constant( "read_columns", f_read_columns,
+			 "function(string|object,int|void,int|void:"
+			 "mapping(string:array(string|int)))", 0 );
+  add_function_constant( "read_counts", f_read_counts,
+			 "function(string|object,string,int|void,int|void:"
+			 "mapping(string|int:int))", 0 );
 }
 
 
@@ -89,6 +106,675 @@ PIKE_MODULE_EXIT
 }
 
 
+/** Helper functions **/
+
+/* Opens the logfile argument of the reading functions. *my_fd is
+ * cleared if the file descriptor belongs to a file object, and thus
+ * should not be closed by the caller.
+ */
+static FD clf_open(const char *name, INT32 args, int argno,
+		  struct svalue *file, int *my_fd)
+{
+  FD f = -1;
+
+  *my_fd = 1;
+  if(file->type == T_OBJECT)
+  {
+    f = fd_from_object(file->u.object);
+    
+    if(f == -1)
+      Pike_error("%s: File is not open.\n", name);
+    *my_fd = 0;
+  } else if(file->type == T_STRING &&
+	    file->u.string->size_shift == 0) {
+#ifdef PIKE_SECURITY
+      if(!CHECK_SECURITY(SECURITY_BIT_SECURITY))
+      {
+	if(!CHECK_SECURITY(SECURITY_BIT_CONDITIONAL_IO))
+	  Pike_error("Permission denied.\n");
+	push_text("read");
+	push_int(0);
+	ref_push_string(file->u.string);
+	push_text("r");
+	push_int(00666);
+
+	safe_apply(OBJ2CREDS(CURRENT_CREDS)->user,"valid_open",5);
+	switch(Pike_sp[-1].type)
+	{
+	case PIKE_T_INT:
+	  switch(Pike_sp[-1].u.integer)
+	  {
+	  case 0: /* return 0 */
+	    errno=EPERM;
+	    Pike_error("%s(): Failed to open file for reading (errno=%d).\n",
+		       name, errno);
+
+	  case 2: /* ok */
+	    pop_stack();
+	    break;
+
+	  case 3: /* permission denied */
+	    Pike_error("%s: permission denied.\n", name);
+
+	  default:
+	    Pike_error("Error in user->valid_open, wrong return value.\n");
+	  }
+	  break;
+
+	default:
+	  Pike_error("Error in user->valid_open, wrong return type.\n");
+
+	case PIKE_T_STRING:
+	  /*	  if(Pike_sp[-1].u.string->shift_size) */
+	  /*	    file=Pike_sp[-1]; */
+	  pop_stack();
+	}
+
+      }
+#endif
+    do {
+      THREADS_ALLOW();
+      f=fd_open((char *)STR0(file->u.string), fd_RDONLY, 0);
+      THREADS_DISALLOW();
+      if (f >= 0 || errno != EINTR) break;
+      check_threads_etc();
+    } while (1);
+
+    if(f < 0)
+      Pike_error("%s(): Failed to open file for reading (errno=%d).\n",
+	    name, errno);
+  } else
+    SIMPLE_BAD_ARG_ERROR(name, argno, "string|Stdio.File");
+  return f;
+}
+
+
+/** The parser **/
+
+/* Log lines are parsed by a DFA, which is shared by read() and the
+ * parallel parsing in read_columns() and read_counts(). All string
+ * fields are contiguous in the input, so they are recorded as
+ * references into it. A line break always ends the current line. The
+ * values of a complete line are handed to the emit callback when the
+ * next line starts, or at the end of the input.
+ */
+
+#define CLF_NFIELDS	15
+
+/* Special lengths of values. */
+#define CLF_INT		-1
+#define CLF_HTTP09	-2
+
+struct clf_val
+{
+  const unsigned char *str;
+  ptrdiff_t len;		/* String length, CLF_INT or CLF_HTTP09. */
+  INT32 ival;
+};
+
+struct clf_dfa
+{
+  int state, tzs, nv;
+  INT32 v, yy, mm, dd, h, m, s, tz;
+  ptrdiff_t bstart, bend;	/* The current string, as input indices. */
+  struct clf_val vals[CLF_NFIELDS];
+  /* Called with a complete line in vals. pos is the input index after
+   * the character that ended it. Returns 0 to stop parsing.
+   */
+  int (*emit)(struct clf_dfa *d, ptrdiff_t pos);
+  void *arg;
+};
+
+/* The states in the middle of a string. */
+#define CLF_IN_STRING(STATE)						\
+  ((STATE) == 1 || (STATE) == 3 || (STATE) == 5 ||			\
+   (STATE) == 8 || (STATE) == 9 ||					\
+   (STATE) == 31 || (STATE) == 33 || (STATE) == 34)
+
+#define CLF_PUSH(X) do {						\
+    if (nv < CLF_NFIELDS) {						\
+      vals[nv].len = CLF_INT;						\
+      vals[nv].ival = (X);						\
+    }									\
+    nv++;								\
+  } while(0)
+#define CLF_PUSH_HTTP09() do {						\
+    if (nv < CLF_NFIELDS) {						\
+      vals[nv].len = CLF_HTTP09;					\
+      vals[nv].ival = 0;						\
+    }									\
+    nv++;								\
+  } while(0)
+#define CLF_PUSHBUF() do {						\
+    if (nv < CLF_NFIELDS) {						\
+      vals[nv].str = p + bstart;					\
+      vals[nv].len = bend - bstart;					\
+    }									\
+    nv++;								\
+  } while(0)
+/* Start a new buffer with the current character. */
+#define CLF_BUFNEW() do { bstart = i; bend = i+1; } while(0)
+/* Extend the buffer up to and including the current character. */
+#define CLF_BUFSET() do { bend = i+1; } while(0)
+
+static void clf_dfa_init(struct clf_dfa *d,
+			 int (*emit)(struct clf_dfa *d, ptrdiff_t pos),
+			 void *arg)
+{
+  MEMSET(d, 0, sizeof(struct clf_dfa));
+  d->emit = emit;
+  d->arg = arg;
+}
+
+/* Feeds p[i..len-1] to the DFA. Strings are kept as pointers into p,
+ * so the input from clf_dfa_keep() and on must not move between calls
+ * unless clf_dfa_move() is told. Does not use the interpreter lock
+ * unless the emit callback does. Returns 0 if it asked to stop.
+ */
+static int clf_dfa_run(struct clf_dfa *d, const unsigned char *p,
+		       ptrdiff_t i, ptrdiff_t len)
+{
+  struct clf_val *vals = d->vals;
+  ptrdiff_t bstart = d->bstart, bend = d->bend;
+  int cls, c, state = d->state, tzs = d->tzs, nv = d->nv, ret = 1;
+  INT32 v = d->v, yy = d->yy, mm = d->mm, dd = d->dd;
+  INT32 h = d->h, m = d->m, s = d->s, tz = d->tz;
+
+  for (; i < len; i++) {
+    c = p[i];
+    cls = char_class[c];
+#ifdef TRACE_DFA
+    fprintf(stderr, "DFA(%d): '%c' ", state, (c<32? '.':c));
+    switch(cls) {
+    case CLS_WSPACE: fprintf(stderr, "CLS_WSPACE"); break;
+    case CLS_CRLF: fprintf(stderr, "CLS_CRLF"); break;
+    case CLS_TOKEN: fprintf(stderr, "CLS_TOKEN"); break;
+    case CLS_DIGIT: fprintf(stderr, "CLS_DIGIT"); break;
+    case CLS_QUOTE: fprintf(stderr, "CLS_QUOTE"); break;
+    case CLS_LBRACK: fprintf(stderr, "CLS_LBRACK"); break;
+    case CLS_RBRACK: fprintf(stderr, "CLS_RBRACK"); break;
+    case CLS_SLASH: fprintf(stderr, "CLS_SLASH"); break;
+    case CLS_COLON: fprintf(stderr, "CLS_COLON"); break;
+    case CLS_HYPHEN: fprintf(stderr, "CLS_HYPHEN"); break;
+    case CLS_PLUS: fprintf(stderr, "CLS_PLUS"); break;
+    default: fprintf(stderr, "???");
+    }
+    fprintf(stderr, " %d values\n", nv);
+#endif
+    switch(state) {
+    case 0:
+      if(nv) {
+	if(nv == CLF_NFIELDS && !d->emit(d, i+1)) {
+	  ret = 0;
+	  goto done;
+	}
+	nv = 0;
+      }
+      if(cls > CLS_CRLF) {
+	if(cls == CLS_HYPHEN) {
+	  CLF_PUSH(0);
+	  state = 2;
+	  break;
+	}
+	CLF_BUFNEW();
+	state = 1;
+      }
+      break;
+    case 1:
+      if(cls > CLS_CRLF) {
+	CLF_BUFSET();
+	break;
+      }
+      CLF_PUSHBUF(); /* remotehost */
+      state = (cls == CLS_WSPACE? 2:0);
+      break;
+    case 2:
+      if(cls > CLS_CRLF) {
+	if(cls == CLS_HYPHEN) {
+	  CLF_PUSH(0);
+	  state = 4;
+	  break;
+	}
+	CLF_BUFNEW();
+	state = 3;
+      } else if(cls == CLS_CRLF)
+	state = 0;
+      break;
+    case 3:
+      if(cls > CLS_CRLF) {
+	CLF_BUFSET();
+	break;
+      }
+      CLF_PUSHBUF(); /* rfc931 */
+      state = (cls == CLS_WSPACE? 4:0);
+      break;
+    case 4:
+      if(cls > CLS_CRLF) {
+	if(cls == CLS_HYPHEN) {
+	  CLF_PUSH(0);
+	  state = 6;
+	  break;
+	}
+	CLF_BUFNEW();
+	state = 5;
+      } else if(cls == CLS_CRLF)
+	state = 0;
+      break;
+    case 5:
+      if(cls > CLS_CRLF) {
+	CLF_BUFSET();
+	break;
+      }
+      CLF_PUSHBUF(); /* authuser */
+      state = (cls == CLS_WSPACE? 6:0);
+      break;
+    case 6:
+      if(cls == CLS_LBRACK)
+	state = 15;
+      else if(cls == CLS_CRLF)
+	state = 0;
+      else if(cls == CLS_HYPHEN) {
+	CLF_PUSH(0);
+	CLF_PUSH(0);
+	CLF_PUSH(0);
+	state = 7;
+      }
+      break;
+    case 7:
+      if(cls == CLS_QUOTE) {
+	bstart = bend = i+1;
+	state = 31;
+      } else if(cls == CLS_CRLF)
+	state = 0;
+      else if(cls == CLS_HYPHEN) {
+	CLF_PUSH(0);
+	CLF_PUSH(0);
+	CLF_PUSH(0);
+	state = 10;
+      }
+      break;
+    case 8:
+      if(cls == CLS_QUOTE)
+	state = 9;
+      else if(cls == CLS_CRLF) {
+	CLF_PUSHBUF();
+	state = 0;
+      } else
+	CLF_BUFSET();
+      break;
+    case 9:
+      if(cls > CLS_CRLF) {
+	/* The quote is part of the protocol after all. */
+	CLF_BUFSET();
+	state = 8;
+	break;
+      }
+      CLF_PUSHBUF(); /* protocol */
+      state = (cls == CLS_CRLF? 0 : 10);
+      break;
+    case 10:
+      if(cls == CLS_DIGIT) {
+	v = c&0xf;
+	state = 11;
+      } else if(cls == CLS_CRLF)
+	state = 0;
+      else if(cls == CLS_HYPHEN) {
+	CLF_PUSH(0);
+	state = 12;
+      }
+      break;
+    case 11:
+      if(cls == CLS_DIGIT)
+	v = v*10+(c&0xf);
+      else if(cls == CLS_WSPACE) {
+	CLF_PUSH(v); /* status */
+	state = 12;
+      } else state = 0;
+      break;
+    case 12:
+      if(cls == CLS_DIGIT) {
+	v = c&0xf;
+	state = 13;
+      } else if(cls == CLS_CRLF)
+	state = 0;
+      else if(cls == CLS_HYPHEN) {
+	CLF_PUSH(0);
+	state = 14;
+      }
+      break;
+    case 13:
+      if(cls == CLS_DIGIT)
+	v = v*10+(c&0xf);
+      else {
+	CLF_PUSH(v); /* bytes */
+	state = (cls == CLS_CRLF? 0:14);
+      }
+      break;
+    case 14:
+      if(cls == CLS_CRLF)
+	state = 0;
+      break;
+
+    case 15:
+      if(cls == CLS_DIGIT) {
+	dd = c&0xf;
+	state = 16;
+      } else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 16:
+      /* getting day */
+      if(cls == CLS_DIGIT)
+	dd = dd*10+(c&0xf);
+      else if(cls == CLS_SLASH)
+	state = 17;
+      else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 17:
+      if(cls == CLS_DIGIT) {
+	mm = c&0xf;
+	state = 18;
+      } else if(cls == CLS_TOKEN) {
+	mm = c|0x20;
+	state = 21;
+      } else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 18:
+      /* getting numeric month */
+      if(cls == CLS_DIGIT)
+	mm = mm*10+(c&0xf);
+      else if(cls == CLS_SLASH)
+	state = 19;
+      else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 19:
+      if(cls == CLS_DIGIT) {
+	yy = c&0xf;
+	state = 20;
+      } else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 20:
+      /* getting year */
+      if(cls == CLS_DIGIT)
+	yy = yy*10+(c&0xf);
+      else if(cls == CLS_COLON)
+	state = 22;
+      else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 21:
+      /* getting textual month */
+      if(cls == CLS_TOKEN)
+	mm = (mm<<8)|c|0x20;
+      else if(cls == CLS_SLASH) {
+	state = 19;
+	switch(mm) {
+	case ('j'<<16)|('a'<<8)|'n': mm=1; break;
+	case ('f'<<16)|('e'<<8)|'b': mm=2; break;
+	case ('m'<<16)|('a'<<8)|'r': mm=3; break;
+	case ('a'<<16)|('p'<<8)|'r': mm=4; break;
+	case ('m'<<16)|('a'<<8)|'y': mm=5; break;
+	case ('j'<<16)|('u'<<8)|'n': mm=6; break;
+	case ('j'<<16)|('u'<<8)|'l': mm=7; break;
+	case ('a'<<16)|('u'<<8)|'g': mm=8; break;
+	case ('s'<<16)|('e'<<8)|'p': mm=9; break;
+	case ('o'<<16)|('c'<<8)|'t': mm=10; break;
+	case ('n'<<16)|('o'<<8)|'v': mm=11; break;
+	case ('d'<<16)|('e'<<8)|'c': mm=12; break;
+	default:
+	  state = 14;
+	}
+      } else if(cls == CLS_CRLF)
+	state = 0;
+      break;
+    case 22:
+      if(cls == CLS_DIGIT) {
+	h = c&0xf;
+	state = 23;
+      } else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 23:
+      /* getting hour */
+      if(cls == CLS_DIGIT)
+	h = h*10+(c&0xf);
+      else if(cls == CLS_COLON)
+	state = 24;
+      else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 24:
+      if(cls == CLS_DIGIT) {
+	m = c&0xf;
+	state = 25;
+      } else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 25:
+      /* getting minute */
+      if(cls == CLS_DIGIT)
+	m = m*10+(c&0xf);
+      else if(cls == CLS_COLON)
+	state = 26;
+      else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 26:
+      if(cls == CLS_DIGIT) {
+	s = c&0xf;
+	state = 27;
+      } else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 27:
+      /* getting second */
+      if(cls == CLS_DIGIT)
+	s = s*10+(c&0xf);
+      else if(cls == CLS_WSPACE)
+	state = 28;
+      else
+	state = (cls == CLS_CRLF? 0:14);
+      break;
+    case 28:
+      if(cls>=CLS_HYPHEN) {
+	state = 29;
+	tzs = cls!=CLS_PLUS;
+	tz = 0;
+      } else if(cls == CLS_DIGIT) {
+	state = 29;
+	tzs = 0;
+	tz = c&0xf;
+      } else if(cls==CLS_CRLF)
+	state = 0;
+      break;
+    case 29:
+      /* getting timezone */
+      if(cls == CLS_DIGIT)
+	tz = tz*10+(c&0xf);
+      else {
+	if(tzs)
+	  tz = -tz;
+	CLF_PUSH(yy);
+	CLF_PUSH(mm);
+	CLF_PUSH(dd);
+	CLF_PUSH(h);
+	CLF_PUSH(m);
+	CLF_PUSH(s);
+	CLF_PUSH(tz);
+	if(cls == CLS_RBRACK)
+	  state = 7;
+	else
+	  state = (cls == CLS_CRLF? 0 : 30);
+      }
+      break;
+    case 30:
+      if(cls == CLS_RBRACK)
+	state = 7;
+      else if(cls == CLS_CRLF)
+	state = 0;
+      break;
+    case 31:
+      if(cls == CLS_QUOTE) {
+	CLF_PUSHBUF();
+	CLF_PUSH(0);
+	CLF_PUSH(0);
+	state = 10;
+      } else if(cls >= CLS_TOKEN)
+	CLF_BUFSET();
+      else {
+	CLF_PUSHBUF(); /* method */
+	state = (cls == CLS_CRLF? 0 : 32);
+      }
+      break;
+    case 32:
+      if(cls == CLS_QUOTE) {
+	CLF_PUSH(0);
+	CLF_PUSH(0);
+	state = 10;
+      } else if(cls >= CLS_TOKEN) {
+	CLF_BUFNEW();
+	state = 33;
+      } else
+	if(cls == CLS_CRLF)
+	  state = 0;
+      break;
+    case 33:
+      if(cls == CLS_QUOTE)
+	state = 34;
+      else if(cls == CLS_CRLF) {
+	CLF_PUSHBUF();
+	state = 0;
+      } else if(cls == CLS_WSPACE) {
+	CLF_PUSHBUF(); /* path */
+	state = 35;
+      } else
+	CLF_BUFSET();
+      break;
+    case 34:
+      if(cls >= CLS_TOKEN) {
+	CLF_BUFSET();
+	state = 33;
+      } else if(cls == CLS_CRLF) {
+	CLF_PUSHBUF();
+	state = 0;
+      } else {
+	CLF_PUSHBUF();
+	CLF_PUSH_HTTP09();
+	state = 10;
+      }
+      break;
+    case 35:
+      if(cls == CLS_QUOTE) {
+	CLF_PUSH_HTTP09();
+	state = 10;
+      } else if(cls >= CLS_TOKEN) {
+	CLF_BUFNEW();
+	state = 8;
+      } else
+	if(cls == CLS_CRLF)
+	  state = 0;
+      break;
+    }
+  }
+
+ done:
+  d->state = state;
+  d->tzs = tzs;
+  d->nv = nv;
+  d->v = v;
+  d->yy = yy;
+  d->mm = mm;
+  d->dd = dd;
+  d->h = h;
+  d->m = m;
+  d->s = s;
+  d->tz = tz;
+  d->bstart = bstart;
+  d->bend = bend;
+  return ret;
+}
+
+/* Ends the input at p[len]. Returns 0 if the emit callback asked to
+ * stop.
+ */
+static int clf_dfa_end(struct clf_dfa *d, const unsigned char *p,
+		       ptrdiff_t len)
+{
+  struct clf_val *vals = d->vals;
+  ptrdiff_t bstart = d->bstart, bend = d->bend;
+  int nv = d->nv;
+
+  if(CLF_IN_STRING(d->state))
+    CLF_PUSHBUF();
+  d->state = 0;
+  d->nv = 0;
+  return nv != CLF_NFIELDS || d->emit(d, len);
+}
+
+/* Returns the index of the first character of p[0..len-1] that the
+ * DFA still refers to.
+ */
+static ptrdiff_t clf_dfa_keep(struct clf_dfa *d, const unsigned char *p,
+			      ptrdiff_t len)
+{
+  ptrdiff_t keep = len;
+  int k;
+
+  if(CLF_IN_STRING(d->state) && d->bstart < keep)
+    keep = d->bstart;
+  for (k = 0; k < d->nv && k < CLF_NFIELDS; k++)
+    if (d->vals[k].len >= 0 && d->vals[k].str - p < keep)
+      keep = d->vals[k].str - p;
+  return keep;
+}
+
+/* Tells the DFA that the input from index drop and on has been moved
+ * from from + drop to to.
+ */
+static void clf_dfa_move(struct clf_dfa *d, const unsigned char *from,
+			 const unsigned char *to, ptrdiff_t drop)
+{
+  int k;
+
+  for (k = 0; k < d->nv && k < CLF_NFIELDS; k++)
+    if (d->vals[k].len >= 0)
+      d->vals[k].str = to + (d->vals[k].str - from - drop);
+  d->bstart -= drop;
+  d->bend -= drop;
+}
+
+struct clf_read
+{
+  struct svalue *logfun;
+  ptrdiff_t offs0;		/* File offset of the start of the buffer. */
+};
+
+/* The emit callback of read(). */
+static int clf_read_line(struct clf_dfa *d, ptrdiff_t pos)
+{
+  struct clf_read *r = (struct clf_read *)d->arg;
+  int k;
+
+  for (k = 0; k < CLF_NFIELDS; k++) {
+    struct clf_val *val = d->vals + k;
+    if (val->len == CLF_INT)
+      push_int(val->ival);
+    else if (val->len == CLF_HTTP09)
+      push_text("HTTP/0.9");
+    else
+      push_string(make_shared_binary_string((char *)val->str, val->len));
+  }
+  f_aggregate(CLF_NFIELDS);
+  push_int64(r->offs0 + pos);
+  apply_svalue(r->logfun, 2);
+  pop_stack();
+  return 1;
+}
+
 /** Functions implementing Pike functions **/
 
 /*! @module CommonLog
@@ -149,684 +835,571 @@ PIKE_MODULE_EXIT
 
 static void f_read( INT32 args )
 {
-  char *read_buf;
   struct svalue *logfun, *file;
   FD f = -1;
-  int cls, c, my_fd=1, state=0, tzs=0;
-  char *char_pointer;
-  INT32 v=0, yy=0, mm=0, dd=0, h=0, m=0, s=0, tz=0;
-  ptrdiff_t offs0=0, len=0;
-  struct svalue *old_sp;
-  /* #define DYNAMIC_BUF */
-#ifdef DYNAMIC_BUF
-  dynamic_buffer buf;
-#else
-#define BUFSET(X) do { if(bufpos == bufsize) { bufsize *= 2; buf = realloc(buf, bufsize+1); } buf[bufpos++] = c; } while(0)
-#define PUSHBUF() do { push_string( make_shared_binary_string( buf,bufpos ) ); bufpos=0; } while(0)
-  char *buf;
-  int bufsize=CLF_BLOCK_SIZE, bufpos=0;
-#endif
+  int my_fd=1;
+  unsigned char *buf, *tmp;
+  ptrdiff_t offs0=0, size=2*CLF_BLOCK_SIZE, len=0, got, keep;
+  struct clf_read r;
+  struct clf_dfa d;
 
   if(args>2 && sp[-1].type == T_INT) {
     offs0 = sp[-1].u.integer;
     pop_n_elems(1);
     --args;
   }
-  old_sp = sp;
 
   get_all_args("CommonLog.read", args, "%*%*", &logfun, &file);
   if(logfun->type != T_FUNCTION)
     SIMPLE_BAD_ARG_ERROR("CommonLog.read", 1, "function");
 
-  if(file->type == T_OBJECT)
-  {
-    f = fd_from_object(file->u.object);
-    
-    if(f == -1)
-      Pike_error("CommonLog.read: File is not open.\n");
-    my_fd = 0;
-  } else if(file->type == T_STRING &&
-	    file->u.string->size_shift == 0) {
-#ifdef PIKE_SECURITY
-      if(!CHECK_SECURITY(SECURITY_BIT_SECURITY))
-      {
-	if(!CHECK_SECURITY(SECURITY_BIT_CONDITIONAL_IO))
-	  Pike_error("Permission denied.\n");
-	push_text("read");
-	push_int(0);
-	ref_push_string(file->u.string);
-	push_text("r");
-	push_int(00666);
-
-	safe_apply(OBJ2CREDS(CURRENT_CREDS)->user,"valid_open",5);
-	switch(Pike_sp[-1].type)
-	{
-	case PIKE_T_INT:
-	  switch(Pike_sp[-1].u.integer)
-	  {
-	  case 0: /* return 0 */
-	    errno=EPERM;
-	    Pike_error("CommonLog.read(): Failed to open file for reading (errno=%d).\n",
-		       errno);
-
-	  case 2: /* ok */
-	    pop_stack();
-	    break;
-
-	  case 3: /* permission denied */
-	    Pike_error("CommonLog.read: permission denied.\n");
-
-	  default:
-	    Pike_error("Error in user->valid_open, wrong return value.\n");
-	  }
-	  break;
-
-	default:
-	  Pike_error("Error in user->valid_open, wrong return type.\n");
-
-	case PIKE_T_STRING:
-	  /*	  if(Pike_sp[-1].u.string->shift_size) */
-	  /*	    file=Pike_sp[-1]; */
-	  pop_stack();
-	}
-
-      }
-#endif
-    do {
-      THREADS_ALLOW();
-      f=fd_open((char *)STR0(file->u.string), fd_RDONLY, 0);
-      THREADS_DISALLOW();
-      if (f >= 0 || errno != EINTR) break;
-      check_threads_etc();
-    } while (1);
-
-    if(f < 0)
-      Pike_error("CommonLog.read(): Failed to open file for reading (errno=%d).\n",
-	    errno);
-  } else
-    SIMPLE_BAD_ARG_ERROR("CommonLog.read", 2, "string|Stdio.File");
+  f = clf_open("CommonLog.read", args, 2, file, &my_fd);
 
 #ifdef HAVE_LSEEK64
   lseek64(f, offs0, SEEK_SET);
 #else
   fd_lseek(f, offs0, SEEK_SET);
 #endif
-  read_buf = malloc(CLF_BLOCK_SIZE+1);
-#ifndef DYNAMIC_BUF
-  buf = malloc(bufsize);
-#endif
+  buf = xalloc(size);
+  r.logfun = logfun;
+  r.offs0 = offs0;
+  clf_dfa_init(&d, clf_read_line, &r);
   while(1) {
+    /* Drop what the DFA is done with, and make room for a block. */
+    keep = clf_dfa_keep(&d, buf, len);
+    tmp = buf;
+    if(len - keep > size - CLF_BLOCK_SIZE) {
+      size *= 2;
+      tmp = xalloc(size);
+    }
+    MEMMOVE(tmp, buf + keep, len - keep);
+    clf_dfa_move(&d, buf, tmp, keep);
+    if(tmp != buf) {
+      free(buf);
+      buf = tmp;
+    }
+    len -= keep;
+    r.offs0 += keep;
+
     do {
       THREADS_ALLOW();
-      len = fd_read(f, read_buf, CLF_BLOCK_SIZE);
+      got = fd_read(f, buf + len, CLF_BLOCK_SIZE);
       THREADS_DISALLOW();
-      if (len >= 0 || errno != EINTR) break;
+      if (got >= 0 || errno != EINTR) break;
       check_threads_etc();
     } while (1);
-    if(len == 0)
+    if(got <= 0)
       break; /* nothing more to read. */
-    if(len < 0)
-      break;
-    char_pointer = read_buf;
-    while(len--) {
-      offs0++;
-      c = char_pointer[0] & 0xff;
-      char_pointer ++;
-      cls = char_class[c];
-#ifdef TRACE_DFA
-      fprintf(stderr, "DFA(%d): '%c' ", state, (c<32? '.':c));
-      switch(cls) {
-      case CLS_WSPACE: fprintf(stderr, "CLS_WSPACE"); break;
-      case CLS_CRLF: fprintf(stderr, "CLS_CRLF"); break;
-      case CLS_TOKEN: fprintf(stderr, "CLS_TOKEN"); break;
-      case CLS_DIGIT: fprintf(stderr, "CLS_DIGIT"); break;
-      case CLS_QUOTE: fprintf(stderr, "CLS_QUOTE"); break;
-      case CLS_LBRACK: fprintf(stderr, "CLS_LBRACK"); break;
-      case CLS_RBRACK: fprintf(stderr, "CLS_RBRACK"); break;
-      case CLS_SLASH: fprintf(stderr, "CLS_SLASH"); break;
-      case CLS_COLON: fprintf(stderr, "CLS_COLON"); break;
-      case CLS_HYPHEN: fprintf(stderr, "CLS_HYPHEN"); break;
-      case CLS_PLUS: fprintf(stderr, "CLS_PLUS"); break;
-      default: fprintf(stderr, "???");
-      }
-      fprintf(stderr, " %d items on stack\n", sp-old_sp);
-#endif
-      switch(state) {
-      case 0:
-	if(sp != old_sp) {
-	  if(sp == old_sp+15) {
-	    f_aggregate(15);
-	    push_int64(offs0);
-	    apply_svalue(logfun, 2);
-	    pop_stack();
-	  } else
-	    pop_n_elems(sp-old_sp);
-	}
-	if(cls > CLS_CRLF) {
-	  if(cls == CLS_HYPHEN) {
-	    push_int(0);
-	    state = 2;
-	    break;
-	  }
-#ifdef DYNAMIC_BUF
-	  buf.s.str = NULL;
-	  initialize_buf( &buf );
-	  low_my_putchar( c, &buf );
-#else
-	  bufpos = 0;
-	  BUFSET(c);
-#endif
-	  state=1;
-	}
-	break;
-      case 1:
-	if(cls > CLS_CRLF) {
-#ifdef DYNAMIC_BUF
-	  low_my_putchar( c, &buf );
-#else
-	  BUFSET(c);
-#endif
-	  break;
-	}
-#ifdef DYNAMIC_BUF
-	push_string( low_free_buf( &buf ) ); /* remotehost */
-#else
-	PUSHBUF();
-#endif
-	state = (cls == CLS_WSPACE? 2:0);
-	break;
-      case 2:
-	if(cls > CLS_CRLF) {
-	  if(cls == CLS_HYPHEN) {
-	    push_int(0);
-	    state = 4;
-	    break;
-	  }
-#ifdef DYNAMIC_BUF
-	  buf.s.str = NULL;
-	  initialize_buf( &buf );
-	  low_my_putchar( c, &buf );
-#else
-	  bufpos = 0;
-	  BUFSET(c);
-#endif
+    clf_dfa_run(&d, buf, len, len + got);
+    len += got;
+  }
+  clf_dfa_end(&d, buf, len);
+  free(buf);
+  if(my_fd)
+    /* If my_fd == 0, the second argument was an object and thus we don't
+     * want to free it.
+     */
+    fd_close(f);
+  pop_n_elems(args);
+  push_int64(r.offs0 + len);
+}
 
-	  state=3;
-	} else if(cls == CLS_CRLF)
-	  state=0;
-	break;
-      case 3:
-	if(cls > CLS_CRLF) {
-#ifdef DYNAMIC_BUF
-	  low_my_putchar( c, &buf );
-#else
-	  BUFSET(c);
-#endif
+/* Parallel parsing.
+ *
+ * read_columns() and read_counts() load the whole file, mmapped if
+ * possible, split it at line boundaries into chunks, and run the DFA
+ * over the chunks without the interpreter lock, possibly in several
+ * threads. Each distinct value is only made into a pike string once
+ * per chunk. Since a line break always ends the current line, the
+ * result does not depend on where the chunks are split.
+ */
 
-	  break;
-	}
-#ifdef DYNAMIC_BUF
-	push_string( low_free_buf( &buf ) ); /* rfc931 */
-#else
-	PUSHBUF(); /* rfc931 */
-#endif
-	state = (cls == CLS_WSPACE? 4:0);
-	break;
-      case 4:
-	if(cls > CLS_CRLF) {
-	  if(cls == CLS_HYPHEN) {
-	    push_int(0);
-	    state = 6;
-	    break;
-	  }
-#ifdef DYNAMIC_BUF
-	  buf.s.str = NULL;
-	  initialize_buf( &buf );
-	  low_my_putchar( c, &buf );
-#else
-	  bufpos = 0;
-	  BUFSET(c);
-#endif
+#define CLF_CHUNK_SIZE	(1024*1024)
+#define CLF_MAX_THREADS	32
 
-	  state=5;
-	} else if(cls == CLS_CRLF)
-	  state=0;
-	break;
-      case 5:
-	if(cls > CLS_CRLF) {
-#ifdef DYNAMIC_BUF
-	  low_my_putchar( c, &buf );
-#else
-	  BUFSET(c);
-#endif
+static const char *clf_field_names[CLF_NFIELDS] = {
+  "remote_host", "ident_user", "auth_user", "year", "month", "day",
+  "hours", "minutes", "seconds", "timezone", "method", "path",
+  "protocol", "reply_code", "bytes",
+};
 
-	  break;
-	}
-#ifdef DYNAMIC_BUF
-	push_string( low_free_buf( &buf ) ); /* authuser */
-#else
-	PUSHBUF(); /* authuser */
-#endif
-	state = (cls == CLS_WSPACE? 6:0);
-	break;
-      case 6:
-	if(cls == CLS_LBRACK)
-	  state = 15;
-	else if(cls == CLS_CRLF)
-	  state = 0;
-	else if(cls == CLS_HYPHEN) {
-	  push_int(0);
-	  push_int(0);
-	  push_int(0);
-	  state = 7;
-	}
-	break;
-      case 7:
-	if(cls == CLS_QUOTE) {
-#ifdef DYNAMIC_BUF
-	  buf.s.str = NULL;
-	  initialize_buf( &buf );
-#else
-	  bufpos = 0;
-#endif
-	  state = 31;
-	} else if(cls == CLS_CRLF)
-	  state = 0;
-	else if(cls == CLS_HYPHEN) {
-	  push_int(0);
-	  push_int(0);
-	  push_int(0);
-	  state = 10;
-	}
-	break;
-      case 8:
-	if(cls == CLS_QUOTE)
-	  state = 9;
-	else if(cls == CLS_CRLF) {
-#ifdef DYNAMIC_BUF
-	  push_string( low_free_buf( &buf ) );
-#else
-	  PUSHBUF();
-#endif
-	  state = 0;
-	} else
-#ifdef DYNAMIC_BUF
-	  low_my_putchar( c, &buf );
-#else
-	  BUFSET(c);
-#endif
+struct clf_key
+{
+  struct clf_val val;
+  size_t hval;
+  INT_TYPE count;
+};
 
-	break;
-      case 9:
-	if(cls > CLS_CRLF) {
-#ifdef DYNAMIC_BUF
-	  low_my_putchar( '"', &buf);
-	  low_my_putchar( c, &buf);
-#else
-	  BUFSET('"');
-	  BUFSET(c);
-#endif
-	  state = 8;
-	  break;
-	}
-#ifdef DYNAMIC_BUF
-	push_string( low_free_buf( &buf ) ); /* protocol */
-#else
-	PUSHBUF(); /* protoocl */
-#endif
-	state = (cls == CLS_CRLF? 0 : 10);
-	break;
-      case 10:
-	if(cls == CLS_DIGIT) {
-	  v = c&0xf;
-	  state = 11;
-	} else if(cls == CLS_CRLF)
-	  state = 0;
-	else if(cls == CLS_HYPHEN) {
-	  push_int(0);
-	  state = 12;
-	}
-	break;
-      case 11:
-	if(cls == CLS_DIGIT)
-	  v = v*10+(c&0xf);
-	else if(cls == CLS_WSPACE) {
-	  push_int(v); /* status */
-	  state = 12;
-	} else state = 0;
-	break;
-      case 12:
-	if(cls == CLS_DIGIT) {
-	  v = c&0xf;
-	  state = 13;
-	} else if(cls == CLS_CRLF)
-	  state = 0;
-	else if(cls == CLS_HYPHEN) {
-	  push_int(0);
-	  state = 14;
-	}
-	break;
-      case 13:
-	if(cls == CLS_DIGIT)
-	  v = v*10+(c&0xf);
-	else {
-	  push_int(v); /* bytes */
-	  state = (cls == CLS_CRLF? 0:14);
-	}
-	break;
-      case 14:
-	if(cls == CLS_CRLF)
-	  state = 0;
-	break;
+/* The distinct values of one field in one chunk. */
+struct clf_table
+{
+  struct clf_key *keys;
+  INT32 *hash;			/* Indices into keys, -1 if free. */
+  size_t nkeys, mask;
+};
 
-      case 15:
-	if(cls == CLS_DIGIT) {
-	  dd = c&0xf;
-	  state = 16;
-	} else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 16:
-	/* getting day */
-	if(cls == CLS_DIGIT)
-	  dd = dd*10+(c&0xf);
-	else if(cls == CLS_SLASH)
-	  state = 17;
-	else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 17:
-	if(cls == CLS_DIGIT) {
-	  mm = c&0xf;
-	  state = 18;
-	} else if(cls == CLS_TOKEN) {
-	  mm = c|0x20;
-	  state = 21;
-	} else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 18:
-	/* getting numeric month */
-	if(cls == CLS_DIGIT)
-	  mm = mm*10+(c&0xf);
-	else if(cls == CLS_SLASH)
-	  state = 19;
-	else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 19:
-	if(cls == CLS_DIGIT) {
-	  yy = c&0xf;
-	  state = 20;
-	} else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 20:
-	/* getting year */
-	if(cls == CLS_DIGIT)
-	  yy = yy*10+(c&0xf);
-	else if(cls == CLS_COLON)
-	  state = 22;
-	else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 21:
-	/* getting textual month */
-	if(cls == CLS_TOKEN)
-	  mm = (mm<<8)|c|0x20;
-	else if(cls == CLS_SLASH) {
-	  state = 19;
-	  switch(mm) {
-	  case ('j'<<16)|('a'<<8)|'n': mm=1; break;
-	  case ('f'<<16)|('e'<<8)|'b': mm=2; break;
-	  case ('m'<<16)|('a'<<8)|'r': mm=3; break;
-	  case ('a'<<16)|('p'<<8)|'r': mm=4; break;
-	  case ('m'<<16)|('a'<<8)|'y': mm=5; break;
-	  case ('j'<<16)|('u'<<8)|'n': mm=6; break;
-	  case ('j'<<16)|('u'<<8)|'l': mm=7; break;
-	  case ('a'<<16)|('u'<<8)|'g': mm=8; break;
-	  case ('s'<<16)|('e'<<8)|'p': mm=9; break;
-	  case ('o'<<16)|('c'<<8)|'t': mm=10; break;
-	  case ('n'<<16)|('o'<<8)|'v': mm=11; break;
-	  case ('d'<<16)|('e'<<8)|'c': mm=12; break;
-	  default:
-	    state = 14;
-	  }
-	}
-	break;
-      case 22:
-	if(cls == CLS_DIGIT) {
-	  h = c&0xf;
-	  state = 23;
-	} else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 23:
-	/* getting hour */
-	if(cls == CLS_DIGIT)
-	  h = h*10+(c&0xf);
-	else if(cls == CLS_COLON)
-	  state = 24;
-	else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 24:
-	if(cls == CLS_DIGIT) {
-	  m = c&0xf;
-	  state = 25;
-	} else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 25:
-	/* getting minute */
-	if(cls == CLS_DIGIT)
-	  m = m*10+(c&0xf);
-	else if(cls == CLS_COLON)
-	  state = 26;
-	else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 26:
-	if(cls == CLS_DIGIT) {
-	  s = c&0xf;
-	  state = 27;
-	} else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 27:
-	/* getting second */
-	if(cls == CLS_DIGIT)
-	  s = s*10+(c&0xf);
-	else if(cls == CLS_WSPACE)
-	  state = 28;
-	else
-	  state = (cls == CLS_CRLF? 0:14);
-	break;
-      case 28:
-	if(cls>=CLS_HYPHEN) {
-	  state = 29;
-	  tzs = cls!=CLS_PLUS;
-	  tz = 0;
-	} else if(cls == CLS_DIGIT) {
-	  state = 29;
-	  tzs = 0;
-	  tz = c&0xf;
-	} else if(cls==CLS_CRLF)
-	  state = 0;
-	break;
-      case 29:
-	/* getting timezone */
-	if(cls == CLS_DIGIT)
-	  tz = tz*10+(c&0xf);
-	else {
-	  if(tzs)
-	    tz = -tz;
-	  push_int(yy);
-	  push_int(mm);
-	  push_int(dd);
-	  push_int(h);
-	  push_int(m);
-	  push_int(s);
-	  push_int(tz);
-	  if(cls == CLS_RBRACK)
-	    state = 7;
-	  else
-	    state = (cls == CLS_CRLF? 0 : 30);
-	}
-	break;
-      case 30:
-	if(cls == CLS_RBRACK)
-	  state = 7;
-	else if(cls == CLS_CRLF)
-	  state = 0;
-	break;
-      case 31:
-	if(cls == CLS_QUOTE) {
-#ifdef DYNAMIC_BUF
-	  push_string( low_free_buf( &buf ) );
-#else
-	  PUSHBUF();
-#endif
-	  push_int(0);
-	  push_int(0);
-	  state = 10;
-	} else if(cls >= CLS_TOKEN)
-#ifdef DYNAMIC_BUF
-	  low_my_putchar( c, &buf );
-#else
-	  BUFSET(c);
-#endif
+struct clf_rec
+{
+  INT32 v[CLF_NFIELDS];		/* Integer value or key index. */
+  unsigned INT16 strings;	/* Bit n is set if v[n] is a key index. */
+};
 
-	else {
-#ifdef DYNAMIC_BUF
-	  push_string( low_free_buf( &buf ) ); /* method */
-#else
-	  PUSHBUF(); /* method */
-#endif
-	  state = (cls == CLS_CRLF? 0 : 32);
-	}
-	break;
-      case 32:
-	if(cls == CLS_QUOTE) {
-	  push_int(0);
-	  push_int(0);
-	  state = 10;
-	} else if(cls >= CLS_TOKEN) {
-#ifdef DYNAMIC_BUF
-	  buf.s.str = NULL;
-	  initialize_buf( &buf );
-	  low_my_putchar( c, &buf );
-#else
-	  bufpos = 0;
-	  BUFSET(c);
-#endif
+struct clf_chunk
+{
+  const unsigned char *p;
+  size_t len;
+  struct clf_rec *recs;
+  size_t nrecs, recsize;
+  int field;			/* Field to count, or -1 for all columns. */
+  struct clf_table tables[CLF_NFIELDS];
+  int failed;			/* Out of memory. */
+};
 
-	  state = 33;
-	} else
-	  if(cls == CLS_CRLF)
-	    state = 0;
-	break;
-      case 33:
-	if(cls == CLS_QUOTE)
-	  state = 34;
-	else if(cls == CLS_CRLF) {
-#ifdef DYNAMIC_BUF
-	  push_string( low_free_buf( &buf ) ); 
-#else
-	  PUSHBUF(); 
-#endif
-	  state = 0;
-	} else if(cls == CLS_WSPACE) {
-#ifdef DYNAMIC_BUF
-	  push_string( low_free_buf( &buf ) );  /* path */
-#else
-	  PUSHBUF();  /* path */
-#endif
-	  state = 35;
-	} else	
-#ifdef DYNAMIC_BUF
-	  low_my_putchar( c, &buf );
-#else
-	  BUFSET(c);
+struct clf_job
+{
+  void *mem;			/* The mmapped or malloced file. */
+  size_t mapped;		/* Size of the mapping, 0 if malloced. */
+  const unsigned char *data;	/* The file from the offset and on. */
+  size_t len;
+  struct clf_chunk *chunks;
+  int nchunks;
+  int field;			/* Field to count, or -1 for all columns. */
+};
+
+static void clf_free_job(struct clf_job *job)
+{
+  int i, k;
+
+  for (i = 0; i < job->nchunks; i++) {
+    struct clf_chunk *ch = job->chunks + i;
+    if (ch->recs) free(ch->recs);
+    for (k = 0; k < CLF_NFIELDS; k++) {
+      if (ch->tables[k].keys) free(ch->tables[k].keys);
+      if (ch->tables[k].hash) free(ch->tables[k].hash);
+    }
+  }
+  if (job->chunks) free(job->chunks);
+  job->chunks = NULL;
+  job->nchunks = 0;
+#ifdef CLF_USE_MMAP
+  if (job->mapped)
+    munmap(job->mem, job->mapped);
+  else
 #endif
+  if (job->mem)
+    free(job->mem);
+  job->mem = NULL;
+  job->mapped = 0;
+}
 
-	break;
-      case 34:
-	if(cls >= CLS_TOKEN) {
-#ifdef DYNAMIC_BUF
-	  low_my_putchar( '"', &buf );
-	  low_my_putchar( c, &buf );
-#else
-	  BUFSET('"');
-	  BUFSET(c);
+/* Called without the interpreter lock. Loads the file from offs0 and
+ * on. Returns 0 on success, and -1 with errno set on failure.
+ */
+static int clf_load(FD f, INT_TYPE offs0, struct clf_job *job)
+{
+  unsigned char *buf = NULL, *tmp;
+  size_t size = 0, len = 0;
+  ptrdiff_t got;
+#ifdef CLF_USE_MMAP
+  PIKE_STAT_T st;
+
+  if (!fd_fstat(f, &st) && st.st_size > 0) {
+    void *mem = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, f, 0);
+    if (mem != MAP_FAILED) {
+      job->mem = mem;
+      job->mapped = (size_t)st.st_size;
+      if (offs0 < (INT_TYPE)st.st_size) {
+	job->data = (unsigned char *)mem + offs0;
+	job->len = (size_t)(st.st_size - offs0);
+      }
+      return 0;
+    }
+  }
 #endif
 
-	  state = 33;
-	} else if(cls == CLS_CRLF) {
-#ifdef DYNAMIC_BUF
-	  push_string( low_free_buf( &buf ) ); 
+  /* Not a regular file, or no mmap. */
+#ifdef HAVE_LSEEK64
+  lseek64(f, offs0, SEEK_SET);
 #else
-	  PUSHBUF(); 
+  fd_lseek(f, offs0, SEEK_SET);
 #endif
-	  state = 0;
+  while (1) {
+    if (len == size) {
+      size = size ? size*2 : CLF_CHUNK_SIZE;
+      if (!(tmp = realloc(buf, size))) {
+	if (buf) free(buf);
+	errno = ENOMEM;
+	return -1;
+      }
+      buf = tmp;
+    }
+    got = fd_read(f, buf + len, size - len);
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      if (buf) free(buf);
+      return -1;
+    }
+    if (!got) break;
+    len += got;
+  }
+  job->mem = buf;
+  job->data = buf;
+  job->len = len;
+  return 0;
+}
+
+static size_t clf_hash(const struct clf_val *val)
+{
+  size_t h = (size_t)val->len;
+  ptrdiff_t i;
+
+  if (val->len < 0)
+    return ((size_t)(unsigned INT32)val->ival * 0x9e3779b1) ^ h;
+  for (i = 0; i < val->len; i++)
+    h = (h * 33) ^ val->str[i];
+  return h ^ (h >> 11);
+}
+
+static int clf_table_grow(struct clf_table *t)
+{
+  size_t size = t->mask ? (t->mask + 1) * 2 : 64, i;
+  struct clf_key *keys;
+  INT32 *hash;
+
+  if (!(hash = malloc(size * sizeof(INT32))))
+    return 0;
+  if (!(keys = realloc(t->keys, (size/2) * sizeof(struct clf_key)))) {
+    free(hash);
+    return 0;
+  }
+  t->keys = keys;
+  t->mask = size - 1;
+  for (i = 0; i < size; i++)
+    hash[i] = -1;
+  for (i = 0; i < t->nkeys; i++) {
+    size_t j = keys[i].hval & t->mask;
+    while (hash[j] >= 0)
+      j = (j + 1) & t->mask;
+    hash[j] = (INT32)i;
+  }
+  if (t->hash) free(t->hash);
+  t->hash = hash;
+  return 1;
+}
+
+/* Counts val in the table. Returns its index, or -1 if out of memory. */
+static INT32 clf_table_add(struct clf_table *t, const struct clf_val *val)
+{
+  size_t h = clf_hash(val), i;
+  INT32 k;
+
+  if (t->nkeys * 2 >= t->mask && !clf_table_grow(t))
+    return -1;
+
+  for (i = h & t->mask; (k = t->hash[i]) >= 0; i = (i + 1) & t->mask) {
+    struct clf_key *key = t->keys + k;
+    if (key->hval == h && key->val.len == val->len &&
+	(val->len < 0 ? key->val.ival == val->ival :
+	 !MEMCMP(key->val.str, val->str, val->len))) {
+      key->count++;
+      return k;
+    }
+  }
+  k = (INT32)t->nkeys++;
+  t->keys[k].val = *val;
+  t->keys[k].hval = h;
+  t->keys[k].count = 1;
+  t->hash[i] = k;
+  return k;
+}
+
+/* Records a parsed line. Returns 0 if out of memory. */
+static int clf_emit(struct clf_chunk *ch, struct clf_val *vals, int field)
+{
+  struct clf_rec *rec;
+  int k;
+
+  if (field >= 0)
+    return clf_table_add(ch->tables + field, vals + field) >= 0;
+
+  if (ch->nrecs == ch->recsize) {
+    size_t size = ch->recsize ? ch->recsize * 2 : 1024;
+    struct clf_rec *recs = realloc(ch->recs, size * sizeof(struct clf_rec));
+    if (!recs) return 0;
+    ch->recs = recs;
+    ch->recsize = size;
+  }
+  rec = ch->recs + ch->nrecs++;
+  rec->strings = 0;
+  for (k = 0; k < CLF_NFIELDS; k++) {
+    if (vals[k].len == CLF_INT)
+      rec->v[k] = vals[k].ival;
+    else if ((rec->v[k] = clf_table_add(ch->tables + k, vals + k)) < 0)
+      return 0;
+    else
+      rec->strings |= 1 << k;
+  }
+  return 1;
+}
+
+static int clf_chunk_line(struct clf_dfa *d, ptrdiff_t pos)
+{
+  struct clf_chunk *ch = (struct clf_chunk *)d->arg;
+  return clf_emit(ch, d->vals, ch->field);
+}
+
+/* Called without the interpreter lock. */
+static void clf_parse_chunk(struct clf_chunk *ch)
+{
+  struct clf_dfa d;
+
+  clf_dfa_init(&d, clf_chunk_line, ch);
+  if (!clf_dfa_run(&d, ch->p, 0, (ptrdiff_t)ch->len) ||
+      !clf_dfa_end(&d, ch->p, (ptrdiff_t)ch->len))
+    ch->failed = 1;
+}
+
+static void clf_parse_task(void *data, int i)
+{
+  struct clf_job *job = (struct clf_job *)data;
+  clf_parse_chunk(job->chunks + i);
+}
+
+/* Loads the file, and parses it using up to threads threads. */
+static void clf_parse_file(const char *name, INT32 args,
+			   struct svalue *file, INT_TYPE offs0,
+			   INT_TYPE threads, struct clf_job *job)
+{
+  FD f;
+  int my_fd, i, e = 0;
+  size_t pos = 0;
+
+  f = clf_open(name, args, 1, file, &my_fd);
+  if (offs0 < 0) offs0 = 0;
+
+  THREADS_ALLOW();
+  if (clf_load(f, offs0, job))
+    e = errno;
+  THREADS_DISALLOW();
+
+  if (my_fd)
+    fd_close(f);
+  if (e)
+    Pike_error("%s(): Failed to read file (errno=%d).\n", name, e);
+
+  /* Split at the first line break after every CLF_CHUNK_SIZE bytes. */
+  job->chunks = xalloc((job->len / CLF_CHUNK_SIZE + 1) *
+		       sizeof(struct clf_chunk));
+  while (pos < job->len) {
+    struct clf_chunk *ch = job->chunks + job->nchunks++;
+    size_t end = pos + CLF_CHUNK_SIZE;
+    if (end >= job->len)
+      end = job->len;
+    else {
+      const unsigned char *nl =
+	memchr(job->data + end, '\n', job->len - end);
+      end = nl ? (size_t)(nl - job->data) + 1 : job->len;
+    }
+    MEMSET(ch, 0, sizeof(struct clf_chunk));
+    ch->p = job->data + pos;
+    ch->len = end - pos;
+    ch->field = job->field;
+    pos = end;
+  }
+
+  if (threads > CLF_MAX_THREADS) threads = CLF_MAX_THREADS;
+
+  THREADS_ALLOW();
+  th_parallel(clf_parse_task, job, job->nchunks, (int)threads);
+  THREADS_DISALLOW();
+
+  for (i = 0; i < job->nchunks; i++)
+    if (job->chunks[i].failed)
+      Pike_error("%s(): Out of memory.\n", name);
+}
+
+/* Pushes an array with the values of the keys in a table. */
+static struct array *clf_push_keys(struct clf_table *t)
+{
+  struct array *a = allocate_array(t->nkeys);
+  size_t i;
+
+  push_array(a);
+  a->type_field = 0;
+  for (i = 0; i < t->nkeys; i++) {
+    struct clf_val *val = &t->keys[i].val;
+    struct svalue *item = ITEM(a) + i;
+    if (val->len == CLF_INT) {
+      item->u.integer = val->ival;
+      a->type_field |= BIT_INT;
+      continue;
+    }
+    if (val->len == CLF_HTTP09)
+      item->u.string = make_shared_string("HTTP/0.9");
+    else
+      item->u.string =
+	make_shared_binary_string((char *)val->str, val->len);
+    item->type = T_STRING;
+    a->type_field |= BIT_STRING;
+  }
+  return a;
+}
+
+/*! @decl mapping(string:array(string|int)) @
+ *!   read_columns(Stdio.File|string logfile, void|int offset, @
+ *!                void|int threads)
+ *!
+ *! Reads and parses the whole log file like @[read()], but returns
+ *! the result column by column instead of calling a callback for
+ *! every line. This is considerably faster for large files, since
+ *! the file is parsed without the interpreter lock, and every distinct
+ *! string in a column is only created once per megabyte of input or
+ *! so.
+ *!
+ *! @param offset
+ *! The position in the file where the parser should begin.
+ *!
+ *! @param threads
+ *! If larger than 1, the file is split at line boundaries and the
+ *! pieces are parsed in parallel by up to this many threads.
+ *!
+ *! @returns
+ *! A mapping with one array per field, all of the same size, indexed
+ *! with the names of the elements of the array given to the callback
+ *! of @[read()]: @expr{"remote_host"@}, @expr{"ident_user"@},
+ *! @expr{"auth_user"@}, @expr{"year"@}, @expr{"month"@},
+ *! @expr{"day"@}, @expr{"hours"@}, @expr{"minutes"@},
+ *! @expr{"seconds"@}, @expr{"timezone"@}, @expr{"method"@},
+ *! @expr{"path"@}, @expr{"protocol"@}, @expr{"reply_code"@} and
+ *! @expr{"bytes"@}.
+ *!
+ *! @seealso
+ *!   @[read()], @[read_counts()]
+ */
+static void f_read_columns( INT32 args )
+{
+  struct svalue *file;
+  INT_TYPE offs0 = 0, threads = 0;
+  struct clf_job job;
+  struct array *cols[CLF_NFIELDS];
+  size_t total = 0, pos = 0, r;
+  int i, k;
+  ONERROR err;
+
+  get_all_args("CommonLog.read_columns", args, "%*.%i%i",
+	       &file, &offs0, &threads);
+
+  MEMSET(&job, 0, sizeof(job));
+  job.field = -1;
+  SET_ONERROR(err, clf_free_job, &job);
+  clf_parse_file("CommonLog.read_columns", args, file, offs0, threads,
+		 &job);
+
+  for (i = 0; i < job.nchunks; i++)
+    total += job.chunks[i].nrecs;
+  for (k = 0; k < CLF_NFIELDS; k++) {
+    push_text(clf_field_names[k]);
+    push_array(cols[k] = allocate_array(total));
+    cols[k]->type_field = 0;
+  }
+
+  for (i = 0; i < job.nchunks; i++) {
+    struct clf_chunk *ch = job.chunks + i;
+    struct array *keys[CLF_NFIELDS];
+    for (k = 0; k < CLF_NFIELDS; k++)
+      keys[k] = clf_push_keys(ch->tables + k);
+    for (r = 0; r < ch->nrecs; r++, pos++) {
+      struct clf_rec *rec = ch->recs + r;
+      for (k = 0; k < CLF_NFIELDS; k++) {
+	if (rec->strings & (1 << k)) {
+	  assign_svalue_no_free(ITEM(cols[k]) + pos,
+				ITEM(keys[k]) + rec->v[k]);
+	  cols[k]->type_field |= BIT_STRING;
 	} else {
-#ifdef DYNAMIC_BUF
-	  push_string( low_free_buf( &buf ) ); 
-#else
-	  PUSHBUF(); 
-#endif
-	  push_text("HTTP/0.9");
-	  state = 10;
+	  ITEM(cols[k])[pos].u.integer = rec->v[k];
+	  cols[k]->type_field |= BIT_INT;
 	}
-	break;
-      case 35:
-	if(cls == CLS_QUOTE) {
-	  push_text("HTTP/0.9");
-	  state = 10;
-	} else if(cls >= CLS_TOKEN) {
-#ifdef DYNAMIC_BUF
-	  buf.s.str = NULL;
-	  initialize_buf( &buf );
-	  low_my_putchar( c, &buf );
-#else
-	  bufpos = 0;
-	  BUFSET(c);
-#endif
-
-	  state = 8;
-	} else
-	  if(cls == CLS_CRLF)
-	    state = 0;
-	break;
       }
     }
+    pop_n_elems(CLF_NFIELDS);
   }
-  if(state == 1 || state == 3 || state == 5 ||
-     state == 8 || state == 9 ||
-     state == 31 || state == 33 || state == 34) {
-#ifdef DYNAMIC_BUF
-    push_string( low_free_buf( &buf ) ); 
-#else
-    PUSHBUF(); 
-#endif
-  }
-  if(sp == old_sp + 15) {
-    f_aggregate(15);
-    push_int64(offs0);
-    apply_svalue(logfun, 2);
+
+  f_aggregate_mapping(2*CLF_NFIELDS);
+  CALL_AND_UNSET_ONERROR(err);
+  stack_pop_n_elems_keep_top(args);
+}
+
+/*! @decl mapping(string|int:int) read_counts(Stdio.File|string logfile, @
+ *!                                          string field, @
+ *!                                          void|int offset, @
+ *!                                          void|int threads)
+ *!
+ *! Reads and parses the whole log file like @[read_columns()], but
+ *! only counts how many times each value of a single field occurs.
+ *! No per line data is kept, and the counting is done by the parsing
+ *! threads.
+ *!
+ *! @param field
+ *! The field to count, e.g. @expr{"remote_host"@} or
+ *! @expr{"reply_code"@}. See @[read_columns()] for the field names.
+ *!
+ *! @param offset
+ *! The position in the file where the parser should begin.
+ *!
+ *! @param threads
+ *! If larger than 1, the file is parsed by up to this many threads.
+ *!
+ *! @returns
+ *! A mapping from the values of the field to the number of lines
+ *! with that value.
+ *!
+ *! @seealso
+ *!   @[read_columns()]
+ */
+static void f_read_counts( INT32 args )
+{
+  struct svalue *file;
+  char *field;
+  INT_TYPE offs0 = 0, threads = 0;
+  struct clf_job job;
+  struct mapping *m;
+  int i, k;
+  ONERROR err;
+
+  get_all_args("CommonLog.read_counts", args, "%*%s.%i%i",
+	       &file, &field, &offs0, &threads);
+
+  MEMSET(&job, 0, sizeof(job));
+  for (k = 0; k < CLF_NFIELDS; k++)
+    if (!strcmp(field, clf_field_names[k])) break;
+  if (k == CLF_NFIELDS)
+    SIMPLE_BAD_ARG_ERROR("CommonLog.read_counts", 2, "field name");
+  job.field = k;
+
+  SET_ONERROR(err, clf_free_job, &job);
+  clf_parse_file("CommonLog.read_counts", args, file, offs0, threads,
+		 &job);
+
+  push_mapping(m = allocate_mapping(0));
+  for (i = 0; i < job.nchunks; i++) {
+    struct clf_table *t = job.chunks[i].tables + k;
+    struct array *keys = clf_push_keys(t);
+    size_t j;
+    for (j = 0; j < t->nkeys; j++) {
+      struct svalue *val = low_mapping_lookup(m, ITEM(keys) + j);
+      if (val)
+	val->u.integer += t->keys[j].count;
+      else {
+	push_int64(t->keys[j].count);
+	mapping_insert(m, ITEM(keys) + j, Pike_sp - 1);
+	pop_stack();
+      }
+    }
     pop_stack();
   }
-  free(read_buf);
-#ifndef DYNAMIC_BUF
-  free(buf);
-#endif
-  if(my_fd)
-    /* If my_fd == 0, the second argument was an object and thus we don't
-     * want to free it.
-     */
-    fd_close(f);
-  pop_n_elems(sp-old_sp+args);  
-  push_int64(offs0);
+
+  CALL_AND_UNSET_ONERROR(err);
+  stack_pop_n_elems_keep_top(args);
 }
 
 /*! @endmodule
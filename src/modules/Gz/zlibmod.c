@@ -280,12 +280,8 @@ static int do_deflate(dynamic_buffer *buf,
    return ret;
 }
 
-void zlibmod_pack(struct pike_string *data, dynamic_buffer *buf,
-		  int level, int strategy, int wbits)
+static void check_pack_args(int level, int strategy, int wbits)
 {
-  struct zipper z;
-  int ret;
-
   if(level < Z_NO_COMPRESSION ||
      level > Z_BEST_COMPRESSION)
     Pike_error("Compression level out of range for pack. %d %d %d\n",
@@ -304,6 +300,15 @@ void zlibmod_pack(struct pike_string *data, dynamic_buffer *buf,
 
   if( wbits<0 ? (wbits<-15 || wbits>-8) : (wbits<8 || wbits>15 ) )
     Pike_error("Invalid window size value %d for pack.\n", wbits);
+}
+
+void zlibmod_pack(struct pike_string *data, dynamic_buffer *buf,
+		  int level, int strategy, int wbits)
+{
+  struct zipper z;
+  int ret;
+
+  check_pack_args(level, strategy, wbits);
 
   MEMSET(&z, 0, sizeof(z));
   z.gz.zalloc = Z_NULL;
@@ -356,12 +361,215 @@ void zlibmod_pack(struct pike_string *data, dynamic_buffer *buf,
     Pike_error("Error while deflating data (%d).\n",ret);
 }
 
+#ifdef _REENTRANT
+/* Parallel compression in the style of pigz.
+ *
+ * The input is split into blocks which are compressed independently
+ * as raw deflate data, each primed with the end of the preceding
+ * block as dictionary. All blocks but the last end with a sync flush,
+ * which leaves them byte aligned, so they can simply be concatenated.
+ */
+
+#define PAR_BLOCK_SIZE	(128*1024)
+#define PAR_MAX_THREADS	32
+
+struct par_block
+{
+  unsigned char *in;
+  size_t len;
+  size_t dict_len;		/* Bytes before in to use as dictionary. */
+  unsigned char *out;
+  size_t out_len;
+  int ret;
+};
+
+struct par_job
+{
+  struct par_block *blocks;
+  int nblocks;
+  int level, strategy, wbits;
+  int checksum;			/* Task 0 computes the adler32. */
+  unsigned char *in;
+  size_t len;
+  unsigned INT32 adler;
+};
+
+/* Called without the interpreter lock. */
+static void par_deflate_block(struct par_job *job, struct par_block *b,
+			      int last)
+{
+  z_stream z;
+  size_t size = b->len + (b->len>>3) + 64;
+  int ret;
+
+  MEMSET(&z, 0, sizeof(z));
+  ret = deflateInit2(&z, job->level, Z_DEFLATED, -job->wbits, 9,
+		     job->strategy);
+  if (ret != Z_OK) {
+    b->ret = ret;
+    return;
+  }
+  if (b->dict_len)
+    ret = deflateSetDictionary(&z, b->in - b->dict_len,
+			       (unsigned INT32)b->dict_len);
+  if ((ret == Z_OK) && !(b->out = malloc(size)))
+    ret = Z_MEM_ERROR;
+
+  z.next_in = b->in;
+  z.avail_in = (unsigned INT32)b->len;
+  while (ret == Z_OK) {
+    unsigned char *tmp;
+
+    z.next_out = b->out + b->out_len;
+    z.avail_out = (unsigned INT32)(size - b->out_len);
+    ret = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+    b->out_len = size - z.avail_out;
+
+    if (last ? (ret == Z_STREAM_END) : ((ret == Z_OK) && z.avail_out)) {
+      ret = Z_OK;
+      break;
+    }
+    if (ret != Z_OK) break;
+
+    /* Out of output space. */
+    size *= 2;
+    if (!(tmp = realloc(b->out, size))) {
+      ret = Z_MEM_ERROR;
+      break;
+    }
+    b->out = tmp;
+  }
+
+  deflateEnd(&z);
+  b->ret = ret;
+}
+
+/* Called without the interpreter lock. */
+static void par_adler(struct par_job *job)
+{
+  unsigned char *in = job->in;
+  size_t left = job->len;
+  unsigned INT32 adler = adler32(0, NULL, 0);
+
+  while (left) {
+    unsigned INT32 chunk = (unsigned INT32)MINIMUM(left, 0x40000000);
+    adler = adler32(adler, in, chunk);
+    in += chunk;
+    left -= chunk;
+  }
+  job->adler = adler;
+}
+
+static void par_deflate_task(void *data, int i)
+{
+  struct par_job *job = (struct par_job *)data;
+
+  if (i < job->checksum) {
+    par_adler(job);
+    return;
+  }
+  i -= job->checksum;
+  par_deflate_block(job, job->blocks + i, i == job->nblocks - 1);
+}
+
+/* Compress data using up to threads threads. Produces a zlib stream,
+ * or raw deflate data if wbits is negative.
+ */
+static struct pike_string *zlibmod_pack_parallel(struct pike_string *data,
+						 int level, int strategy,
+						 int wbits, int threads)
+{
+  struct par_job job;
+  struct pike_string *res;
+  unsigned char *p;
+  size_t dict_size, total;
+  int raw = 0, i, err = Z_OK;
+
+  check_pack_args(level, strategy, wbits);
+
+  if (wbits < 0) {
+    raw = 1;
+    wbits = -wbits;
+  }
+  /* Some zlib versions don't support 8 bit windows. */
+  if (wbits == 8) wbits = 9;
+  dict_size = ((size_t)1) << wbits;
+
+  MEMSET(&job, 0, sizeof(job));
+  job.level = level;
+  job.strategy = strategy;
+  job.wbits = wbits;
+  job.checksum = !raw;
+  job.in = STR0(data);
+  job.len = data->len;
+  job.nblocks = (int)((data->len + PAR_BLOCK_SIZE - 1) / PAR_BLOCK_SIZE);
+  job.blocks = xalloc(job.nblocks * sizeof(struct par_block));
+  MEMSET(job.blocks, 0, job.nblocks * sizeof(struct par_block));
+  for (i = 0; i < job.nblocks; i++) {
+    struct par_block *b = job.blocks + i;
+    b->in = STR0(data) + (size_t)i * PAR_BLOCK_SIZE;
+    b->len = MINIMUM(PAR_BLOCK_SIZE,
+		     data->len - (size_t)i * PAR_BLOCK_SIZE);
+    b->dict_len = i ? dict_size : 0;
+  }
+
+  if (threads > PAR_MAX_THREADS) threads = PAR_MAX_THREADS;
+
+  /* The checksum is a pass over all the data, so it goes first and
+   * runs alongside the blocks.
+   */
+  THREADS_ALLOW();
+  th_parallel(par_deflate_task, &job, job.checksum + job.nblocks, threads);
+  THREADS_DISALLOW();
+
+  total = raw ? 0 : 6;
+  for (i = 0; i < job.nblocks; i++) {
+    if (job.blocks[i].ret != Z_OK) err = job.blocks[i].ret;
+    total += job.blocks[i].out_len;
+  }
+
+  if (err != Z_OK) {
+    for (i = 0; i < job.nblocks; i++)
+      if (job.blocks[i].out) free(job.blocks[i].out);
+    free(job.blocks);
+    Pike_error("Error while deflating data (%d).\n", err);
+  }
+
+  res = begin_shared_string(total);
+  p = STR0(res);
+  if (!raw) {
+    /* RFC 1950 header. */
+    unsigned INT32 flevel = (level < 2 || strategy == Z_HUFFMAN_ONLY) ? 0 :
+      (level < 6) ? 1 : (level == 6) ? 2 : 3;
+    unsigned INT32 head = ((((wbits - 8) << 4) | Z_DEFLATED) << 8) |
+      (flevel << 6);
+    head += 31 - (head % 31);
+    *p++ = head >> 8;
+    *p++ = head & 0xff;
+  }
+  for (i = 0; i < job.nblocks; i++) {
+    MEMCPY(p, job.blocks[i].out, job.blocks[i].out_len);
+    p += job.blocks[i].out_len;
+    free(job.blocks[i].out);
+  }
+  free(job.blocks);
+  if (!raw) {
+    *p++ = job.adler >> 24;
+    *p++ = (job.adler >> 16) & 0xff;
+    *p++ = (job.adler >> 8) & 0xff;
+    *p++ = job.adler & 0xff;
+  }
+
+  return end_shared_string(res);
+}
+#endif /* _REENTRANT */
+
 /*! @endclass
  */
 
 /*! @decl string compress(string data, void|int(0..1) raw, @
  *!                       void|int(0..9) level, void|int strategy, @
- *!                       void|int(8..15) window_size)
+ *!                       void|int(8..15) window_size, void|int threads)
  *!
  *! Encodes and returns the input @[data] according to the deflate
  *! format defined in RFC 1951.
@@ -410,6 +618,12 @@ void zlibmod_pack(struct pike_string *data, dynamic_buffer *buf,
  *!   Defines the size of the LZ77 window from 256 bytes to 32768
  *!   bytes, expressed as 2^x.
  *!
+ *! @param threads
+ *!   If larger than 1, large inputs are split into blocks which are
+ *!   compressed in parallel by up to this many threads, and then
+ *!   joined into a single stream. The result is slightly larger than
+ *!   with serial compression, and differs from it byte-wise, but
+ *!   decodes to the same data.
  */
 static void gz_compress(INT32 args)
 {
@@ -421,9 +635,10 @@ static void gz_compress(INT32 args)
   int raw = 0;
   int level = 8;
   int strategy = Z_DEFAULT_STRATEGY;
+  int threads = 0;
 
-  get_all_args("compress", args, "%n.%d%d%d%d", &data, &raw, &level, &strategy,
-               &wbits);
+  get_all_args("compress", args, "%n.%d%d%d%d%d", &data, &raw, &level,
+	       &strategy, &wbits, &threads);
 
   if( !wbits )
     wbits = 15;
@@ -431,6 +646,17 @@ static void gz_compress(INT32 args)
   if( raw )
     wbits = -wbits;
 
+#ifdef _REENTRANT
+  if( threads > 1 && data->len >= 2*PAR_BLOCK_SIZE )
+  {
+    struct pike_string *res =
+      zlibmod_pack_parallel(data, level, strategy, wbits, threads);
+    pop_n_elems(args);
+    push_string(res);
+    return;
+  }
+#endif
+
   initialize_buf(&buf);
   SET_ONERROR(err, toss_buffer, &buf);
   zlibmod_pack(data, &buf, level, strategy, wbits);
@@ -963,9 +1189,17 @@ static void gz_crc32(INT32 args)
    } else
       crc=0;
 	 
-   crc=crc32(crc,
-	     (unsigned char*)sp[-args].u.string->str,
-	     DO_NOT_WARN((unsigned INT32)(sp[-args].u.string->len)));
+   if (sp[-args].u.string->len > BUF) {
+      unsigned char *data = (unsigned char *)sp[-args].u.string->str;
+      unsigned INT32 len =
+	DO_NOT_WARN((unsigned INT32)(sp[-args].u.string->len));
+      THREADS_ALLOW();
+      crc=crc32(crc, data, len);
+      THREADS_DISALLOW();
+   } else
+      crc=crc32(crc,
+		(unsigned char*)sp[-args].u.string->str,
+		DO_NOT_WARN((unsigned INT32)(sp[-args].u.string->len)));
 
    pop_n_elems(args);
    push_int((INT32)crc);
@@ -1062,8 +1296,8 @@ PIKE_MODULE_INIT
   /* function(string,void|int:int) */
   ADD_FUNCTION("crc32",gz_crc32,tFunc(tStr tOr(tVoid,tInt),tInt),0);
 
-  /* function(string,void|int(0..1),void|int,void|int:string) */
-  ADD_FUNCTION("compress",gz_compress,tFunc(tStr tOr(tVoid,tInt01) tOr(tVoid,tInt09) tOr(tVoid,tInt) tOr(tVoid,tInt),tStr),0);
+  /* function(string,void|int(0..1),void|int,void|int,void|int,void|int:string) */
+  ADD_FUNCTION("compress",gz_compress,tFunc(tStr tOr(tVoid,tInt01) tOr(tVoid,tInt09) tOr(tVoid,tInt) tOr(tVoid,tInt) tOr(tVoid,tInt),tStr),0);
 
   /* function(string,void|int(0..1):string) */
   ADD_FUNCTION("uncompress",gz_uncompress,tFunc(tStr tOr(tVoid,tInt01),tStr),0);
@@ -33,6 +33,7 @@
 #include "object.h"
 #include "interpret.h"
 #include "svalue.h"
+#include "threads.h"
 #include "mapping.h"
 #include "builtin_functions.h"
 #include "pike_error.h"
@@ -112,6 +113,11 @@ static void colortable_free_lookup_stuff(struct neo_colortable *nct)
 	 break;
       case NCT_FULL:
          break;
+      case NCT_KDTREE:
+	 if (nct->lu.kdtree.nodes)
+	    free(nct->lu.kdtree.nodes);
+	 nct->lu.kdtree.nodes=NULL;
+	 break;
    }
 }
 
@@ -224,6 +230,7 @@ static void _img_copy_colortable(struct neo_colortable *dest,
       case NCT_CUBICLES: dest->lu.cubicles.cubicles=NULL; break;
       case NCT_RIGID:    dest->lu.rigid.index=NULL; break;
       case NCT_FULL:     break;
+      case NCT_KDTREE:   dest->lu.kdtree.nodes=NULL; break;
    }
    
    /* copy dither info */
@@ -1797,25 +1804,35 @@ static void dither_floyd_steinberg_firstline(struct nct_dither *dith,
    rgbd_group *er;
    int i;
 
-   er=dith->u.floyd_steinberg.errors;
-   for (i=0; i<dith->rowlen; i++)
+   if (dith->u.floyd_steinberg.primed)
    {
-      er[i].r = DO_NOT_WARN((float)((my_rand()&65535)*(1.0/65536)-0.49999));
-      er[i].g = DO_NOT_WARN((float)((my_rand()&65535)*(1.0/65536)-0.49999));
-      er[i].b = DO_NOT_WARN((float)((my_rand()&65535)*(1.0/65536)-0.49999));
+      /* continuing from rows dithered earlier (see nct_map_rows) */
+      dith->u.floyd_steinberg.primed=0;
+      *cd=dith->u.floyd_steinberg.currentdir;
    }
+   else
+   {
+      er=dith->u.floyd_steinberg.errors;
+      for (i=0; i<dith->rowlen; i++)
+      {
+	 er[i].r = DO_NOT_WARN((float)((my_rand()&65535)*(1.0/65536)-0.49999));
+	 er[i].g = DO_NOT_WARN((float)((my_rand()&65535)*(1.0/65536)-0.49999));
+	 er[i].b = DO_NOT_WARN((float)((my_rand()&65535)*(1.0/65536)-0.49999));
+      }
 
-   er=dith->u.floyd_steinberg.nexterrors;
-   for (i=0; i<dith->rowlen; i++) er[i].r=er[i].g=er[i].b=0.0;
+      er=dith->u.floyd_steinberg.nexterrors;
+      for (i=0; i<dith->rowlen; i++) er[i].r=er[i].g=er[i].b=0.0;
+
+      dith->u.floyd_steinberg.currentdir=
+	 (*cd)=(dith->u.floyd_steinberg.dir>=0)?1:-1;
+   }
 
-   if (dith->u.floyd_steinberg.dir>=0)
+   if (*cd==1)
    {
-      dith->u.floyd_steinberg.currentdir=(*cd)=1;
       *rowpos=0;
    }
    else
    {
-      dith->u.floyd_steinberg.currentdir=(*cd)=-1;
       (*rowpos)=dith->rowlen-1;
       (*s)+=dith->rowlen-1;
       if (drgb) (*drgb)+=dith->rowlen-1;
@@ -1962,6 +1979,7 @@ int image_colortable_initiate_dither(struct neo_colortable *nct,
 	 dith->u.floyd_steinberg.currentdir=
 	    dith->u.floyd_steinberg.dir=
 	       nct->du.floyd_steinberg.dir;
+	 dith->u.floyd_steinberg.primed=0;
 	 return 1;
 
       case NCTD_RANDOMCUBE:
@@ -2769,7 +2787,7 @@ void image_colortable_cast(INT32 args)
 **!
 **! returns the object being called
 **!
-**! see also: cubicles, map
+**! see also: cubicles, map, kdtree
 **! note
 **!     Not applicable to colorcube types of colortable.
 **/
@@ -2806,7 +2824,7 @@ void image_colortable_full(INT32 args)
 **!
 **! returns the object being called
 **!
-**! see also: cubicles, map, full
+**! see also: cubicles, map, full, kdtree
 **! note
 **!     Not applicable to colorcube types of colortable.
 **/
@@ -2848,6 +2866,43 @@ void image_colortable_rigid(INT32 args)
    ref_push_object(THISOBJ);
 }
 
+/*
+**! method object kdtree()
+**!	Set the colortable to use a k-d tree to lookup the
+**!	closest color.
+**!
+**!	The colors are kept in a binary tree that splits the
+**!	colorspace in red, green or blue on each level. The lookup
+**!	gives the same result as <ref>full</ref>, but only needs
+**!	to compare with a few of the colors, which makes it a good
+**!	choice for large colortables, like 256 colors from an image.
+**!
+**!	example: <tt>colors=Image.Colortable(img,256)->kdtree();</tt>
+**!
+**!     algorithm time: about O[m*log n], where n is numbers of colors
+**!	and m is number of pixels
+**!
+**!	The tree is built on first usage, which takes very little time.
+**!
+**! returns the object being called
+**!
+**! see also: cubicles, rigid, full, map
+**! note
+**!     Not applicable to colorcube types of colortable.
+**/
+
+void image_colortable_kdtree(INT32 args)
+{
+   if (THIS->lookup_mode!=NCT_KDTREE) 
+   {
+      colortable_free_lookup_stuff(THIS);
+      THIS->lookup_mode=NCT_KDTREE;
+      THIS->lu.kdtree.nodes=NULL;
+   }
+   pop_n_elems(args);
+   ref_push_object(THISOBJ);
+}
+
 /*
 **! method object cubicles()
 **! method object cubicles(int r,int g,int b)
@@ -3354,6 +3409,190 @@ void build_rigid(struct neo_colortable *nct)
    free(dist);
 }
 
+#define KDCOMP(N,AXIS) \
+   ((AXIS)==0?(N).color.r:((AXIS)==1?(N).color.g:(N).color.b))
+
+/* Makes nodes[lo..hi-1] a subtree: the median in the axis with the
+ * largest spread goes in the middle, and the halves on each side are
+ * built the same way. */
+static void _kdtree_build(struct nctlu_kdnode *nodes,int lo,int hi,
+			  rgbl_group sf)
+{
+   while (hi-lo>1)
+   {
+      int min[3]={255,255,255},max[3]={0,0,0};
+      int i,j,l,h,mid,axis;
+      INT64 spread,best;
+
+      for (i=lo; i<hi; i++)
+	 for (j=0; j<3; j++)
+	 {
+	    int c=KDCOMP(nodes[i],j);
+	    if (c<min[j]) min[j]=c;
+	    if (c>max[j]) max[j]=c;
+	 }
+
+      axis=0;
+      best=(INT64)sf.r*SQ(max[0]-min[0]);
+      if ((spread=(INT64)sf.g*SQ(max[1]-min[1]))>best) axis=1,best=spread;
+      if ((spread=(INT64)sf.b*SQ(max[2]-min[2]))>best) axis=2;
+
+      /* quickselect the median to mid */
+      mid=(lo+hi)>>1;
+      l=lo; h=hi-1;
+      while (l<h)
+      {
+	 int pivot=KDCOMP(nodes[(l+h)>>1],axis);
+	 i=l; j=h;
+	 while (i<=j)
+	 {
+	    while (KDCOMP(nodes[i],axis)<pivot) i++;
+	    while (KDCOMP(nodes[j],axis)>pivot) j--;
+	    if (i<=j)
+	    {
+	       struct nctlu_kdnode tmp=nodes[i];
+	       nodes[i++]=nodes[j];
+	       nodes[j--]=tmp;
+	    }
+	 }
+	 if (mid<=j) h=j;
+	 else if (mid>=i) l=i;
+	 else break;
+      }
+
+      nodes[mid].axis=axis;
+      _kdtree_build(nodes,lo,mid,sf);
+      lo=mid+1;
+   }
+   if (hi-lo==1) nodes[lo].axis=0;
+}
+
+static void build_kdtree(struct neo_colortable *nct)
+{
+   struct nctlu_kdnode *nodes;
+   ptrdiff_t i;
+   int n=0;
+
+   if (nct->lu.kdtree.nodes) Pike_fatal("kdtree is initialized twice.\n");
+
+   nodes=xalloc(sizeof(struct nctlu_kdnode)*(nct->u.flat.numentries+1));
+
+   for (i=0; i<nct->u.flat.numentries; i++)
+      if (nct->u.flat.entries[i].no!=-1)
+      {
+	 nodes[n].color=nct->u.flat.entries[i].color;
+	 nodes[n].index=DO_NOT_WARN((int)i);
+	 n++;
+      }
+
+   _kdtree_build(nodes,0,n,nct->spacefactor);
+
+   nct->lu.kdtree.n=n;
+   nct->lu.kdtree.nodes=nodes;
+}
+
+/* Finds the closest color in the subtree nodes[lo..hi-1]. Of several
+ * colors at the same distance the first in the colortable wins, just
+ * as with full(). */
+static void _kdtree_lookup(const struct nctlu_kdnode *nodes,int lo,int hi,
+			   int r,int g,int b,rgbl_group sf,
+			   int *best,int *bestdist)
+{
+   while (lo<hi)
+   {
+      int mid=(lo+hi)>>1;
+      const struct nctlu_kdnode *nd=nodes+mid;
+      int dist=sf.r*SQ(nd->color.r-r)+
+	       sf.g*SQ(nd->color.g-g)+
+	       sf.b*SQ(nd->color.b-b);
+      int diff,w;
+
+      if (dist<*bestdist || (dist==*bestdist && nd->index<*best))
+      {
+	 *bestdist=dist;
+	 *best=nd->index;
+      }
+
+      switch (nd->axis)
+      {
+	 case 0: diff=nd->color.r-r; w=sf.r; break;
+	 case 1: diff=nd->color.g-g; w=sf.g; break;
+	 default: diff=nd->color.b-b; w=sf.b; break;
+      }
+
+      /* search the near half first; the far half is only of
+	 interest if the split plane is close enough */
+      if (diff>0)
+      {
+	 _kdtree_lookup(nodes,lo,mid,r,g,b,sf,best,bestdist);
+	 if (w*diff*diff>*bestdist) return;
+	 lo=mid+1;
+      }
+      else
+      {
+	 _kdtree_lookup(nodes,mid+1,hi,r,g,b,sf,best,bestdist);
+	 if (w*diff*diff>*bestdist) return;
+	 hi=mid;
+      }
+   }
+}
+
+static INLINE int kdtree_lookup(struct neo_colortable *nct,rgbl_group val)
+{
+   int best=0,bestdist=INT_MAX;
+   _kdtree_lookup(nct->lu.kdtree.nodes,0,nct->lu.kdtree.n,
+		  val.r,val.g,val.b,nct->spacefactor,&best,&bestdist);
+   return best;
+}
+
+/* Builds the lookup structures that are otherwise built on demand,
+ * so that several threads can share them. */
+static void colortable_build_lookup(struct neo_colortable *nct)
+{
+   if (nct->type!=NCT_FLAT) return;
+
+   switch (nct->lookup_mode)
+   {
+      case NCT_CUBICLES:
+      {
+	 struct nctlu_cubicles *cubs=&(nct->lu.cubicles);
+	 int r,g,b;
+
+	 if (!cubs->cubicles)
+	 {
+	    int n2=cubs->r*cubs->g*cubs->b;
+	    struct nctlu_cubicle *cub;
+	    cub=cubs->cubicles=xalloc(sizeof(struct nctlu_cubicle)*n2+1);
+	    while (n2--)
+	    {
+	       cub->n=0;
+	       cub->index=NULL;
+	       cub++;
+	    }
+	 }
+
+	 for (b=0; b<cubs->b; b++)
+	    for (g=0; g<cubs->g; g++)
+	       for (r=0; r<cubs->r; r++)
+	       {
+		  struct nctlu_cubicle *cub=
+		     cubs->cubicles+r+g*cubs->r+b*cubs->r*cubs->g;
+		  if (!cub->index)
+		     _build_cubicle(nct,r,g,b,cubs->r,cubs->g,cubs->b,cub);
+	       }
+	 break;
+      }
+      case NCT_RIGID:
+	 if (!nct->lu.rigid.index) build_rigid(nct);
+	 break;
+      case NCT_KDTREE:
+	 if (!nct->lu.kdtree.nodes) build_kdtree(nct);
+	 break;
+      case NCT_FULL:
+	 break;
+   }
+}
+
 /*
 **! method object map(object image)
 **! method object `*(object image)
@@ -3414,7 +3653,13 @@ void build_rigid(struct neo_colortable *nct)
 **!	the lookup method, which may take time the first
 **!	use of the colortable - the second use is quicker.
 **!
-**! see also: cubicles, full
+**!     Large images are mapped by several threads at once if
+**!     <ref>Image.set_threads</ref> allows it, when no dither or
+**!     <ref>floyd_steinberg</ref> dither is used. With Floyd-Steinberg
+**!     each thread starts its rows with the error from a few rows
+**!     before, so the result differs slightly from a single thread.
+**!
+**! see also: cubicles, full, kdtree
 **/
 
 /* Some functions to avoid warnings about losss of precision. */
@@ -3437,6 +3682,151 @@ static inline unsigned INT32 TO_UINT32(ptrdiff_t val)
 #define TO_UINT32(x)	((unsigned INT32)x)
 #endif /* __ECL */
 
+/**** parallel mapping ****/
+
+/* Large images are mapped in bands of rows on several threads (see
+ * Image.set_threads), each with its own lookup cache and dither
+ * state. Without dithering the result is the same as from one
+ * thread. With Floyd-Steinberg dithering each band first dithers
+ * the last NCT_FS_WARMUP rows of the band above into a scratch
+ * buffer, so the errors diffused from above are carried into the
+ * band and no seams show. Other dithers are done in one go. */
+
+#define NCT_FS_WARMUP 16
+
+typedef void nct_map_rows_function(rgb_group *s,
+				   void *d,
+				   int n,
+				   struct neo_colortable *nct,
+				   struct nct_dither *dith,
+				   int rowlen);
+
+struct nct_map_job
+{
+   struct neo_colortable *nct;
+   nct_map_rows_function *map;
+   rgb_group *s;
+   char *d;
+   size_t dsize;		/* size of one destination pixel */
+   int rowlen;
+   rgbd_group *seed;		/* first row errors, Floyd-Steinberg */
+   int failed;
+};
+
+static void nct_map_rows(void *data,INT32 y0,INT32 y1)
+{
+   struct nct_map_job *job=(struct nct_map_job *)data;
+   struct neo_colortable nct=*job->nct;
+   struct nct_dither dith;
+   int rowlen=job->rowlen;
+   int i;
+
+   for (i=0; i<COLORLOOKUPCACHEHASHSIZE; i++)
+      nct.lookupcachehash[i].index=-1;
+
+   if (!image_colortable_initiate_dither(&nct,&dith,rowlen))
+   {
+      job->failed=1;
+      return;
+   }
+
+   if (dith.type==NCTD_FLOYD_STEINBERG)
+   {
+      INT32 w0=MAXIMUM(y0-NCT_FS_WARMUP,0);
+      int dir=dith.u.floyd_steinberg.dir;
+
+      MEMCPY(dith.u.floyd_steinberg.errors,job->seed,
+	     rowlen*sizeof(rgbd_group));
+      for (i=0; i<rowlen; i++)
+	 dith.u.floyd_steinberg.nexterrors[i].r=
+	    dith.u.floyd_steinberg.nexterrors[i].g=
+	    dith.u.floyd_steinberg.nexterrors[i].b=0.0;
+      /* the direction row w0 would have had */
+      dith.u.floyd_steinberg.currentdir=
+	 dir>0?1:(dir<0?-1:((w0&1)?-1:1));
+      dith.u.floyd_steinberg.primed=1;
+
+      if (w0<y0)
+      {
+	 void *scratch=malloc((y0-w0)*rowlen*job->dsize+1);
+	 if (!scratch)
+	 {
+	    image_colortable_free_dither(&dith);
+	    job->failed=1;
+	    return;
+	 }
+	 job->map(job->s+w0*rowlen,scratch,(y0-w0)*rowlen,
+		  &nct,&dith,rowlen);
+	 free(scratch);
+	 dith.u.floyd_steinberg.primed=1;
+      }
+   }
+
+   job->map(job->s+y0*rowlen,job->d+(size_t)y0*rowlen*job->dsize,
+	    (y1-y0)*rowlen,&nct,&dith,rowlen);
+
+   image_colortable_free_dither(&dith);
+}
+
+/* Returns 1 if the image was mapped, 0 if it should be done in the
+ * calling thread. */
+static int nct_map_parallel(struct neo_colortable *nct,
+			    rgb_group *s,
+			    void *d,
+			    size_t dsize,
+			    int len,
+			    int rowlen,
+			    nct_map_rows_function *map)
+{
+#ifdef _REENTRANT
+   struct nct_map_job job;
+   INT32 band=0;
+   int i;
+
+   if (image_threads<2 || len<IMG_PAR_MIN_PIXELS ||
+       rowlen<1 || len%rowlen)
+      return 0;
+   if (nct->dither_type!=NCTD_NONE &&
+       nct->dither_type!=NCTD_FLOYD_STEINBERG)
+      return 0;
+
+   colortable_build_lookup(nct);
+
+   job.nct=nct;
+   job.map=map;
+   job.s=s;
+   job.d=(char *)d;
+   job.dsize=dsize;
+   job.rowlen=rowlen;
+   job.seed=NULL;
+   job.failed=0;
+
+   if (nct->dither_type==NCTD_FLOYD_STEINBERG)
+   {
+      /* my_rand() needs the interpreter lock */
+      job.seed=xalloc(rowlen*sizeof(rgbd_group)+1);
+      for (i=0; i<rowlen; i++)
+      {
+	 job.seed[i].r = DO_NOT_WARN((float)((my_rand()&65535)*(1.0/65536)-0.49999));
+	 job.seed[i].g = DO_NOT_WARN((float)((my_rand()&65535)*(1.0/65536)-0.49999));
+	 job.seed[i].b = DO_NOT_WARN((float)((my_rand()&65535)*(1.0/65536)-0.49999));
+      }
+      /* few bands, since each redoes NCT_FS_WARMUP rows */
+      band=MAXIMUM(len/rowlen/image_threads,4*NCT_FS_WARMUP);
+   }
+
+   THREADS_ALLOW();
+   img_run_rows(nct_map_rows,&job,len/rowlen,rowlen,band);
+   THREADS_DISALLOW();
+
+   if (job.seed) free(job.seed);
+
+   return !job.failed;
+#else
+   return 0;
+#endif
+}
+
 /* begin instantiating from colortable_lookup.h */
 /* instantiate map functions */
 
@@ -3447,6 +3837,8 @@ static inline unsigned INT32 TO_UINT32(ptrdiff_t val)
 #define NCTLU_FLAT_FULL_NAME _img_nct_map_to_flat_full
 #define NCTLU_CUBE_NAME _img_nct_map_to_cube
 #define NCTLU_FLAT_RIGID_NAME _img_nct_map_to_flat_rigid
+#define NCTLU_FLAT_KDTREE_NAME _img_nct_map_to_flat_kdtree
+#define NCTLU_ROWS_NAME _img_nct_map_to_rows
 #define NCTLU_LINE_ARGS (dith,&rowpos,&s,&d,NULL,NULL,NULL,&cd)
 #define NCTLU_RIGID_WRITE (d[0]=feprim[i].color)
 #define NCTLU_DITHER_RIGID_GOT (*d)
@@ -3474,6 +3866,8 @@ static inline unsigned INT32 TO_UINT32(ptrdiff_t val)
 #undef NCTLU_CUBE_FAST_WRITE_DITHER_GOT
 #undef NCTLU_RIGID_WRITE
 #undef NCTLU_FLAT_RIGID_NAME
+#undef NCTLU_FLAT_KDTREE_NAME
+#undef NCTLU_ROWS_NAME
 #undef NCTLU_DITHER_RIGID_GOT
 #undef NCTLU_SELECT_FUNCTION
 #undef NCTLU_EXECUTE_FUNCTION
@@ -3487,6 +3881,8 @@ static inline unsigned INT32 TO_UINT32(ptrdiff_t val)
 #define NCTLU_FLAT_FULL_NAME _img_nct_index_8bit_flat_full
 #define NCTLU_CUBE_NAME _img_nct_index_8bit_cube
 #define NCTLU_FLAT_RIGID_NAME _img_nct_index_8bit_flat_rigid
+#define NCTLU_FLAT_KDTREE_NAME _img_nct_index_8bit_flat_kdtree
+#define NCTLU_ROWS_NAME _img_nct_index_8bit_rows
 #define NCTLU_LINE_ARGS (dith,&rowpos,&s,NULL,&d,NULL,NULL,&cd)
 #define NCTLU_RIGID_WRITE (d[0] = TO_UCHAR(feprim[i].no))
 #define NCTLU_DITHER_RIGID_GOT (feprim[i].color)
@@ -3522,6 +3918,8 @@ static inline unsigned INT32 TO_UINT32(ptrdiff_t val)
 #undef NCTLU_CUBE_FAST_WRITE_DITHER_GOT
 #undef NCTLU_RIGID_WRITE
 #undef NCTLU_FLAT_RIGID_NAME
+#undef NCTLU_FLAT_KDTREE_NAME
+#undef NCTLU_ROWS_NAME
 #undef NCTLU_DITHER_RIGID_GOT
 #undef NCTLU_SELECT_FUNCTION
 #undef NCTLU_EXECUTE_FUNCTION
@@ -3535,6 +3933,8 @@ static inline unsigned INT32 TO_UINT32(ptrdiff_t val)
 #define NCTLU_FLAT_FULL_NAME _img_nct_index_16bit_flat_full
 #define NCTLU_CUBE_NAME _img_nct_index_16bit_cube
 #define NCTLU_FLAT_RIGID_NAME _img_nct_index_16bit_flat_rigid
+#define NCTLU_FLAT_KDTREE_NAME _img_nct_index_16bit_flat_kdtree
+#define NCTLU_ROWS_NAME _img_nct_index_16bit_rows
 #define NCTLU_LINE_ARGS (dith,&rowpos,&s,NULL,NULL,&d,NULL,&cd)
 #define NCTLU_RIGID_WRITE (d[0] = TO_USHORT(feprim[i].no))
 #define NCTLU_DITHER_RIGID_GOT (feprim[i].color)
@@ -3570,6 +3970,8 @@ static inline unsigned INT32 TO_UINT32(ptrdiff_t val)
 #undef NCTLU_CUBE_FAST_WRITE_DITHER_GOT
 #undef NCTLU_RIGID_WRITE
 #undef NCTLU_FLAT_RIGID_NAME
+#undef NCTLU_FLAT_KDTREE_NAME
+#undef NCTLU_ROWS_NAME
 #undef NCTLU_DITHER_RIGID_GOT
 #undef NCTLU_SELECT_FUNCTION
 #undef NCTLU_EXECUTE_FUNCTION
@@ -3583,6 +3985,8 @@ static inline unsigned INT32 TO_UINT32(ptrdiff_t val)
 #define NCTLU_FLAT_FULL_NAME _img_nct_index_32bit_flat_full
 #define NCTLU_CUBE_NAME _img_nct_index_32bit_cube
 #define NCTLU_FLAT_RIGID_NAME _img_nct_index_32bit_flat_rigid
+#define NCTLU_FLAT_KDTREE_NAME _img_nct_index_32bit_flat_kdtree
+#define NCTLU_ROWS_NAME _img_nct_index_32bit_rows
 #define NCTLU_LINE_ARGS (dith,&rowpos,&s,NULL,NULL,NULL,&d,&cd)
 #define NCTLU_RIGID_WRITE (d[0] = TO_UINT32(feprim[i].no))
 #define NCTLU_DITHER_RIGID_GOT (feprim[i].color)
@@ -3618,6 +4022,8 @@ static inline unsigned INT32 TO_UINT32(ptrdiff_t val)
 #undef NCTLU_CUBE_FAST_WRITE_DITHER_GOT
 #undef NCTLU_RIGID_WRITE
 #undef NCTLU_FLAT_RIGID_NAME
+#undef NCTLU_FLAT_KDTREE_NAME
+#undef NCTLU_ROWS_NAME
 #undef NCTLU_DITHER_RIGID_GOT
 #undef NCTLU_SELECT_FUNCTION
 #undef NCTLU_EXECUTE_FUNCTION
@@ -4636,6 +5042,7 @@ void init_image_colortable(void)
    ADD_FUNCTION("cubicles",image_colortable_cubicles,tOr(tFunc(tNone,tObj),tFunc(tInt tInt tInt tOr(tVoid,tInt),tObj)),0);
    ADD_FUNCTION("rigid",image_colortable_rigid,tOr(tFunc(tNone,tObj),tFunc(tInt tInt tInt,tObj)),0);
    ADD_FUNCTION("full",image_colortable_full,tFunc(tNone,tObj),0);
+   ADD_FUNCTION("kdtree",image_colortable_kdtree,tFunc(tNone,tObj),0);
 
    /* map image */
    /* function(object:object)|function(string,int,int) */
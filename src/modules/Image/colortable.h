@@ -57,7 +57,8 @@ struct neo_colortable
    {
       NCT_CUBICLES, /* cubicle lookup */
       NCT_RIGID, /* rigid lookup */
-      NCT_FULL /* scan all values */
+      NCT_FULL, /* scan all values */
+      NCT_KDTREE /* k-d tree lookup */
    } lookup_mode;
 
    union
@@ -104,6 +105,17 @@ struct neo_colortable
 	 int r,g,b; /* size */
 	 int *index;
       } rigid;
+      struct nctlu_kdtree
+      {
+	 int n;
+	 struct nctlu_kdnode
+	 {
+	    rgb_group color;
+	    unsigned char axis; /* split axis; 0=r, 1=g, 2=b */
+	    int index; /* position in u.flat.entries */
+	 } *nodes; /* [n], NULL if not initiated; each subrange
+		      is a subtree with the split node in the middle */
+      } kdtree;
    } lu;
 
    enum nct_dither_type
@@ -181,6 +193,7 @@ struct nct_dither
 	 float forward;
 	 int dir;
 	 int currentdir;
+	 int primed; /* errors and currentdir are already set up */
       } floyd_steinberg;
       struct nctd_randomcube randomcube;
       struct nctd_ordered ordered;
@@ -331,6 +331,79 @@ void NCTLU_FLAT_RIGID_NAME(rgb_group *s,
    CHRONO("end flat/rigid map");
 }
 
+void NCTLU_FLAT_KDTREE_NAME(rgb_group *s,
+			    NCTLU_DESTINATION *d,
+			    int n,
+			    struct neo_colortable *nct,
+			    struct nct_dither *dith,
+			    int rowlen)
+{
+   struct nct_flat_entry *feprim = nct->u.flat.entries;
+
+   nct_dither_encode_function *dither_encode=dith->encode;
+   nct_dither_got_function *dither_got=dith->got;
+   nct_dither_line_function *dither_newline=dith->newline;
+   int rowpos=0,cd=1,rowcount=0;
+   rgbl_group last;
+   int i=-1;
+
+   if (!nct->lu.kdtree.nodes)
+   {
+      CHRONO("init flat/kdtree map");
+      build_kdtree(nct);
+   }
+   if (!nct->lu.kdtree.n) return; /* no colors */
+
+   CHRONO("begin flat/kdtree map");
+
+   if (dith->firstline)
+      (dith->firstline)NCTLU_LINE_ARGS;
+
+   while (n--)
+   {
+      rgbl_group val;
+	 
+      if (dither_encode)
+      {
+	 val=dither_encode(dith,rowpos,*s);
+      }
+      else
+      {
+	 val.r=s->r;
+	 val.g=s->g;
+	 val.b=s->b;
+      }
+
+      /* runs of the same color are common */
+      if (i<0 || val.r!=last.r || val.g!=last.g || val.b!=last.b)
+      {
+	 i=kdtree_lookup(nct,val);
+	 last=val;
+      }
+      NCTLU_RIGID_WRITE;
+
+      if (dither_encode)
+      {
+        if (dither_got)
+          dither_got(dith,rowpos,*s,NCTLU_DITHER_RIGID_GOT);
+        s+=cd; d+=cd; rowpos+=cd;
+        if (++rowcount==rowlen)
+        {
+          rowcount=0;
+          if (dither_newline) 
+            (dither_newline)NCTLU_LINE_ARGS;
+        }
+      }
+      else
+      {
+	 d++;
+	 s++;
+      }
+   }
+
+   CHRONO("end flat/kdtree map");
+}
+
 void NCTLU_CUBE_NAME(rgb_group *s,
 		     NCTLU_DESTINATION *d,
 		     int n,
@@ -561,6 +634,14 @@ void (*NCTLU_SELECT_FUNCTION(struct neo_colortable *nct))
 		      DEFINETOSTR(NCTLU_FLAT_CUBICLES_NAME) "\n");
 #endif /* COLORTABLE_DEBUG */
 	       return &NCTLU_FLAT_CUBICLES_NAME;
+	    case NCT_KDTREE:
+#ifdef COLORTABLE_DEBUG
+	      fprintf(stderr,
+		      "COLORTABLE " DEFINETOSTR(NCTLU_SELECT_FUNCTION) ":"
+		      DEFINETOSTR(NCTLU_DESTINATION) " => "
+		      DEFINETOSTR(NCTLU_FLAT_KDTREE_NAME) "\n");
+#endif /* COLORTABLE_DEBUG */
+	       return &NCTLU_FLAT_KDTREE_NAME;
 	 }
       default:
 	 Pike_fatal("lookup select (%s:%d) couldn't find the lookup mode\n",
@@ -570,6 +651,17 @@ void (*NCTLU_SELECT_FUNCTION(struct neo_colortable *nct))
    return 0;
 }
 
+/* nct_map_rows_function for nct_map_parallel() */
+static void NCTLU_ROWS_NAME(rgb_group *s,
+			    void *d,
+			    int n,
+			    struct neo_colortable *nct,
+			    struct nct_dither *dith,
+			    int rowlen)
+{
+   (NCTLU_SELECT_FUNCTION(nct))(s,(NCTLU_DESTINATION *)d,n,nct,dith,rowlen);
+}
+
 int NCTLU_EXECUTE_FUNCTION(struct neo_colortable *nct,
 			   rgb_group *s,
 			   NCTLU_DESTINATION *d,
@@ -580,6 +672,10 @@ int NCTLU_EXECUTE_FUNCTION(struct neo_colortable *nct,
 
    if (nct->type==NCT_NONE) return 0;
 
+   if (nct_map_parallel(nct,s,d,sizeof(NCTLU_DESTINATION),len,rowlen,
+			NCTLU_ROWS_NAME))
+      return 1;
+
    image_colortable_initiate_dither(nct,&dith,rowlen);
    (NCTLU_SELECT_FUNCTION(nct))(s,d,len,nct,&dith,rowlen);
    image_colortable_free_dither(&dith);
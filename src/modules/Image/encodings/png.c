@@ -55,6 +55,7 @@ static struct pike_string *param_bpp;
 static struct pike_string *param_background;
 static struct pike_string *param_zlevel;
 static struct pike_string *param_zstrategy;
+static struct pike_string *param_filter;
 
 /*! @module Image
  */
@@ -121,38 +122,51 @@ static void push_png_chunk(const char *type,    /* 4 bytes */
    f_add(3);
 }
 
-static void png_decompress(int style)
+/* Appends x to buf as a 32 bit big endian integer. */
+static void png_buf_32bit(dynamic_buffer *buf, unsigned INT32 x)
 {
-  dynamic_buffer buf;
-  ONERROR err;
-
-  if (style!=0)
-    Pike_error("Internal error: Illegal decompression style %d.\n",style);
-
-  initialize_buf(&buf);
-  SET_ONERROR(err, toss_buffer, &buf);
-  zlibmod_unpack(Pike_sp[-1].u.string, &buf, 0);
-  UNSET_ONERROR(err);
-
-  pop_stack();
-  push_string(low_free_buf(&buf));
+  unsigned char *p = (unsigned char *)low_make_buf_space(4, buf);
+  p[0] = (unsigned char)(x>>24);
+  p[1] = (unsigned char)(x>>16);
+  p[2] = (unsigned char)(x>>8);
+  p[3] = (unsigned char)x;
 }
 
-static void png_compress(int style, int zlevel, int zstrategy)
+/* Appends a complete chunk to buf. */
+static void png_buf_chunk(dynamic_buffer *buf, const char *type,
+			  const unsigned char *data, size_t len)
 {
-  dynamic_buffer buf;
-  ONERROR err;
-
-  if (style)
-    Pike_error("Internal error: Illegal decompression style %d.\n",style);
-
-  initialize_buf(&buf);
-  SET_ONERROR(err, toss_buffer, &buf);
-  zlibmod_pack(Pike_sp[-1].u.string, &buf, zlevel, zstrategy, 15);
-  UNSET_ONERROR(err);
+  size_t off;
+
+  png_buf_32bit(buf, (unsigned INT32)len);
+  off = buf->s.len;
+  MEMCPY(low_make_buf_space(4, buf), type, 4);
+  if (len)
+    MEMCPY(low_make_buf_space(len, buf), data, len);
+  png_buf_32bit(buf, crc32(0, (unsigned char *)buf->s.str + off,
+			   (unsigned INT32)(len + 4)));
+}
 
-  pop_stack();
-  push_string(low_free_buf(&buf));
+/* Appends an IDAT chunk holding the compressed data to buf. The
+ * deflate output is written straight into buf, so no intermediate
+ * strings are created. */
+static void png_buf_idat(dynamic_buffer *buf, struct pike_string *data,
+			 int zlevel, int zstrategy)
+{
+  size_t off = buf->s.len, len;
+  unsigned char *p;
+
+  low_make_buf_space(8, buf);
+  zlibmod_pack(data, buf, zlevel, zstrategy, 15);
+
+  len = buf->s.len - off - 8;
+  p = (unsigned char *)buf->s.str + off;
+  p[0] = (unsigned char)(len>>24);
+  p[1] = (unsigned char)(len>>16);
+  p[2] = (unsigned char)(len>>8);
+  p[3] = (unsigned char)len;
+  MEMCPY(p+4, "IDAT", 4);
+  png_buf_32bit(buf, crc32(0, p+4, (unsigned INT32)(len + 4)));
 }
 
 /*! @decl string _chunk(string type, string data)
@@ -387,21 +401,37 @@ static void image_png___decode(INT32 args)
  *	    "compression": int method         - compression method (0)
  */
 
-static struct pike_string *_png_unfilter(unsigned char *data,
-					 size_t len,
-					 int xsize,int ysize,
-					 int filter,int type,
-					 int bpp,
-					 unsigned char **pos)
+/* The Paeth predictor. pa, pb and pc are the distances from
+ * p=a+b-c to a, b and c respectively. */
+static INLINE int _png_paeth(int a, int b, int c)
 {
-   struct pike_string *ps;
-   unsigned char *d;
-   unsigned char *s;
-   int x;
-   int sbb;
+   int pa = b - c, pb = a - c, pc;
+
+   pc = abs(pa + pb);
+   pa = abs(pa);
+   pb = abs(pb);
+   if (pb < pa) { pa = pb; a = b; }
+   if (pc < pa) a = c;
+   return a;
+}
 
-   if(filter!=0)
-     Pike_error("Unknown filter type %d.\n", filter);
+/* Unfilters rows of PNG data from s into d. d may be equal to s, in
+ * which case the data is unfiltered in place. The per filter loops
+ * keep the first pixel out of the inner loop so that they are free
+ * from the left edge tests. Runs without the interpreter lock;
+ * returns -1 on success, otherwise the unknown filter type. */
+static int _png_unfilter(unsigned char *d,
+			 const unsigned char *s,
+			 size_t len,
+			 int xsize,int ysize,
+			 int type,int bpp,
+			 size_t *dlen,
+			 const unsigned char **pos)
+{
+   unsigned char *d0=d;
+   const unsigned char *prev=NULL;
+   size_t n,m,i;
+   int x,sbb,res=-1;
 
    switch (type) /* Each pixel is ... */
    {
@@ -414,113 +444,71 @@ static struct pike_string *_png_unfilter(unsigned char *data,
    bpp*=x; /* multipy for units/pixel (rgba=4, grey=1, etc) */
    xsize=(xsize*bpp+7)>>3; /* xsize in bytes */
 
-   ps=begin_shared_string(len-((len+xsize)/(xsize+1)));
-   d=(unsigned char*)ps->str;
-   s=data;
-
    sbb=(bpp+7)>>3; /* rounding up */
 
-   for (;;)
+   while (len && ysize--)
    {
-      if (!len || !ysize--)
-      {
-	 if (pos) *pos=s;
-	 return end_shared_string(ps);
-      }
-      x=xsize;
-
-#if 0
-      fprintf(stderr,
-	      "%05d 0x%08lx %02x %02x %02x > %02x < %02x %02x %02x "
-	      "len=%ld xsize=%d sbb=%d next=0x%08lx d=0x%lx nd=0x%lx\n",
-	      ysize+1,(unsigned long)s,
-	      s[-3],s[-2],s[-1],s[0],s[1],s[2],s[3],
-	      len,xsize,sbb,
-	      (unsigned long)s+xsize+1,
-	      (unsigned long)d,
-	      (unsigned long)d+xsize);
-#endif
+      int ft=*(s++);
+      len--;
+      n=(len<(size_t)xsize)?len:(size_t)xsize;
+      m=((size_t)sbb<n)?(size_t)sbb:n;
 
-      switch (*(s++))
+      switch (ft)
       {
 	 case 0: /* no filter */
-	    while (x-- && --len)
-	       *(d++)=*(s++);
-	    if (len) len--;
+	    if (d!=s) MEMMOVE(d,s,n);
 	    break;
 	 case 1: /* sub left */
-	    while (x-- && --len)
-	       if (x+sbb<xsize)
-		  *d=s[0]+d[-sbb],d++,s++;
-	       else
-		  *(d++)=*(s++);
-	    if (len) len--;
+	    for (i=0; i<m; i++) d[i]=s[i];
+	    for (; i<n; i++) d[i]=s[i]+d[i-sbb];
 	    break;
 	 case 2: /* sub up */
-	    if (d - (unsigned char*)ps->str >= xsize)
-	       while (x-- && --len)
-		  *d=s[0]+d[-xsize],d++,s++;
-	    else
-	       while (x-- && --len)
-		  *(d++)=*(s++);
-	    if (len) len--;
+	    if (prev)
+	       for (i=0; i<n; i++) d[i]=s[i]+prev[i];
+	    else if (d!=s)
+	       MEMMOVE(d,s,n);
 	    break;
 	 case 3: /* average */
-	    while (x-- && --len)
+	    if (prev)
 	    {
-	       int a,b;
-
-	       if (x+sbb<xsize) a=d[-sbb]; else a=0;
-	       if (d - (unsigned char*)ps->str >= xsize) b=d[-xsize]; else b=0;
-	       a=(a+b)>>1;
-
-	       *d=*s+a;
-
-	       d++;
-	       s++;
+	       for (i=0; i<m; i++) d[i]=s[i]+(prev[i]>>1);
+	       for (; i<n; i++) d[i]=s[i]+((d[i-sbb]+prev[i])>>1);
+	    }
+	    else
+	    {
+	       for (i=0; i<m; i++) d[i]=s[i];
+	       for (; i<n; i++) d[i]=s[i]+(d[i-sbb]>>1);
 	    }
-	    if (len) len--;
-
 	    break;
 	 case 4: /* paeth */
-	    while (x-- && --len)
+	    if (prev)
 	    {
-	       int a,b,c,p,pa,pb,pc;
-
-	       if (x+sbb<xsize)
-		  {
-		     a=d[-sbb];
-		     if (d - (unsigned char*)ps->str >= xsize)
-		     {
-			b=d[-xsize];
-			c=d[-xsize-sbb];
-		     }
-		     else b=c=0;
-
-		     p=a+b-c;
-		     pa=abs(p-a);
-		     pb=abs(p-b);
-		     pc=abs(p-c);
-		     if (pa<=pb && pa<=pc) p=a;
-		     else if (pb<=pc) p=b;
-		     else p=c;
-
-		     *d=(unsigned char)(p+*s);
-		  }
-	       else if (d - (unsigned char*)ps->str >= xsize)
-		  *d=(unsigned char)(d[-xsize]+*s); /* de facto */
-	       else *d=*s;
-
-	       d++;
-	       s++;
+	       for (i=0; i<m; i++) d[i]=s[i]+prev[i];
+	       for (; i<n; i++)
+		  d[i]=s[i]+_png_paeth(d[i-sbb],prev[i],prev[i-sbb]);
+	    }
+	    else
+	    {
+	       /* b=c=0 always predicts a */
+	       for (i=0; i<m; i++) d[i]=s[i];
+	       for (; i<n; i++) d[i]=s[i]+d[i-sbb];
 	    }
-	    if (len) len--;
-
 	    break;
 	 default:
-	    Pike_error("Unsupported subfilter %d (filter %d)\n", s[-1],type);
+	    res=ft;
+	    goto done;
       }
+
+      prev=d;
+      d+=n;
+      s+=n;
+      len-=n;
    }
+
+done:
+   if (dlen) *dlen=d-d0;
+   if (pos) *pos=s;
+   return res;
 }
 
 static int _png_write_rgb(rgb_group *w1,
@@ -977,129 +965,194 @@ struct IHDR
   int interlace;
 };
 
-/* IN: IDAT string on stack */
+/* Checks the image format up front, so that the pixel data can be
+ * decoded without the interpreter lock. */
+static void _png_check_format(struct IHDR *ihdr, struct neo_colortable *ct)
+{
+  if (ihdr->compression!=0)
+    Pike_error("Internal error: Illegal decompression style %d.\n",
+	       ihdr->compression);
+  if (ihdr->filter!=0)
+    Pike_error("Unknown filter type %d.\n", ihdr->filter);
+  if (ihdr->interlace!=0 && ihdr->interlace!=1)
+    Pike_error("Unknown interlace type %d.\n", ihdr->interlace);
+
+  switch (ihdr->type)
+  {
+    case 0:
+      if (ihdr->bpp==1 || ihdr->bpp==2 || ihdr->bpp==4 ||
+	  ihdr->bpp==8 || ihdr->bpp==16)
+	return;
+      Pike_error("Image.PNG._decode: Unsupported color type/bit depth %d (grey)/%d bit.\n",
+		 ihdr->type, ihdr->bpp);
+      break;
+    case 2:
+      if (ihdr->bpp==8 || ihdr->bpp==16) return;
+      Pike_error("Image.PNG._decode: Unsupported color type/bit depth %d (rgb)/%d bit.\n",
+		 ihdr->type, ihdr->bpp);
+      break;
+    case 3:
+      if (!ct)
+	Pike_error("Image.PNG.decode: No palette, but color type 3 needs one.\n");
+      if (ct->type!=NCT_FLAT)
+	Pike_error("Image.PNG.decode: Internal error (created palette isn't flat).\n");
+      if (!ct->u.flat.numentries)
+	Pike_error("Image.PNG.decode: Palette is zero entries long;"
+		   " need at least one color.\n");
+      if (ihdr->bpp==1 || ihdr->bpp==2 || ihdr->bpp==4 || ihdr->bpp==8)
+	return;
+      Pike_error("Image.PNG._decode: Unsupported color type/bit depth %d (palette)/%d bit.\n",
+		 ihdr->type, ihdr->bpp);
+      break;
+    case 4:
+      if (ihdr->bpp==8 || ihdr->bpp==16) return;
+      Pike_error("Image.PNG._decode: Unsupported color type/bit depth %d (grey+a)/%d bit.\n",
+		 ihdr->type, ihdr->bpp);
+      break;
+    case 6:
+      if (ihdr->bpp==8 || ihdr->bpp==16) return;
+      Pike_error("Image.PNG._decode: Unsupported color type/bit depth %d (rgba)/%d bit.\n",
+		 ihdr->type, ihdr->bpp);
+      break;
+    default:
+      Pike_error("Image.PNG._decode: Unknown color type %d (bit depth %d).\n",
+		 ihdr->type, ihdr->bpp);
+  }
+}
+
+/* IN: The joined IDAT data */
 /* OUT: Image object with image (and possibly alpha, depending on
-   return value) */
+   return value) on the stack */
 static int _png_decode_idat(struct IHDR *ihdr, struct neo_colortable *ct,
-                            struct pike_string *trns)
+                            struct pike_string *trns,
+			    struct pike_string *idat)
 {
-  struct pike_string *fs;
+  dynamic_buffer buf;
   struct image *img;
-  rgb_group *w1,*wa1;
+  rgb_group *w1,*wa1,*t1=NULL,*ta1=NULL;
   unsigned char *s0;
+  size_t len;
   unsigned int i,x,y;
-  ONERROR err, a_err;
+  int bad=-1;
+  ONERROR b_err, err, a_err, t_err, ta_err;
 
-  png_decompress(ihdr->compression);
-  if( sp[-1].type!=T_STRING )
-    Pike_error("Got illegal data from decompression.\n");
+  _png_check_format(ihdr, ct);
+
+  /* The data is inflated into buf and then unfiltered in place. */
+  initialize_buf(&buf);
+  SET_ONERROR(b_err, toss_buffer, &buf);
+  zlibmod_unpack(idat, &buf, 0);
 
   w1=xalloc(sizeof(rgb_group)*ihdr->width*ihdr->height);
   SET_ONERROR(err, free_and_clear, &w1);
   wa1=xalloc(sizeof(rgb_group)*ihdr->width*ihdr->height);
   SET_ONERROR(a_err, free_and_clear, &wa1);
 
-  fs = sp[-1].u.string;
+  if (ihdr->interlace)
+  {
+    /* need arena */
+    t1=xalloc(sizeof(rgb_group)*ihdr->width*ihdr->height);
+    ta1=xalloc(sizeof(rgb_group)*ihdr->width*ihdr->height);
+  }
+  SET_ONERROR(t_err, free_and_clear, &t1);
+  SET_ONERROR(ta_err, free_and_clear, &ta1);
 
-  /* --- interlace decoding --- */
+  s0=(unsigned char*)buf.s.str;
+  len=buf.s.len;
 
-  switch (ihdr->interlace)
-  {
-  case 0: /* none */
-    fs=_png_unfilter((unsigned char*)fs->str,fs->len,
-                     ihdr->width,ihdr->height,
-                     ihdr->filter,ihdr->type,ihdr->bpp,
-                     NULL);
-
-    if (!_png_write_rgb(w1,wa1,
-                        ihdr->type,ihdr->bpp,
-                        (unsigned char*)fs->str,fs->len,
-                        ihdr->width,
-                        ihdr->width*ihdr->height,
-                        ct,trns))
-    {
-      free(wa1);
-      wa1=NULL;
-    }
-    free_string(fs);
-    break;
+  THREADS_ALLOW();
 
-  case 1: /* adam7 */
-    {
-      rgb_group *t1,*ta1;
-      ONERROR t_err, ta_err, ds_err;
-      int got_alpha = 0;
+  /* --- interlace decoding --- */
 
-      /* need arena */
-      t1=xalloc(sizeof(rgb_group)*ihdr->width*ihdr->height);
-      SET_ONERROR(t_err, free_and_clear, &t1);
-      ta1=xalloc(sizeof(rgb_group)*ihdr->width*ihdr->height);
-      SET_ONERROR(ta_err, free_and_clear, &ta1);
+  if (!ihdr->interlace)
+  {
+    size_t dlen;
+
+    bad=_png_unfilter(s0,s0,len,
+		      ihdr->width,ihdr->height,
+		      ihdr->type,ihdr->bpp,
+		      &dlen,NULL);
+
+    if (bad<0 &&
+	!_png_write_rgb(w1,wa1,
+			ihdr->type,ihdr->bpp,
+			s0,dlen,
+			ihdr->width,
+			ihdr->width*ihdr->height,
+			ct,trns))
+      free_and_clear((void **)&wa1);
+  }
+  else /* adam7 */
+  {
+    const unsigned char *s=s0;
+    int got_alpha = 0;
 
-      /* loop over adam7 interlace's
-	 and write them to the arena */
+    /* loop over adam7 interlace's
+       and write them to the arena */
 
-      s0=(unsigned char*)fs->str;
-      for (i=0; i<7; i++)
+    for (i=0; i<7; i++)
+    {
+      rgb_group *d1, *da1 = NULL;
+      unsigned char *d=(unsigned char*)s;
+      size_t dlen;
+      unsigned int x0 = adam7[i].x0;
+      unsigned int xd = adam7[i].xd;
+      unsigned int y0 = adam7[i].y0;
+      unsigned int yd = adam7[i].yd;
+      unsigned int iwidth = (ihdr->width+xd-1-x0)/xd;
+      unsigned int iheight = (ihdr->height+yd-1-y0)/yd;
+
+      if(!iwidth || !iheight) continue;
+
+      bad=_png_unfilter(d,s,len-(s-s0),
+			iwidth, iheight,
+			ihdr->type,ihdr->bpp,
+			&dlen,&s);
+      if (bad>=0) break;
+
+      if (_png_write_rgb(w1,wa1,ihdr->type,ihdr->bpp,
+			 d,dlen,
+			 iwidth,
+			 iwidth*iheight,
+			 ct,trns))
       {
-	struct pike_string *ds;
-	rgb_group *d1, *da1 = NULL;
-	unsigned int x0 = adam7[i].x0;
-	unsigned int xd = adam7[i].xd;
-	unsigned int y0 = adam7[i].y0;
-	unsigned int yd = adam7[i].yd;
-	unsigned int iwidth = (ihdr->width+xd-1-x0)/xd;
-	unsigned int iheight = (ihdr->height+yd-1-y0)/yd;
-
-	if(!iwidth || !iheight) continue;
-
-	ds=_png_unfilter(s0,fs->len-(s0-(unsigned char*)fs->str),
-			 iwidth, iheight,
-			 ihdr->filter,ihdr->type,ihdr->bpp,
-			 &s0);
-
-	if (_png_write_rgb(w1,wa1,ihdr->type,ihdr->bpp,
-			   (unsigned char*)ds->str,ds->len,
-			   iwidth,
-			   iwidth*iheight,
-			   ct,trns))
-	{
-	  da1 = wa1;
-	  for (y=y0; y<ihdr->height; y+=yd)
-	    for (x=x0; x<ihdr->width; x+=xd)
-	      ta1[x+y*ihdr->width]=*(da1++);
-	  got_alpha = 1;
-	}
-	d1=w1;
+	da1 = wa1;
 	for (y=y0; y<ihdr->height; y+=yd)
 	  for (x=x0; x<ihdr->width; x+=xd)
-	    t1[x+y*ihdr->width]=*(d1++);
-
-	free_string(ds);
+	    ta1[x+y*ihdr->width]=*(da1++);
+	got_alpha = 1;
       }
+      d1=w1;
+      for (y=y0; y<ihdr->height; y+=yd)
+	for (x=x0; x<ihdr->width; x+=xd)
+	  t1[x+y*ihdr->width]=*(d1++);
+    }
 
+    if (bad<0)
+    {
+      free(w1);
+      w1=t1;
+      t1=NULL;
       free(wa1);
+      wa1=NULL;
       if (got_alpha) {
-	wa1 = ta1;
-      } else {
-	free(ta1);
-	wa1 = NULL;
+	wa1=ta1;
+	ta1=NULL;
       }
-      UNSET_ONERROR(ta_err);
-      free(w1);
-      w1=t1;
-      UNSET_ONERROR(t_err);
     }
-    break;
-  default:
-    Pike_error("Unknown interlace type %d.\n", ihdr->interlace);
   }
 
-  /* Image data now in w1, alpha in wa1 */
-  pop_stack();
+  THREADS_DISALLOW();
+
+  if (bad>=0)
+    Pike_error("Unsupported subfilter %d (filter %d)\n", bad, ihdr->type);
 
+  /* Image data now in w1, alpha in wa1 */
+  CALL_AND_UNSET_ONERROR(ta_err);
+  CALL_AND_UNSET_ONERROR(t_err);
   UNSET_ONERROR(a_err);
   UNSET_ONERROR(err);
+  CALL_AND_UNSET_ONERROR(b_err);
 
   /* Create image object and leave it on the stack */
   push_object(clone_object(image_program,0));
@@ -1140,6 +1193,7 @@ static void img_png_decode(INT32 args, int mode)
    struct pike_string *trns=NULL;
 
    int n=0, i;
+   size_t idat_len=0;
    struct IHDR ihdr={-1,-1,-1,-1,-1,-1,-1};
    ONERROR err;
 
@@ -1281,12 +1335,11 @@ static void img_png_decode(INT32 args, int mode)
 	    break;
 
          case 0x49444154: /* IDAT */
-	    /* compressed image data. push, n++ */
+	    /* compressed image data. count, joined below */
 	    if ( mode == MODE_HEADER_ONLY ) break;
 
-	    ref_push_string(b->item[1].u.string);
+	    idat_len+=len;
 	    n++;
-	    if (n>32) { f_add(n); n=1; }
 	    break;
 
          case 0x49454e44: /* IEND */
@@ -1442,7 +1495,7 @@ static void img_png_decode(INT32 args, int mode)
    }
 
 
-   /* on stack: mapping   nstring */
+   /* on stack: mapping   array */
 
    if ( mode != MODE_HEADER_ONLY )
    {
@@ -1457,19 +1510,38 @@ static void img_png_decode(INT32 args, int mode)
        PIKE_ERROR("Image.PNG._decode", "Missing palette (PLTE chunk).\n",
                   sp, args);
 
-     /* Join IDAT blocks */
-     if (!n)
-       push_empty_string();
+     /* Join IDAT blocks, straight into one string */
+     if (n==1)
+     {
+       for (i=0; i<a->size; i++)
+	 if (int_from_32bit((unsigned char*)a->item[i].u.array->
+			    item[0].u.string->str) == 0x49444154)
+	   ref_push_string(a->item[i].u.array->item[1].u.string);
+     }
      else
-       f_add(n);
+     {
+       struct pike_string *idat=begin_shared_string(idat_len);
+       char *d=idat->str;
+       for (i=0; i<a->size; i++)
+       {
+	 struct pike_string *data=a->item[i].u.array->item[1].u.string;
+	 if (int_from_32bit((unsigned char*)a->item[i].u.array->
+			    item[0].u.string->str) != 0x49444154)
+	   continue;
+	 MEMCPY(d, data->str, data->len);
+	 d+=data->len;
+       }
+       push_string(end_shared_string(idat));
+     }
 
-     if (_png_decode_idat(&ihdr, ct, trns)==1)
+     if (_png_decode_idat(&ihdr, ct, trns, sp[-1].u.string)==1)
      {
        mapping_string_insert(m, param_alpha, sp-1);
        pop_stack();
      }
      mapping_string_insert(m, param_image, sp-1);
      pop_stack();
+     pop_stack(); /* the IDAT data */
 
      if(trns)
        UNSET_ONERROR(err);
@@ -1503,6 +1575,105 @@ static void img_png_decode(INT32 args, int mode)
 }
 
 
+/* Applies filter type ft to the row cur, with prev as the row above
+ * it or NULL for the first row, and writes the result to d. Unlike
+ * the unfiltering, each output byte only depends on the input rows,
+ * so the loops are straight element wise operations. */
+static void _png_filter_row(unsigned char *d,
+			    const unsigned char *cur,
+			    const unsigned char *prev,
+			    size_t n, int sbb, int ft)
+{
+   size_t i, m=((size_t)sbb<n)?(size_t)sbb:n;
+
+   switch (ft)
+   {
+      case 0: /* no filter */
+	 MEMCPY(d,cur,n);
+	 break;
+      case 2: /* sub up */
+	 if (prev)
+	 {
+	    for (i=0; i<n; i++) d[i]=cur[i]-prev[i];
+	    break;
+	 }
+	 MEMCPY(d,cur,n);
+	 break;
+      case 3: /* average */
+	 if (prev)
+	 {
+	    for (i=0; i<m; i++) d[i]=cur[i]-(prev[i]>>1);
+	    for (; i<n; i++) d[i]=cur[i]-((cur[i-sbb]+prev[i])>>1);
+	 }
+	 else
+	 {
+	    for (i=0; i<m; i++) d[i]=cur[i];
+	    for (; i<n; i++) d[i]=cur[i]-(cur[i-sbb]>>1);
+	 }
+	 break;
+      case 4: /* paeth */
+	 if (prev)
+	 {
+	    for (i=0; i<m; i++) d[i]=cur[i]-prev[i];
+	    for (; i<n; i++)
+	       d[i]=cur[i]-_png_paeth(cur[i-sbb],prev[i],prev[i-sbb]);
+	    break;
+	 }
+	 /* FALLTHRU */
+      case 1: /* sub left */
+	 for (i=0; i<m; i++) d[i]=cur[i];
+	 for (; i<n; i++) d[i]=cur[i]-cur[i-sbb];
+	 break;
+   }
+}
+
+/* The sum of the filtered bytes taken as signed values; the usual
+ * heuristic for which filter will compress best. */
+static size_t _png_row_cost(const unsigned char *d, size_t n)
+{
+   size_t i, sum=0;
+   for (i=0; i<n; i++)
+      sum+=(d[i]<128)?d[i]:256-d[i];
+   return sum;
+}
+
+/* Filters the row cur into d, prefixed by the filter type byte. With
+ * filter PNG_FILTER_ADAPTIVE each row gets the filter with the lowest
+ * cost, tmp is then scratch space of n bytes. */
+#define PNG_FILTER_ADAPTIVE -1
+static void _png_encode_row(unsigned char *d,
+			    const unsigned char *cur,
+			    const unsigned char *prev,
+			    size_t n, int sbb, int filter,
+			    unsigned char *tmp)
+{
+   size_t best, cost;
+   int ft;
+
+   if (filter!=PNG_FILTER_ADAPTIVE)
+   {
+      *d=filter;
+      _png_filter_row(d+1,cur,prev,n,sbb,filter);
+      return;
+   }
+
+   *d=0;
+   MEMCPY(d+1,cur,n);
+   best=_png_row_cost(cur,n);
+   for (ft=1; ft<=4; ft++)
+   {
+      if (!prev && ft>1) break; /* the rest equals none or sub */
+      _png_filter_row(tmp,cur,prev,n,sbb,ft);
+      cost=_png_row_cost(tmp,n);
+      if (cost<best)
+      {
+	 best=cost;
+	 *d=ft;
+	 MEMCPY(d+1,tmp,n);
+      }
+   }
+}
+
 /*! @decl string encode(Image.Image image)
  *! @decl string encode(Image.Image image, mapping options)
  *! 	Encodes a PNG image.
@@ -1522,6 +1693,12 @@ static void img_png_decode(INT32 args, int mode)
  *!       The type of LZ77 strategy to be used. Possible values are
  *!       @[Gz.DEFAULT_STRATEGY], @[Gz.FILTERED], @[Gz.HUFFMAN_ONLY],
  *!       @[Gz.RLE], @[Gz.FIXED]. Default is @[Gz.DEFAULT_STRATEGY].
+ *!     @member int(-1..4) "filter"
+ *!       The row filter to use; 0 (none), 1 (sub), 2 (up),
+ *!       3 (average) or 4 (paeth). -1 picks the filter that is
+ *!       likely to compress best for each row, which usually gives
+ *!       smaller files at some cost in speed. Default is -1, except
+ *!       for palette images which default to 0.
  *!   @endmapping
  *!
  *! @seealso
@@ -1537,10 +1714,16 @@ static void image_png_encode(INT32 args)
    rgb_group *s,*sa=NULL;
    struct neo_colortable *ct=NULL;
 
-   int n=0,y,x,bpp;
+   int y,x,bpp,sbb;
    int zlevel=8;
    int zstrategy=0;
-   char buf[20];
+   int filter=-2;
+   unsigned char *tmp=NULL, *rows, *d;
+   size_t rowbytes;
+   struct pike_string *ps;
+   dynamic_buffer buf;
+   unsigned char hdr[13];
+   ONERROR err, ps_err, r_err;
 
    if (!args)
      SIMPLE_TOO_FEW_ARGS_ERROR("Image.PNG.encode", 1);
@@ -1621,12 +1804,19 @@ static void image_png_encode(INT32 args)
         else
           zstrategy = s->u.integer;
       }
-   }
 
-   sprintf(buf,"%c%c%c%c%c%c%c%c",
-	   137,'P','N','G',13,10,26,10);
-   push_string(make_shared_binary_string(buf,8));
-   n++;
+      /* Attribute filter */
+      s = low_mapping_string_lookup(sp[1-args].u.mapping, param_filter);
+      if( s )
+      {
+        if ( s->type!=T_INT || s->u.integer<-1 || s->u.integer>4 )
+          PIKE_ERROR("Image.PNG.encode",
+                     "Option (arg 2) \"filter\" has illegal value.\n",
+                     sp, args);
+        else
+          filter = s->u.integer;
+      }
+   }
 
    if (ct)
    {
@@ -1636,150 +1826,152 @@ static void image_png_encode(INT32 args)
 	 PIKE_ERROR("Image.PNG.encode", "Palette size to large; "
 		    "PNG doesn't support bigger palettes then 256 colors.\n",
 		    sp, args);
+      if (alpha)
+	 PIKE_ERROR("Image.PNG.encode",
+		    "Colortable and alpha channel not supported "
+		    "at the same time.\n", sp, args);
       if (sz>16) bpp=8;
       else if (sz>4) bpp=4;
       else if (sz>2) bpp=2;
       else bpp=1;
+      sbb=1;
+      rowbytes=((size_t)img->xsize*bpp+7)>>3;
+      if (filter==-2) filter=0;
    }
    else
+   {
       bpp=8;
+      sbb=3+!!alpha;
+      rowbytes=(size_t)img->xsize*sbb;
+      if (filter==-2) filter=PNG_FILTER_ADAPTIVE;
+   }
 
-   sprintf(buf,"%c%c%c%c%c%c%c%c%c%c%c%c%c",
-	   (char)((img->xsize>>24)&255),(char)((img->xsize>>16)&255),
-	   (char)((img->xsize>>8)&255), (char)((img->xsize)&255),
-	   (char)((img->ysize>>24)&255),(char)((img->ysize>>16)&255),
-	   (char)((img->ysize>>8)&255), (char)((img->ysize)&255),
-	   bpp /* bpp */,
-	   ct?3:(alpha?6:2) /* type (P/(RGBA/RGB)) */,
-	   0 /* compression, 0=deflate */,
-	   0 /* filter, 0=per line filter */,
-	   0 /* interlace */);
-   push_string(make_shared_binary_string(buf,13));
-
-   push_png_chunk("IHDR",NULL);
-   n++;
+   initialize_buf(&buf);
+   SET_ONERROR(err, toss_buffer, &buf);
+
+   MEMCPY(low_make_buf_space(8, &buf), "\211PNG\r\n\032\n", 8);
+
+   hdr[0]=(unsigned char)(img->xsize>>24);
+   hdr[1]=(unsigned char)(img->xsize>>16);
+   hdr[2]=(unsigned char)(img->xsize>>8);
+   hdr[3]=(unsigned char)(img->xsize);
+   hdr[4]=(unsigned char)(img->ysize>>24);
+   hdr[5]=(unsigned char)(img->ysize>>16);
+   hdr[6]=(unsigned char)(img->ysize>>8);
+   hdr[7]=(unsigned char)(img->ysize);
+   hdr[8]=bpp; /* bpp */
+   hdr[9]=ct?3:(alpha?6:2); /* type (P/(RGBA/RGB)) */
+   hdr[10]=0; /* compression, 0=deflate */
+   hdr[11]=0; /* filter, 0=per line filter */
+   hdr[12]=0; /* interlace */
+   png_buf_chunk(&buf, "IHDR", hdr, 13);
 
    if (ct)
    {
-      struct pike_string *ps;
-      ps=begin_shared_string(3<<bpp);
-      MEMSET(ps->str,0,3<<bpp);
-      image_colortable_write_rgb(ct,(unsigned char*)ps->str);
-      push_string(end_shared_string(ps));
-      push_png_chunk("PLTE",NULL);
-      n++;
+      unsigned char plte[3*256];
+      MEMSET(plte,0,3<<bpp);
+      image_colortable_write_rgb(ct,plte);
+      png_buf_chunk(&buf, "PLTE", plte, 3<<bpp);
+   }
+
+   /* The filtered data is built in an unlinked string that is handed
+    * to deflate and then thrown away. */
+   ps=begin_shared_string(img->ysize*(rowbytes+1));
+   SET_ONERROR(ps_err, do_free_unlinked_pike_string, ps);
+
+   /* Two rows for packing (with room for a stray pad byte), one for
+    * trying filters and the palette indices. */
+   rows=xalloc(3*(rowbytes+1)+(ct?(size_t)img->xsize*img->ysize:0));
+   SET_ONERROR(r_err, free, rows);
+
+   if (ct)
+   {
+      tmp=rows+3*(rowbytes+1);
+      image_colortable_index_8bit_image(ct,img->img,tmp,
+					img->xsize*img->ysize,img->xsize);
    }
 
-   y=img->ysize;
+   d=(unsigned char*)ps->str;
    s=img->img;
    if (alpha) sa=alpha->img;
-   if (ct) {
-      if (alpha) {
-	 PIKE_ERROR("Image.PNG.encode",
-		    "Colortable and alpha channel not supported "
-		    "at the same time.\n", sp, args);
-      }
-      else
-      {
-         unsigned char *d;
-         struct pike_string *ps;
-	 unsigned char *tmp, *ts;
 
-         x = img->xsize;
-         tmp=xalloc(x*y);
+   THREADS_ALLOW();
+   {
+      unsigned char *cur=rows, *prev=NULL, *scratch=rows+2*(rowbytes+1);
+      unsigned char *ts=tmp;
 
-	 image_colortable_index_8bit_image(ct,s,tmp,x*y,x);
-         ps=begin_shared_string( y * ((x*bpp+7)/8+1) );
-         d=(unsigned char*)ps->str;
-	 ts=tmp;
+      for (y=0; y<img->ysize; y++)
+      {
+	 unsigned char *r=cur;
+	 x=img->xsize;
 
-	 while (y--)
+	 if (ct)
 	 {
-	    x=img->xsize;
-	    *(d++)=0; /* filter */
 	    if (bpp==8)
 	    {
-	       MEMCPY(d,ts,x);
+	       MEMCPY(r,ts,x);
 	       ts += x;
-               d += x;
 	    }
 	    else
 	    {
 	       int bit=8-bpp;
-	       *d=0;
+	       *r=0;
 	       while (x--)
 	       {
-		  *d|=(*ts)<<bit;
-		  if (!bit) { bit=8-bpp; *++d=0; }
+		  *r|=(*ts)<<bit;
+		  if (!bit) { bit=8-bpp; *++r=0; }
 		  else bit-=bpp;
 		  ts++;
 	       }
-	       if (bit != (8 - bpp)) {
-		 /* The last byte wasn't filled fully,
-		  * so we need to pad with a few bits.
-		  */
-		 d++;
-	       }
 	    }
 	 }
-
-#ifdef PIKE_DEBUG
-	 if (d != (unsigned char *)(ps->str + ps->len)) {
-	   Pike_fatal("PNG data doesn't align properly "
-		      "%d x %d (%d bpp) len: %ld, got: %ld.\n",
-		      img->xsize, img->ysize, bpp,
-		      (long)ps->len, (long)(d - (unsigned char *)ps->str));
-	 }
-#endif
-
-         push_string(end_shared_string(ps));
-	 free(tmp);
-      }
-   }
-   else {
-     struct pike_string *ps;
-     unsigned char *d;
-     ps=begin_shared_string(y*(img->xsize*(3+!!alpha)+1));
-     d=(unsigned char*)ps->str;
-      while (y--)
-      {
-	 x=img->xsize;
-	 *(d++)=0; /* filter */
-	 if (alpha)
+	 else if (alpha)
 	    while (x--)
 	    {
-	       *(d++)=s->r;
-	       *(d++)=s->g;
-	       *(d++)=s->b;
-	       *(d++)=(sa->r+sa->g*2+sa->b)>>2;
+	       *(r++)=s->r;
+	       *(r++)=s->g;
+	       *(r++)=s->b;
+	       *(r++)=(sa->r+sa->g*2+sa->b)>>2;
 	       s++;
 	       sa++;
 	    }
 	 else
 	    while (x--)
 	    {
-	       *(d++)=s->r;
-	       *(d++)=s->g;
-	       *(d++)=s->b;
+	       *(r++)=s->r;
+	       *(r++)=s->g;
+	       *(r++)=s->b;
 	       s++;
 	    }
+
+	 _png_encode_row(d,cur,prev,rowbytes,sbb,filter,scratch);
+	 d+=rowbytes+1;
+
+	 prev=cur;
+	 cur=(cur==rows)?rows+rowbytes+1:rows;
       }
-      push_string(end_shared_string(ps));
    }
+   THREADS_DISALLOW();
+
+#ifdef PIKE_DEBUG
+   if (d != (unsigned char *)(ps->str + ps->len)) {
+     Pike_fatal("PNG data doesn't align properly "
+		"%d x %d (%d bpp) len: %ld, got: %ld.\n",
+		img->xsize, img->ysize, bpp,
+		(long)ps->len, (long)(d - (unsigned char *)ps->str));
+   }
+#endif
 
-   png_compress(0, zlevel, zstrategy);
-   push_png_chunk("IDAT",NULL);
-   n++;
+   CALL_AND_UNSET_ONERROR(r_err);
 
-   push_empty_string();
-   push_png_chunk("IEND",NULL);
-   n++;
+   png_buf_idat(&buf, ps, zlevel, zstrategy);
+   CALL_AND_UNSET_ONERROR(ps_err);
 
-   f_add(n);
-   sp--;
+   png_buf_chunk(&buf, "IEND", NULL, 0);
+
+   UNSET_ONERROR(err);
    pop_n_elems(args);
-   *sp=sp[args];
-   sp++;
+   push_string(low_free_buf(&buf));
 }
 
 static void image_png__decode(INT32 args)
@@ -1872,6 +2064,7 @@ void exit_image_png(void)
    free_string(param_type);
    free_string(param_zlevel);
    free_string(param_zstrategy);
+   free_string(param_filter);
 }
 
 void init_image_png(void)
@@ -1924,4 +2117,5 @@ void init_image_png(void)
    param_background=make_shared_string("background");
    param_zlevel=make_shared_string("zlevel");
    param_zstrategy=make_shared_string("zstrategy");
+   param_filter=make_shared_string("filter");
 }
@@ -197,6 +197,59 @@ static void exit_image_struct(struct object *obj)
 	  */
 }
 
+/***************** parallel rows *******************************/
+
+/* img_run_rows() calls fun for bands of the rows 0..rows-1, on up to
+ * image_threads threads from the th_parallel() pool. It is called
+ * without the interpreter lock, so fun must not touch any Pike data.
+ * The bands are handed out in increasing order, and the kernels give
+ * the same result no matter how the rows are split. A band of 0 picks
+ * a band size from the number of threads; images smaller than
+ * IMG_PAR_MIN_PIXELS are always done by the calling thread.
+ */
+
+#define IMG_PAR_MAX_THREADS	32
+
+int image_threads=1;
+
+struct img_rows_job
+{
+   void (*fun)(void *data,INT32 y0,INT32 y1);
+   void *data;
+   INT32 rows,band;
+};
+
+static void img_rows_band(void *data,int i)
+{
+   struct img_rows_job *job=(struct img_rows_job *)data;
+   INT32 y=i*job->band;
+   job->fun(job->data,y,MINIMUM(y+job->band,job->rows));
+}
+
+void img_run_rows(void (*fun)(void *data,INT32 y0,INT32 y1),
+		  void *data,INT32 rows,INT32 row_size,INT32 band)
+{
+   int threads=MINIMUM(image_threads,IMG_PAR_MAX_THREADS);
+
+   if (band<1)
+      /* A few bands per thread evens out the load. */
+      band=MAXIMUM(rows/(threads*4),1);
+
+   if (threads>1 && rows>=2*band &&
+       (double)rows*row_size>=IMG_PAR_MIN_PIXELS)
+   {
+      struct img_rows_job job;
+
+      job.fun=fun;
+      job.data=data;
+      job.rows=rows;
+      job.band=band;
+      th_parallel(img_rows_band,&job,(rows+band-1)/band,threads);
+      return;
+   }
+   if (rows>0) fun(data,0,rows);
+}
+
 /***************** internals ***********************************/
 
 #define apply_alpha(x,y,alpha) \
@@ -372,113 +425,125 @@ static INLINE rgb_group _pixel_apply_matrix(struct image *img,
 }
 
 
-static void img_apply_matrix(struct image *dest,
-			     struct image *img,
-			     int width,int height,
-			     rgbd_group *matrix,
-			     double div,
-			     rgb_group default_rgb)
+struct apply_matrix_job
 {
-   rgb_group *d,*ip,*dp;
+   struct image *img;
+   rgb_group *d;
+   rgbd_group *matrix;
+   int width,height,bx,by,ex,ey;
+   double div,qr,qg,qb;
+   rgb_group default_rgb;
+};
+
+static void img_apply_matrix_rows(void *data,INT32 y0,INT32 y1)
+{
+   struct apply_matrix_job *job=(struct apply_matrix_job *)data;
+   struct image *img=job->img;
+   rgb_group *ip,*dp;
    rgbd_group *mp;
-   int i,x,y,bx,by,ex,ey,yp;
-   int widthheight;
-   double sumr,sumg,sumb;
-   double qr,qg,qb;
+   int i,x,y,x0,x1,yp;
+   int width=job->width,height=job->height,bx=job->bx,by=job->by;
+   double qr=job->qr,qg=job->qg,qb=job->qb;
+   rgb_group default_rgb=job->default_rgb;
    register double r=0,g=0,b=0;
 
-THREADS_ALLOW();
-
-   widthheight=width*height;
-   sumr=sumg=sumb=0;
-   for (i=0; i<widthheight;)
-     {
-       sumr+=matrix[i].r;
-       sumg+=matrix[i].g;
-       sumb+=matrix[i++].b;
-     }
-
-   if (!sumr) sumr=1; sumr*=div; qr=1.0/sumr;
-   if (!sumg) sumg=1; sumg*=div; qg=1.0/sumg;
-   if (!sumb) sumb=1; sumb*=div; qb=1.0/sumb;
-
-   bx=width/2;
-   by=height/2;
-   ex=width-bx;
-   ey=height-by;
-   
-THREADS_DISALLOW();
-
-   d=xalloc(sizeof(rgb_group)*img->xsize*img->ysize + 1);
+   for (y=y0; y<y1; y++)
+   {
+      /* Pixels closer to the edge than the matrix reaches are done
+	 the slow way, in columns 0..x0-1 and x1..xsize-1. */
+      if (y>=by && y<img->ysize-job->ey)
+      {
+	 x0=MINIMUM(bx,img->xsize);
+	 x1=MAXIMUM(img->xsize-job->ex,x0);
+      }
+      else
+	 x0=x1=img->xsize;
 
-THREADS_ALLOW();
-CHRONO("apply_matrix, one");
+      dp=job->d+y*img->xsize;
+      for (x=0; x<x0; x++)
+	 dp[x]=_pixel_apply_matrix(img,x,y,width,height,
+				   job->matrix,default_rgb,job->div);
 
-   for (y=by; y<img->ysize-ey; y++)
-   {
-      dp=d+y*img->xsize+bx;
-      for (x=bx; x<img->xsize-ex; x++)
+      dp+=x0;
+      for (x=x0; x<x1; x++)
       {
 	 r=g=b=0;
-	 mp=matrix;
+	 mp=job->matrix;
 	 ip=img->img+(x-bx)+(y-by)*img->xsize;
-	 /* for (yp=y-by,j=0; j<height; j++,yp++) */
-#ifdef MATRIX_DEBUG
-j=-1;
-#endif
 	 for (yp=y-by; yp<height+y-by; yp++)
 	 {
-#ifdef MATRIX_DEBUG
-j++;
-#endif
 	    for (i=0; i<width; i++)
 	    {
 	       r+=ip->r*mp->r;
  	       g+=ip->g*mp->g;
  	       b+=ip->b*mp->b;
-#ifdef MATRIX_DEBUG
-	       fprintf(stderr,"%d,%d ->%d,%d,%d\n",
-		       i,j,
-		       img->img[x+i+(y+j)*img->xsize].r,
-		       img->img[x+i+(y+j)*img->xsize].g,
-		       img->img[x+i+(y+j)*img->xsize].b);
-#endif
 	       mp++;
 	       ip++;
 	    }
 	    ip+=img->xsize-width;
 	 }
-#ifdef MATRIX_DEBUG
-	 fprintf(stderr,"->%d,%d,%d\n",r/sumr,g/sumg,b/sumb);
-#endif
 	 r=default_rgb.r+DOUBLE_TO_INT(r*qr+0.5); dp->r=testrange(r);
 	 g=default_rgb.g+DOUBLE_TO_INT(g*qg+0.5); dp->g=testrange(g);
 	 b=default_rgb.b+DOUBLE_TO_INT(b*qb+0.5); dp->b=testrange(b);
 	 dp++;
       }
+
+      dp=job->d+y*img->xsize;
+      for (x=x1; x<img->xsize; x++)
+	 dp[x]=_pixel_apply_matrix(img,x,y,width,height,
+				   job->matrix,default_rgb,job->div);
    }
+}
 
-CHRONO("apply_matrix, two");
+static void img_apply_matrix(struct image *dest,
+			     struct image *img,
+			     int width,int height,
+			     rgbd_group *matrix,
+			     double div,
+			     rgb_group default_rgb)
+{
+   struct apply_matrix_job job;
+   rgb_group *d;
+   int i;
+   int widthheight;
+   double sumr,sumg,sumb;
 
-   for (y=0; y<img->ysize; y++)
-   {
-      for (x=0; x<bx; x++)
-	 d[x+y*img->xsize]=_pixel_apply_matrix(img,x,y,width,height,
-					       matrix,default_rgb,div);
-      for (x=img->xsize-ex; x<img->xsize; x++)
-	 d[x+y*img->xsize]=_pixel_apply_matrix(img,x,y,width,height,
-					       matrix,default_rgb,div);
-   }
+THREADS_ALLOW();
 
-   for (x=0; x<img->xsize; x++)
-   {
-      for (y=0; y<by; y++)
-	 d[x+y*img->xsize]=_pixel_apply_matrix(img,x,y,width,height,
-					       matrix,default_rgb,div);
-      for (y=img->ysize-ey; y<img->ysize; y++)
-	 d[x+y*img->xsize]=_pixel_apply_matrix(img,x,y,width,height,
-					       matrix,default_rgb,div);
-   }
+   widthheight=width*height;
+   sumr=sumg=sumb=0;
+   for (i=0; i<widthheight;)
+     {
+       sumr+=matrix[i].r;
+       sumg+=matrix[i].g;
+       sumb+=matrix[i++].b;
+     }
+
+   if (!sumr) sumr=1; sumr*=div; job.qr=1.0/sumr;
+   if (!sumg) sumg=1; sumg*=div; job.qg=1.0/sumg;
+   if (!sumb) sumb=1; sumb*=div; job.qb=1.0/sumb;
+
+   job.bx=width/2;
+   job.by=height/2;
+   job.ex=width-job.bx;
+   job.ey=height-job.by;
+   
+THREADS_DISALLOW();
+
+   d=xalloc(sizeof(rgb_group)*img->xsize*img->ysize + 1);
+
+   job.img=img;
+   job.d=d;
+   job.matrix=matrix;
+   job.width=width;
+   job.height=height;
+   job.div=div;
+   job.default_rgb=default_rgb;
+
+THREADS_ALLOW();
+CHRONO("apply_matrix, one");
+
+   img_run_rows(img_apply_matrix_rows,&job,img->ysize,img->xsize,0);
 
 CHRONO("apply_matrix, three");
 
@@ -3307,13 +3372,34 @@ void image_select_from(INT32 args)
 **! note
 **!     resulting image will be 1x1 pixels, at least
 */
+struct bitscale_job
+{
+  rgb_group *s, *d;
+  INT32 oldx, oldy, newx, newy;
+  INT32 *xs;			/* Source column of each column. */
+};
+
+static void img_bitscale_rows(void *data, INT32 y0, INT32 y1)
+{
+  struct bitscale_job *job = (struct bitscale_job *)data;
+  INT32 x, y;
+
+  for( y = y0; y<y1; y++ )
+  {
+    rgb_group *s = job->s + ((INT64)y * job->oldy / job->newy) * job->oldx;
+    rgb_group *d = job->d + (ptrdiff_t)y * job->newx;
+    for( x = 0; x<job->newx; x++ )
+      d[x] = s[job->xs[x]];
+  }
+}
+
 void image_bitscale( INT32 args )
 {
   int newx=1, newy=1;
   int oldx, oldy;
-  int x, y;
+  int x;
   struct object *ro;
-  rgb_group *s, *d;
+  struct bitscale_job job;
   oldx = THIS->xsize;
   oldy = THIS->ysize;
 
@@ -3354,15 +3440,23 @@ void image_bitscale( INT32 args )
   push_int( newx );
   push_int( newy );
   ro = clone_object( image_program, 2 );
-  d=((struct image *)get_storage( ro, image_program))->img;
-  
-  for( y = 0; y<newy; y++ )
-  {
-    s = THIS->img + (y * oldy / newy) * THIS->xsize;
-    for( x = 0; x<newx; x++ )
-      *(d++) = *(s+x*oldx/newx);
-  }
   push_object( ro );
+
+  job.s = THIS->img;
+  job.d = ((struct image *)get_storage( ro, image_program))->img;
+  job.oldx = oldx;
+  job.oldy = oldy;
+  job.newx = newx;
+  job.newy = newy;
+  job.xs = xalloc( sizeof(INT32) * newx );
+  for( x = 0; x<newx; x++ )
+    job.xs[x] = (INT32)((INT64)x * oldx / newx);
+
+  THREADS_ALLOW();
+  img_run_rows( img_bitscale_rows, &job, newy, newx, 0 );
+  THREADS_DISALLOW();
+
+  free( job.xs );
 }
 
 /*
@@ -4576,6 +4670,207 @@ static void image__sprintf( INT32 args )
   }
 }
 
+/* blur() and grey_blur() work in place, so each pixel sees the new
+ * values to the left of it and in the row above. To keep that, rows
+ * are blurred in parallel as a wavefront: a row does the columns
+ * x..x1-1 only when the row above has finished column x1, the last
+ * one read from it. That also keeps each row two columns behind the
+ * row above, which still reads its old values.
+ */
+
+#define BLUR_CHUNK 256
+
+struct blur_job
+{
+   rgb_group *img;
+   INT32 xe,ye;
+   int grey;
+#ifdef _REENTRANT
+   INT32 *done;			/* Columns finished in each row. */
+   PIKE_MUTEX_T lock;
+   COND_T progress;
+#endif
+};
+
+static void img_blur_span(struct blur_job *job,INT32 y,INT32 x0,INT32 x1)
+{
+  INT32 xe = job->xe;
+  rgb_group *ro1 = y ? job->img+xe*(y-1) : NULL;
+  rgb_group *ro2 = job->img+xe*y;
+  rgb_group *ro3 = ( y < job->ye-1 ) ? job->img+xe*(y+1) : NULL;
+  INT32 x;
+
+  for( x=x0; x<x1; x++ )
+  {
+    int tmpr=0, tmpg=0, tmpb=0;
+    int n=0;
+
+    if( ro1 && ro3 && x > 1 && x < xe-1 )
+    {
+      /* All nine pixels, the common case. */
+      tmpr = ro1[x-1].r + ro1[x].r + ro1[x+1].r +
+	ro2[x-1].r + ro2[x].r + ro2[x+1].r +
+	ro3[x-1].r + ro3[x].r + ro3[x+1].r;
+      if( job->grey )
+      {
+	ro2[x].r = ro2[x].g = ro2[x].b = tmpr/9;
+	continue;
+      }
+      tmpg = ro1[x-1].g + ro1[x].g + ro1[x+1].g +
+	ro2[x-1].g + ro2[x].g + ro2[x+1].g +
+	ro3[x-1].g + ro3[x].g + ro3[x+1].g;
+      tmpb = ro1[x-1].b + ro1[x].b + ro1[x+1].b +
+	ro2[x-1].b + ro2[x].b + ro2[x+1].b +
+	ro3[x-1].b + ro3[x].b + ro3[x+1].b;
+      ro2[x].r = tmpr/9;
+      ro2[x].g = tmpg/9;
+      ro2[x].b = tmpb/9;
+      continue;
+    }
+
+    if( ro1 )
+    {
+      if( x > 1 )    {
+	n++;
+	tmpr += ro1[x-1].r;
+	tmpg += ro1[x-1].g;
+	tmpb += ro1[x-1].b;
+      };
+      n++;
+      tmpr += ro1[x].r;
+      tmpg += ro1[x].g;
+      tmpb += ro1[x].b;
+      if( x < xe-1 )
+      {
+	n++;
+	tmpr += ro1[x+1].r;
+	tmpg += ro1[x+1].g;
+	tmpb += ro1[x+1].b;
+      };
+    }
+    if( x > 1 )
+    {
+      n++;
+      tmpr += ro2[x-1].r;
+      tmpg += ro2[x-1].g;
+      tmpb += ro2[x-1].b;
+    }
+    n++;
+    tmpr += ro2[x].r;
+    tmpg += ro2[x].g;
+    tmpb += ro2[x].b;
+
+    if( x < xe-1 )
+    {
+      n++;
+      tmpr += ro2[x+1].r;
+      tmpg += ro2[x+1].g;
+      tmpb += ro2[x+1].b;
+    }
+    if( ro3 )
+    {
+      if( x > 1 )
+      {
+	n++;
+	tmpr += ro3[x-1].r;
+	tmpg += ro3[x-1].g;
+	tmpb += ro3[x-1].b;
+      }
+      n++;
+      tmpr += ro3[x].r;
+      tmpg += ro3[x].g;
+      tmpb += ro3[x].b;
+      if( x < xe-1 )
+      {
+	n++;
+	tmpr += ro3[x+1].r;
+	tmpg += ro3[x+1].g;
+	tmpb += ro3[x+1].b;
+      }
+    }
+    if( job->grey )
+      ro2[x].r = ro2[x].g = ro2[x].b = tmpr/n;
+    else
+    {
+      ro2[x].r = tmpr/n;
+      ro2[x].g = tmpg/n;
+      ro2[x].b = tmpb/n;
+    }
+  }
+}
+
+static void img_blur_rows(void *data,INT32 y0,INT32 y1)
+{
+  struct blur_job *job = (struct blur_job *)data;
+  INT32 y, x, x1;
+
+  for( y=y0; y<y1; y++ )
+    for( x=0; x<job->xe; x=x1 )
+    {
+      x1 = MINIMUM(x+BLUR_CHUNK, job->xe);
+#ifdef _REENTRANT
+      if( job->done && y )
+      {
+	INT32 need = MINIMUM(x1+1, job->xe);
+	mt_lock(&job->lock);
+	while( job->done[y-1] < need )
+	  co_wait(&job->progress, &job->lock);
+	mt_unlock(&job->lock);
+      }
+#endif
+      img_blur_span(job, y, x, x1);
+#ifdef _REENTRANT
+      if( job->done )
+      {
+	mt_lock(&job->lock);
+	job->done[y] = x1;
+	co_broadcast(&job->progress);
+	mt_unlock(&job->lock);
+      }
+#endif
+    }
+}
+
+static void img_blur(struct image *img, INT_TYPE passes, int grey)
+{
+  struct blur_job job;
+  INT_TYPE cnt;
+
+  job.img = img->img;
+  job.xe = img->xsize;
+  job.ye = img->ysize;
+  job.grey = grey;
+#ifdef _REENTRANT
+  job.done = NULL;
+  if( image_threads > 1 && job.ye > 1 )
+  {
+    job.done = xalloc(sizeof(INT32)*job.ye);
+    mt_init(&job.lock);
+    co_init(&job.progress);
+  }
+#endif
+
+  THREADS_ALLOW();
+  for( cnt=0; cnt<passes; cnt++ )
+  {
+#ifdef _REENTRANT
+    if( job.done )
+      MEMSET(job.done, 0, sizeof(INT32)*job.ye);
+#endif
+    img_run_rows(img_blur_rows, &job, job.ye, job.xe, 1);
+  }
+  THREADS_DISALLOW();
+
+#ifdef _REENTRANT
+  if( job.done )
+  {
+    free(job.done);
+    mt_destroy(&job.lock);
+    co_destroy(&job.progress);
+  }
+#endif
+}
+
 /*
 **! method object grey_blur(int no_pass)
 **!	Works like blur, but only operates on the r color channel.
@@ -4599,9 +4894,6 @@ static void image_grey_blur( INT32 args )
 {
   /* Basically a exactly like blur, but only uses the r color channel. */
   INT_TYPE t;
-  int x, y, cnt;
-  int xe = THIS->xsize;
-  int ye = THIS->ysize;
   rgb_group *rgb = THIS->img;
   if( args != 1 )
     SIMPLE_TOO_FEW_ARGS_ERROR("grey_blur",1);
@@ -4613,38 +4905,8 @@ static void image_grey_blur( INT32 args )
 
   t = sp[-args].u.integer;  /* times */
 
-  for( cnt=0; cnt<t; cnt++ )
-  {
-    rgb_group *ro1=NULL, *ro2=NULL, *ro3=rgb;
-    for( y=0; y<ye; y++ )
-    {
-      ro1 = ro2;
-      ro2 = ro3;
-      ro3 = ( y < ye-1 ) ? rgb+xe*(y+1) : 0;
+  img_blur(THIS, t, 1);
 
-      for( x=0; x<xe; x++ )
-      {
-	int tmp = 0;
-	int n = 0;
-	if( ro1 )
-	{
-	  if( x > 1 )    {n++;tmp += ro1[x-1].r;};
-	  tmp += ro1[x].r; n++;
-	  if( x < xe-1 ) {n++;tmp += ro1[x+1].r;};
-	}
-	if( x > 1 )    {n++;tmp += ro2[x-1].r;};
-	tmp += ro2[x].r; n++;
-	if( x < xe-1 ) {n++;tmp += ro2[x+1].r;};
-	if( ro3 )
-	{
-	  if( x > 1 )    {n++;tmp += ro3[x-1].r;};
-	  tmp += ro3[x].r; n++;
-	  if( x < xe-1 ) {n++;tmp += ro3[x+1].r;};
-	}
-	ro2[x].r = ro2[x].g = ro2[x].b = tmp/n;
-      }
-    }
-  }
   pop_n_elems( args );
   ref_push_object( THISOBJ );
 }
@@ -4673,9 +4935,6 @@ static void image_blur( INT32 args )
  * special case.  */
 {
   INT_TYPE t;
-  int x, y, cnt;
-  int xe = THIS->xsize;
-  int ye = THIS->ysize;
   rgb_group *rgb = THIS->img;
   if( args != 1 )
     SIMPLE_TOO_FEW_ARGS_ERROR("blur",1);
@@ -4687,85 +4946,8 @@ static void image_blur( INT32 args )
 
   t = sp[-args].u.integer;  /* times */
 
-  for( cnt=0; cnt<t; cnt++ )
-  {
-    rgb_group *ro1=NULL, *ro2=NULL, *ro3=rgb;
-    for( y=0; y<ye; y++ )
-    {
-      ro1 = ro2;
-      ro2 = ro3;
-      ro3 = ( y < ye-1 ) ? rgb+xe*(y+1) : 0;
+  img_blur(THIS, t, 0);
 
-      for( x=0; x<xe; x++ )
-      {
-	int tmpr=0, tmpg=0, tmpb=0;
-	int n=0;
-	if( ro1 )
-	{
-	  if( x > 1 )    {
-	    n++;
-	    tmpr += ro1[x-1].r;
-	    tmpg += ro1[x-1].g;
-	    tmpb += ro1[x-1].b;
-	  };
-	  n++;
-	  tmpr += ro1[x].r;
-	  tmpg += ro1[x].g;
-	  tmpb += ro1[x].b;
-	  if( x < xe-1 )
-	  {
-	    n++;
-	    tmpr += ro1[x+1].r;
-	    tmpg += ro1[x+1].g;
-	    tmpb += ro1[x+1].b;
-	  };
-	}
-	if( x > 1 )
-	{
-	  n++;
-	  tmpr += ro2[x-1].r;
-	  tmpg += ro2[x-1].g;
-	  tmpb += ro2[x-1].b;
-	}
-	n++;
-	tmpr += ro2[x].r;
-	tmpg += ro2[x].g;
-	tmpb += ro2[x].b;
-
-	if( x < xe-1 )
-	{
-	  n++;
-	  tmpr += ro2[x+1].r;
-	  tmpg += ro2[x+1].g;
-	  tmpb += ro2[x+1].b;
-	}
-	if( ro3 )
-	{
-	  if( x > 1 )
-	  {
-	    n++;
-	    tmpr += ro3[x-1].r;
-	    tmpg += ro3[x-1].g;
-	    tmpb += ro3[x-1].b;
-	  }
-	  n++;
-	  tmpr += ro3[x].r;
-	  tmpg += ro3[x].g;
-	  tmpb += ro3[x].b;
-	  if( x < xe-1 )
-	  {
-	    n++;
-	    tmpr += ro3[x+1].r;
-	    tmpg += ro3[x+1].g;
-	    tmpb += ro3[x+1].b;
-	  }
-	}
-	ro2[x].r = tmpr/n;
-	ro2[x].g = tmpg/n;
-	ro2[x].b = tmpb/n;
-      }
-    }
-  }
   pop_n_elems( args );
   ref_push_object( THISOBJ );
 }
@@ -4856,6 +5038,44 @@ void image__decode( INT32 args )
     pop_stack();
 }
 
+/*
+**! module Image
+**! method int set_threads(int threads)
+**!	Sets the number of threads that large images are split over
+**!	by <ref>Image.Image->scale</ref>, <ref>Image.Image->bitscale</ref>,
+**!	<ref>Image.Image->rotate</ref>,
+**!	<ref>Image.Image->skewx</ref>, <ref>Image.Image->skewy</ref>,
+**!	<ref>Image.Image->apply_matrix</ref>, <ref>Image.Image->blur</ref>
+**!	and <ref>Image.Image->grey_blur</ref>, and by
+**!	<ref>Image.Colortable->map</ref>. The result does not depend
+**!	on the number of threads, except for Floyd-Steinberg dithered
+**!	colortable mapping. The default is 1.
+**! returns the previous number of threads
+**!
+**! method int get_threads()
+**!	Returns the number of threads set with <ref>set_threads</ref>.
+*/
+
+void image_set_threads(INT32 args)
+{
+   INT_TYPE threads;
+   int old=image_threads;
+
+   get_all_args("set_threads",args,"%i",&threads);
+   if (threads<1)
+      SIMPLE_BAD_ARG_ERROR("set_threads",1,"int(1..)");
+   image_threads=(int)MINIMUM(threads,IMG_PAR_MAX_THREADS);
+
+   pop_n_elems(args);
+   push_int(old);
+}
+
+void image_get_threads(INT32 args)
+{
+   pop_n_elems(args);
+   push_int(image_threads);
+}
+
 /***************** global init etc *****************************/
 
 #define tRGB tOr3(tColor,tVoid,tInt) tOr(tInt,tVoid) tOr(tInt,tVoid)
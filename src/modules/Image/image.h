@@ -255,6 +255,12 @@ void img_find_autocrop(struct image *this,
 		       int rgb_set,
 		       rgb_group rgb);
 
+#define IMG_PAR_MIN_PIXELS	65536
+
+extern int image_threads;
+void img_run_rows(void (*fun)(void *data,INT32 y0,INT32 y1),
+		  void *data,INT32 rows,INT32 row_size,INT32 band);
+
 /* layers.c */
 
 void image_lay(INT32 args);
@@ -58,3 +58,6 @@ IMAGE_FUNCTION("lay",image_lay,
 	       tOr(tFunc(tArr(tOr(tObj,tLayerMap)),tObj),
 		   tFunc(tArr(tOr(tObj,tLayerMap))
 			 tInt tInt tInt tInt,tObj)),0)
+
+IMAGE_FUNCTION("set_threads",image_set_threads,tFunc(tInt1Plus,tInt),0)
+IMAGE_FUNCTION("get_threads",image_get_threads,tFunc(tNone,tInt),0)
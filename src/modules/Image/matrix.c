@@ -168,72 +168,104 @@ static INLINE void scale_add_line(double py,double dx,
    }
 }
 
-void img_scale(struct image *dest,
-	       struct image *source,
-	       INT32 newx,INT32 newy)
+struct scale_job
 {
-   rgbd_group *new,*s;
+   struct image *source;
+   rgbd_group *new;
    rgb_group *d;
-   INT32 y,yd;
-   double yn,dx,dy;
-
-CHRONO("scale begin");
-
-   if (dest->img) { free(dest->img); dest->img=NULL; }
-
-   if (!THIS->img) return; /* no way */
-   if (newx<1) newx=1;
-   if (newy<1) newy=1;
-
-   new=xalloc(newx*newy*sizeof(rgbd_group)+1);
+   INT32 newx,newy;
+   double dx,dy;
+};
+
+/* Scales into the destination rows y0..y1-1. The source rows are
+ * walked from the top, so every destination pixel gets the same
+ * contributions in the same order whatever the bands are. */
+static void img_scale_rows(void *data,INT32 y0,INT32 y1)
+{
+   struct scale_job *job=(struct scale_job *)data;
+   struct image *source=job->source;
+   rgbd_group *new=job->new,*s;
+   rgb_group *d;
+   INT32 y,yd,newx=job->newx;
+   double yn,dx=job->dx,dy=job->dy;
 
-   THREADS_ALLOW();
+#define SCALE_ADD_LINE(PY,YN) do {					\
+      INT32 yn_=(YN);							\
+      if (yn_>=y0 && yn_<y1)						\
+	 scale_add_line((PY),dx,new,yn_,newx,source->img,y,source->xsize); \
+   } while(0)
 
-   for (y=0; y<newx*newy; y++)
+   for (y=y0*newx; y<y1*newx; y++)
       new[y].r=new[y].g=new[y].b=0.0;
 
-   dx=((double)newx-0.000001)/source->xsize;
-   dy=((double)newy-0.000001)/source->ysize;
-
    for (y=0,yn=0; y<source->ysize; y++,yn+=dy)
    {
+      if (DOUBLE_TO_INT(yn)>=y1) break;
+      if (DOUBLE_TO_INT(yn+dy)<y0) continue;
+
       if (DOUBLE_TO_INT(yn)<DOUBLE_TO_INT(yn+dy))
       {
 	 if (1.0-decimals(yn))
-	    scale_add_line((1.0-decimals(yn)),dx,
-			   new, DOUBLE_TO_INT(yn), newx,
-			   source->img, y, source->xsize);
+	    SCALE_ADD_LINE((1.0-decimals(yn)), DOUBLE_TO_INT(yn));
 	 if ((yd = DOUBLE_TO_INT(yn+dy) - DOUBLE_TO_INT(yn))>1)
             while (--yd)
-   	       scale_add_line(1.0, dx, new, DOUBLE_TO_INT(yn+yd), newx,
-			      source->img, y, source->xsize);
+	       SCALE_ADD_LINE(1.0, DOUBLE_TO_INT(yn+yd));
 	 if (decimals(yn+dy))
-	    scale_add_line((decimals(yn+dy)), dx, new, DOUBLE_TO_INT(yn+dy),
-			   newx, source->img, y, source->xsize);
+	    SCALE_ADD_LINE((decimals(yn+dy)), DOUBLE_TO_INT(yn+dy));
       }
       else
-	 scale_add_line(dy, dx, new, DOUBLE_TO_INT(yn), newx,
-			source->img, y, source->xsize);
+	 SCALE_ADD_LINE(dy, DOUBLE_TO_INT(yn));
    }
 
-   dest->img=d=malloc(newx*newy*sizeof(rgb_group)+1);
-   if (d) 
+#undef SCALE_ADD_LINE
+
+   s=new+y0*newx;
+   d=job->d+y0*newx;
+   y=(y1-y0)*newx;
+   while (y--) 
    {
+      d->r = MINIMUM(DOUBLE_TO_INT(s->r+0.5),255);
+      d->g = MINIMUM(DOUBLE_TO_INT(s->g+0.5),255);
+      d->b = MINIMUM(DOUBLE_TO_INT(s->b+0.5),255);
+      d++; s++;
+   }
+}
 
-CHRONO("transfer begin");
+void img_scale(struct image *dest,
+	       struct image *source,
+	       INT32 newx,INT32 newy)
+{
+   struct scale_job job;
+   rgbd_group *new;
+   rgb_group *d;
 
-     s=new;
-     y=newx*newy;
-     while (y--) 
-     {
-       d->r = MINIMUM(DOUBLE_TO_INT(s->r+0.5),255);
-       d->g = MINIMUM(DOUBLE_TO_INT(s->g+0.5),255);
-       d->b = MINIMUM(DOUBLE_TO_INT(s->b+0.5),255);
-       d++; s++;
-     }
+CHRONO("scale begin");
+
+   if (dest->img) { free(dest->img); dest->img=NULL; }
+
+   if (!THIS->img) return; /* no way */
+   if (newx<1) newx=1;
+   if (newy<1) newy=1;
+
+   new=xalloc(newx*newy*sizeof(rgbd_group)+1);
+
+   THREADS_ALLOW();
 
-     dest->xsize=newx;
-     dest->ysize=newy;
+   dest->img=d=malloc(newx*newy*sizeof(rgb_group)+1);
+   if (d) 
+   {
+      job.source=source;
+      job.new=new;
+      job.d=d;
+      job.newx=newx;
+      job.newy=newy;
+      job.dx=((double)newx-0.000001)/source->xsize;
+      job.dy=((double)newy-0.000001)/source->ysize;
+
+      img_run_rows(img_scale_rows,&job,newy,newx,0);
+
+      dest->xsize=newx;
+      dest->ysize=newy;
    }
    free(new);
 
@@ -244,35 +276,21 @@ CHRONO("scale end");
      resource_error(NULL,0,0,"memory",0,"Out of memory.\n");
 }
 
-/* Special, faster, case for scale=1/2 */
-void img_scale2(struct image *dest, struct image *source)
+struct scale2_job
 {
-   rgb_group *new;
-   INT32 x, y, newx, newy;
-   newx = (source->xsize+1) >> 1;
-   newy = (source->ysize+1) >> 1;
+   struct image *dest,*source;
+   INT32 newx;
+};
 
-   if (dest->img) { free(dest->img); dest->img=NULL; }
-   if (!THIS->img || newx<0 || newy<0) return; /* no way */
-
-   if (!newx) newx = 1;
-   if (!newy) newy = 1;
-
-   new=xalloc(newx*newy*sizeof(rgb_group)+1);
-
-   THREADS_ALLOW();
-   MEMSET(new,0,newx*newy*sizeof(rgb_group));
-
-   dest->img=new;
-   dest->xsize=newx;
-   dest->ysize=newy;
-
-   /* Adjust for edge. */
-   newx -= source->xsize & 1;
-   newy -= source->ysize & 1;
+/* The base case and the X edge of scale2 for the rows y0..y1-1. */
+static void img_scale2_rows(void *data,INT32 y0,INT32 y1)
+{
+   struct scale2_job *job=(struct scale2_job *)data;
+   struct image *dest=job->dest,*source=job->source;
+   INT32 x,y,newx=job->newx;
 
    /* The base case. */
-   for (y = 0; y < newy; y++)
+   for (y = y0; y < y1; y++)
       for (x = 0; x < newx; x++)
       {
 	 pixel(dest,x,y).r = (COLORTYPE)
@@ -293,7 +311,7 @@ void img_scale2(struct image *dest, struct image *source)
       }
    /* X edge. */
    if (source->xsize & 1) {
-     for (y = 0; y < newy; y++) {
+     for (y = y0; y < y1; y++) {
        pixel(dest,newx,y).r = (COLORTYPE)
 	 (((INT32) pixel(source,2*newx,2*y+0).r+
 	   (INT32) pixel(source,2*newx,2*y+1).r) >> 1);
@@ -305,6 +323,41 @@ void img_scale2(struct image *dest, struct image *source)
 	   (INT32) pixel(source,2*newx,2*y+1).b) >> 1);
      }
    }
+}
+
+/* Special, faster, case for scale=1/2 */
+void img_scale2(struct image *dest, struct image *source)
+{
+   struct scale2_job job;
+   rgb_group *new;
+   INT32 x, newx, newy;
+   newx = (source->xsize+1) >> 1;
+   newy = (source->ysize+1) >> 1;
+
+   if (dest->img) { free(dest->img); dest->img=NULL; }
+   if (!THIS->img || newx<0 || newy<0) return; /* no way */
+
+   if (!newx) newx = 1;
+   if (!newy) newy = 1;
+
+   new=xalloc(newx*newy*sizeof(rgb_group)+1);
+
+   THREADS_ALLOW();
+   MEMSET(new,0,newx*newy*sizeof(rgb_group));
+
+   dest->img=new;
+   dest->xsize=newx;
+   dest->ysize=newy;
+
+   /* Adjust for edge. */
+   newx -= source->xsize & 1;
+   newy -= source->ysize & 1;
+
+   job.dest=dest;
+   job.source=source;
+   job.newx=newx;
+   img_run_rows(img_scale2_rows,&job,newy,newx,0);
+
    /* Y edge. */
    if (source->ysize & 1) {
      for (x = 0; x < newx; x++) {
@@ -701,44 +754,33 @@ void image_mirrory(INT32 args)
 
 #define ROUND(X) (DOUBLE_TO_COLORTYPE((X)+0.5))
 
-static void img_skewx(struct image *src,
-		      struct image *dest,
-		      double diff,
-		      int xpn) /* expand pixel for use with alpha instead */
+struct skew_job
 {
-   double x0,xmod,xm,x0f;
+   struct image *src,*dest;
+   double *start;		/* Offset of each row or column. */
+   int xpn;
+};
+
+static void img_skewx_rows(void *data,INT32 y0,INT32 y1)
+{
+   struct skew_job *job=(struct skew_job *)data;
+   struct image *src=job->src,*dest=job->dest;
+   double x0,xm,x0f;
    INT32 y,len,x0i;
    rgb_group *s,*d;
    rgb_group rgb;
+   int xpn=job->xpn;
 
-   if (dest->img) free(dest->img);
-   if (diff<0)
-      dest->xsize = DOUBLE_TO_INT(ceil(-diff)) + src->xsize, x0 = -diff;
-   else
-      dest->xsize = DOUBLE_TO_INT(ceil(diff)) + src->xsize, x0=0;
-   dest->ysize=src->ysize;
    len=src->xsize;
-
-   if (!src->xsize) dest->xsize=0;
-   d=dest->img=malloc(sizeof(rgb_group)*dest->xsize*dest->ysize+1);
-   if (!d) return;
-   s=src->img;
-
-   if (!src->xsize || !src->ysize) {
-     return;
-   }
-
-   THREADS_ALLOW();
-   xmod=diff/src->ysize;
-   rgb=dest->rgb;
-
-   CHRONO("skewx begin\n");
-
-   y=src->ysize;
-   while (y--)
+   for (y=y0; y<y1; y++)
    {
       int j;
 
+      s=src->img+y*len;
+      d=dest->img+y*dest->xsize;
+      x0=job->start[y];
+      rgb=dest->rgb;
+
       if (xpn) rgb=*s;
       for (j = x0i = DOUBLE_TO_INT((x0f = floor(x0))); j--;) *(d++)=rgb;
       if (!(xm=(x0-x0f)))
@@ -772,61 +814,84 @@ static void img_skewx(struct image *src,
 	    d->b=ROUND(rgb.b*xn+s->b*xm);
 	 d++;
 	 s++;
-	 debug_malloc_touch(dest->img);
 	 j = dest->xsize - x0i - len - 1;
       }
       if (xpn) rgb=s[-1];
       if(j>0)
 	while (j--) *(d++)=rgb;
-      else
-	d += j;
-      debug_malloc_touch(dest->img);
-      x0+=xmod;
    }
-   THREADS_DISALLOW();
-   debug_malloc_touch(dest->img);
-
-   CHRONO("skewx end\n");
 }
 
-static void img_skewy(struct image *src,
+static void img_skewx(struct image *src,
 		      struct image *dest,
 		      double diff,
 		      int xpn) /* expand pixel for use with alpha instead */
 {
-   double y0,ymod,ym,y0f;
-   INT32 x,len,xsz,y0i;
-   rgb_group *s,*d;
-   rgb_group rgb;
+   struct skew_job job;
+   double x0,xmod;
+   INT32 y;
+   rgb_group *d;
 
    if (dest->img) free(dest->img);
    if (diff<0)
-      dest->ysize = DOUBLE_TO_INT(ceil(-diff)) + src->ysize, y0 = -diff;
+      dest->xsize = DOUBLE_TO_INT(ceil(-diff)) + src->xsize, x0 = -diff;
    else
-      dest->ysize = DOUBLE_TO_INT(ceil(diff)) + src->ysize, y0 = 0;
-   xsz=dest->xsize=src->xsize;
-   len=src->ysize;
+      dest->xsize = DOUBLE_TO_INT(ceil(diff)) + src->xsize, x0=0;
+   dest->ysize=src->ysize;
 
-   if (!src->ysize) dest->ysize=0;
-   d=dest->img=malloc(sizeof(rgb_group)*dest->ysize*dest->xsize+1);
-   if (!d) return;
-   s=src->img;
+   if (!src->xsize) dest->xsize=0;
+   job.start=xalloc(sizeof(double)*src->ysize+1);
+   d=dest->img=malloc(sizeof(rgb_group)*dest->xsize*dest->ysize+1);
+   if (!d || !src->xsize || !src->ysize) {
+     free(job.start);
+     return;
+   }
 
    THREADS_ALLOW();
-   ymod=diff/src->xsize;
-   rgb=dest->rgb;
+   xmod=diff/src->ysize;
 
-   if (!src->xsize || !src->ysize) {
-     return;
+   CHRONO("skewx begin\n");
+
+   /* Sum up the offsets in row order, as the rows may be done in
+      any order. */
+   for (y=0; y<src->ysize; y++)
+   {
+      job.start[y]=x0;
+      x0+=xmod;
    }
+   job.src=src;
+   job.dest=dest;
+   job.xpn=xpn;
+   img_run_rows(img_skewx_rows,&job,src->ysize,dest->xsize,0);
+   free(job.start);
 
-CHRONO("skewy begin\n");
+   THREADS_DISALLOW();
+   debug_malloc_touch(dest->img);
+
+   CHRONO("skewx end\n");
+}
 
-   x=src->xsize;
-   while (x--)
+static void img_skewy_columns(void *data,INT32 x0,INT32 x1)
+{
+   struct skew_job *job=(struct skew_job *)data;
+   struct image *src=job->src,*dest=job->dest;
+   double y0,ym,y0f;
+   INT32 x,len,xsz,y0i;
+   rgb_group *s,*d;
+   rgb_group rgb;
+   int xpn=job->xpn;
+
+   xsz=dest->xsize;
+   len=src->ysize;
+   for (x=x0; x<x1; x++)
    {
       int j;
 
+      s=src->img+x;
+      d=dest->img+x;
+      y0=job->start[x];
+      rgb=dest->rgb;
+
       if (xpn) rgb=*s;
       for (j = y0i = DOUBLE_TO_INT((y0f = floor(y0))); j--;) *d=rgb,d+=xsz;
       if (!(ym=(y0-y0f)))
@@ -865,12 +930,52 @@ CHRONO("skewy begin\n");
       if (xpn) rgb=s[-xsz];
       if(j>0)
 	while (j--) *d=rgb,d+=xsz;
-      else
-	d += j;
-      s-=len*xsz-1;
-      d-=dest->ysize*xsz-1;
+   }
+}
+
+static void img_skewy(struct image *src,
+		      struct image *dest,
+		      double diff,
+		      int xpn) /* expand pixel for use with alpha instead */
+{
+   struct skew_job job;
+   double y0,ymod;
+   INT32 x;
+   rgb_group *d;
+
+   if (dest->img) free(dest->img);
+   if (diff<0)
+      dest->ysize = DOUBLE_TO_INT(ceil(-diff)) + src->ysize, y0 = -diff;
+   else
+      dest->ysize = DOUBLE_TO_INT(ceil(diff)) + src->ysize, y0 = 0;
+   dest->xsize=src->xsize;
+
+   if (!src->ysize) dest->ysize=0;
+   job.start=xalloc(sizeof(double)*src->xsize+1);
+   d=dest->img=malloc(sizeof(rgb_group)*dest->ysize*dest->xsize+1);
+   if (!d || !src->xsize || !src->ysize) {
+     free(job.start);
+     return;
+   }
+
+   THREADS_ALLOW();
+   ymod=diff/src->xsize;
+
+CHRONO("skewy begin\n");
+
+   /* Sum up the offsets in column order, as the columns may be done
+      in any order. */
+   for (x=0; x<src->xsize; x++)
+   {
+      job.start[x]=y0;
       y0+=ymod;
    }
+   job.src=src;
+   job.dest=dest;
+   job.xpn=xpn;
+   img_run_rows(img_skewy_columns,&job,src->xsize,dest->ysize,0);
+   free(job.start);
+
    THREADS_DISALLOW();
 
 CHRONO("skewy end\n");
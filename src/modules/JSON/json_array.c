@@ -23,8 +23,8 @@ static const int JSON_array_en_main = 1;
 #line 47 "rl/json_array.rl"
 
     /* Check stacks since we have uncontrolled recursion here. */
-    check_stack (10);
-    check_c_stack (1024);
+    if (!json_check_stack (state))
+	return p;
 
     if (!(state->flags&JSON_VALIDATE)) {
 	a = low_allocate_array(0,5);
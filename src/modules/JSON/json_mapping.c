@@ -4,7 +4,7 @@
 
 
 
-#line 61 "rl/json_mapping.rl"
+#line 58 "rl/json_mapping.rl"
 
 
 static ptrdiff_t _parse_JSON_mapping(PCHARP str, ptrdiff_t p, ptrdiff_t pe, struct parser_state *state) {
@@ -21,14 +21,14 @@ static const int JSON_mapping_error = 0;
 static const int JSON_mapping_en_main = 1;
 
 
-#line 69 "rl/json_mapping.rl"
+#line 66 "rl/json_mapping.rl"
 
     /* Check stacks since we have uncontrolled recursion here. */
-    check_stack (10);
-    check_c_stack (1024);
+    if (!json_check_stack (state))
+	return p;
 
     if (!(state->flags&JSON_VALIDATE)) {
-	m = debug_allocate_mapping(5);
+	m = debug_allocate_mapping(json_mapping_size_hint(state));
 	push_mapping(m);
     }
 
@@ -38,7 +38,7 @@ static const int JSON_mapping_en_main = 1;
 	cs = JSON_mapping_start;
 	}
 
-#line 80 "rl/json_mapping.rl"
+#line 77 "rl/json_mapping.rl"
     
 #line 44 "json_mapping.c"
 	{
@@ -70,10 +70,7 @@ tr2:
 #line 29 "rl/json_mapping.rl"
 	{
 	state->level++;
-	if (state->flags&JSON_UTF8)
-	    p = _parse_JSON_string_utf8(str, p, pe, state);
-	else
-	    p = _parse_JSON_string(str, p, pe, state);
+	p = _parse_JSON_key(str, p, pe, state);
 	state->level--;
 
 	if (state->flags&JSON_ERROR) {
@@ -91,7 +88,7 @@ st3:
 	if ( ++p == pe )
 		goto _test_eof3;
 case 3:
-#line 95 "json_mapping.c"
+#line 92 "json_mapping.c"
 	switch( ( ((int)INDEX_PCHARP(str, p))) ) {
 		case 13: goto st3;
 		case 32: goto st3;
@@ -149,7 +146,7 @@ st5:
 	if ( ++p == pe )
 		goto _test_eof5;
 case 5:
-#line 153 "json_mapping.c"
+#line 150 "json_mapping.c"
 	switch( ( ((int)INDEX_PCHARP(str, p))) ) {
 		case 13: goto st5;
 		case 32: goto st5;
@@ -163,9 +160,9 @@ st6:
 	if ( ++p == pe )
 		goto _test_eof6;
 case 6:
-#line 60 "rl/json_mapping.rl"
+#line 57 "rl/json_mapping.rl"
 	{ p--; {p++; cs = 6; goto _out;} }
-#line 169 "json_mapping.c"
+#line 166 "json_mapping.c"
 	goto st0;
 	}
 	_test_eof2: cs = 2; goto _test_eof; 
@@ -178,9 +175,11 @@ case 6:
 	_out: {}
 	}
 
-#line 81 "rl/json_mapping.rl"
+#line 78 "rl/json_mapping.rl"
 
     if (cs >= JSON_mapping_first_final) {
+	if (!(state->flags&JSON_VALIDATE))
+	    json_mapping_size_done(state, m);
 	return p;
     }
 
@@ -444,7 +444,7 @@ case 14:
 
 	state->flags |= JSON_ERROR;
 	if (p == pe) {
-	    err_msg = "Unterminated string";
+	    if (!(state->flags&JSON_VALIDATE)) err_msg = "Unterminated string";
 	    return start;
 	}
 	return p;
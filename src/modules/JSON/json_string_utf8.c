@@ -30,20 +30,31 @@ static const int JSON_string_en_main_hex1 = 15;
 
 #line 141 "rl/json_string_utf8.rl"
 
+    /* Fast path for strings without escapes and non-ASCII characters,
+     * which can be copied verbatim. */
+    if (p < pe && *p == '"') {
+	ptrdiff_t run = json_plain_prefix(p + 1, pe - p - 1);
+	if (p + 1 + run < pe && p[1 + run] == '"') {
+	    if (!(state->flags&JSON_VALIDATE))
+		push_string(make_shared_binary_string((char *)p + 1, run));
+	    return p + run + 2 - (unsigned char*)(str.ptr);
+	}
+    }
+
     if (!(state->flags&JSON_VALIDATE)) {
 	init_string_builder(&s, 0);
 	SET_ONERROR(handle, free_string_builder, &s);
     }
 
     
-#line 40 "json_string_utf8.c"
+#line 51 "json_string_utf8.c"
 	{
 	cs = JSON_string_start;
 	}
 
-#line 148 "rl/json_string_utf8.rl"
+#line 159 "rl/json_string_utf8.rl"
     
-#line 47 "json_string_utf8.c"
+#line 58 "json_string_utf8.c"
 	{
 	if ( p == pe )
 		goto _test_eof;
@@ -231,7 +242,7 @@ st3:
 	if ( ++p == pe )
 		goto _test_eof3;
 case 3:
-#line 235 "json_string_utf8.c"
+#line 246 "json_string_utf8.c"
 	switch( (*p) ) {
 		case 34u: goto tr9;
 		case 92u: goto tr10;
@@ -276,7 +287,7 @@ st21:
 case 21:
 #line 126 "rl/json_string_utf8.rl"
 	{ p--; {p++; cs = 21; goto _out;} }
-#line 280 "json_string_utf8.c"
+#line 291 "json_string_utf8.c"
 	goto st0;
 tr4:
 #line 68 "rl/json_string_utf8.rl"
@@ -304,7 +315,7 @@ st4:
 	if ( ++p == pe )
 		goto _test_eof4;
 case 4:
-#line 308 "json_string_utf8.c"
+#line 319 "json_string_utf8.c"
 	switch( (*p) ) {
 		case 34u: goto tr14;
 		case 47u: goto tr14;
@@ -340,7 +351,7 @@ st6:
 	if ( ++p == pe )
 		goto _test_eof6;
 case 6:
-#line 344 "json_string_utf8.c"
+#line 355 "json_string_utf8.c"
 	if ( (*p) < 65u ) {
 		if ( 48u <= (*p) && (*p) <= 57u )
 			goto tr17;
@@ -361,7 +372,7 @@ st7:
 	if ( ++p == pe )
 		goto _test_eof7;
 case 7:
-#line 365 "json_string_utf8.c"
+#line 376 "json_string_utf8.c"
 	if ( (*p) < 65u ) {
 		if ( 48u <= (*p) && (*p) <= 57u )
 			goto tr18;
@@ -382,7 +393,7 @@ st8:
 	if ( ++p == pe )
 		goto _test_eof8;
 case 8:
-#line 386 "json_string_utf8.c"
+#line 397 "json_string_utf8.c"
 	if ( (*p) < 65u ) {
 		if ( 48u <= (*p) && (*p) <= 57u )
 			goto tr19;
@@ -422,7 +433,7 @@ st9:
 	if ( ++p == pe )
 		goto _test_eof9;
 case 9:
-#line 426 "json_string_utf8.c"
+#line 437 "json_string_utf8.c"
 	if ( 128u <= (*p) && (*p) <= 191u )
 		goto tr20;
 	goto st0;
@@ -456,7 +467,7 @@ st10:
 	if ( ++p == pe )
 		goto _test_eof10;
 case 10:
-#line 460 "json_string_utf8.c"
+#line 471 "json_string_utf8.c"
 	if ( 128u <= (*p) && (*p) <= 191u )
 		goto tr21;
 	goto st0;
@@ -468,7 +479,7 @@ st11:
 	if ( ++p == pe )
 		goto _test_eof11;
 case 11:
-#line 472 "json_string_utf8.c"
+#line 483 "json_string_utf8.c"
 	if ( 128u <= (*p) && (*p) <= 191u )
 		goto tr22;
 	goto st0;
@@ -502,7 +513,7 @@ st12:
 	if ( ++p == pe )
 		goto _test_eof12;
 case 12:
-#line 506 "json_string_utf8.c"
+#line 517 "json_string_utf8.c"
 	if ( 128u <= (*p) && (*p) <= 191u )
 		goto tr23;
 	goto st0;
@@ -514,7 +525,7 @@ st13:
 	if ( ++p == pe )
 		goto _test_eof13;
 case 13:
-#line 518 "json_string_utf8.c"
+#line 529 "json_string_utf8.c"
 	if ( 128u <= (*p) && (*p) <= 191u )
 		goto tr24;
 	goto st0;
@@ -526,7 +537,7 @@ st14:
 	if ( ++p == pe )
 		goto _test_eof14;
 case 14:
-#line 530 "json_string_utf8.c"
+#line 541 "json_string_utf8.c"
 	if ( 128u <= (*p) && (*p) <= 191u )
 		goto tr25;
 	goto st0;
@@ -567,7 +578,7 @@ st18:
 	if ( ++p == pe )
 		goto _test_eof18;
 case 18:
-#line 571 "json_string_utf8.c"
+#line 582 "json_string_utf8.c"
 	if ( (*p) < 65u ) {
 		if ( 48u <= (*p) && (*p) <= 57u )
 			goto tr29;
@@ -588,7 +599,7 @@ st19:
 	if ( ++p == pe )
 		goto _test_eof19;
 case 19:
-#line 592 "json_string_utf8.c"
+#line 603 "json_string_utf8.c"
 	if ( (*p) < 65u ) {
 		if ( 48u <= (*p) && (*p) <= 57u )
 			goto tr30;
@@ -609,7 +620,7 @@ st20:
 	if ( ++p == pe )
 		goto _test_eof20;
 case 20:
-#line 613 "json_string_utf8.c"
+#line 624 "json_string_utf8.c"
 	if ( (*p) < 65u ) {
 		if ( 48u <= (*p) && (*p) <= 57u )
 			goto tr31;
@@ -646,7 +657,7 @@ case 20:
 	_out: {}
 	}
 
-#line 149 "rl/json_string_utf8.rl"
+#line 160 "rl/json_string_utf8.rl"
 
     if (cs >= JSON_string_first_final) {
 	if (!(state->flags&JSON_VALIDATE)) {
@@ -666,7 +677,7 @@ failure:
 
     state->flags |= JSON_ERROR;
     if (p == pe) {
-	err_msg = "Unterminated string";
+	if (!(state->flags&JSON_VALIDATE)) err_msg = "Unterminated string";
 	return start;
     }
     return p - (unsigned char*)(str.ptr);
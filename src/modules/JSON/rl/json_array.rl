@@ -46,8 +46,8 @@ static ptrdiff_t _parse_JSON_array(PCHARP str, ptrdiff_t p, ptrdiff_t pe, struct
     %% write data;
 
     /* Check stacks since we have uncontrolled recursion here. */
-    check_stack (10);
-    check_c_stack (1024);
+    if (!json_check_stack (state))
+	return p;
 
     if (!(state->flags&JSON_VALIDATE)) {
 	a = low_allocate_array(0,5);
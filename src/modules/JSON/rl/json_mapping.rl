@@ -28,10 +28,7 @@
 
     action parse_key {
 	state->level++;
-	if (state->flags&JSON_UTF8)
-	    p = _parse_JSON_string_utf8(str, fpc, pe, state);
-	else
-	    p = _parse_JSON_string(str, fpc, pe, state);
+	p = _parse_JSON_key(str, fpc, pe, state);
 	state->level--;
 
 	if (state->flags&JSON_ERROR) {
@@ -68,11 +65,11 @@ static ptrdiff_t _parse_JSON_mapping(PCHARP str, ptrdiff_t p, ptrdiff_t pe, stru
     %% write data;
 
     /* Check stacks since we have uncontrolled recursion here. */
-    check_stack (10);
-    check_c_stack (1024);
+    if (!json_check_stack (state))
+	return p;
 
     if (!(state->flags&JSON_VALIDATE)) {
-	m = debug_allocate_mapping(5);
+	m = debug_allocate_mapping(json_mapping_size_hint(state));
 	push_mapping(m);
     }
 
@@ -80,6 +77,8 @@ static ptrdiff_t _parse_JSON_mapping(PCHARP str, ptrdiff_t p, ptrdiff_t pe, stru
     %% write exec;
 
     if (cs >= JSON_mapping_first_final) {
+	if (!(state->flags&JSON_VALIDATE))
+	    json_mapping_size_done(state, m);
 	return p;
     }
 
@@ -120,7 +120,7 @@ static ptrdiff_t _parse_JSON_string(PCHARP str, ptrdiff_t p, ptrdiff_t pe, struc
 
 	state->flags |= JSON_ERROR;
 	if (p == pe) {
-	    err_msg = "Unterminated string";
+	    if (!(state->flags&JSON_VALIDATE)) err_msg = "Unterminated string";
 	    return start;
 	}
 	return p;
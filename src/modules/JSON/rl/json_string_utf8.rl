@@ -139,6 +139,17 @@ static ptrdiff_t _parse_JSON_string_utf8(PCHARP str, ptrdiff_t pos, ptrdiff_t en
 
     %% write data;
 
+    /* Fast path for strings without escapes and non-ASCII characters,
+     * which can be copied verbatim. */
+    if (p < pe && *p == '"') {
+	ptrdiff_t run = json_plain_prefix(p + 1, pe - p - 1);
+	if (p + 1 + run < pe && p[1 + run] == '"') {
+	    if (!(state->flags&JSON_VALIDATE))
+		push_string(make_shared_binary_string((char *)p + 1, run));
+	    return p + run + 2 - (unsigned char*)(str.ptr);
+	}
+    }
+
     if (!(state->flags&JSON_VALIDATE)) {
 	init_string_builder(&s, 0);
 	SET_ONERROR(handle, free_string_builder, &s);
@@ -165,7 +176,7 @@ failure:
 
     state->flags |= JSON_ERROR;
     if (p == pe) {
-	err_msg = "Unterminated string";
+	if (!(state->flags&JSON_VALIDATE)) err_msg = "Unterminated string";
 	return start;
     }
     return p - (unsigned char*)(str.ptr);
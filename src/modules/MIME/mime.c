@@ -24,6 +24,7 @@
 #include "builtin_functions.h"
 #include "module_support.h"
 #include "pike_error.h"
+#include "threads.h"
 
 #ifdef __CHAR_UNSIGNED__
 #define SIGNED signed
@@ -48,13 +49,52 @@ static void f_tokenize_labled( INT32 args );
 static void f_quote( INT32 args );
 static void f_quote_labled( INT32 args );
 
+static void init_b64_decoder( struct object *o );
+static void f_b64_decoder_feed( INT32 args );
+static void f_b64_decoder_finish( INT32 args );
+static void init_b64_encoder( struct object *o );
+static void f_b64_encoder_create( INT32 args );
+static void f_b64_encoder_feed( INT32 args );
+static void f_b64_encoder_finish( INT32 args );
+static void init_qp_decoder( struct object *o );
+static void f_qp_decoder_feed( INT32 args );
+static void f_qp_decoder_finish( INT32 args );
+
+
+/** Storage for the streaming codecs **/
+
+/* Base64 decoder state: d holds the bits not output yet, below a
+ * sentinel bit, and pads counts the '=' seen. */
+struct b64_decode_state
+{
+  INT32 d;
+  int pads;
+};
+
+/* Base64 encoder state. */
+struct b64_encode_state
+{
+  unsigned char carry[3];	/* Bytes of an incomplete group. */
+  int ncarry;
+  int g;			/* Groups on the current line. */
+  int insert_crlf;
+};
+
+/* Quoted-printable decoder state. */
+struct qp_decode_state
+{
+  unsigned char carry[3];	/* An escape split between calls. */
+  int ncarry;
+};
+
 
 /** Global tables **/
 
 static const char base64tab[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-static SIGNED char base64rtab[(1<<(CHAR_BIT-1))-' '];
+static SIGNED char base64val[1<<CHAR_BIT];
+static char base64pairs[2<<12];	/* Two chars for each 12 bit value. */
 static const char qptab[16] = "0123456789ABCDEF";
-static SIGNED char qprtab[(1<<(CHAR_BIT-1))-'0'];
+static SIGNED char qpval[1<<CHAR_BIT];
 
 #define CT_CTL     0
 #define CT_WHITE   1
@@ -92,17 +132,23 @@ PIKE_MODULE_INIT
   Pike_compiler->new_program->id = PROG_MODULE_MIME_ID;
 
   /* Init reverse base64 mapping */
-  memset( base64rtab, -1, sizeof(base64rtab) );
+  memset( base64val, -1, sizeof(base64val) );
   for (i = 0; i < 64; i++)
-    base64rtab[base64tab[i] - ' '] = i;
+    base64val[(unsigned char)base64tab[i]] = i;
+
+  /* Init base64 mapping for pairs of chars */
+  for (i = 0; i < 1<<12; i++) {
+    base64pairs[i<<1] = base64tab[i>>6];
+    base64pairs[(i<<1)+1] = base64tab[i&63];
+  }
 
   /* Init reverse qp mapping */
-  memset( qprtab, -1, sizeof(qprtab) );
+  memset( qpval, -1, sizeof(qpval) );
   for (i = 0; i < 16; i++)
-    qprtab[qptab[i]-'0'] = i;
+    qpval[(unsigned char)qptab[i]] = i;
   for (i = 10; i < 16; i++)
     /* Lower case hex digits */
-    qprtab[qptab[i] - ('0' + 'A' - 'a')] = i;
+    qpval[qptab[i] - 'A' + 'a'] = i;
 
   /* Init lexical properties of characters for MIME.tokenize() */
   memset( rfc822ctype, CT_ATOM, sizeof(rfc822ctype) );
@@ -149,6 +195,30 @@ PIKE_MODULE_INIT
   add_function_constant( "quote_labled", f_quote_labled,
 			 "function(array(array(string|int)):string)",
 			 OPT_TRY_OPTIMIZE );
+
+  /* Add streaming codecs */
+  start_new_program();
+  ADD_STORAGE( struct b64_decode_state );
+  set_init_callback( init_b64_decoder );
+  ADD_FUNCTION( "feed", f_b64_decoder_feed, tFunc(tStr,tStr), 0 );
+  ADD_FUNCTION( "finish", f_b64_decoder_finish, tFunc(tNone,tStr), 0 );
+  end_class( "Base64Decoder", 0 );
+
+  start_new_program();
+  ADD_STORAGE( struct b64_encode_state );
+  set_init_callback( init_b64_encoder );
+  ADD_FUNCTION( "create", f_b64_encoder_create,
+		tFunc(tOr(tInt,tVoid),tVoid), ID_PROTECTED );
+  ADD_FUNCTION( "feed", f_b64_encoder_feed, tFunc(tStr,tStr), 0 );
+  ADD_FUNCTION( "finish", f_b64_encoder_finish, tFunc(tNone,tStr), 0 );
+  end_class( "Base64Encoder", 0 );
+
+  start_new_program();
+  ADD_STORAGE( struct qp_decode_state );
+  set_init_callback( init_qp_decoder );
+  ADD_FUNCTION( "feed", f_qp_decoder_feed, tFunc(tStr,tStr), 0 );
+  ADD_FUNCTION( "finish", f_qp_decoder_finish, tFunc(tNone,tStr), 0 );
+  end_class( "QPDecoder", 0 );
 }
 
 /* Restore and exit module */
@@ -160,13 +230,108 @@ PIKE_MODULE_EXIT
 
 /** Functions implementing Pike functions **/
 
+/* Inputs at least this long are coded without the interpreter lock. */
+#define MIME_THREADS_THRESHOLD	65536
+
+/*  Decodes len chars from src into dest, which must have room for
+ *  (len*3)/4+3 bytes.  Any chars outside the base64 alphabet are
+ *  ignored.  Returns the end of the output.
+ */
+static unsigned char *do_b64_decode( const unsigned char *src, ptrdiff_t len,
+				     unsigned char *dest,
+				     struct b64_decode_state *st )
+{
+  const unsigned char *end = src + len;
+  INT32 d = st->d;
+  int pads = st->pads;
+
+  while (src < end) {
+    int c;
+    if (d == 1 && end - src >= 4) {
+      /* Fast path for a complete group of four valid chars. */
+      int a = base64val[src[0]], b = base64val[src[1]];
+      int e = base64val[src[2]], f = base64val[src[3]];
+      if ((a|b|e|f) >= 0) {
+	INT32 g = (a<<18)|(b<<12)|(e<<6)|f;
+	*dest++ = (g>>16)&0xff;
+	*dest++ = (g>>8)&0xff;
+	*dest++ = g&0xff;
+	src += 4;
+	continue;
+      }
+    }
+    c = *src++;
+    if (base64val[c] >= 0) {
+      /* 6 more bits to put into d */
+      if((d=(d<<6)|base64val[c])>=0x1000000) {
+	/* d now contains 24 valid bits.  Put them in the buffer */
+	*dest++ = (d>>16)&0xff;
+	*dest++ = (d>>8)&0xff;
+	*dest++ = d&0xff;
+	d=1;
+      }
+    } else if (c == '=') {
+      /* A pad character has been encountered.
+	 Increase pad count, and remove unused bits from d. */
+      pads++;
+      d>>=2;
+    }
+  }
+
+  st->d = d;
+  st->pads = pads;
+  return dest;
+}
+
+/*  Outputs the data remaining in a base64 decoder state, and resets it.
+ */
+static unsigned char *b64_decode_end( unsigned char *dest,
+				      struct b64_decode_state *st )
+{
+  /* If data size not an even multiple of 3 bytes, output remaining data */
+  switch(st->pads) {
+  case 1:
+    *dest++ = (st->d>>8)&0xff;
+  case 2:
+    *dest++ = st->d&0xff;
+  }
+  st->d = 1;
+  st->pads = 0;
+  return dest;
+}
+
+/*  Decodes a base64 string into a new string, using and updating the
+ *  state st.  If final is set the remaining data is output as well.
+ */
+static struct pike_string *b64_decode_string( struct pike_string *s,
+					      struct b64_decode_state *st,
+					      int final )
+{
+  struct pike_string *res = begin_shared_string( (s->len*3)/4 + 3 );
+  unsigned char *src = STR0(s);
+  unsigned char *dest = STR0(res);
+  ptrdiff_t len = s->len;
+
+  if (len >= MIME_THREADS_THRESHOLD) {
+    THREADS_ALLOW();
+    dest = do_b64_decode( src, len, dest, st );
+    THREADS_DISALLOW();
+  } else
+    dest = do_b64_decode( src, len, dest, st );
+
+  if (final)
+    dest = b64_decode_end( dest, st );
+
+  return end_and_resize_shared_string( res, dest - STR0(res) );
+}
+
 /*! @decl string decode_base64(string encoded_data)
  *!
  *! This function decodes data encoded using the @tt{base64@}
  *! transfer encoding.
  *!
  *! @seealso
- *! @[MIME.encode_base64()], @[MIME.decode()]
+ *! @[MIME.encode_base64()], @[MIME.decode()], @[Base64Decoder]
  */
 static void f_decode_base64( INT32 args )
 {
@@ -180,81 +345,91 @@ static void f_decode_base64( INT32 args )
 
     /* Decode the string in sp[-1].u.string.  Any whitespace etc
        must be ignored, so the size of the result can't be exactly
-       calculated from the input size.  We'll use a string builder
-       instead. */
+       calculated from the input size.  We'll allocate for the worst
+       case and shrink the result afterwards. */
 
-    struct string_builder buf;
-    SIGNED char *src;
-    ptrdiff_t cnt;
-    INT32 d = 1;
-    int pads = 0;
-
-    init_string_builder( &buf, 0 );
+    struct b64_decode_state st;
+    struct pike_string *res;
 
-    for (src = (SIGNED char *)sp[-1].u.string->str, cnt = sp[-1].u.string->len;
-	 cnt--; src++)
-      if(*src>=' ' && base64rtab[*src-' ']>=0) {
-	/* 6 more bits to put into d */
-	if((d=(d<<6)|base64rtab[*src-' '])>=0x1000000) {
-	  /* d now contains 24 valid bits.  Put them in the buffer */
-	  string_builder_putchar( &buf, (d>>16)&0xff );
-	  string_builder_putchar( &buf, (d>>8)&0xff );
-	  string_builder_putchar( &buf, d&0xff );
-	  d=1;
-	}
-      } else if (*src=='=') {
-	/* A pad character has been encountered.
-	   Increase pad count, and remove unused bits from d. */
-	pads++;
-	d>>=2;
-      }
-
-    /* If data size not an even multiple of 3 bytes, output remaining data */
-    switch(pads) {
-    case 1:
-      string_builder_putchar( &buf, (d>>8)&0xff );
-    case 2:
-      string_builder_putchar( &buf, d&0xff );
-    }
+    st.d = 1;
+    st.pads = 0;
+    res = b64_decode_string( sp[-1].u.string, &st, 1 );
 
     /* Return result */
     pop_n_elems( 1 );
-    push_string( finish_string_builder( &buf ) );
+    push_string( res );
   }
 }
 
 /*  Convenience function for encode_base64();  Encode groups*3 bytes from
- *  *srcp into groups*4 bytes at *destp.
+ *  *srcp into groups*4 bytes at *destp.  *gp counts the groups on the
+ *  current line; a linebreak is inserted before every 20th group if
+ *  insert_crlf is set, so there's never one at the end.
  */
-static int do_b64_encode( ptrdiff_t groups, unsigned char **srcp, char **destp,
-			  int insert_crlf )
+static void do_b64_encode( ptrdiff_t groups, unsigned char **srcp,
+			   char **destp, int *gp, int insert_crlf )
 {
   unsigned char *src = *srcp;
   char *dest = *destp;
-  int g = 0;
+  int g = *gp;
 
   while (groups--) {
     /* Get 24 bits from src */
     INT32 d = *src++<<8;
     d = (*src++|d)<<8;
     d |= *src++;
-    /* Output in encoded from to dest */
-    *dest++ = base64tab[d>>18];
-    *dest++ = base64tab[(d>>12)&63];
-    *dest++ = base64tab[(d>>6)&63];
-    *dest++ = base64tab[d&63];
     /* Insert a linebreak once in a while... */
-    if(insert_crlf && ++g == 19) {
+    if(insert_crlf && g == 19) {
       *dest++ = 13;
       *dest++ = 10;
       g=0;
     }
+    /* Output in encoded form to dest, two chars per lookup */
+    MEMCPY(dest, base64pairs + ((d>>12)<<1), 2);
+    MEMCPY(dest + 2, base64pairs + ((d&0xfff)<<1), 2);
+    dest += 4;
+    g++;
   }
 
   /* Update pointers */
   *srcp = src;
   *destp = dest;
-  return g;
+  *gp = g;
+}
+
+/*  Encodes the last 1 or 2 bytes of the data with pads.
+ */
+static void b64_encode_last( unsigned char *src, int last, char **destp,
+			     int *gp, int insert_crlf )
+{
+  /* Temporary storage for the last group, as we may have to read
+     an extra byte or two and don't want to get any page-faults.  */
+  unsigned char tmp[3], *tmpp = tmp;
+  int i;
+
+  tmp[1] = tmp[2] = 0;
+  for (i = 0; i < last; i++)
+    tmp[i] = src[i];
+
+  /* Encode the last group, and replace output codes with pads as needed */
+  do_b64_encode( 1, &tmpp, destp, gp, insert_crlf );
+  switch (last) {
+  case 1:
+    *--*destp = '=';
+  case 2:
+    *--*destp = '=';
+  }
+}
+
+/*  The size of the base64 encoding of groups 24 bit groups following
+ *  g groups on the current line.
+ */
+static ptrdiff_t b64_encoded_size( ptrdiff_t groups, int g, int insert_crlf )
+{
+  ptrdiff_t size = groups*4;
+  if (insert_crlf && groups)
+    size += ((groups + g - 1)/19)*2;
+  return size;
 }
 
 /*! @decl string encode_base64(string data, void|int no_linebreaks)
@@ -265,7 +440,7 @@ static int do_b64_encode( ptrdiff_t groups, unsigned char **srcp, char **destp,
  *! will not contain any linebreaks.
  *!
  *! @seealso
- *! @[MIME.decode_base64()], @[MIME.encode()]
+ *! @[MIME.decode_base64()], @[MIME.encode()], @[Base64Encoder]
  */
 static void f_encode_base64( INT32 args )
 {
@@ -281,42 +456,33 @@ static void f_encode_base64( INT32 args )
        the number of 24 bit groups in the input, and the number of
        bytes actually present in the last group. */
 
-    ptrdiff_t groups = (sp[-args].u.string->len+2)/3;
-    ptrdiff_t last = (sp[-args].u.string->len-1)%3+1;
+    ptrdiff_t len = sp[-args].u.string->len;
+    ptrdiff_t groups = (len+2)/3;
+    int last = (int)((len-1)%3+1);
+    int g = 0;
 
     int insert_crlf = !(args == 2 && sp[-1].type == T_INT &&
 			sp[-1].u.integer != 0);
 
     /* We need 4 bytes for each 24 bit group, and 2 bytes for each linebreak */
     struct pike_string *str =
-      begin_shared_string( groups*4+(insert_crlf? (groups/19)*2 : 0) );
+      begin_shared_string( b64_encoded_size( groups, 0, insert_crlf ) );
 
     unsigned char *src = (unsigned char *)sp[-args].u.string->str;
     char *dest = str->str;
 
     if (groups) {
-      /* Temporary storage for the last group, as we may have to read
-	 an extra byte or two and don't want to get any page-faults.  */
-      unsigned char tmp[3], *tmpp = tmp;
-      int i;
-
-      if (do_b64_encode( groups-1, &src, &dest, insert_crlf ) == 18)
-	/* Skip the final linebreak if it's not to be followed by anything */
-	str->len -= 2;
-
-      /* Copy the last group to temporary storage */
-      tmp[1] = tmp[2] = 0;
-      for (i = 0; i < last; i++)
-	tmp[i] = *src++;
+      if (len >= MIME_THREADS_THRESHOLD) {
+	THREADS_ALLOW();
+	do_b64_encode( groups-1, &src, &dest, &g, insert_crlf );
+	THREADS_DISALLOW();
+      } else
+	do_b64_encode( groups-1, &src, &dest, &g, insert_crlf );
 
-      /* Encode the last group, and replace output codes with pads as needed */
-      do_b64_encode( 1, &tmpp, &dest, 0 );
-      switch (last) {
-      case 1:
-	*--dest = '=';
-      case 2:
-	*--dest = '=';
-      }
+      if (last == 3)
+	do_b64_encode( 1, &src, &dest, &g, insert_crlf );
+      else
+	b64_encode_last( src, last, &dest, &g, insert_crlf );
     }
 
     /* Return the result */
@@ -325,13 +491,56 @@ static void f_encode_base64( INT32 args )
   }
 }
 
+/*  Decodes quoted-printable data from src into dest, which must have
+ *  room for len bytes.  An escape that isn't complete at the end of
+ *  the data is left for the next call unless at_end is set.  Returns
+ *  the number of chars consumed and sets *destp to the end of the
+ *  output.
+ */
+static ptrdiff_t do_qp_decode( const unsigned char *src, ptrdiff_t len,
+			       unsigned char **destp, int at_end )
+{
+  const unsigned char *start = src, *end = src + len;
+  unsigned char *dest = *destp;
+
+  while (src < end) {
+    /* Copy raw data up to the next '=' in one go. */
+    const unsigned char *eq = memchr( src, '=', end - src );
+    ptrdiff_t cnt;
+    if (!eq) eq = end;
+    MEMCPY( dest, src, eq - src );
+    dest += eq - src;
+    if ((src = eq) == end) break;
+
+    /* Encoded data */
+    cnt = end - src - 1;
+    if (cnt < 2 && !at_end)
+      break;			/* Wait for the rest of the escape. */
+    src++;
+    if (cnt > 0 && (*src == 10 || *src == 13)) {
+      /* A '=' followed by CR, LF or CRLF will be simply ignored. */
+      if (*src == 13)
+	src++;
+      if (src < end && *src == 10)
+	src++;
+    } else if (cnt >= 2 && qpval[src[0]] >= 0 && qpval[src[1]] >= 0) {
+      /* A '=' followed by a hexadecimal number. */
+      *dest++ = (qpval[src[0]]<<4)|qpval[src[1]];
+      src += 2;
+    }
+  }
+
+  *destp = dest;
+  return src - start;
+}
+
 /*! @decl string decode_qp(string encoded_data)
  *!
  *! This function decodes data encoded using the @tt{quoted-printable@}
  *! (a.k.a. quoted-unreadable) transfer encoding.
  *!
  *! @seealso
- *! @[MIME.encode_qp()], @[MIME.decode()]
+ *! @[MIME.encode_qp()], @[MIME.decode()], @[QPDecoder]
  */
 static void f_decode_qp( INT32 args )
 {
@@ -343,47 +552,65 @@ static void f_decode_qp( INT32 args )
     Pike_error( "Char out of range for MIME.decode_qp()\n" );
   else {
 
-    /* Decode the string in sp[-1].u.string.  We have absolutely no idea
-       how much of the input is raw data and how much is encoded data,
-       so we'll use a string builder to hold the result. */
+    /* Decode the string in sp[-1].u.string.  The result is never
+       longer than the input, so allocate that and shrink it
+       afterwards. */
 
-    struct string_builder buf;
-    SIGNED char *src;
-    ptrdiff_t cnt;
+    struct pike_string *s = sp[-1].u.string;
+    struct pike_string *res = begin_shared_string( s->len );
+    unsigned char *dest = STR0(res);
 
-    init_string_builder(&buf, 0);
-
-    for (src = (SIGNED char *)sp[-1].u.string->str, cnt = sp[-1].u.string->len;
-	 cnt--; src++)
-      if (*src == '=') {
-	/* Encoded data */
-	if (cnt > 0 && (src[1] == 10 || src[1] == 13)) {
-	  /* A '=' followed by CR, LF or CRLF will be simply ignored. */
-	  if (src[1] == 13) {
-	    --cnt;
-	    src++;
-	  }
-	  if (cnt>0 && src[1]==10) {
-	    --cnt;
-	    src++;
-	  }
-	} else if (cnt >= 2 && src[1] >= '0' && src[2] >= '0' &&
-		   qprtab[src[1]-'0'] >= 0 && qprtab[src[2]-'0'] >= 0) {
-	  /* A '=' followed by a hexadecimal number. */
-	  string_builder_putchar( &buf, (qprtab[src[1]-'0']<<4)|qprtab[src[2]-'0'] );
-	  cnt -= 2;
-	  src += 2;
-	}
-      } else
-	/* Raw data */
-	string_builder_putchar( &buf, *(unsigned char *)src );
+    if (s->len >= MIME_THREADS_THRESHOLD) {
+      THREADS_ALLOW();
+      do_qp_decode( STR0(s), s->len, &dest, 1 );
+      THREADS_DISALLOW();
+    } else
+      do_qp_decode( STR0(s), s->len, &dest, 1 );
 
     /* Return the result */
+    res = end_and_resize_shared_string( res, dest - STR0(res) );
     pop_n_elems( 1 );
-    push_string( finish_string_builder( &buf ) );
+    push_string( res );
   }
 }
 
+/*  Encodes len bytes from src as quoted-printable into dest, which
+ *  must have room for qp_encoded_max(len) bytes.  Returns the end of
+ *  the output.
+ */
+static char *do_qp_encode( const unsigned char *src, ptrdiff_t len,
+			   char *dest, int insert_crlf )
+{
+  int col = 0;
+
+  for (; len--; src++) {
+    if ((*src >= 33 && *src <= 60) ||
+	(*src >= 62 && *src <= 126))
+      /* These characters can always be encoded as themselves */
+      *dest++ = *src;
+    else {
+      /* Better safe than sorry, eh?  Use the dreaded hex escape */
+      *dest++ = '=';
+      *dest++ = qptab[(*src)>>4];
+      *dest++ = qptab[(*src)&15];
+      col += 2;
+    }
+    /* We'd better not let the lines get too long */
+    if (++col >= 73 && insert_crlf) {
+      *dest++ = '=';
+      *dest++ = 13;
+      *dest++ = 10;
+      col = 0;
+    }
+  }
+
+  return dest;
+}
+
+/* Each input byte adds at most three chars and columns, and a soft
+ * linebreak is at least 73 columns apart. */
+#define qp_encoded_max(LEN)	((LEN)*3 + ((LEN)*3/73 + 1)*3)
+
 /*! @decl string encode_qp(string data, void|int no_linebreaks)
  *!
  *! This function encodes data using the @tt{quoted-printable@}
@@ -410,45 +637,296 @@ static void f_encode_qp( INT32 args )
   else {
 
     /* Encode the string in sp[-args].u.string.  We don't know how
-       much of the data has to be encoded, so let's use that trusty
-       string builder once again. */
+       much of the data has to be encoded, so allocate for the worst
+       case and shrink the result afterwards. */
 
-    struct string_builder buf;
-    unsigned char *src = (unsigned char *)sp[-args].u.string->str;
-    ptrdiff_t cnt;
-    int col = 0;
+    struct pike_string *s = sp[-args].u.string;
+    struct pike_string *res = begin_shared_string( qp_encoded_max(s->len) );
+    char *dest;
     int insert_crlf = !(args == 2 && sp[-1].type == T_INT &&
 			sp[-1].u.integer != 0);
 
-    init_string_builder( &buf, 0 );
+    if (s->len >= MIME_THREADS_THRESHOLD) {
+      THREADS_ALLOW();
+      dest = do_qp_encode( STR0(s), s->len, res->str, insert_crlf );
+      THREADS_DISALLOW();
+    } else
+      dest = do_qp_encode( STR0(s), s->len, res->str, insert_crlf );
 
-    for (cnt = sp[-args].u.string->len; cnt--; src++) {
-      if ((*src >= 33 && *src <= 60) ||
-	  (*src >= 62 && *src <= 126))
-	/* These characters can always be encoded as themselves */
-	string_builder_putchar( &buf, *(unsigned char *)src );
-      else {
-	/* Better safe than sorry, eh?  Use the dreaded hex escape */
-	string_builder_putchar( &buf, '=' );
-	string_builder_putchar( &buf, qptab[(*src)>>4] );
-	string_builder_putchar( &buf, qptab[(*src)&15] );
-	col += 2;
-      }
-      /* We'd better not let the lines get too long */
-      if (++col >= 73 && insert_crlf) {
-	string_builder_putchar( &buf, '=' );
-	string_builder_putchar( &buf, 13 );
-	string_builder_putchar( &buf, 10 );
-	col = 0;
-      }
-    }
-    
     /* Return the result */
+    res = end_and_resize_shared_string( res, dest - res->str );
     pop_n_elems( args );
-    push_string( finish_string_builder( &buf ) );
+    push_string( res );
+  }
+}
+
+/*! @class Base64Decoder
+ *!
+ *! Decodes @tt{base64@} data that arrives in pieces, e.g. a large
+ *! attachment read a block at a time, without keeping all of it in
+ *! memory. The result is the same as from @[decode_base64()] on all
+ *! the data at once.
+ *!
+ *! @seealso
+ *!   @[decode_base64()], @[Base64Encoder]
+ */
+
+#define THIS_B64D ((struct b64_decode_state *)(Pike_fp->current_storage))
+
+static void init_b64_decoder( struct object *o )
+{
+  THIS_B64D->d = 1;
+  THIS_B64D->pads = 0;
+}
+
+/*! @decl string feed(string data)
+ *!
+ *! Decodes @[data] and returns all complete bytes of the result so
+ *! far.
+ */
+static void f_b64_decoder_feed( INT32 args )
+{
+  struct pike_string *s, *res;
+  struct b64_decode_state st;
+
+  get_all_args( "feed", args, "%S", &s );
+  if (s->size_shift != 0)
+    Pike_error( "Char out of range for MIME.Base64Decoder()->feed()\n" );
+
+  /* Work on a copy of the state, since the lock may be released. */
+  st = *THIS_B64D;
+  res = b64_decode_string( s, &st, 0 );
+  *THIS_B64D = st;
+
+  pop_n_elems( args );
+  push_string( res );
+}
+
+/*! @decl string finish()
+ *!
+ *! Returns the last bytes of the result, if the data ended with
+ *! padding, and resets the decoder for new data.
+ */
+static void f_b64_decoder_finish( INT32 args )
+{
+  unsigned char tmp[3];
+  unsigned char *dest = b64_decode_end( tmp, THIS_B64D );
+
+  pop_n_elems( args );
+  push_string( make_shared_binary_string( (char *)tmp, dest - tmp ) );
+}
+
+/*! @endclass
+ */
+
+/*! @class Base64Encoder
+ *!
+ *! Encodes data that arrives in pieces with the @tt{base64@} transfer
+ *! encoding. The result is the same as from @[encode_base64()] on all
+ *! the data at once.
+ *!
+ *! @seealso
+ *!   @[encode_base64()], @[Base64Decoder]
+ */
+
+#define THIS_B64E ((struct b64_encode_state *)(Pike_fp->current_storage))
+
+static void init_b64_encoder( struct object *o )
+{
+  THIS_B64E->ncarry = 0;
+  THIS_B64E->g = 0;
+  THIS_B64E->insert_crlf = 1;
+}
+
+/*! @decl void create(void|int no_linebreaks)
+ *!
+ *! If a nonzero value is passed as @[no_linebreaks], the result will
+ *! not contain any linebreaks.
+ */
+static void f_b64_encoder_create( INT32 args )
+{
+  INT_TYPE no_linebreaks = 0;
+
+  get_all_args( "create", args, ".%i", &no_linebreaks );
+  THIS_B64E->insert_crlf = !no_linebreaks;
+  pop_n_elems( args );
+}
+
+/*! @decl string feed(string data)
+ *!
+ *! Encodes @[data] and returns the result for all complete 24 bit
+ *! groups so far.
+ */
+static void f_b64_encoder_feed( INT32 args )
+{
+  struct b64_encode_state *st = THIS_B64E;
+  struct pike_string *s, *res;
+  unsigned char *src;
+  ptrdiff_t len, groups;
+  char *dest;
+  int g;
+
+  get_all_args( "feed", args, "%S", &s );
+  if (s->size_shift != 0)
+    Pike_error( "Char out of range for MIME.Base64Encoder()->feed()\n" );
+
+  src = STR0(s);
+  len = s->len;
+  groups = (st->ncarry + len)/3;
+  g = st->g;
+
+  res = begin_shared_string( b64_encoded_size( groups, g, st->insert_crlf ) );
+  dest = res->str;
+
+  if (groups && st->ncarry) {
+    /* Complete the group left from the last call. */
+    unsigned char *carry = st->carry;
+    int n = 3 - st->ncarry;
+    MEMCPY( st->carry + st->ncarry, src, n );
+    do_b64_encode( 1, &carry, &dest, &g, st->insert_crlf );
+    src += n;
+    len -= n;
+    groups--;
+    st->ncarry = 0;
+  }
+
+  if (groups) {
+    int insert_crlf = st->insert_crlf;
+    if (groups*3 >= MIME_THREADS_THRESHOLD) {
+      THREADS_ALLOW();
+      do_b64_encode( groups, &src, &dest, &g, insert_crlf );
+      THREADS_DISALLOW();
+    } else
+      do_b64_encode( groups, &src, &dest, &g, insert_crlf );
+    len -= groups*3;
+  }
+
+  /* Keep the bytes of the incomplete group for the next call. */
+  MEMCPY( st->carry + st->ncarry, src, len );
+  st->ncarry += (int)len;
+  st->g = g;
+
+  pop_n_elems( args );
+  push_string( end_shared_string( res ) );
+}
+
+/*! @decl string finish()
+ *!
+ *! Returns the encoding of the last incomplete group, if any, and
+ *! resets the encoder for new data.
+ */
+static void f_b64_encoder_finish( INT32 args )
+{
+  struct b64_encode_state *st = THIS_B64E;
+  char tmp[6], *dest = tmp;
+
+  if (st->ncarry)
+    b64_encode_last( st->carry, st->ncarry, &dest, &st->g, st->insert_crlf );
+  st->ncarry = 0;
+  st->g = 0;
+
+  pop_n_elems( args );
+  push_string( make_shared_binary_string( tmp, dest - tmp ) );
+}
+
+/*! @endclass
+ */
+
+/*! @class QPDecoder
+ *!
+ *! Decodes @tt{quoted-printable@} data that arrives in pieces. The
+ *! result is the same as from @[decode_qp()] on all the data at once.
+ *!
+ *! @seealso
+ *!   @[decode_qp()]
+ */
+
+#define THIS_QPD ((struct qp_decode_state *)(Pike_fp->current_storage))
+
+static void init_qp_decoder( struct object *o )
+{
+  THIS_QPD->ncarry = 0;
+}
+
+/*! @decl string feed(string data)
+ *!
+ *! Decodes @[data] and returns the result so far. An escape sequence
+ *! at the end of @[data] that isn't complete is kept until the next
+ *! call.
+ */
+static void f_qp_decoder_feed( INT32 args )
+{
+  struct qp_decode_state *st = THIS_QPD;
+  struct pike_string *s, *res;
+  unsigned char *src, *dest;
+  ptrdiff_t len;
+
+  get_all_args( "feed", args, "%S", &s );
+  if (s->size_shift != 0)
+    Pike_error( "Char out of range for MIME.QPDecoder()->feed()\n" );
+
+  src = STR0(s);
+  len = s->len;
+  res = begin_shared_string( st->ncarry + len );
+  dest = STR0(res);
+
+  if (st->ncarry) {
+    /* Finish the escape left from the last call first. */
+    unsigned char tmp[5];
+    int n = st->ncarry + (int)MINIMUM(len, 2);
+    ptrdiff_t c;
+    MEMCPY( tmp, st->carry, st->ncarry );
+    MEMCPY( tmp + st->ncarry, src, n - st->ncarry );
+    c = do_qp_decode( tmp, n, &dest, 0 );
+    if (c < st->ncarry) {
+      /* Still not complete, so all of data is in tmp. */
+      MEMCPY( st->carry, tmp + c, n - c );
+      st->ncarry = (int)(n - c);
+      len = 0;
+    } else {
+      src += c - st->ncarry;
+      len -= c - st->ncarry;
+      st->ncarry = 0;
+    }
+  }
+
+  if (len) {
+    ptrdiff_t c;
+    if (len >= MIME_THREADS_THRESHOLD) {
+      THREADS_ALLOW();
+      c = do_qp_decode( src, len, &dest, 0 );
+      THREADS_DISALLOW();
+    } else
+      c = do_qp_decode( src, len, &dest, 0 );
+    MEMCPY( st->carry, src + c, len - c );
+    st->ncarry = (int)(len - c);
   }
+
+  res = end_and_resize_shared_string( res, dest - STR0(res) );
+  pop_n_elems( args );
+  push_string( res );
+}
+
+/*! @decl string finish()
+ *!
+ *! Returns the decoding of an incomplete escape at the end of the
+ *! data, if any, and resets the decoder for new data.
+ */
+static void f_qp_decoder_finish( INT32 args )
+{
+  struct qp_decode_state *st = THIS_QPD;
+  unsigned char tmp[3], *dest = tmp;
+
+  do_qp_decode( st->carry, st->ncarry, &dest, 1 );
+  st->ncarry = 0;
+
+  pop_n_elems( args );
+  push_string( make_shared_binary_string( (char *)tmp, dest - tmp ) );
 }
 
+/*! @endclass
+ */
+
 /* MIME.decode_uue() */
 
 /*! @decl string decode_uue(string encoded_data)
@@ -17,6 +17,7 @@
 #include "builtin_functions.h"
 #include "module_support.h"
 #include "operators.h"
+#include "threads.h"
 
 #include "math_module.h"
 
@@ -42,6 +43,96 @@ extern struct program *math_fmatrix_program;
 extern struct program *math_lmatrix_program;
 #endif /* INT64 */
 
+/* --- parallel rows ---------------------------------------------- */
+
+/* math_run_rows() calls fun for bands of the rows 0..rows-1, on up to
+ * math_threads threads of the th_parallel() pool. Work is the number
+ * of multiply-adds per row. Operations smaller than
+ * MATH_UNLOCK_MIN_WORK are done right away; larger ones run without
+ * the interpreter lock, so fun must not touch any Pike data. Each row
+ * is computed by one thread in the same order as by the plain loops,
+ * so the result does not depend on the number of threads.
+ */
+
+#define MATH_PAR_MAX_THREADS	32
+#define MATH_UNLOCK_MIN_WORK	65536.0
+#define MATH_PAR_MIN_WORK	1048576.0
+
+/* The kernels work on blocks of this many columns and rows, which
+ * stay in the cache while they are used.
+ */
+#define MATH_BLOCK_J	256
+#define MATH_BLOCK_K	64
+#define MATH_BLOCK_T	32
+
+int math_threads=1;
+
+#ifdef _REENTRANT
+struct math_rows_job
+{
+   void (*fun)(void *data,INT32 y0,INT32 y1);
+   void *data;
+   INT32 rows,band;
+};
+
+static void math_rows_band(void *data,int i)
+{
+   struct math_rows_job *job=(struct math_rows_job *)data;
+   INT32 y=i*job->band;
+   job->fun(job->data,y,MINIMUM(y+job->band,job->rows));
+}
+#endif
+
+static void math_run_rows(void (*fun)(void *data,INT32 y0,INT32 y1),
+			  void *data,INT32 rows,double work)
+{
+   if (rows<1) return;
+#ifdef _REENTRANT
+   if (rows*work>=MATH_UNLOCK_MIN_WORK)
+   {
+      int threads=MINIMUM(math_threads,MATH_PAR_MAX_THREADS);
+
+      THREADS_ALLOW();
+      if (threads>1 && rows>=2 && rows*work>=MATH_PAR_MIN_WORK)
+      {
+	 struct math_rows_job job;
+
+	 job.fun=fun;
+	 job.data=data;
+	 job.rows=rows;
+	 /* A few bands per thread evens out the load. */
+	 job.band=MAXIMUM(rows/(threads*4),1);
+	 th_parallel(math_rows_band,&job,(rows+job.band-1)/job.band,threads);
+      }
+      else
+	 fun(data,0,rows);
+      THREADS_DISALLOW();
+      return;
+   }
+#endif
+   fun(data,0,rows);
+}
+
+void math_set_threads(INT32 args)
+{
+   INT_TYPE threads;
+   int old=math_threads;
+
+   get_all_args("set_threads",args,"%i",&threads);
+   if (threads<1)
+      SIMPLE_BAD_ARG_ERROR("set_threads",1,"int(1..)");
+   math_threads=(int)MINIMUM(threads,MATH_PAR_MAX_THREADS);
+
+   pop_n_elems(args);
+   push_int(old);
+}
+
+void math_get_threads(INT32 args)
+{
+   pop_n_elems(args);
+   push_int(math_threads);
+}
+
 #define PNAME "Matrix"
 #define FTYPE double
 #define PTYPE tFloat
@@ -170,6 +261,11 @@ extern struct program *math_lmatrix_program;
  *! Returns the transpose of the matrix as a new object.
  */
 
+/*! @decl Matrix transpose_to(Matrix dest)
+ *! Stores the transpose of the matrix in @[dest], which must be a
+ *! matrix of the same type and the transposed size, and returns it.
+ */
+
 /*! @decl float norm()
  *! @decl float norm2()
  *! @decl Matrix normv()
@@ -214,7 +310,19 @@ extern struct program *math_lmatrix_program;
 /*! @decl Matrix `*(object with)
  *! @decl Matrix ``*(object with)
  *! @decl Matrix mult(object with)
- *!	Matrix multiplication.
+ *!	Matrix multiplication. The width of the matrix must be the
+ *!	height of @[with], and the result is as high as the matrix
+ *!	and as wide as @[with].
+ *!
+ *! @seealso
+ *!   @[Math.set_threads()]
+ */
+
+/*! @decl Matrix mult_to(object|int|float with, Matrix dest)
+ *!	Stores the product of the matrix and @[with] in @[dest] and
+ *!	returns it, instead of creating a new matrix. @[dest] must be
+ *!	a matrix of the same type and the size of the product, and
+ *!	can only be the matrix itself when @[with] is a number.
  */
 
 /*! @decl Matrix cross(object with)
@@ -230,6 +338,12 @@ extern struct program *math_lmatrix_program;
  *!	Convolve called matrix with the argument.
  */
 
+/*! @decl Matrix convolve_to(object with, Matrix dest)
+ *!	Stores the convolution of the matrix with @[with] in @[dest],
+ *!	which must be another matrix of the same type and the size of
+ *!	the result, and returns it.
+ */
+
 /*! @decl int xsize()
  *!     Returns the width of the matrix.
  */
@@ -61,6 +61,20 @@ static const struct math_class
  *! Floating point not-a-number (e.g. inf/inf).
  */
 
+/*! @decl int set_threads(int threads)
+ *! Sets the number of threads that large matrix multiplications,
+ *! convolutions and transpositions are split over. They are run
+ *! without the interpreter lock whatever the number of threads, and
+ *! the result does not depend on it. The default is 1.
+ *!
+ *! @returns
+ *!   Returns the previous number of threads.
+ */
+
+/*! @decl int get_threads()
+ *! Returns the number of threads set with @[set_threads()].
+ */
+
 /*! @endmodule */
 
 PIKE_MODULE_EXIT
@@ -99,4 +113,7 @@ PIKE_MODULE_INIT
    add_float_constant("e", 2.7182818284590452354   ,0);
    add_float_constant("inf", MAKE_INF(1), 0);
    add_float_constant("nan", MAKE_NAN(), 0);
+
+   ADD_FUNCTION("set_threads",math_set_threads,tFunc(tInt1Plus,tInt),0);
+   ADD_FUNCTION("get_threads",math_get_threads,tFunc(tNone,tInt),0);
 }
@@ -19,5 +19,7 @@ extern void exit_math_lmatrix(void);
 #endif /* INT64 */
 extern void exit_math_imatrix(void);
 extern void exit_math_smatrix(void);
+extern void math_set_threads(INT32 args);
+extern void math_get_threads(INT32 args);
 extern void init_math_transforms(void);
 extern void exit_math_transforms(void);
@@ -406,28 +406,98 @@ static INLINE struct matrixX(_storage)
 /* --- real math stuff --------------------------------------------- */
 
 
-static void matrixX(_transpose)(INT32 args)
+/* Returns the storage of argument arg, which must be a matrix of
+ * this type.
+ */
+static struct matrixX(_storage) *matrixX(_get_arg_)(char *func,
+						     INT32 args,int arg)
 {
    struct matrixX(_storage) *mx;
-   int x,y,xs,ys;
+
+   if (Pike_sp[arg-1-args].type!=T_OBJECT ||
+       !((mx=(struct matrixX(_storage)*)
+	  get_storage(Pike_sp[arg-1-args].u.object,
+		      XmatrixY(math_,_program)))))
+      SIMPLE_BAD_ARG_ERROR(func,arg,"object(Math." PNAME ")");
+   return mx;
+}
+
+static void matrixX(_check_dest_)(char *func,INT32 args,
+				  struct matrixX(_storage) *dmx,
+				  int xsize,int ysize)
+{
+   if (dmx->xsize!=xsize || dmx->ysize!=ysize)
+      math_error(func,Pike_sp-args,args,0,
+		 "Destination matrix has the wrong size.\n");
+}
+
+struct matrixX(_transpose_job)
+{
    FTYPE *s,*d;
+   int xs,ys;			/* Of s. */
+};
+
+/* Rows y0..y1-1 of d, in tiles that fit in the cache. */
+static void matrixX(_transpose_rows)(void *data,INT32 y0,INT32 y1)
+{
+   struct matrixX(_transpose_job) *job=data;
+   int xs=job->xs,ys=job->ys;
+   INT32 i0;
+   int x0;
+
+   for (i0=y0; i0<y1; i0+=MATH_BLOCK_T)
+      for (x0=0; x0<ys; x0+=MATH_BLOCK_T)
+      {
+	 INT32 i,i1=MINIMUM(i0+MATH_BLOCK_T,y1);
+	 int x,x1=MINIMUM(x0+MATH_BLOCK_T,ys);
+
+	 for (i=i0; i<i1; i++)
+	 {
+	    FTYPE *d=job->d+(size_t)i*ys;
+	    FTYPE *s=job->s+i;
+	    for (x=x0; x<x1; x++)
+	       d[x]=s[(size_t)x*xs];
+	 }
+      }
+}
+
+static void matrixX(_low_transpose)(struct matrixX(_storage) *mx,
+				    struct matrixX(_storage) *dmx)
+{
+   struct matrixX(_transpose_job) job;
+
+   job.s=mx->m;
+   job.d=dmx->m;
+   job.xs=mx->xsize;
+   job.ys=mx->ysize;
+   math_run_rows(matrixX(_transpose_rows),&job,mx->xsize,
+		 (double)mx->ysize);
+}
+
+static void matrixX(_transpose)(INT32 args)
+{
+   struct matrixX(_storage) *mx;
 
    pop_n_elems(args);
    mx=matrixX(_push_new_)(THIS->ysize,THIS->xsize);
+   matrixX(_low_transpose)(THIS,mx);
+}
 
-   ys=THIS->ysize;
-   xs=THIS->xsize;
-   s=THIS->m;
-   d=mx->m;
+static void matrixX(_transpose_to)(INT32 args)
+{
+   struct matrixX(_storage) *dmx;
 
-   y=xs;
-   while (y--)
-   {
-      x=ys;
-      while (x--)
-	 *(d++)=*s,s+=xs;
-      s-=xs*ys-1;
-   }
+   if (args<1)
+      SIMPLE_TOO_FEW_ARGS_ERROR("transpose_to",1);
+   pop_n_elems(args-1);
+   args=1;
+
+   dmx=matrixX(_get_arg_)("transpose_to",args,1);
+   matrixX(_check_dest_)("transpose_to",args,dmx,THIS->ysize,THIS->xsize);
+   if (dmx==THIS)
+      math_error("transpose_to",Pike_sp-args,args,0,
+		 "Destination must not be the source.\n");
+   matrixX(_low_transpose)(THIS,dmx);
 }
 
 
@@ -643,12 +713,104 @@ static void matrixX(_min)(INT32 args)
 
 
 
+struct matrixX(_mult_job)
+{
+   FTYPE *a,*b,*d;
+   int n,p;			/* a is rows*n, b is n*p. */
+};
+
+/* Rows y0..y1-1 of d=a*b, which must be zero on entry. Four rows of d
+ * are done at a time over a block of b, so that each element of b is
+ * loaded once for all of them. Every element still sums its terms in
+ * order, so the result is the same as with a single dot product.
+ */
+static void matrixX(_mult_rows)(void *data,INT32 y0,INT32 y1)
+{
+   struct matrixX(_mult_job) *job=data;
+   int n=job->n,p=job->p;
+   int k0,j0;
+
+   for (k0=0; k0<n; k0+=MATH_BLOCK_K)
+   {
+      int k1=MINIMUM(k0+MATH_BLOCK_K,n);
+
+      for (j0=0; j0<p; j0+=MATH_BLOCK_J)
+      {
+	 int j1=MINIMUM(j0+MATH_BLOCK_J,p);
+	 INT32 i=y0;
+	 int j,k;
+
+	 for (; i+4<=y1; i+=4)
+	 {
+	    FTYPE *a0=job->a+(size_t)i*n,*a1=a0+n,*a2=a1+n,*a3=a2+n;
+	    FTYPE *d0=job->d+(size_t)i*p,*d1=d0+p,*d2=d1+p,*d3=d2+p;
+
+	    for (k=k0; k<k1; k++)
+	    {
+	       FTYPE x0=a0[k],x1=a1[k],x2=a2[k],x3=a3[k];
+	       FTYPE *bk=job->b+(size_t)k*p;
+
+	       for (j=j0; j<j1; j++)
+	       {
+		  FTYPE y=bk[j];
+		  d0[j]+=x0*y;
+		  d1[j]+=x1*y;
+		  d2[j]+=x2*y;
+		  d3[j]+=x3*y;
+	       }
+	    }
+	 }
+
+	 for (; i<y1; i++)
+	 {
+	    FTYPE *ai=job->a+(size_t)i*n;
+	    FTYPE *di=job->d+(size_t)i*p;
+
+	    for (k=k0; k<k1; k++)
+	    {
+	       FTYPE x=ai[k];
+	       FTYPE *bk=job->b+(size_t)k*p;
+
+	       for (j=j0; j<j1; j++)
+		  di[j]+=x*bk[j];
+	    }
+	 }
+      }
+   }
+}
+
+/* dmx=amx*bmx. dmx must not be one of the others. */
+static void matrixX(_low_mult)(struct matrixX(_storage) *amx,
+			       struct matrixX(_storage) *bmx,
+			       struct matrixX(_storage) *dmx)
+{
+   struct matrixX(_mult_job) job;
+
+   MEMSET(dmx->m,0,sizeof(FTYPE)*dmx->xsize*dmx->ysize);
+   job.a=amx->m;
+   job.b=bmx->m;
+   job.d=dmx->m;
+   job.n=amx->xsize;
+   job.p=bmx->xsize;
+   math_run_rows(matrixX(_mult_rows),&job,amx->ysize,
+		 (double)amx->xsize*bmx->xsize);
+}
+
+static void matrixX(_scale)(struct matrixX(_storage) *mx,FTYPE z,
+			    struct matrixX(_storage) *dmx)
+{
+   FTYPE *s=mx->m,*d=dmx->m;
+   int n=mx->xsize*mx->ysize;
+
+   while (n--)
+      *(d++)=*(s++)*z;
+}
+
 static void matrixX(_mult)(INT32 args)
 {
    struct matrixX(_storage) *mx=NULL;
    struct matrixX(_storage) *dmx;
-   int n,i,j,k,m,p;
-   FTYPE *s1,*s2,*d,*st;
+   int i;
    FTYPE z;
 
    if (args<1)
@@ -677,45 +839,58 @@ static void matrixX(_mult)(INT32 args)
 scalar_mult:
 
       dmx=matrixX(_push_new_)(THIS->xsize,THIS->ysize);
-      
-      s1=THIS->m;
-      d=dmx->m;
-      n=THIS->xsize*THIS->ysize;
-      while (n--)
-	 *(d++)=*(s1++)*z;
+      matrixX(_scale)(THIS,z,dmx);
 
       stack_swap();
       pop_stack();
       return;
    }
-	 
-   if (Pike_sp[-1].type!=T_OBJECT ||
-       !((mx=(struct matrixX(_storage)*)
-	  get_storage(Pike_sp[-1].u.object,XmatrixY(math_,_program)))))
-      SIMPLE_BAD_ARG_ERROR("`*",1,"object(Math.Matrix)");
 
-   if (mx->xsize != THIS->ysize)
+   mx=matrixX(_get_arg_)("`*",args,1);
+
+   if (mx->ysize != THIS->xsize)
       math_error("`*",Pike_sp-args,args,0,
 		 "Incompatible matrices.\n");
 
-   m=THIS->xsize;
-   n=THIS->ysize; /* == mx->xsize */
-   p=mx->ysize;
+   dmx=matrixX(_push_new_)(mx->xsize,THIS->ysize);
+   matrixX(_low_mult)(THIS,mx,dmx);
 
-   dmx=matrixX(_push_new_)(p,m);
+   stack_swap();
+   pop_stack();
+}
 
-   s1=mx->m;
-   s2=THIS->m;
-   d=dmx->m;
-   for (k=0; k<p; k++)
-      for (i=0; i<m; i++)
-      {
-	 z=(FTYPE)0;
-	 st=s2+k*n;
-	 for (j=i; j<i+m*n; j+=m)
-	    z += s1[ j ] * *(st++);
-	 *(d++)=z;
-      }
+static void matrixX(_mult_to)(INT32 args)
+{
+   struct matrixX(_storage) *mx;
+   struct matrixX(_storage) *dmx;
+
+   if (args<2)
+      SIMPLE_TOO_FEW_ARGS_ERROR("mult_to",2);
+   pop_n_elems(args-2);
+   args=2;
+
+   dmx=matrixX(_get_arg_)("mult_to",args,2);
+
+   if (Pike_sp[-2].type==T_INT || Pike_sp[-2].type==T_FLOAT)
+   {
+      FTYPE z=(Pike_sp[-2].type==T_INT?
+	       (FTYPE)Pike_sp[-2].u.integer:
+	       (FTYPE)Pike_sp[-2].u.float_number);
+      matrixX(_check_dest_)("mult_to",args,dmx,THIS->xsize,THIS->ysize);
+      matrixX(_scale)(THIS,z,dmx);
+   }
+   else
+   {
+      mx=matrixX(_get_arg_)("mult_to",args,1);
+      if (mx->ysize != THIS->xsize)
+	 math_error("mult_to",Pike_sp-args,args,0,
+		    "Incompatible matrices.\n");
+      matrixX(_check_dest_)("mult_to",args,dmx,mx->xsize,THIS->ysize);
+      if (dmx==THIS || dmx==mx)
+	 math_error("mult_to",Pike_sp-args,args,0,
+		    "Destination must not be one of the factors.\n");
+      matrixX(_low_mult)(THIS,mx,dmx);
+   }
 
    stack_swap();
    pop_stack();
@@ -793,166 +968,117 @@ static void matrixX(_dot)(INT32 args)
   pop_stack();
 }
 
+struct matrixX(_convolve_job)
+{
+   FTYPE *a,*b,*d;
+   INT32 axz,ayz,bxz,byz;
+};
+
+/* Rows y0..y1-1 of the convolution d of a with b, which must be zero
+ * on entry. Instead of a dot product per element, each element of b
+ * is multiplied with a whole row of a and added to a row of d, which
+ * needs no bounds checks in the inner loop. The terms of every
+ * element are still added in the same order as a dot product over b
+ * backwards would.
+ */
+static void matrixX(_convolve_rows)(void *data,INT32 y0,INT32 y1)
+{
+   struct matrixX(_convolve_job) *job=data;
+   INT32 axz=job->axz,ayz=job->ayz,bxz=job->bxz,byz=job->byz;
+   INT32 dxz=axz+bxz-1;
+   INT32 y;
+
+   for (y=y0; y<y1; y++)
+   {
+      FTYPE *d=job->d+(size_t)y*dxz;
+      INT32 ay=y-byz+1;		/* The row of a under the first row of b. */
+      INT32 by=MAXIMUM(0,-ay);
+      INT32 by1=MINIMUM(byz,ayz-ay);
+
+      for (; by<by1; by++)
+      {
+	 FTYPE *a=job->a+(size_t)(ay+by)*axz;
+	 FTYPE *b=job->b+(size_t)(byz-by)*bxz-1;
+	 INT32 bx;
+
+	 for (bx=0; bx<bxz; bx++)
+	 {
+	    FTYPE z=*(b--);
+	    FTYPE *dd=d+bxz-1-bx;
+	    INT32 x;
+
+	    for (x=0; x<axz; x++)
+	       dd[x]+=z*a[x];
+	 }
+      }
+   }
+}
+
+static void matrixX(_low_convolve)(struct matrixX(_storage) *amx,
+				   struct matrixX(_storage) *bmx,
+				   struct matrixX(_storage) *dmx)
+{
+   struct matrixX(_convolve_job) job;
+
+   MEMSET(dmx->m,0,sizeof(FTYPE)*dmx->xsize*dmx->ysize);
+   job.a=amx->m;
+   job.b=bmx->m;
+   job.d=dmx->m;
+   job.axz=amx->xsize;
+   job.ayz=amx->ysize;
+   job.bxz=bmx->xsize;
+   job.byz=bmx->ysize;
+   math_run_rows(matrixX(_convolve_rows),&job,dmx->ysize,
+		 (double)amx->xsize*bmx->xsize*MINIMUM(amx->ysize,bmx->ysize));
+}
+
 static void matrixX(_convolve)(INT32 args)
 {
-   struct matrixX(_storage) *mx=NULL;
-   struct matrixX(_storage) *dmx,*amx,*bmx;
-   INT32 ax,ay;
-   INT32 axb,ayb;
-   INT32 dxz,dyz,axz,ayz,bxz,byz;
-   FTYPE *bs,*as,*d;
+   struct matrixX(_storage) *dmx,*bmx;
 
    if (args<1)
       SIMPLE_TOO_FEW_ARGS_ERROR("convolve",1);
 
-   if (Pike_sp[-args].type!=T_OBJECT ||
-       !((bmx=(struct matrixX(_storage)*)
-	  get_storage(Pike_sp[-args].u.object,XmatrixY(math_,_program)))))
-      SIMPLE_BAD_ARG_ERROR("convolve",1,"object(Math.Matrix)");
+   bmx=matrixX(_get_arg_)("convolve",args,1);
 
    if (bmx->xsize==0 || bmx->ysize==0 ||
        THIS->xsize==0 || THIS->ysize==0)
       math_error("convolve",Pike_sp-args,args,0,
 		 "Source or argument matrix too small (zero size).\n");
 
-   bxz=bmx->xsize;
-   byz=bmx->ysize;
-
-   amx=THIS; /* matrix a */
-   axz=amx->xsize;
-   ayz=amx->ysize;
-
-   dxz=axz+bxz-1;
-   dyz=ayz+byz-1;
-
-   dmx=matrixX(_push_new_)(dxz,dyz);
-   d=dmx->m; /* destination pointer */
-
-/* matrix a source pointer: forwards */
-   as=amx->m-axz*(byz-1)-(bxz-1);
-/* matrix b source pointer: backwards */
-   bs=bmx->m+bxz*byz-1; 
-
-/*
+   dmx=matrixX(_push_new_)(THIS->xsize+bmx->xsize-1,
+			   THIS->ysize+bmx->ysize-1);
+   matrixX(_low_convolve)(THIS,bmx,dmx);
 
-   bbb         d.....
-   bb#aaa   -> ......  ax=-bxz+1
-     aaaa      ......  ay=-byz+1
-
-    bbb        :d....  
-    b##aa   -> ......  ax=-axz+1 +1
-     aaaa      ......  
-
-     bbb       :d....  
-     ###a   -> ......  ax=0
-     aaaa      ......  
-
-      bbb      :::d..
-     a###  ->  ......  ax=axz-bxz
-     aaaa      ......  
-...
-        bbb    :::::d  ax=axz-1
-     aaa#bb -> ......
-     aaaa      ......
-...
-     aaaa      ::::::
-     aaa#bb -> ::::::  ax=axz-1
-        bbb    :::::d  ay=ayz-1
+   stack_pop_n_elems_keep_top(args);
+}
 
-*/
+static void matrixX(_convolve_to)(INT32 args)
+{
+   struct matrixX(_storage) *dmx,*bmx;
 
-#define DO_SOME_CONVOLVING(CHECK_X,CHECK_Y)				\
-	 do								\
-	 {								\
-	    FTYPE *a=as;						\
-	    FTYPE *b=bs;						\
-	    FTYPE sum = (FTYPE)0.0;					\
-	    INT32 yn=byz;						\
-	    INT32 y=ay;							\
-            INT32 x=0;							\
-									\
-	    while (yn--)						\
-	    {								\
-	       if (!(CHECK_Y && (y<0 || y>=ayz)))			\
-	       {							\
-		  INT32 xn=bxz;						\
-		  if (CHECK_X) x=ax;					\
-									\
-		  while (xn--)						\
-		  {							\
-		     if (!(CHECK_X && (x<0 || x>=axz)))			\
-		     {							\
-/*  			fprintf(stderr, */				\
-/*  				"a=%d,%d[%d]:%g b=[%d]:%g a*b=%g\n", */	\
-/*  				x,y,(a-amx->m),*a, */			\
-/*  				(b-bmx->m),*b, */			\
-/*  				*a**b); */				\
-			sum+=*a**b;					\
-		     }							\
-/*  		     else */						\
-/*  			fprintf(stderr, */				\
-/*  				"a=%d,%d[%d]:outside b=[%d]:%g\n", */	\
-/*  				x,y,(a-amx->m), */			\
-/*  				(b-bmx->m),*b); */			\
-		     b--;						\
-		     a++;						\
-		     if (CHECK_X) x++;					\
-		  }							\
-		  a+=axz-bxz; /* skip to next line */			\
-	       }							\
-	       else							\
-	       {							\
-/*  		  fprintf(stderr,"skip y=%d\n",y); */			\
-		  a+=axz;						\
-		  b-=bxz;						\
-	       }							\
-	       if (CHECK_Y) y++;					\
-	    }								\
-/*  	    fprintf(stderr,"=== a=%d,%d:%g\n", */			\
-/*  		    ax,ay,sum); */					\
-									\
-	    *(d++)=sum;							\
-            as++;							\
-	 }								\
-	 while(0)
-
-   ayb=ayz-byz+1; /* 0,0-axb,ayb         */
-   axb=axz-bxz+1; /* doesn't need checks */
-
-   for (ay=-byz+1; ay<0; ay++) 
-   {
-      for (ax=-bxz+1; ax<0; ax++)
-	 DO_SOME_CONVOLVING(1,1);
-      for (; ax<axb; ax++)
-	 DO_SOME_CONVOLVING(0,1);
-      for (; ax<axz; ax++)
-	 DO_SOME_CONVOLVING(1,1);
-      as-=bxz-1;
-   }
+   if (args<2)
+      SIMPLE_TOO_FEW_ARGS_ERROR("convolve_to",2);
+   pop_n_elems(args-2);
+   args=2;
 
-   for (; ay<ayb; ay++) 
-   {
-      for (ax=-bxz+1; ax<0; ax++)
-	 DO_SOME_CONVOLVING(1,0);
-      for (; ax<axb; ax++)
-	 DO_SOME_CONVOLVING(0,0);
-      for (; ax<axz; ax++)
-	 DO_SOME_CONVOLVING(1,0);
-      as-=bxz-1;
-   }
+   bmx=matrixX(_get_arg_)("convolve_to",args,1);
+   dmx=matrixX(_get_arg_)("convolve_to",args,2);
 
-   for (; ay<ayz; ay++) 
-   {
-      for (ax=-bxz+1; ax<0; ax++)
-	 DO_SOME_CONVOLVING(1,1);
-      for (; ax<axb; ax++)
-	 DO_SOME_CONVOLVING(0,1);
-      for (; ax<axz; ax++)
-	 DO_SOME_CONVOLVING(1,1);
-      as-=bxz-1;
-   }
+   if (bmx->xsize==0 || bmx->ysize==0 ||
+       THIS->xsize==0 || THIS->ysize==0)
+      math_error("convolve_to",Pike_sp-args,args,0,
+		 "Source or argument matrix too small (zero size).\n");
+   matrixX(_check_dest_)("convolve_to",args,dmx,
+			 THIS->xsize+bmx->xsize-1,
+			 THIS->ysize+bmx->ysize-1);
+   if (dmx==THIS || dmx==bmx)
+      math_error("convolve_to",Pike_sp-args,args,0,
+		 "Destination must not be one of the sources.\n");
+   matrixX(_low_convolve)(THIS,bmx,dmx);
 
-   stack_pop_n_elems_keep_top(args);
+   stack_swap();
+   pop_stack();
 }
 
 
@@ -1001,6 +1127,7 @@ void Xmatrix(init_math_)(void)
 
    ADD_FUNCTION("transpose",matrixX(_transpose), tFunc(tNone, tObj), 0);
    ADD_FUNCTION("t",matrixX(_transpose), tFunc(tNone, tObj), 0);
+   ADD_FUNCTION("transpose_to",matrixX(_transpose_to), tFunc(tObj, tObj), 0);
 
    ADD_FUNCTION("norm",matrixX(_norm), tFunc(tNone, tFloat), 0);
    ADD_FUNCTION("norm2",matrixX(_norm2), tFunc(tNone, tFloat), 0);
@@ -1021,6 +1148,8 @@ void Xmatrix(init_math_)(void)
 		tFunc(tOr3(tObj,tFloat,tInt), tObj), 0);
    ADD_FUNCTION("``*",matrixX(_mult),
 		tFunc(tOr3(tObj,tFloat,tInt), tObj), 0);
+   ADD_FUNCTION("mult_to",matrixX(_mult_to),
+		tFunc(tOr3(tObj,tFloat,tInt) tObj, tObj), 0);
 
    ADD_FUNCTION("`",matrixX(_dot),
 		tFunc(tOr3(tObj,tFloat,tInt), tObj), 0);
@@ -1030,6 +1159,8 @@ void Xmatrix(init_math_)(void)
    ADD_FUNCTION("dot_product",matrixX(_dot), tFunc(tObj, tObj), 0);
 
    ADD_FUNCTION("convolve",matrixX(_convolve), tFunc(tObj, tObj), 0);
+   ADD_FUNCTION("convolve_to",matrixX(_convolve_to),
+		tFunc(tObj tObj, tObj), 0);
    
    ADD_FUNCTION("cross",matrixX(_cross), tFunc(tObj, tObj), 0);
    ADD_FUNCTION("`",matrixX(_cross), tFunc(tObj, tObj), 0);
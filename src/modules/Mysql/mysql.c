@@ -78,6 +78,7 @@
 #include "mapping.h"
 #include "bignum.h"
 #include "module_support.h"
+#include "array.h"
 
 /* System includes */
 #ifdef HAVE_STRING_H
@@ -186,6 +187,52 @@ static MUTEX_T stupid_port_lock;
  * State maintenance
  */
 
+#ifdef HAVE_MYSQL_STMT_INIT
+/* Close the statements left by stmt_query_abort(). */
+static void close_dead_stmts(void)
+{
+  struct precompiled_mysql *conn = PIKE_MYSQL;
+  MYSQL_STMT *dead[PIKE_MYSQL_STMT_CACHE_SIZE];
+  int i, n = conn->num_stmt_dead;
+
+  if (!n) return;
+  /* More may be added while the lock is released. */
+  MEMCPY(dead, conn->stmt_dead, n * sizeof(MYSQL_STMT *));
+  conn->num_stmt_dead = 0;
+
+  MYSQL_ALLOW();
+  for (i = 0; i < n; i++)
+    mysql_stmt_close(dead[i]);
+  MYSQL_DISALLOW();
+}
+
+/* Close all cached prepared statements. */
+static void free_stmt_cache(void)
+{
+  struct pike_mysql_stmt *cache = PIKE_MYSQL->stmt_cache;
+  int i;
+
+  close_dead_stmts();
+
+  MYSQL_ALLOW();
+  for (i = 0; i < PIKE_MYSQL_STMT_CACHE_SIZE; i++) {
+    if (cache[i].stmt) {
+      mysql_stmt_close(cache[i].stmt);
+      cache[i].stmt = NULL;
+    }
+  }
+  MYSQL_DISALLOW();
+
+  for (i = 0; i < PIKE_MYSQL_STMT_CACHE_SIZE; i++) {
+    if (cache[i].query) {
+      free_string(cache[i].query);
+      cache[i].query = NULL;
+    }
+    cache[i].last_used = 0;
+  }
+}
+#endif /* HAVE_MYSQL_STMT_INIT */
+
 static void init_mysql_struct(struct object *o)
 {
   MEMSET(PIKE_MYSQL, 0, sizeof(struct precompiled_mysql));
@@ -226,6 +273,10 @@ static void exit_mysql_struct(struct object *o)
     PIKE_MYSQL->conn_charset = NULL;
   }
 
+#ifdef HAVE_MYSQL_STMT_INIT
+  free_stmt_cache();
+#endif /* HAVE_MYSQL_STMT_INIT */
+
   MYSQL_ALLOW();
 
   if (mysql) {
@@ -1116,6 +1167,7 @@ static void low_query(INT32 args, char *name, int flags)
       Pike_error("%s(): Bad mysql result object!\n", name);
     }
     res->result = result;
+    res->unbuffered = !(flags & PIKE_MYSQL_FLAG_STORE_RESULT);
   }
 }
 
@@ -1140,6 +1192,482 @@ static void f_streaming_typed_query(INT32 args)
   low_query(args, "streaming_typed_query", PIKE_MYSQL_FLAG_TYPED_RESULT);
 }
 
+#ifdef HAVE_MYSQL_STMT_INIT
+
+/* Prepared statements.
+ *
+ * Statements are checked out of the per connection cache while they
+ * are in use, so concurrent users of the same query string simply
+ * get separate statements. The cache is keyed on the shared string,
+ * so identical query strings map to the same entry.
+ */
+
+/* Initial buffer size for string valued result columns. */
+#define PIKE_MYSQL_STMT_STRBUF	256
+
+struct stmt_column {
+  union {
+    LONGEST i;
+    double f;
+  } val;
+  unsigned long length;
+  my_bool is_null;
+  my_bool error;
+  char *buf;
+  unsigned long buf_size;
+};
+
+struct stmt_query {
+  struct precompiled_mysql *conn;
+  struct pike_string *query;
+  MYSQL_STMT *stmt;
+  MYSQL_RES *meta;
+  MYSQL_FIELD *fields;		/* Result columns, from meta. */
+  MYSQL_BIND *binds;		/* Parameters followed by result columns. */
+  struct stmt_column *cols;	/* Ditto. */
+  int nparams;
+  int ncols;
+  int cached;			/* Statement came from the cache. */
+};
+
+static void stmt_query_free_buffers(struct stmt_query *q)
+{
+  int i;
+  if (q->cols) {
+    for (i = 0; i < q->nparams + q->ncols; i++) {
+      if (q->cols[i].buf) free(q->cols[i].buf);
+    }
+    free(q->cols);
+    q->cols = NULL;
+  }
+  if (q->binds) {
+    free(q->binds);
+    q->binds = NULL;
+  }
+  if (q->meta) {
+    mysql_free_result(q->meta);
+    q->meta = NULL;
+  }
+}
+
+/* Error cleanup: the statement is in an unknown state, so drop it.
+ * This runs while unwinding, where the interpreter lock must not be
+ * released, so the statement is normally left for close_dead_stmts().
+ */
+static void stmt_query_abort(struct stmt_query *q)
+{
+  struct precompiled_mysql *conn = q->conn;
+  MYSQL_STMT *stmt = q->stmt;
+
+  stmt_query_free_buffers(q);
+  if (stmt) {
+    q->stmt = NULL;
+    if (conn->num_stmt_dead < PIKE_MYSQL_STMT_CACHE_SIZE) {
+      conn->stmt_dead[conn->num_stmt_dead++] = stmt;
+      return;
+    }
+    /* Too many already. Close it while keeping the interpreter lock.
+     * That is safe since the connection lock is never held while
+     * waiting for the interpreter lock.
+     */
+#ifdef _REENTRANT
+    mt_lock(&conn->lock);
+    mysql_stmt_close(stmt);
+    mt_unlock(&conn->lock);
+#else
+    mysql_stmt_close(stmt);
+#endif
+  }
+}
+
+/* Take the statement for q->query out of the cache, or prepare a
+ * new one if there is none.
+ */
+static void stmt_checkout(struct stmt_query *q, char *name)
+{
+  struct precompiled_mysql *conn = PIKE_MYSQL;
+  MYSQL *mysql = conn->mysql;
+  MYSQL_STMT *stmt = NULL;
+  char errbuf[256];
+  unsigned long thread_id;
+  int i;
+
+  close_dead_stmts();
+
+  /* Statements don't survive a reconnect. */
+  thread_id = mysql_thread_id(mysql);
+  if (thread_id != conn->stmt_thread_id) {
+    free_stmt_cache();
+    conn->stmt_thread_id = thread_id;
+  }
+
+  for (i = 0; i < PIKE_MYSQL_STMT_CACHE_SIZE; i++) {
+    struct pike_mysql_stmt *e = conn->stmt_cache + i;
+    if (e->query == q->query && e->stmt) {
+      q->stmt = e->stmt;
+      q->cached = 1;
+      e->stmt = NULL;
+      free_string(e->query);
+      e->query = NULL;
+      e->last_used = 0;
+      return;
+    }
+  }
+
+  errbuf[0] = 0;
+  MYSQL_ALLOW();
+  if ((stmt = mysql_stmt_init(mysql))) {
+    if (mysql_stmt_prepare(stmt, q->query->str, q->query->len)) {
+      strncpy(errbuf, mysql_stmt_error(stmt), sizeof(errbuf) - 1);
+      errbuf[sizeof(errbuf) - 1] = 0;
+      mysql_stmt_close(stmt);
+      stmt = NULL;
+    }
+  } else {
+    strncpy(errbuf, mysql_error(mysql), sizeof(errbuf) - 1);
+    errbuf[sizeof(errbuf) - 1] = 0;
+  }
+  MYSQL_DISALLOW();
+
+  if (!stmt) {
+    if (q->query->len <= 512) {
+      Pike_error("%s(): Couldn't prepare query \"%s\" (%s)\n",
+		 name, q->query->str, errbuf);
+    }
+    Pike_error("%s(): Couldn't prepare query (%s)\n", name, errbuf);
+  }
+  q->stmt = stmt;
+  q->cached = 0;
+}
+
+/* Return a statement to the cache, evicting the least recently used
+ * entry if it is full.
+ */
+static void stmt_checkin(struct stmt_query *q)
+{
+  struct precompiled_mysql *conn = PIKE_MYSQL;
+  struct pike_mysql_stmt *victim = conn->stmt_cache;
+  MYSQL_STMT *old = NULL;
+  int i;
+
+  for (i = 0; i < PIKE_MYSQL_STMT_CACHE_SIZE; i++) {
+    struct pike_mysql_stmt *e = conn->stmt_cache + i;
+    if (e->query == q->query) {
+      /* Someone else returned the same query while we were busy. */
+      old = q->stmt;
+      victim = NULL;
+      break;
+    }
+    if (e->last_used < victim->last_used) victim = e;
+  }
+
+  if (victim) {
+    old = victim->stmt;
+    if (victim->query) free_string(victim->query);
+    add_ref(victim->query = q->query);
+    victim->stmt = q->stmt;
+    victim->last_used = ++conn->stmt_clock;
+  }
+  q->stmt = NULL;
+
+  if (old) {
+    MYSQL_ALLOW();
+    mysql_stmt_close(old);
+    MYSQL_DISALLOW();
+  }
+}
+
+/* Bind the arguments after the query, the last args - 1 values on the
+ * stack, as statement parameters. */
+static void stmt_bind_params(struct stmt_query *q, INT32 args, char *name)
+{
+  int i;
+
+  for (i = 0; i < q->nparams; i++) {
+    MYSQL_BIND *b = q->binds + i;
+    struct stmt_column *c = q->cols + i;
+    struct svalue *a = Pike_sp + 1 - args + i;
+
+    c->is_null = 0;
+    b->is_null = &c->is_null;
+    switch (a->type) {
+    case T_INT:
+      if (IS_UNDEFINED(a)) {
+	b->buffer_type = MYSQL_TYPE_NULL;
+	c->is_null = 1;
+	break;
+      }
+      c->val.i = a->u.integer;
+      b->buffer_type = MYSQL_TYPE_LONGLONG;
+      b->buffer = &c->val.i;
+      break;
+    case T_FLOAT:
+      c->val.f = a->u.float_number;
+      b->buffer_type = MYSQL_TYPE_DOUBLE;
+      b->buffer = &c->val.f;
+      break;
+    case T_STRING:
+      if (a->u.string->size_shift)
+	SIMPLE_BAD_ARG_ERROR(name, i + 2, "string (8bit)");
+      c->length = a->u.string->len;
+      b->buffer_type = MYSQL_TYPE_STRING;
+      b->buffer = a->u.string->str;
+      b->buffer_length = c->length;
+      b->length = &c->length;
+      break;
+    case T_OBJECT:
+      {
+	struct object *null = get_val_null();
+	int is_null = (a->u.object == null);
+	free_object(null);
+	if (is_null) {
+	  b->buffer_type = MYSQL_TYPE_NULL;
+	  c->is_null = 1;
+	  break;
+	}
+      }
+      /* FALL_THROUGH */
+    default:
+      SIMPLE_BAD_ARG_ERROR(name, i + 2, "int|float|string|Val.null");
+    }
+  }
+
+  if (q->nparams && mysql_stmt_bind_param(q->stmt, q->binds))
+    Pike_error("%s(): Couldn't bind parameters (%s)\n",
+	       name, mysql_stmt_error(q->stmt));
+}
+
+/* Set up result buffers from the result set metadata. */
+static void stmt_bind_results(struct stmt_query *q, char *name)
+{
+  MYSQL_FIELD *fields = q->fields = mysql_fetch_fields(q->meta);
+  int i;
+
+  for (i = 0; i < q->ncols; i++) {
+    MYSQL_BIND *b = q->binds + q->nparams + i;
+    struct stmt_column *c = q->cols + q->nparams + i;
+
+    b->is_null = &c->is_null;
+    b->length = &c->length;
+    b->error = &c->error;
+    switch (fields[i].type) {
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_LONGLONG:
+      b->buffer_type = MYSQL_TYPE_LONGLONG;
+      b->buffer = &c->val.i;
+      b->is_unsigned = !!(fields[i].flags & UNSIGNED_FLAG);
+      break;
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+      b->buffer_type = MYSQL_TYPE_DOUBLE;
+      b->buffer = &c->val.f;
+      break;
+    default:
+      /* Decimals, bits, temporal types, strings and blobs are fetched
+       * as text, and converted by mysqlmod_push_typed_field(). There
+       * is room for a NUL after the buffer. */
+      if (!(c->buf = malloc(PIKE_MYSQL_STMT_STRBUF + 1)))
+	Pike_error("%s(): Out of memory.\n", name);
+      c->buf_size = PIKE_MYSQL_STMT_STRBUF;
+      b->buffer_type = MYSQL_TYPE_STRING;
+      b->buffer = c->buf;
+      b->buffer_length = c->buf_size;
+      break;
+    }
+  }
+
+  if (mysql_stmt_bind_result(q->stmt, q->binds + q->nparams))
+    Pike_error("%s(): Couldn't bind result (%s)\n",
+	       name, mysql_stmt_error(q->stmt));
+}
+
+/* Push the current row as an array. */
+static void stmt_push_row(struct stmt_query *q, char *name)
+{
+  int i;
+
+  for (i = 0; i < q->ncols; i++) {
+    MYSQL_BIND *b = q->binds + q->nparams + i;
+    struct stmt_column *c = q->cols + q->nparams + i;
+
+    if (c->is_null) {
+      push_object(get_val_null());
+      continue;
+    }
+    switch (b->buffer_type) {
+    case MYSQL_TYPE_LONGLONG:
+      if (b->is_unsigned)
+	push_ulongest((unsigned LONGEST) c->val.i);
+      else
+	push_int64(c->val.i);
+      break;
+    case MYSQL_TYPE_DOUBLE:
+      push_float((FLOAT_TYPE) c->val.f);
+      break;
+    default:
+      if (c->length > c->buf_size) {
+	/* Truncated: grow the buffer and refetch the column. */
+	char *nbuf = realloc(c->buf, c->length + 1);
+	if (!nbuf) Pike_error("%s(): Out of memory.\n", name);
+	c->buf = nbuf;
+	c->buf_size = c->length;
+	b->buffer = c->buf;
+	b->buffer_length = c->buf_size;
+	if (mysql_stmt_fetch_column(q->stmt, b, i, 0))
+	  Pike_error("%s(): Couldn't fetch column %d (%s)\n",
+		     name, i, mysql_stmt_error(q->stmt));
+	/* Rebind so the next fetch uses the larger buffer. */
+	if (mysql_stmt_bind_result(q->stmt, q->binds + q->nparams))
+	  Pike_error("%s(): Couldn't bind result (%s)\n",
+		     name, mysql_stmt_error(q->stmt));
+      }
+      c->buf[c->length] = 0;
+      mysqlmod_push_typed_field(q->fields + i, c->buf, c->length);
+      break;
+    }
+  }
+  f_aggregate(q->ncols);
+}
+
+/*! @decl int|array(array(mixed)) prepared_typed_query(string query, @
+ *!                                   int|float|string|object ... bindings)
+ *!
+ *! Execute @[query] as a server side prepared statement.
+ *!
+ *! The statement is prepared the first time a given query string is
+ *! used, and is then kept in a small per connection cache, so
+ *! repeated queries only transfer the bound values. Every @expr{?@}
+ *! in @[query] is replaced by the corresponding value in
+ *! @[bindings]; @[Val.null] and @[UNDEFINED] are sent as @tt{NULL@}.
+ *!
+ *! The whole result set is transferred from the server and stored in
+ *! memory before it is converted, without holding the interpreter
+ *! lock, so prepared queries don't stream. Use
+ *! @[streaming_typed_query()] for results that don't fit in memory.
+ *!
+ *! @returns
+ *!   Returns the rows of the result as arrays of typed values as in
+ *!   @[big_typed_query()], or @expr{0@} (zero) if the query didn't
+ *!   return a result set. Integers, floats, decimals and bit fields
+ *!   are converted as there, and other values, e.g. dates and times,
+ *!   are returned as strings.
+ *!
+ *! @seealso
+ *!   @[big_typed_query()], @[streaming_typed_query()]
+ */
+static void f_prepared_typed_query(INT32 args)
+{
+  struct stmt_query q;
+  ONERROR uwp;
+  char *name = "prepared_typed_query";
+  char errbuf[256];
+  int rc, retry, exec_failed;
+
+  if (!args)
+    SIMPLE_TOO_FEW_ARGS_ERROR(name, 1);
+  CHECK_8BIT_STRING(name, 1);
+  if (!PIKE_MYSQL->mysql)
+    Pike_error("%s(): Not connected.\n", name);
+
+  MEMSET(&q, 0, sizeof(q));
+  q.conn = PIKE_MYSQL;
+  q.query = sp[-args].u.string;
+  SET_ONERROR(uwp, stmt_query_abort, &q);
+
+  for (retry = 0;; retry++) {
+    MYSQL_STMT *stmt;
+
+    stmt_checkout(&q, name);
+    stmt = q.stmt;
+
+    q.nparams = mysql_stmt_param_count(stmt);
+    if (q.nparams != args - 1)
+      Pike_error("%s(): Query needs %d bindings, got %d.\n",
+		 name, q.nparams, args - 1);
+    q.meta = mysql_stmt_result_metadata(stmt);
+    q.ncols = q.meta ? mysql_num_fields(q.meta) : 0;
+
+    if (q.nparams + q.ncols) {
+      q.binds = calloc(q.nparams + q.ncols, sizeof(MYSQL_BIND));
+      q.cols = calloc(q.nparams + q.ncols, sizeof(struct stmt_column));
+      if (!q.binds || !q.cols)
+	Pike_error("%s(): Out of memory.\n", name);
+    }
+
+    stmt_bind_params(&q, args, name);
+
+    /* The result is stored in the same locked section, so that no
+     * other command can be sent on the connection in the middle of it.
+     */
+    MYSQL_ALLOW();
+    exec_failed = rc = mysql_stmt_execute(stmt);
+    if (!rc && q.meta)
+      rc = mysql_stmt_store_result(stmt);
+    if (rc) {
+      strncpy(errbuf, mysql_stmt_error(stmt), sizeof(errbuf) - 1);
+      errbuf[sizeof(errbuf) - 1] = 0;
+    }
+    MYSQL_DISALLOW();
+
+    if (!rc) break;
+
+    if (exec_failed && q.cached && !retry &&
+	((mysql_stmt_errno(stmt) == CR_SERVER_GONE_ERROR) ||
+	 (mysql_stmt_errno(stmt) == CR_SERVER_LOST))) {
+      /* The cached statement belonged to a lost connection.
+       * Prepare it again, which also triggers the reconnect.
+       */
+      stmt_query_abort(&q);
+      continue;
+    }
+
+    if (q.query->len <= 512) {
+      Pike_error("%s(): Query \"%s\" failed (%s)\n",
+		 name, q.query->str, errbuf);
+    }
+    Pike_error("%s(): Query failed (%s)\n", name, errbuf);
+  }
+
+  if (!q.meta) {
+    stmt_query_free_buffers(&q);
+    stmt_checkin(&q);
+    UNSET_ONERROR(uwp);
+    pop_n_elems(args);
+    push_int(0);
+    return;
+  }
+
+  stmt_bind_results(&q, name);
+
+  /* The rows are read from the stored result, and don't need the
+   * connection.
+   */
+  BEGIN_AGGREGATE_ARRAY(100) {
+    for (;;) {
+      rc = mysql_stmt_fetch(q.stmt);
+      if (rc == MYSQL_NO_DATA) break;
+      if (rc == 1)
+	Pike_error("%s(): Couldn't fetch row (%s)\n",
+		   name, mysql_stmt_error(q.stmt));
+      /* MYSQL_DATA_TRUNCATED is handled per column. */
+      stmt_push_row(&q, name);
+      DO_AGGREGATE_ARRAY(120);
+    }
+  } END_AGGREGATE_ARRAY;
+
+  mysql_stmt_free_result(q.stmt);
+  stmt_query_free_buffers(&q);
+  stmt_checkin(&q);
+  UNSET_ONERROR(uwp);
+
+  stack_pop_n_elems_keep_top(args);
+}
+
+#endif /* HAVE_MYSQL_STMT_INIT */
+
 
 /*! @decl void create_db(string database)
  *!
@@ -1863,6 +2391,12 @@ PIKE_MODULE_INIT
   /* function(string:int|object) */
   ADD_FUNCTION("streaming_typed_query",
 	       f_streaming_typed_query,tFunc(tStr,tObj), ID_PUBLIC);
+#ifdef HAVE_MYSQL_STMT_INIT
+  /* function(string, int|float|string|object ...:int|array(array(mixed))) */
+  ADD_FUNCTION("prepared_typed_query", f_prepared_typed_query,
+	       tFuncV(tStr,tOr4(tInt,tFlt,tStr,tObj),
+		      tOr(tInt,tArr(tArr(tMix)))), ID_PUBLIC);
+#endif /* HAVE_MYSQL_STMT_INIT */
 #ifdef USE_OLD_FUNCTIONS
   /* function(string:void) */
   ADD_FUNCTION("create_db", f_create_db,tFunc(tStr,tVoid), ID_PUBLIC);
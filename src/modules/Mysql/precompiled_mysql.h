@@ -51,6 +51,17 @@
  * Structures
  */
 
+#ifdef HAVE_MYSQL_STMT_INIT
+/* Number of server side prepared statements kept per connection. */
+#define PIKE_MYSQL_STMT_CACHE_SIZE	32
+
+struct pike_mysql_stmt {
+  struct pike_string *query;
+  MYSQL_STMT *stmt;
+  unsigned INT32 last_used;
+};
+#endif /* HAVE_MYSQL_STMT_INIT */
+
 struct precompiled_mysql {
 #ifdef PIKE_THREADS
   DEFINE_MUTEX(lock);
@@ -60,6 +71,15 @@ struct precompiled_mysql {
   struct pike_string	*host, *database, *user, *password;	/* Reconnect */
   struct mapping   *options;
   struct pike_string *conn_charset;
+
+#ifdef HAVE_MYSQL_STMT_INIT
+  struct pike_mysql_stmt stmt_cache[PIKE_MYSQL_STMT_CACHE_SIZE];
+  unsigned INT32 stmt_clock;
+  unsigned long stmt_thread_id;	/* Server connection the cache is for. */
+  /* Statements to close, see stmt_query_abort(). */
+  MYSQL_STMT *stmt_dead[PIKE_MYSQL_STMT_CACHE_SIZE];
+  int num_stmt_dead;
+#endif /* HAVE_MYSQL_STMT_INIT */
 };
 
 struct precompiled_mysql_result {
@@ -67,6 +87,7 @@ struct precompiled_mysql_result {
   MYSQL_RES	*result;
   int eof;
   int typed_mode;
+  int unbuffered;	/* From mysql_use_result(). */
 };
 
 /*
@@ -93,5 +114,6 @@ void init_mysql_res_efuns(void);
 void init_mysql_res_programs(void);
 void exit_mysql_res(void);
 void mysqlmod_parse_field(MYSQL_FIELD *field, int support_default);
+void mysqlmod_push_typed_field(MYSQL_FIELD *field, char *data, size_t len);
 
 #endif /* PRECOMPILED_MYSQL_H */
@@ -549,6 +549,93 @@ static void f_seek(INT32 args)
   pop_n_elems(args);
 }
 
+/* Push the value of field in typed mode. data is the text form of the
+ * value, len bytes followed by a NUL.
+ */
+void mysqlmod_push_typed_field(MYSQL_FIELD *field, char *data, size_t len)
+{
+  switch (field->type) {
+    /* Integer types */
+  case FIELD_TYPE_LONGLONG:
+#ifdef AUTO_BIGNUM
+    if (len >= 10) {
+      push_string(make_shared_binary_string(data, len));
+      convert_stack_top_string_to_inumber(10);
+      break;
+    }
+#endif
+    /* FALL_THROUGH */
+  case FIELD_TYPE_TINY:
+  case FIELD_TYPE_SHORT:
+  case FIELD_TYPE_LONG:
+  case FIELD_TYPE_INT24:
+    push_int(STRTOL(data, 0, 10));
+    break;
+
+#if defined (HAVE_MYSQL_FETCH_LENGTHS) && defined (AUTO_BIGNUM)
+  case FIELD_TYPE_BIT:
+    if (len <= SIZEOF_LONGEST) {
+      unsigned LONGEST val = 0;
+      unsigned j;
+      for (j = 0; j < len; j++)
+	val = (val << 8) | (unsigned char) data[j];
+      push_ulongest (val);
+    }
+    else {
+      push_string (make_shared_binary_string (data, len));
+      push_int (256);
+      convert_stack_top_with_base_to_bignum();
+      reduce_stack_top_bignum();
+    }
+    break;
+#endif
+
+    /* Floating point types */
+  case FIELD_TYPE_FLOAT:
+  case FIELD_TYPE_DOUBLE:
+    push_float(atof(data));
+    break;
+
+  case FIELD_TYPE_DECIMAL:
+  case FIELD_TYPE_NEWDECIMAL:
+    if (!field->decimals) {
+#ifdef AUTO_BIGNUM
+      if (len >= 10) {
+	push_string(make_shared_binary_string(data, len));
+	convert_stack_top_string_to_inumber(10);
+	break;
+      }
+#endif
+      push_int(STRTOL(data, 0, 10));
+      break;
+    }
+
+    /* Fixed-point number with fraction part. Make an mpq. */
+
+    if (mpq_program.type == PIKE_T_FREE) {
+      push_text ("Gmp.mpq");
+      SAFE_APPLY_MASTER ("resolv", 1);
+      if (Pike_sp[-1].type == T_PROGRAM)
+	move_svalue (&mpq_program, --Pike_sp);
+      else {
+	pop_stack();
+	mpq_program.type = T_INT;
+      }
+    }
+
+    if (mpq_program.type == T_PROGRAM) {
+      push_string(make_shared_binary_string(data, len));
+      apply_svalue (&mpq_program, 1);
+      break;
+    }
+    /* FALL_THROUGH */
+
+  default:
+    push_string(make_shared_binary_string(data, len));
+    break;
+  }
+}
+
 /*! @decl int|array(string) fetch_row()
  *!
  *! Fetch the next row from the result.
@@ -574,10 +661,34 @@ static void f_fetch_row(INT32 args)
   }
 
   num_fields = mysql_num_fields(PIKE_MYSQL_RES->result);
-  row = mysql_fetch_row(PIKE_MYSQL_RES->result);
+#ifdef _REENTRANT
+  if (PIKE_MYSQL_RES->unbuffered && PIKE_MYSQL_RES->connection) {
+    /* Rows from mysql_use_result() are read from the server socket
+     * on demand, so don't hold the interpreter lock while waiting.
+     * The connection lock serializes us against other users of the
+     * same connection.
+     */
+    struct precompiled_mysql *conn = (struct precompiled_mysql *)
+      get_storage(PIKE_MYSQL_RES->connection, mysql_program);
+    MYSQL_RES *result = PIKE_MYSQL_RES->result;
+    MUTEX_T *lock = conn?&conn->lock:NULL;
+
+    THREADS_ALLOW();
+    if (lock) mt_lock(lock);
+    row = mysql_fetch_row(result);
 #ifdef HAVE_MYSQL_FETCH_LENGTHS
-  row_lengths = mysql_fetch_lengths(PIKE_MYSQL_RES->result);
+    row_lengths = mysql_fetch_lengths(result);
+#endif /* HAVE_MYSQL_FETCH_LENGTHS */
+    if (lock) mt_unlock(lock);
+    THREADS_DISALLOW();
+  } else
+#endif /* _REENTRANT */
+  {
+    row = mysql_fetch_row(PIKE_MYSQL_RES->result);
+#ifdef HAVE_MYSQL_FETCH_LENGTHS
+    row_lengths = mysql_fetch_lengths(PIKE_MYSQL_RES->result);
 #endif /* HAVE_MYSQL_FETCH_LENGTHS */
+  }
 
   pop_n_elems(args);
 
@@ -592,111 +703,13 @@ static void f_fetch_row(INT32 args)
 
 	if (PIKE_MYSQL_RES->typed_mode &&
 	    (field = mysql_fetch_field(PIKE_MYSQL_RES->result))) {
-	  switch (field->type) {
-	    /* Integer types */
-          case FIELD_TYPE_LONGLONG:
-#ifdef AUTO_BIGNUM
-	    if (
+	  mysqlmod_push_typed_field(field, row[i],
 #ifdef HAVE_MYSQL_FETCH_LENGTHS
-		row_lengths[i]
+				    row_lengths[i]
 #else
-		strlen(row[i])
-#endif
-		>= 10) {
-	      push_text(row[i]);
-	      convert_stack_top_string_to_inumber(10);
-	      break;
-	    }
-#endif
-	    /* FALL_THROUGH */
-	  case FIELD_TYPE_TINY:
-	  case FIELD_TYPE_SHORT:
-	  case FIELD_TYPE_LONG:
-	  case FIELD_TYPE_INT24:
-	    push_int(STRTOL(row[i], 0, 10));
-	    break;
-
-#if defined (HAVE_MYSQL_FETCH_LENGTHS) && defined (AUTO_BIGNUM)
-	  case FIELD_TYPE_BIT:
-	    if (row_lengths[i] <= SIZEOF_LONGEST) {
-	      unsigned LONGEST val = 0;
-	      unsigned j;
-	      for (j = 0; j < row_lengths[i]; j++)
-		val = (val << 8) | (unsigned char) row[i][j];
-	      push_ulongest (val);
-	    }
-	    else {
-	      push_string (make_shared_binary_string (row[i], row_lengths[i]));
-	      push_int (256);
-	      convert_stack_top_with_base_to_bignum();
-	      reduce_stack_top_bignum();
-	    }
-	    break;
-#endif
-
-	    /* Floating point types */
-	  case FIELD_TYPE_FLOAT:
-	  case FIELD_TYPE_DOUBLE:
-	    push_float(atof(row[i]));
-	    break;
-
-	  case FIELD_TYPE_DECIMAL:
-	  case FIELD_TYPE_NEWDECIMAL:
-	    if (!field->decimals) {
-#ifdef AUTO_BIGNUM
-	      if (
-#ifdef HAVE_MYSQL_FETCH_LENGTHS
-		row_lengths[i]
-#else
-		strlen(row[i])
-#endif
-		>= 10
-	      ) {
-#ifdef HAVE_MYSQL_FETCH_LENGTHS
-		push_string(make_shared_binary_string(row[i], row_lengths[i]));
-#else
-		push_text(row[i]);
-#endif
-		convert_stack_top_string_to_inumber(10);
-		break;
-	      }
-#endif
-	      push_int(STRTOL(row[i], 0, 10));
-	      break;
-	    }
-
-	    /* Fixed-point number with fraction part. Make an mpq. */
-
-	    if (mpq_program.type == PIKE_T_FREE) {
-	      push_text ("Gmp.mpq");
-	      SAFE_APPLY_MASTER ("resolv", 1);
-	      if (Pike_sp[-1].type == T_PROGRAM)
-		move_svalue (&mpq_program, --Pike_sp);
-	      else {
-		pop_stack();
-		mpq_program.type = T_INT;
-	      }
-	    }
-
-	    if (mpq_program.type == T_PROGRAM) {
-#ifdef HAVE_MYSQL_FETCH_LENGTHS
-	      push_string(make_shared_binary_string(row[i], row_lengths[i]));
-#else
-	      push_text(row[i]);
-#endif
-	      apply_svalue (&mpq_program, 1);
-	      break;
-	    }
-	    /* FALL_THROUGH */
-
-	  default:
-#ifdef HAVE_MYSQL_FETCH_LENGTHS
-	    push_string(make_shared_binary_string(row[i], row_lengths[i]));
-#else
-	    push_text(row[i]);
+				    strlen(row[i])
 #endif /* HAVE_MYSQL_FETCH_LENGTHS */
-	    break;
-	  }
+				    );
 	} else {
 	  /* Everything is strings mode. */
 #ifdef HAVE_MYSQL_FETCH_LENGTHS
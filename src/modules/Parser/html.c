@@ -342,6 +342,13 @@ struct parser_html_storage
 
    /* The current context in the output queue. */
    enum contexts out_ctx;
+
+   /* Object or function that gets the output instead of the output
+    * queue, see output_to(). The output is collected in out_buf until
+    * the end of the feed() or finish() call. */
+   struct svalue out_target;
+   struct string_builder out_buf;
+   int out_buf_init;
    
    /* parser stack */
    struct feed_stack *stack;
@@ -372,6 +379,14 @@ struct parser_html_storage
     * values are concatenated tuples of ({name, to_do, end}), where
     * every name that's a prefix of some other name comes after it. */
 
+   /* Table to quickly reject tag names that can't be in maptag or
+    * mapcont: a bitmap of the first chars below 256 and the length
+    * range. It's rebuilt from the mappings when tag_table_dirty is
+    * set. */
+   unsigned INT32 tag_first[8];
+   ptrdiff_t tag_min_len, tag_max_len;
+   int tag_table_dirty;
+
    /* string to use for magic splice argument */
    struct pike_string *splice_arg;
 
@@ -546,6 +561,11 @@ static void reset_feed(struct parser_html_storage *this)
    this->out_length = 0;
    this->out_ctx = CTX_DATA;
 
+   if (this->out_buf_init) {
+      free_string_builder (&this->out_buf);
+      this->out_buf_init = 0;
+   }
+
    /* Free stack and init new stack head. */
 
    while (1) {
@@ -752,6 +772,7 @@ static void init_html_struct(struct object *o)
    THIS->data_cb_feed = NULL;
    THIS->out=NULL;
    THIS->out_length = THIS->out_max_shift = 0;
+   THIS->out_buf_init = 0;
    THIS->stack = &THIS->top;
    THIS->top.prev = NULL;
    THIS->top.local_feed = NULL;
@@ -776,6 +797,7 @@ static void init_html_struct(struct object *o)
    THIS->mapcont=allocate_mapping(32);
    THIS->mapentity=allocate_mapping(32);
    THIS->mapqtag=allocate_mapping(8);
+   THIS->tag_table_dirty=1;
 
    recalculate_argq(THIS);
 }
@@ -969,6 +991,7 @@ static void html_add_tag(INT32 args)
      map_delete(THIS->maptag,sp-2);
    else
      mapping_insert(THIS->maptag,sp-2,sp-1);
+   THIS->tag_table_dirty=1;
    pop_n_elems(args);
    ref_push_object(THISOBJ);
 }
@@ -1009,6 +1032,7 @@ static void html_add_container(INT32 args)
      map_delete(THIS->mapcont,sp-2);
    else
      mapping_insert(THIS->mapcont,sp-2,sp-1);
+   THIS->tag_table_dirty=1;
    pop_n_elems(args);
    ref_push_object(THISOBJ);
 }
@@ -1270,6 +1294,7 @@ static void html_clear_tags (INT32 args)
   pop_n_elems(args);
   free_mapping (THIS->maptag);
   THIS->maptag = allocate_mapping (32);
+  THIS->tag_table_dirty = 1;
   ref_push_object (THISOBJ);
 }
 
@@ -1278,6 +1303,7 @@ static void html_clear_containers (INT32 args)
   pop_n_elems(args);
   free_mapping (THIS->mapcont);
   THIS->mapcont = allocate_mapping (32);
+  THIS->tag_table_dirty = 1;
   ref_push_object (THISOBJ);
 }
 
@@ -1370,6 +1396,76 @@ static void html_quote_tags(INT32 args)
    push_mapping (res);
 }
 
+/* ------------------------------------ */
+/* quick check for registered tag names */
+
+static void build_tag_table(struct parser_html_storage *this)
+{
+   struct mapping *maps[2];
+   int i;
+
+   MEMSET(this->tag_first, 0, sizeof(this->tag_first));
+   this->tag_min_len = MAX_INT32;
+   this->tag_max_len = 0;
+
+   maps[0] = this->maptag;
+   maps[1] = this->mapcont;
+   for (i = 0; i < 2; i++)
+   {
+      INT32 e;
+      struct keypair *k;
+      struct mapping_data *md = maps[i]->data;
+
+      NEW_MAPPING_LOOP(md)
+      {
+	 struct pike_string *name;
+	 p_wchar2 c;
+
+	 if (k->ind.type != T_STRING) {
+	    /* Shouldn't happen, but let everything through if it does. */
+	    MEMSET(this->tag_first, 0xff, sizeof(this->tag_first));
+	    this->tag_min_len = 0;
+	    this->tag_max_len = MAX_INT32;
+	    continue;
+	 }
+	 name = k->ind.u.string;
+	 if (name->len < this->tag_min_len) this->tag_min_len = name->len;
+	 if (name->len > this->tag_max_len) this->tag_max_len = name->len;
+	 if (!name->len) continue;
+
+	 c = index_shared_string(name, 0);
+	 if (c >= 256) continue;	/* Wide chars always pass. */
+	 this->tag_first[c >> 5] |= ((unsigned INT32)1) << (c & 31);
+
+	 /* The names are lowercased in case insensitive mode, so the
+	  * uppercase chars that map to them must pass too. */
+	 if ((this->flags & FLAG_CASE_INSENSITIVE_TAG) &&
+	     ((c >= 'a' && c <= 'z') || (c >= 0xe0 && c <= 0xfe && c != 0xf7))) {
+	    c -= 32;
+	    this->tag_first[c >> 5] |= ((unsigned INT32)1) << (c & 31);
+	 }
+      }
+   }
+
+   this->tag_table_dirty = 0;
+}
+
+/* Returns zero if the tag name can't be found in maptag or mapcont. */
+static INLINE int tag_name_may_match(struct parser_html_storage *this,
+				     struct pike_string *name)
+{
+   p_wchar2 c;
+
+   if (this->tag_table_dirty) build_tag_table(this);
+
+   if (name->len < this->tag_min_len || name->len > this->tag_max_len)
+      return 0;
+   if (!name->len) return 1;
+   c = index_shared_string(name, 0);
+   return c >= 256 ||
+      (this->tag_first[c >> 5] & (((unsigned INT32)1) << (c & 31)));
+}
+
 /* ---------------------------------------- */
 /* helper function to figure out what to do */
 
@@ -1386,6 +1482,35 @@ static INLINE void recheck_scan(struct parser_html_storage *this,
 /* -------------- */
 /* feed to output */
 
+/* True when the output is collected for the output_to() target
+ * instead of being queued. */
+#define OUT_TO_TARGET(this)						\
+   ((this)->out_target.type != T_INT && (this)->out_max_shift >= 0)
+
+static void put_out_buf(struct parser_html_storage *this,
+			struct pike_string *s, ptrdiff_t start, ptrdiff_t len)
+{
+   if (len <= 0) return;
+   if (!this->out_buf_init) {
+      init_string_builder (&this->out_buf, 0);
+      this->out_buf_init = 1;
+   }
+   string_builder_append (&this->out_buf, MKPCHARP_STR_OFF (s, start), len);
+}
+
+/* Passes on the collected output to the output_to() target. */
+static void flush_out_target(struct parser_html_storage *this)
+{
+   if (!this->out_buf_init) return;
+   push_string (finish_string_builder (&this->out_buf));
+   this->out_buf_init = 0;
+   if (this->out_target.type == T_OBJECT)
+      apply (this->out_target.u.object, "add", 1);
+   else
+      apply_svalue (&this->out_target, 1);
+   pop_stack();
+}
+
 static void put_out_feed(struct parser_html_storage *this, struct svalue *v)
 {
    struct out_piece *f;
@@ -1395,6 +1520,11 @@ static void put_out_feed(struct parser_html_storage *this, struct svalue *v)
      Pike_fatal ("Putting a non-string into output queue in non-mixed mode.\n");
 #endif
 
+   if (OUT_TO_TARGET (this)) {
+     put_out_buf (this, v->u.string, 0, v->u.string->len);
+     return;
+   }
+
    f = alloc_out_piece();
    assign_svalue_no_free(&f->v,v);
 
@@ -1431,6 +1561,14 @@ static void put_out_feed_range(struct parser_html_storage *this,
    /* fit it in range (this allows other code to ignore eof stuff) */
    if (c_tail>tail->s->len) c_tail=tail->s->len;
 
+   if (OUT_TO_TARGET (this)) {
+     /* Copy straight from the feed without making substrings. */
+     for (; head != tail; head = head->next, c_head = 0)
+       put_out_buf (this, head->s, c_head, head->s->len - c_head);
+     put_out_buf (this, head->s, c_head, c_tail - c_head);
+     return;
+   }
+
    if (head != tail && c_head) {
      if (head->s->len-c_head)	/* Ignore empty strings. */
      {
@@ -3174,28 +3312,32 @@ static newstate do_try_feed(struct parser_html_storage *this,
 	      return STATE_WAIT; /* come again */
 	    }
 
-	    if (flags & FLAG_CASE_INSENSITIVE_TAG)
-	      f_lower_case(1);
-
 	    tag = NULL, cont = NULL;
-	    if (flags & FLAG_XML_TAGS) { /* decide what to do from tag syntax */
-	      if (empty_tag) {	/* <foo/> */
-		tag=low_mapping_lookup(this->maptag,sp-1);
-		if (!tag) cont=low_mapping_lookup(this->mapcont,sp-1);
-	      }
-	      else {		/* <foo> */
-		cont=low_mapping_lookup(this->mapcont,sp-1);
-		if (!cont) {
+	    if (!tag_name_may_match(this, sp[-1].u.string))
+	      empty_tag = 1;	/* not registered; skip the lookups */
+	    else {
+	      if (flags & FLAG_CASE_INSENSITIVE_TAG)
+		f_lower_case(1);
+
+	      if (flags & FLAG_XML_TAGS) { /* decide what to do from tag syntax */
+		if (empty_tag) {	/* <foo/> */
 		  tag=low_mapping_lookup(this->maptag,sp-1);
-		  if (!tag || !(flags & FLAG_STRICT_TAGS)) empty_tag = 1;
+		  if (!tag) cont=low_mapping_lookup(this->mapcont,sp-1);
+		}
+		else {		/* <foo> */
+		  cont=low_mapping_lookup(this->mapcont,sp-1);
+		  if (!cont) {
+		    tag=low_mapping_lookup(this->maptag,sp-1);
+		    if (!tag || !(flags & FLAG_STRICT_TAGS)) empty_tag = 1;
+		  }
 		}
 	      }
-	    }
-	    else {		/* decide what to do from registered callbacks */
-	      tag=low_mapping_lookup(this->maptag,sp-1);
-	      if (!tag && (cont=low_mapping_lookup(this->mapcont,sp-1)))
-		empty_tag = 0;
-	      else empty_tag = 1;
+	      else {		/* decide what to do from registered callbacks */
+		tag=low_mapping_lookup(this->maptag,sp-1);
+		if (!tag && (cont=low_mapping_lookup(this->mapcont,sp-1)))
+		  empty_tag = 0;
+		else empty_tag = 1;
+	      }
 	    }
 
 	    if (empty_tag) {	/* no content */
@@ -3908,6 +4050,7 @@ static void html_feed(INT32 args)
    else
       pop_n_elems(args);
 
+   flush_out_target(THIS);
    ref_push_object(THISOBJ);
 }
 
@@ -3942,6 +4085,7 @@ static void html_feed_insert(INT32 args)
    }
    else
       pop_n_elems(args);
+   flush_out_target(THIS);
    ref_push_object(THISOBJ);
 }
 
@@ -3964,6 +4108,7 @@ static void html_finish(INT32 args)
 	 SIMPLE_BAD_ARG_ERROR("finish",1,"string");
    }
    try_feed(1);
+   flush_out_target(THIS);
    ref_push_object(THISOBJ);
 }
 
@@ -4097,6 +4242,47 @@ static void html_write_out(INT32 args)
    ref_push_object(THISOBJ);
 }
 
+/*! @decl Parser.HTML output_to(String.Buffer|function(string:mixed) target)
+ *! @decl Parser.HTML output_to()
+ *! Send the parsed data to @[target] instead of the output queue
+ *! that is read with @[read]. The data from each call to @[feed],
+ *! @[feed_insert] or @[finish] is collected in a single string,
+ *! which is passed to the @tt{add@} function in @[target] if it's
+ *! an object, or to @[target] itself if it's a function. This
+ *! avoids queueing a separate string for every piece of the output.
+ *!
+ *! Call without argument to use the output queue again. Data
+ *! already in the output queue stays there.
+ *!
+ *! @note
+ *!   Not available in @[mixed_mode].
+ *!
+ *! @returns
+ *!   Returns the object being called.
+ */
+
+static void html_output_to(INT32 args)
+{
+   check_all_args("output_to",args,BIT_VOID|BIT_INT|BIT_OBJECT|BIT_FUNCTION,0);
+   if (!args)
+   {
+      push_int(0);
+      args = 1;
+   }
+   else if (sp[-args].type == T_INT && sp[-args].u.integer)
+      SIMPLE_BAD_ARG_ERROR("output_to",1,"object|function|void");
+
+   if (sp[-args].type != T_INT && THIS->out_max_shift < 0)
+      Pike_error("output_to: Cannot send output to a target in mixed mode.\n");
+
+   /* Give the old target what it's got coming. */
+   flush_out_target(THIS);
+
+   assign_svalue(&THIS->out_target, sp-args);
+   pop_n_elems(args);
+   ref_push_object(THISOBJ);
+}
+
 /** query *******************************************/
 
 /*! @decl array(int) at()
@@ -4787,6 +4973,7 @@ static void html_clone(INT32 args)
    add_ref(p->mapentity=THIS->mapentity);
    if (p->mapqtag) free_mapping(p->mapqtag);
    add_ref(p->mapqtag=THIS->mapqtag);
+   p->tag_table_dirty=1;
 
    if (p->splice_arg) free_string(p->splice_arg);
    if (THIS->splice_arg)
@@ -5052,6 +5239,7 @@ static void html_case_insensitive_tag(INT32 args)
    if (args) {
      if (sp[-args].u.integer) THIS->flags |= FLAG_CASE_INSENSITIVE_TAG;
      else THIS->flags &= ~FLAG_CASE_INSENSITIVE_TAG;
+     THIS->tag_table_dirty=1;
    }
    pop_n_elems(args);
 
@@ -5146,6 +5334,9 @@ static void html_mixed_mode(INT32 args)
        if (!o) {
 	 struct out_piece *f;
 	 size_t c;
+	 if (THIS->out_target.type != T_INT)
+	   Pike_error ("Cannot switch to mixed mode while output_to() "
+		       "is in use.\n");
 	 THIS->out_max_shift = -1;
 	 /* Got to count the entries in the output queue. */
 	 for (f = THIS->out, c = 0; f; f = f->next) c++;
@@ -5327,6 +5518,9 @@ void init_parser_html(void)
    PIKE_MAP_VARIABLE(" extra_args", offset + OFFSETOF(parser_html_storage, extra_args),
 		tArray,
 		T_ARRAY, ID_PROTECTED|ID_PRIVATE);
+   PIKE_MAP_VARIABLE(" out_target", offset + OFFSETOF(parser_html_storage, out_target),
+		tOr(tObj,tFunc(tStr,tMix)),
+		T_MIXED, ID_PROTECTED|ID_PRIVATE);
 
    set_init_callback(init_html_struct);
    set_exit_callback(exit_html_struct);
@@ -5346,6 +5540,9 @@ void init_parser_html(void)
 
    ADD_FUNCTION("write_out",html_write_out,
 		tFuncV(tNone,tOr(tStr,tMixed),tObjImpl_PARSER_HTML),0);
+   ADD_FUNCTION("output_to",html_output_to,
+		tFunc(tOr3(tVoid,tObj,tFunc(tStr,tMix)),
+		      tObjImpl_PARSER_HTML),0);
    ADD_FUNCTION("feed_insert",html_feed_insert,
 		tFunc(tStr,tObjImpl_PARSER_HTML),0);
 
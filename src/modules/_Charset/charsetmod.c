@@ -17,6 +17,7 @@
 #include "module_support.h"
 #include "pike_error.h"
 #include "builtin_functions.h"
+#include "threads.h"
 
 #include "charsetmod.h"
 
@@ -395,9 +396,19 @@ static ptrdiff_t feed_utf8(struct pike_string *str, struct std_cs_stor *s)
   const p_wchar0 *p = STR0(str);
   ptrdiff_t l = str->len;
   for (; l > 0; l--) {
-    unsigned int ch = *p++;
+    unsigned int ch = *p;
+
+    if (!(ch & 0x80)) {
+      /* Copy the whole run of 7bit characters. */
+      ptrdiff_t run = ascii_prefix_length(p, l);
+      string_builder_binary_strcat0(&s->strbuild, p, run);
+      p += run;
+      l -= run - 1;
+      continue;
+    }
 
-    if (ch & 0x80) {
+    p++;
+    {
       int cl = utf8cont[(ch>>1) - 64], i;
       if (!cl)
 	transcoder_error (str, p - STR0(str) - 1, 0, "Invalid byte.\n");
@@ -707,10 +718,289 @@ static void f_feed_utf7(INT32 args)
   f_std_feed(args, feed_utf7);
 }
 
+/* Bulk decoding.
+ *
+ * The decoders for the stateless multibyte charsets decode the input
+ * into a p_wchar1 buffer, instead of feeding the string builder one
+ * character at a time. A bulk decoder stops at the first byte
+ * sequence it can't handle by itself, i.e. an incomplete sequence at
+ * the end, an error or a character outside the BMP, and leaves it to
+ * the character based loop of the caller.
+ *
+ * A caller that goes back to the bulk decoder after such a sequence
+ * keeps a struct bulk_scratch for the whole feed, so that the scratch
+ * buffer is only allocated once however often the bulk loop is
+ * interrupted.
+ */
+
+/* Release the interpreter lock while decoding inputs at least this
+ * large. */
+#define BULK_THREADS_THRESHOLD	65536
+
+struct bulk_out {
+  p_wchar1 *out;
+  ptrdiff_t len;
+  unsigned INT32 bits;		/* All decoded characters or:ed together. */
+};
+
+struct bulk_scratch {
+  p_wchar1 *buf;
+  ptrdiff_t size;
+  ptrdiff_t last_run;		/* Bytes used by the previous call. */
+};
+
+typedef ptrdiff_t (*bulk_decoder)(const p_wchar0 *p, ptrdiff_t l,
+				  struct bulk_out *o, const void *ctx);
+
+/* Copies a run of 7bit characters. */
+static INLINE const p_wchar0 *bulk_ascii(const p_wchar0 *p, ptrdiff_t l,
+					 struct bulk_out *o)
+{
+  ptrdiff_t i, run = ascii_prefix_length(p, l);
+  p_wchar1 *out = o->out + o->len;
+  for (i = 0; i < run; i++)
+    out[i] = p[i];
+  o->len += run;
+  return p + run;
+}
+
+/* Frees the scratch buffer of a feed. */
+static void free_bulk_scratch(struct bulk_scratch *scratch)
+{
+  if (scratch->buf) free(scratch->buf);
+  scratch->buf = NULL;
+  scratch->size = 0;
+}
+
+/* Decodes as much as possible of p with dec, and appends the result
+ * to the string builder. Returns the number of bytes used.
+ *
+ * scratch is the scratch buffer of the feed, or NULL if the caller
+ * only calls feed_bulk() once. The interpreter lock is only released
+ * for large inputs when the previous call was not cut short, since
+ * input with many sequences the bulk decoder can't handle would
+ * otherwise release and retake the lock for every short run.
+ */
+static ptrdiff_t feed_bulk(struct string_builder *sb, const p_wchar0 *p,
+			   ptrdiff_t l, bulk_decoder dec, const void *ctx,
+			   struct bulk_scratch *scratch)
+{
+  struct bulk_out o;
+  p_wchar1 buf[256];
+  ptrdiff_t used;
+  int unlock;
+  ONERROR err;
+
+  o.len = 0;
+  o.bits = 0;
+
+  if (l < BULK_THREADS_THRESHOLD && sb->s->size_shift == 1) {
+    /* Decode straight into the string builder. */
+    string_build_mkspace(sb, l, 1);
+    o.out = STR1(sb->s) + sb->s->len;
+    used = dec(p, l, &o, ctx);
+    sb->s->len += o.len;
+    /* Ensure NUL-termination */
+    STR1(sb->s)[sb->s->len] = 0;
+    if ((o.bits > 0xff) && !sb->known_shift)
+      sb->known_shift = 1;
+    if (scratch) scratch->last_run = used;
+    return used;
+  }
+
+  if (l <= (ptrdiff_t)NELEM(buf)) {
+    o.out = buf;
+    used = dec(p, l, &o, ctx);
+    string_builder_binary_strcat1(sb, buf, o.len);
+    if (scratch) scratch->last_run = used;
+    return used;
+  }
+
+  unlock = (l >= BULK_THREADS_THRESHOLD) &&
+    (!scratch || !scratch->buf || scratch->last_run >= BULK_THREADS_THRESHOLD);
+
+  if (!scratch) {
+    o.out = xalloc(l * sizeof(p_wchar1));
+    SET_ONERROR(err, free, o.out);
+  } else {
+    /* The first call of a feed sees the most input, so the buffer
+     * allocated then is large enough for the rest of the feed. */
+    if (scratch->size < l) {
+      free_bulk_scratch(scratch);
+      scratch->buf = xalloc(l * sizeof(p_wchar1));
+      scratch->size = l;
+    }
+    o.out = scratch->buf;
+  }
+  if (unlock) {
+    THREADS_ALLOW();
+    used = dec(p, l, &o, ctx);
+    THREADS_DISALLOW();
+  } else
+    used = dec(p, l, &o, ctx);
+  string_builder_binary_strcat1(sb, o.out, o.len);
+  if (!scratch)
+    CALL_AND_UNSET_ONERROR(err);
+  else
+    scratch->last_run = used;
+  return used;
+}
+
+static ptrdiff_t bulk_sjis(const p_wchar0 *p, ptrdiff_t l,
+			   struct bulk_out *o, const void *ctx)
+{
+  const p_wchar0 *start = p, *end = p + l;
+  p_wchar1 *out = o->out;
+  ptrdiff_t len = o->len;
+  unsigned INT32 bits = o->bits;
+
+  while (p < end) {
+    unsigned INT32 ch = *p;
+    if(ch < 0x80) {
+      const p_wchar0 *e = p + ascii_prefix_length(p, end - p);
+      while (p < e) {
+	ch = *p++;
+	if(ch == 0x5c)
+	  ch = 0xa5;
+	else if(ch == 0x7e)
+	  ch = 0x203e;
+	out[len++] = ch;
+	bits |= ch;
+      }
+      continue;
+    } else if(ch < 0xa1 || ch >= 0xe0) {
+      if(ch == 0x80 || ch == 0xa0 || ch >= 0xeb) {
+	ch = 0xfffd;
+	p++;
+      } else {
+	int lo;
+	if(end - p < 2)
+	  break;
+	lo = p[1];
+	p += 2;
+	if(ch > 0xa0)
+	  ch -= 0x40;
+	if(lo >= 0x40 && lo <= 0x9e && lo != 0x7f) {
+	  if(lo > 0x7f)
+	    --lo;
+	  ch = map_JIS_C6226_1983[(ch-0x81)*188+(lo-0x40)];
+	} else if(lo >= 0x9f && lo <= 0xfc)
+	  ch = map_JIS_C6226_1983[(ch-0x81)*188+94+(lo-0x9f)];
+	else
+	  ch = 0xfffd;
+      }
+    } else {
+      ch += 0xfec0;
+      p++;
+    }
+    out[len++] = ch;
+    bits |= ch;
+  }
+
+  o->len = len;
+  o->bits = bits;
+  return p - start;
+}
+
+static ptrdiff_t bulk_euc(const p_wchar0 *p, ptrdiff_t l,
+			  struct bulk_out *o, const void *ctx)
+{
+  const struct euc_stor *euc = (const struct euc_stor *)ctx;
+  UNICHAR const *map = euc->table;
+  UNICHAR const *map2 = euc->table2;
+  UNICHAR const *map3 = euc->table3;
+  const p_wchar0 *start = p, *end = p + l;
+  unsigned INT32 bits = o->bits;
+
+  while (p < end) {
+    unsigned INT32 ch = *p;
+    if(ch < 0x80) {
+      p = bulk_ascii(p, end - p, o);
+      continue;
+    } else if(ch > 0xa0 && ch < 0xff) {
+      int lo;
+      if(end - p < 2)
+	break;
+      lo = p[1]|0x80;
+      if(lo > 0xa0 && lo < 0xff)
+	ch = map[(ch-0xa1)*94+(lo-0xa1)];
+      else
+	ch = 0xfffd;
+      p += 2;
+    } else if(ch == 0x8e) {
+      if(end - p < 2)
+	break;
+      ch = p[1]|0x80;
+      if(map2 && (ch > 0xa0 && ch < 0xff))
+	ch = map2[ch-0xa1];
+      else
+	ch = 0xfffd;
+      p += 2;
+    } else if(ch == 0x8f) {
+      int lo;
+      if(end - p < 3)
+	break;
+      ch = p[1]|0x80;
+      lo = p[2]|0x80;
+      if(map3 && (ch > 0xa0 && ch < 0xff && lo > 0xa0 && lo < 0xff))
+	ch = map3[(ch-0xa1)*94+(lo-0xa1)];
+      else
+	ch = 0xfffd;
+      p += 3;
+    } else {
+      ch = 0xfffd;
+      p++;
+    }
+    o->out[o->len++] = ch;
+    bits |= ch;
+  }
+
+  o->bits = bits;
+  return p - start;
+}
+
+static ptrdiff_t bulk_multichar(const p_wchar0 *p, ptrdiff_t l,
+				struct bulk_out *o, const void *ctx)
+{
+  const struct multichar_table *table = (const struct multichar_table *)ctx;
+  const p_wchar0 *start = p, *end = p + l;
+  unsigned INT32 bits = o->bits;
+
+  while (p < end) {
+    unsigned INT32 ch = *p;
+    if(ch < 0x80) {
+      p = bulk_ascii(p, end - p, o);
+      continue;
+    } else if(ch == 0x80) {
+      p++;
+    } else {
+      const struct multichar_table *page;
+      unsigned INT32 lo;
+      if(end - p < 2 || ch == 0xff)
+	break;
+      page = table + (ch-0x81);
+      lo = p[1];
+      if(lo < page->lo || lo > page->hi)
+	break;			/* GB18030 four byte sequence or error. */
+      ch = page->table[lo-page->lo];
+      p += 2;
+    }
+    o->out[o->len++] = ch;
+    bits |= ch;
+  }
+
+  o->bits = bits;
+  return p - start;
+}
+
 static ptrdiff_t feed_sjis(struct pike_string *str, struct std_cs_stor *s)
 {
   const p_wchar0 *p = STR0(str);
   ptrdiff_t l = str->len;
+  ptrdiff_t used = feed_bulk(&s->strbuild, p, l, bulk_sjis, NULL, NULL);
+
+  p += used;
+  l -= used;
   while(l>0) {
     unsigned INT32 ch = *p++;
     if(ch < 0x80) {
@@ -764,6 +1054,10 @@ static ptrdiff_t feed_euc(struct pike_string *str, struct std_cs_stor *s)
 
   const p_wchar0 *p = STR0(str);
   ptrdiff_t l = str->len;
+  ptrdiff_t used = feed_bulk(&s->strbuild, p, l, bulk_euc, euc, NULL);
+
+  p += used;
+  l -= used;
   while(l>0) {
     unsigned INT32 ch = *p++;
     if(ch < 0x80) {
@@ -886,55 +1180,79 @@ static void f_create_multichar(INT32 args)
 
 #include "gb18030.h"
 
+/* Returns the linear offset of the GB18030 four byte sequence at p,
+ * or -1 if it isn't one.
+ */
+static INLINE INT32 gb18030_index(const p_wchar0 *p)
+{
+  if ((p[0] < 0x81) || (p[0] > 0xfe) ||
+      (p[1] < 0x30) || (p[1] > 0x39) ||
+      (p[2] < 0x81) || (p[2] > 0xfe) ||
+      (p[3] < 0x30) || (p[3] > 0x39))
+    return -1;
+  return (((p[0] - 0x81)*10 + (p[1] - 0x30))*126 + (p[2] - 0x81))*10 +
+    (p[3] - 0x30);
+}
+
+/* Like gb18030_to_unicode(), but keeps the position in the table in
+ * *j instead of in a static, so that it may be called without the
+ * interpreter lock.
+ */
+static p_wchar2 gb18030_lookup(p_wchar2 i, int *j)
+{
+  int jlo = *j;
+  if ((gb18030_info[jlo].index > i) || (gb18030_info[jlo+1].index <= i)) {
+    int jhi = NUM_GB18030_INFO, jmid;
+    jlo = 0;
+    while (jlo < (jmid = (jlo + jhi)/2)) {
+      if (gb18030_info[jmid].index <= i) {
+	jlo = jmid;
+      } else {
+	jhi = jmid;
+      }
+    }
+    *j = jlo;
+  }
+  return i - gb18030_info[jlo].index + gb18030_info[jlo].ucode;
+}
+
+/* bulk_multichar() with the GB18030 four byte sequences that map to
+ * the BMP. Anything else is left to feed_multichar().
+ */
+static ptrdiff_t bulk_gb18030(const p_wchar0 *p, ptrdiff_t l,
+			      struct bulk_out *o, const void *ctx)
+{
+  const p_wchar0 *start = p, *end = p + l;
+  int j = 0;
+
+  while (p < end) {
+    INT32 index;
+    p_wchar2 ch;
+    p += bulk_multichar(p, end - p, o, ctx);
+    if ((end - p < 4) || ((index = gb18030_index(p)) < 0) ||
+	((ch = gb18030_lookup(index, &j)) > 0xffff))
+      break;
+    o->out[o->len++] = ch;
+    o->bits |= ch;
+    p += 4;
+  }
+
+  return p - start;
+}
+
 /* Used for gb18030 to decode code points outside GBK. */
 static ptrdiff_t feed_gb18030(const p_wchar0 *p, ptrdiff_t l,
 			      struct std_cs_stor *s)
 {
-  p_wchar2 index = 0;
+  INT32 index;
   if (l < 4) {
     return l;
   }
 
   /* First decode the linear offset. */
-
-  if ((p[0] < 0x81) || (p[0] > 0xfe)) {
-#if 0
-    fprintf(stderr, "Illegal character: 0x%02x (expected 0x81 .. 0xfe)\n",
-	    p[0]);
-#endif /* 0 */
-    return 0;
-  }
-  index = p[0] - 0x81;
-
-  if ((p[1] < 0x30) || (p[1] > 0x39)) {
-#if 0
-    fprintf(stderr, "Illegal character: 0x%02x (expected 0x30 .. 0x39)\n",
-	    p[0]);
-#endif /* 0 */
-    return 0;
-  }
-  index *= 10;
-  index += p[1] - 0x30;
-
-  if ((p[2] < 0x81) || (p[2] > 0xfe)) {
-#if 0
-    fprintf(stderr, "Illegal character: 0x%02x (expected 0x81 .. 0xfe)\n",
-	    p[0]);
-#endif /* 0 */
-    return 0;
-  }
-  index *= 126;
-  index += p[2] - 0x81;
-
-  if ((p[3] < 0x30) || (p[3] > 0x39)) {
-#if 0
-    fprintf(stderr, "Illegal character: 0x%02x (expected 0x30 .. 0x39)\n",
-	    p[0]);
-#endif /* 0 */
+  if ((index = gb18030_index(p)) < 0) {
     return 0;
   }
-  index *= 10;
-  index += p[3] - 0x30;
 
   /* Convert to Unicode. */
   string_builder_putchar(&s->strbuild, gb18030_to_unicode(index));
@@ -943,16 +1261,31 @@ static ptrdiff_t feed_gb18030(const p_wchar0 *p, ptrdiff_t l,
   return -4;
 }
 
-static ptrdiff_t feed_multichar(struct pike_string *str,
-				struct std_cs_stor *s)
+static ptrdiff_t low_feed_multichar(struct pike_string *str,
+				    struct std_cs_stor *s,
+				    struct bulk_scratch *scratch)
 {
   struct multichar_stor *m = (struct multichar_stor *)(fp->current_storage + multichar_stor_offs);
   const struct multichar_table *table = m->table;
+  bulk_decoder dec = m->is_gb18030 ? bulk_gb18030 : bulk_multichar;
+  int j = 0;
 
   const p_wchar0 *p = STR0(str);
   ptrdiff_t l = str->len;
   while(l>0) {
-    unsigned INT32 ch = *p++;
+    unsigned INT32 ch = *p;
+    INT32 index;
+    if(ch < 0x81 ||
+       (l > 1 && ch != 0xff &&
+	p[1] >= table[ch-0x81].lo && p[1] <= table[ch-0x81].hi) ||
+       (m->is_gb18030 && l > 3 && (index = gb18030_index(p)) >= 0 &&
+	gb18030_lookup(index, &j) <= 0xffff)) {
+      /* Decode up to the next error or character outside the BMP. */
+      ptrdiff_t used = feed_bulk(&s->strbuild, p, l, dec, table, scratch);
+      p += used;
+      if (!(l -= used)) break;
+    }
+    ch = *p++;
     if(ch < 0x81) {
       /* FIXME: Adjust above limit to 0x80? Recent GB18030 encodes
        *        U+0080 as 0x81 0x30 0x81 0x30.
@@ -992,6 +1325,22 @@ static ptrdiff_t feed_multichar(struct pike_string *str,
   return 0;
 }
 
+static ptrdiff_t feed_multichar(struct pike_string *str,
+				struct std_cs_stor *s)
+{
+  struct bulk_scratch scratch;
+  ptrdiff_t res;
+  ONERROR err;
+
+  scratch.buf = NULL;
+  scratch.size = 0;
+  scratch.last_run = 0;
+  SET_ONERROR(err, free_bulk_scratch, &scratch);
+  res = low_feed_multichar(str, s, &scratch);
+  CALL_AND_UNSET_ONERROR(err);
+  return res;
+}
+
 static void f_feed_multichar(INT32 args)
 {
   f_std_feed(args, feed_multichar);
@@ -21,60 +21,198 @@ RCSID("$Id$");
 static void exit_blob_struct( );
 
 /*
+  A blob is a sequence of chunks. A raw chunk is one or more documents
+
   +-----------+----------+---------+---------+---------+
   | docid: 32 | nhits: 8 | hit: 16 | hit: 16 | hit: 16 |...
   +-----------+----------+---------+---------+---------+
+
+  in increasing docid order. The document ids are less than 2^31, so
+  the first byte of a raw document is never 255, which starts a
+  packed chunk instead:
+
+  +--------+------------+-----------------------+-------------
+  | 255: 8 | nblocks:32 | skip table: nblocks*8 | blocks ...
+  +--------+------------+-----------------------+-------------
+
+  The documents are stored in blocks of WF_PACKED_BLOCK documents
+
+  +--------------+----------+-----------+-----------+
+  | delta:varint | nhits: 8 | hit:varint| hit:varint|...
+  +--------------+----------+-----------+-----------+
+
+  The delta is from the previous document in the chunk (or 0), and each
+  hit is stored as the difference from the previous hit of the
+  document, modulo 2^16. The varints are written by wf_buffer_wvarint.
+
+  Each skip table entry has the last docid (32 bits) and the end offset
+  (32 bits, from the first block) of a block. wf_blob_skip searches it
+  for the first block that can contain the wanted document, so the
+  blocks in between are never looked at.
 */
 
+#define WF_PACKED		255
+#define WF_PACKED_BLOCK		128
+
+#define GET_INT(D) (((unsigned int)(D)[0]<<24) | ((D)[1]<<16) | \
+		    ((D)[2]<<8) | (D)[3])
+#define SKIP_LAST(B,N)	GET_INT( (B)->b->data + (B)->skips + (N)*8 )
+#define SKIP_END(B,N)	GET_INT( (B)->b->data + (B)->skips + (N)*8 + 4 )
+
+static INLINE unsigned int wf_get_varint( unsigned char *d,
+					  unsigned int *pos,
+					  unsigned int end )
+{
+  unsigned int v = 0, shift = 0, p = *pos;
+  while( p < end )
+  {
+    unsigned char c = d[p++];
+    v |= (unsigned int)(c&127) << shift;
+    if( !(c & 128) || (shift += 7) > 28 )
+      break;
+  }
+  *pos = p;
+  return v;
+}
+
+/* Makes n the current block of the packed chunk. */
+static void wf_blob_block( Blob *b, unsigned int n )
+{
+  b->block = n;
+  b->end = b->start + SKIP_END( b, n );
+  if( b->end > b->b->size || b->end < b->start )
+    b->end = b->b->size;
+}
+
+/* Moves to the document at pos in the buffer. Returns 0 if there are
+ * no more documents in the buffer. */
+static int wf_blob_at( Blob *b, unsigned int pos )
+{
+  unsigned char *d = b->b->data;
+  unsigned int size = b->b->size;
+
+  while( 1 )
+  {
+    if( b->packed )
+    {
+      if( pos < b->end )
+      {
+	unsigned int i, end = b->end;
+	b->b->rpos = pos;
+	b->docid += wf_get_varint( d, &pos, end );
+	b->nhits = pos < end ? d[pos++] : 0;
+	b->hits_at = pos;
+	b->unpacked = 0;
+	/* Step over the hits */
+	for( i = 0; i<b->nhits && pos < end; i++ )
+	  while( pos < end && (d[pos++] & 128) )
+	    ;
+	b->next = pos;
+	return 1;
+      }
+      if( b->block+1 < b->nblocks )
+	wf_blob_block( b, b->block+1 );
+      else
+	/* pos is the end of the chunk */
+	b->packed = 0;
+    }
+    else if( pos+5 > size )
+      return 0;
+    else if( d[pos] == WF_PACKED )
+    {
+      unsigned int n = GET_INT( d+pos+1 );
+      if( n > (size-pos-5)/8 )
+	return 0;
+      b->skips = pos+5;
+      b->start = pos = b->skips + n*8;
+      b->nblocks = n;
+      b->docid = 0;
+      if( n )
+      {
+	b->packed = 1;
+	wf_blob_block( b, 0 );
+      }
+    }
+    else
+    {
+      b->b->rpos = pos;
+      b->docid = GET_INT( d+pos );
+      b->nhits = d[pos+4];
+      b->next = pos + 5 + 2*b->nhits;
+      if( b->next > size )
+	return 0;
+      return 1;
+    }
+  }
+}
+
 int wf_blob_next( Blob *b )
 {
   /* Find the next document ID */
   if( b->eof )
     return 0;
 
-  b->docid = 0;
-  if( b->b->rpos >= b->b->size )
+  while( !wf_blob_at( b, b->next ) )
   {
     if( !b->feed )
     {
-      wf_buffer_clear( b->b );
+      /* The buffer is left for wf_blob_free, since this may be
+       * called without the interpreter lock. */
       b->eof = 1;
       return -1;
     }
     ref_push_string( b->word );
-    push_int( b->docid );
+    push_int( 0 );
     apply_svalue( b->feed, 2 );
     if( sp[-1].type != T_STRING )
     {
       b->eof = 1;
       return -1;
     }
-    wf_buffer_set_pike_string( b->b, sp[-1].u.string, 1 );
+    wf_blob_set_data( b, sp[-1].u.string );
   }
-  else
+  return b->docid;
+}
+
+void wf_blob_set_data( Blob *b, struct pike_string *s )
+{
+  wf_buffer_set_pike_string( b->b, s, 1 );
+  b->next = 0;
+  b->packed = 0;
+}
+
+int wf_blob_skip( Blob *b, unsigned int docid )
+{
+  /* In packed chunks the blocks before docid are passed using the
+   * skip table. Other documents are stepped over one at a time, by
+   * looking at their headers only. The feeder is called only when the
+   * current chunk runs out. */
+  while( !b->eof )
   {
-    /* FF past current docid */
-    b->b->rpos += 4 + 1 + 2*wf_blob_nhits( b );
-    if( b->b->rpos >= b->b->size )
+    if( b->docid >= docid )
+      return b->docid;
+
+    if( b->packed && SKIP_LAST( b, b->block ) < docid )
     {
-      if( !b->feed )
-      {
-	wf_buffer_clear( b->b );
-	b->eof = 1;
-	return -1;
-      }
-      ref_push_string( b->word );
-      push_int( b->docid );
-      apply_svalue( b->feed, 2 );
-      if( sp[-1].type != T_STRING )
+      /* Find the first block with a document >= docid */
+      unsigned int lo = b->block+1, hi = b->nblocks;
+      while( lo < hi )
       {
-	b->eof = 1;
-	return -1;
+	unsigned int mid = lo + (hi-lo)/2;
+	if( SKIP_LAST( b, mid ) < docid )
+	  lo = mid+1;
+	else
+	  hi = mid;
       }
-      wf_buffer_set_pike_string( b->b, sp[-1].u.string, 1 );
+      /* Go to the end of the block before it, and let wf_blob_next
+       * move on to it (or the end of the chunk). */
+      wf_blob_block( b, lo-1 );
+      b->docid = SKIP_LAST( b, lo-1 );
+      b->next = b->end;
     }
+    wf_blob_next( b );
   }
-  return wf_blob_docid( b );
+  return -1;
 }
 
 int wf_blob_eof( Blob *b )
@@ -87,13 +225,25 @@ int wf_blob_eof( Blob *b )
 int wf_blob_nhits( Blob *b )
 {
   if( b->eof ) return 0;
-  return ((unsigned char *)b->b->data)[b->b->rpos+4];
+  return b->nhits;
 }
 
 int wf_blob_hit_raw( Blob *b, int n )
 {
   if( b->eof )
     return 0;
+  else if( b->packed )
+  {
+    if( !b->unpacked )
+    {
+      unsigned int i, pos = b->hits_at;
+      unsigned short h = 0;
+      for( i = 0; i<b->nhits; i++ )
+	b->hits[i] = h += wf_get_varint( b->b->data, &pos, b->end );
+      b->unpacked = 1;
+    }
+    return b->hits[n];
+  }
   else
   {
     int off = b->b->rpos + 5 + n*2;
@@ -112,10 +262,7 @@ Hit wf_blob_hit( Blob *b, int n )
   }
   else
   {
-    int off = b->b->rpos + 5 + n*2;
-    unsigned char h =  b->b->data[ off ];
-    unsigned char l = b->b->data[ off + 1 ];
-    unsigned short ht= (h<<8) | l;
+    unsigned short ht = wf_blob_hit_raw( b, n );
     hit.raw = ht;
     if( (ht>>14) == 3 )
     {
@@ -137,17 +284,61 @@ int wf_blob_docid( Blob *b )
 {
   if( b->eof )
     return -1;
-  if( b->docid > 0 )
-    return b->docid;
-  else
+  return b->docid;
+}
+
+struct pike_string *wf_blob_pack( struct pike_string *s )
+{
+  Blob *in = wf_blob_new( NULL, NULL );
+  struct buffer *skips = wf_buffer_new(), *data = wf_buffer_new();
+  struct pike_string *res;
+  unsigned int last = 0, n = 0, i;
+
+  wf_buffer_set_empty( skips );
+  wf_buffer_set_empty( data );
+  wf_blob_set_data( in, s );
+  while( wf_blob_next( in ), !in->eof )
   {
-    int off = b->b->rpos;
-    unsigned char hh =  b->b->data[ off ];
-    unsigned char hl = b->b->data[ off+1 ];
-    unsigned char lh =  b->b->data[ off+2 ];
-    unsigned char ll = b->b->data[ off+3 ];
-    return b->docid = ((((((hh<<8) | hl)<<8) | lh)<<8) | ll);
+    unsigned short h = 0;
+    wf_buffer_wvarint( data, in->docid - last );
+    wf_buffer_wbyte( data, in->nhits );
+    for( i = 0; i<in->nhits; i++ )
+    {
+      unsigned short hit = wf_blob_hit_raw( in, i );
+      wf_buffer_wvarint( data, (unsigned short)(hit-h) );
+      h = hit;
+    }
+    last = in->docid;
+    if( !(++n % WF_PACKED_BLOCK) )
+    {
+      wf_buffer_wint( skips, last );
+      wf_buffer_wint( skips, data->size );
+    }
+  }
+  if( n % WF_PACKED_BLOCK )
+  {
+    wf_buffer_wint( skips, last );
+    wf_buffer_wint( skips, data->size );
+  }
+  wf_blob_free( in );
+
+  if( n )
+  {
+    res = begin_shared_string( 5 + skips->size + data->size );
+    res->str[0] = (char)WF_PACKED;
+    res->str[1] = (skips->size/8)>>24;
+    res->str[2] = (skips->size/8)>>16;
+    res->str[3] = (skips->size/8)>>8;
+    res->str[4] = (skips->size/8);
+    MEMCPY( res->str+5, skips->data, skips->size );
+    MEMCPY( res->str+5+skips->size, data->data, data->size );
+    res = end_shared_string( res );
   }
+  else
+    res = make_shared_binary_string( "", 0 );
+  wf_buffer_free( skips );
+  wf_buffer_free( data );
+  return res;
 }
 
 
@@ -266,21 +457,30 @@ static void _append_hit( struct blob_data *d, int doc_id, int hit )
 
 static void _append_blob( struct blob_data *d, struct pike_string *s )
 {
-  struct buffer *b = wf_buffer_new();
-  wf_buffer_set_pike_string( b, s, 1 );
-  while( !wf_buffer_eof( b ) )
+  Blob *b = wf_blob_new( NULL, NULL );
+  ONERROR e;
+  SET_ONERROR( e, wf_blob_free, b );
+  wf_blob_set_data( b, s );
+  while( wf_blob_next( b ), !b->eof )
   {
-    int docid = wf_buffer_rint( b );
-    int nhits = wf_buffer_rbyte( b );
-    struct hash *h = find_hash( d, docid );
+    struct hash *h = find_hash( d, b->docid );
     /* Make use of the fact that this dochash should be empty, and
      * assume that the incoming data is valid
      */
-    wf_buffer_rewind_r( b, 5 );
     wf_buffer_rewind_w( h->data, -1 );
-    wf_buffer_memcpy( h->data, b, nhits*2+5 );    
+    if( b->packed )
+    {
+      unsigned int i;
+      wf_buffer_wint( h->data, b->docid );
+      wf_buffer_wbyte( h->data, b->nhits );
+      for( i = 0; i<b->nhits; i++ )
+	wf_buffer_wshort( h->data, wf_blob_hit_raw( b, i ) );
+    }
+    else
+      wf_buffer_append( h->data, b->b->data+b->b->rpos,
+			b->next-b->b->rpos );
   }
-  wf_buffer_free( b );
+  CALL_AND_UNSET_ONERROR( e );
 }
 
 /*! @module Search
@@ -290,6 +490,9 @@ static void _append_blob( struct blob_data *d, struct pike_string *s )
  */
 
 /*! @decl void create(void|string initial)
+ *!
+ *! @[initial] and the argument to @[merge] can be raw or packed
+ *! blobs, or any concatenation of them.
  */
 
 static void f_blob_create( INT32 args )
@@ -483,7 +686,10 @@ static void f_blob_memsize( INT32 args )
   push_int( wf_blob_low_memsize( Pike_fp->current_object ) );
 }
 
-/*! @decl string data()
+/*! @decl string data(void|int packed)
+ *!
+ *! Returns the blob, and clears this object. If @[packed] is true, the
+ *! blob is packed, as by @[pack_blob()].
  */
 
 static void f_blob__cast( INT32 args )
@@ -495,6 +701,7 @@ static void f_blob__cast( INT32 args )
   int i, zp=0;
   struct hash *h;
   struct buffer *res;
+  int packed;
 
   zipp = xalloc( THIS->size * sizeof( zipp[0] ) + 1);
 
@@ -546,14 +753,47 @@ static void f_blob__cast( INT32 args )
   free( zipp );
 
   exit_blob_struct(); /* Clear this buffer */
+  packed = args && !UNSAFE_IS_ZERO( sp-args );
   pop_n_elems( args );
   push_string( make_shared_binary_string( res->data, res->size ) );
   wf_buffer_free( res );
+  if( packed )
+  {
+    struct pike_string *s = wf_blob_pack( sp[-1].u.string );
+    pop_stack();
+    push_string( s );
+  }
 }
 
 /*! @endclass
  */
 
+/*! @decl string pack_blob(string blob)
+ *!
+ *! Returns @[blob], which can be raw, packed or a concatenation of
+ *! them, as one packed chunk. The document ids are delta coded and the
+ *! hits difference coded, with variable length integers. The chunk
+ *! has a skip table with the last document id of each block of 128
+ *! documents, which the queries use to skip to a document without
+ *! decoding the blocks before it.
+ *!
+ *! The queries, @[Blob()->create()] and @[Blob()->merge()] take
+ *! packed blobs. @[Search.Database.MySQL] splits and counts the raw
+ *! documents of its blobs, so it keeps using raw blobs; packed ones
+ *! are meant for @[Search.MergeFile] and @[Search.Segment].
+ *!
+ *! The document ids must be increasing, and less than 2^31.
+ */
+
+static void f_pack_blob( INT32 args )
+{
+  struct pike_string *s;
+  get_all_args( "pack_blob", args, "%n", &s );
+  s = wf_blob_pack( s );
+  pop_n_elems( args );
+  push_string( s );
+}
+
 /*! @endmodule
  */
 
@@ -581,12 +821,13 @@ void init_blob_program()
   add_function( "remove", f_blob_remove, "function(int:void)",0 );
   add_function( "remove_list", f_blob_remove_list,
 		"function(array(int):void)",0 );
-  add_function( "data", f_blob__cast, "function(void:string)", 0 );
+  add_function( "data", f_blob__cast, "function(int|void:string)", 0 );
   add_function( "memsize", f_blob_memsize, "function(void:int)", 0 );
   set_init_callback( init_blob_struct );
   set_exit_callback( exit_blob_struct );
   blob_program = end_program( );
   add_program_constant( "Blob", blob_program, 0 );
+  add_function( "pack_blob", f_pack_blob, "function(string:string)", 0 );
 }
 
 void exit_blob_program()
@@ -7,6 +7,26 @@ typedef struct _Blob
   unsigned int eof;
   
   struct buffer *b;
+  /* b->rpos is the offset of the current document */
+
+  unsigned int next;
+  /* The offset of the document after the current one */
+
+  unsigned int nhits;
+
+  /* The rest is only used in packed chunks, see blob.c */
+  unsigned int packed;
+  /* 1 if the current document is in a packed chunk */
+
+  unsigned int skips, nblocks, block, start, end;
+  /* The offset of the skip table, the number of blocks, the current
+   * block, the offset of the first block and the end of the current
+   * block */
+
+  unsigned int hits_at, unpacked;
+  unsigned short hits[255];
+  /* The hits of the current document are decoded into hits when first
+   * used */
 } Blob;
 
 typedef enum {
@@ -46,6 +66,17 @@ void wf_blob_free( Blob *b );
 int wf_blob_next( Blob *b );
 /* Return the document-id of the next document in the blob, or -1 */
 
+void wf_blob_set_data( Blob *b, struct pike_string *s );
+/* Use the blob data s, and start over at its first document. The next
+ * wf_blob_next() returns that document.
+ */
+
+int wf_blob_skip( Blob *b, unsigned int docid );
+/* Move to the first document in the blob with an id of at least
+ * docid, and return its id, or -1. Does nothing if the current
+ * document id is already large enough.
+ */
+
 int wf_blob_nhits( Blob *b );
 /* Return the number of hits for the current document in the blob */
 
@@ -63,6 +94,9 @@ int wf_blob_docid( Blob *b );
 int wf_blob_eof( Blob *b );
 /* Returns -1 if there are no more entries available */
 
+struct pike_string *wf_blob_pack( struct pike_string *s );
+/* Return the documents of the blob s in one packed chunk */
+
 void wf_blob_low_add( struct object *o, int docid, int field, int off );
 /* Add a hit */
 
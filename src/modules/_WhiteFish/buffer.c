@@ -81,6 +81,18 @@ void wf_buffer_wint( struct buffer *b,
   b->size += 4;
 }
 
+void wf_buffer_wvarint( struct buffer *b,
+			unsigned int s )
+{
+  wf_buffer_make_space( b, 5 );
+  while( s > 127 )
+  {
+    b->data[b->size++] = (s&127) | 128;
+    s >>= 7;
+  }
+  b->data[b->size++] = s;
+}
+
 void wf_buffer_rewind_r( struct buffer *b, int n )
 {
   if( n == -1 )
@@ -70,6 +70,13 @@ void wf_buffer_wint( struct buffer *b,   unsigned int s );
  * read_only must be 0 
  */
 
+void wf_buffer_wvarint( struct buffer *b, unsigned int s );
+/* Write an int to the buffer in 1 to 5 bytes, 7 bits at a time with
+ * the least significant bits first. The top bit is set in all bytes
+ * but the last. This is the only w* function that is not NBO.
+ * read_only must be 0 
+ */
+
 int wf_buffer_rbyte( struct buffer *b );
 /* Read a byte from the buffer.
  * If wf_buffer_eof() is true, 0 is returned.
@@ -56,31 +56,46 @@ void wf_resultset_free( struct object *o )
   free_object( WF_RESULTSET( o ) );
 }
 
-void wf_resultset_add( struct object *o,
-		       unsigned int document,
-		       unsigned int weight )
+int wf_resultset_try_add( struct object *o,
+			  unsigned int document,
+			  unsigned int weight )
 {
   int ind;
   ResultSet *d;
 
   if( !(d=T(o)->d) )
   {
-    wf_resultset_clear( o );
-    d = T(o)->d;
+    if( !(d = malloc( 4 + 8*256 )) )
+      return 0;
+    T(o)->d = d;
+    T(o)->allocated_size = 256;
+    d->num_docs = 0;
   }
   ind = d->num_docs;
   
   if( T(o)->allocated_size == ind )
   {
-    T(o)->allocated_size += 2048;
-    d = T(o)->d = realloc( d, 4 + /* num_docs */
-			   4*T(o)->allocated_size*2 ); /* hits */
+    /* Grow by half, so that building a large set is not quadratic */
+    int size = ind + MAXIMUM( 2048, ind/2 );
+    d = realloc( d, 4 + /* num_docs */
+		 4*size*2 ); /* hits */
     if( !d )
-      Pike_error( "Out of memory" );
+      return 0;
+    T(o)->d = d;
+    T(o)->allocated_size = size;
   }
   d->hits[ind].doc_id = document;
   d->hits[ind].ranking = weight;
   d->num_docs = ind+1;
+  return 1;
+}
+
+void wf_resultset_add( struct object *o,
+		       unsigned int document,
+		       unsigned int weight )
+{
+  if( !wf_resultset_try_add( o, document, weight ) )
+    Pike_error( "Out of memory\n" );
 }
 
 void wf_resultset_avg_ranking( struct object *o, int ind, int weight )
@@ -139,6 +154,54 @@ void wf_resultset_clear( struct object *o )
   T(o)->d->num_docs = 0;
 }
 
+static ResultSet *wf_resultset_reserve( struct object *o, int size )
+/* Make the (empty) set o room for size entries, that are written
+ * directly to the returned hits array. */
+{
+  if( T(o)->d ) free( T(o)->d );
+  if( size < 1 ) size = 1;
+  T(o)->d = malloc( 4 + 8*size );
+  if( !T(o)->d )
+  {
+    T(o)->allocated_size = 0;
+    Pike_error( "Out of memory\n" );
+  }
+  T(o)->allocated_size = size;
+  T(o)->d->num_docs = 0;
+  return T(o)->d;
+}
+
+static INLINE int wf_gallop( struct hits *h, int lo, int size,
+			     unsigned INT32 doc )
+/* Returns the index of the first entry from lo and on with a doc_id
+ * of at least doc, or size if there is none. The steps double until
+ * they pass doc, so skipping n entries takes about 2*log2(n)
+ * comparisons, and the next entry is found at once. */
+{
+  int step = 1, hi;
+  if( lo >= size || h[lo].doc_id >= doc )
+    return lo;
+  while( lo+step < size && h[lo+step].doc_id < doc )
+  {
+    lo += step;
+    step <<= 1;
+  }
+  hi = MINIMUM( lo+step, size );
+  /* h[lo].doc_id < doc <= h[hi].doc_id */
+  while( hi-lo > 1 )
+  {
+    int mid = (lo+hi)>>1;
+    if( h[mid].doc_id < doc )
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return hi;
+}
+
+/* Use galloping when one set is this many times larger than the other */
+#define GALLOP_RATIO 16
+
 struct object *wf_resultset_new( )
 {
   struct object *o;
@@ -333,23 +396,80 @@ static int cmp_docid( void *a, void *b )
   return ai < bi ? -1 : ai == bi ? 0 : 1 ;
 }
 
+static void select_top( struct hits *h, int n, int k, int rev )
+/* Moves the k entries with the highest ranking (the lowest if rev)
+ * first in h, in no particular order. Quickselect, so this takes
+ * linear time instead of sorting all n. */
+{
+  int lo = 0, hi = n-1;
+#define RANK(X) (rev ? -(INT64)(INT32)(X).ranking : (INT64)(INT32)(X).ranking)
+  k--;
+  while( lo < hi )
+  {
+    INT64 pivot = RANK( h[(lo+hi)>>1] );
+    int i = lo, j = hi;
+    while( i <= j )
+    {
+      while( RANK( h[i] ) > pivot ) i++;
+      while( RANK( h[j] ) < pivot ) j--;
+      if( i <= j )
+      {
+	struct hits tmp = h[i];
+	h[i++] = h[j];
+	h[j--] = tmp;
+      }
+    }
+    if( k <= j )
+      hi = j;
+    else if( k >= i )
+      lo = i;
+    else
+      break;
+  }
+#undef RANK
+}
+
+static void low_sort( INT32 args, int rev )
+{
+  INT_TYPE max = 0;
+  int n;
+  if( args && Pike_sp[-args].type == PIKE_T_INT )
+    max = Pike_sp[-args].u.integer;
+  if( !THIS->d )
+    return;
+  n = THIS->d->num_docs;
+  if( max > 0 && max < n )
+  {
+    select_top( THIS->d->hits, n, max, rev );
+    n = max;
+  }
+  fsort( THIS->d->hits, n, 8, (void *)(rev ? cmp_hits_rev : cmp_hits) );
+}
+
 static void f_resultset_sort( INT32 args )
-/*! @decl void sort()
- *!   Sort this ResultSet according to ranking.
+/*! @decl object sort(void|int max)
+ *!   Sort this ResultSet according to ranking, highest first.
+ *!
+ *! @param max
+ *!   Only sort the @[max] highest ranked entries to the start of the
+ *!   set, and leave the rest after them in no particular order. This
+ *!   is a lot faster than sorting a large set when only the first few
+ *!   hits are going to be used.
  */
 {
-  if(THIS->d)
-    fsort( THIS->d->hits, THIS->d->num_docs, 8, (void *)cmp_hits );
+  low_sort( args, 0 );
   RETURN_THIS();
 }
 
 static void f_resultset_sort_rev( INT32 args )
-/*! @decl void sort()
- *!   Sort this ResultSet according to ranking.
+/*! @decl object sort_rev(void|int max)
+ *!   Sort this ResultSet according to ranking, lowest first.
+ *!
+ *! @param max
+ *!   As for @[sort()].
  */
 {
-  if(THIS->d)
-    fsort( THIS->d->hits, THIS->d->num_docs, 8, (void *)cmp_hits_rev );
+  low_sort( args, 1 );
   RETURN_THIS();
 }
 
@@ -548,26 +668,99 @@ static void f_resultset_or( INT32 args )
   wf_resultset_push( res );
 }
 
+static void f_resultset_merge( INT32 args )
+/*! @decl ResultSet merge( ResultSet ... sets )
+ *!
+ *! Return a new resultset with all entries in this set and @[sets],
+ *! like @expr{this | set1 | set2 ...@}, but merged in one pass. The
+ *! rankings are added if a document exists in several sets.
+ */
+{
+  struct cursor { struct hits *h, *end; } *heap;
+  struct object *res;
+  ResultSet *d;
+  int i, n = 0, total = 0;
+  ONERROR err;
+
+  for( i = 0; i<args; i++ )
+    if( Pike_sp[i-args].type != PIKE_T_OBJECT ||
+	!get_storage( Pike_sp[i-args].u.object, resultset_program ) )
+      SIMPLE_BAD_ARG_ERROR( "merge", i+1, "ResultSet" );
+
+  heap = xalloc( sizeof( struct cursor ) * (args+1) );
+  SET_ONERROR( err, free, heap );
+
+  /* The sets are kept in a heap on their current doc_id */
+#define DOC(X) (heap[X].h->doc_id)
+#define SIFT_DOWN(X) do {						\
+    int _p = (X);							\
+    while( 1 )								\
+    {									\
+      int _c = 2*_p+1;							\
+      struct cursor _t;							\
+      if( _c >= n ) break;						\
+      if( _c+1 < n && DOC(_c+1) < DOC(_c) ) _c++;			\
+      if( DOC(_p) <= DOC(_c) ) break;					\
+      _t = heap[_p]; heap[_p] = heap[_c]; heap[_c] = _t;		\
+      _p = _c;								\
+    }									\
+  } while(0)
+
+  for( i = -1; i<args; i++ )
+  {
+    ResultSet *s = i < 0 ? THIS->d : T(Pike_sp[i-args].u.object)->d;
+    if( s && s->num_docs )
+    {
+      heap[n].h = s->hits;
+      heap[n++].end = s->hits + s->num_docs;
+      total += s->num_docs;
+    }
+  }
+  for( i = n/2-1; i>=0; i-- )
+    SIFT_DOWN( i );
+
+  res = wf_resultset_new();
+  push_object( res );
+  d = wf_resultset_reserve( res, total );
+
+  while( n )
+  {
+    struct hits *h = heap[0].h;
+    if( d->num_docs && d->hits[d->num_docs-1].doc_id == h->doc_id )
+      d->hits[d->num_docs-1].ranking += h->ranking;
+    else
+      d->hits[d->num_docs++] = *h;
+    if( ++heap[0].h == heap[0].end )
+      heap[0] = heap[--n];
+    SIFT_DOWN( 0 );
+  }
+#undef SIFT_DOWN
+#undef DOC
+
+  CALL_AND_UNSET_ONERROR( err );
+  Pike_sp--;
+  pop_n_elems( args );
+  wf_resultset_push( res );
+}
+
 static void f_resultset_intersect( INT32 args )
 /*! @decl ResultSet intersect( ResultSet a )
  *! @decl ResultSet `&( ResultSet a )
  *!
  *! Return a new resultset with all entries that are present in _both_
  *! sets. Only the document_id is checked, the resulting ranking is
- *! the sum of the rankings if the two sets.
+ *! the sum of the rankings if the two sets. An entry with ranking 0
+ *! (such as from a finalized @[DateSet]) counts as having the ranking
+ *! of the entry in the other set.
  */
 {
   struct object *res = wf_resultset_new();
   struct object *left = Pike_fp->current_object;
   struct object *right;
-  int lp=-1, rp=-1;
-
-  int left_used=1, right_used=1;
-  int left_left=1, right_left=1;
+  int lp=0, rp=0, n=0;
   int right_size, left_size;
-
-  int left_doc=0, left_rank=0, right_doc=0, right_rank=2147483647, last=-1;
-  ResultSet *set_r, *set_l = T(left)->d;
+  ResultSet *set_r, *set_l = T(left)->d, *d;
+  struct hits *l, *r;
 
   get_all_args( "intersect", args, "%o", &right );
 
@@ -583,65 +776,59 @@ static void f_resultset_intersect( INT32 args )
 
   left_size = set_l->num_docs;
   right_size = set_r->num_docs;
+  d = wf_resultset_reserve( res, MINIMUM( left_size, right_size ) );
+  l = set_l->hits;
+  r = set_r->hits;
+
+#define EMIT(L,R) do {							\
+    unsigned INT32 lr = (L).ranking, rr = (R).ranking;			\
+    if( !lr ) lr = rr;							\
+    if( !rr ) rr = lr;							\
+    if( !n || d->hits[n-1].doc_id < (L).doc_id )			\
+    {									\
+      d->hits[n].doc_id = (L).doc_id;					\
+      d->hits[n++].ranking = lr+rr;					\
+    }									\
+  } while(0)
 
-  while( left_left && right_left )
+  if( (INT64)left_size*GALLOP_RATIO < right_size )
   {
-    if( left_left && left_used ) /* New from left */
+    /* Look up the few left entries in the right set */
+    for( ; lp<left_size; lp++ )
     {
-      if( ++lp == left_size )
-      {
-	left_left = 0;
-	continue;
-      }
-      else
-      {
-	left_doc = set_l->hits[lp].doc_id;
-	left_rank = set_l->hits[lp].ranking;
-	if( !left_rank ) left_rank = right_rank;
-	if( !right_left )right_rank = left_rank;
-	left_used = 0;
-      }
+      rp = wf_gallop( r, rp, right_size, l[lp].doc_id );
+      if( rp == right_size )
+	break;
+      if( r[rp].doc_id == l[lp].doc_id )
+	EMIT( l[lp], r[rp] );
     }
-
-    if( right_left && right_used ) /* New from right */
+  }
+  else if( (INT64)right_size*GALLOP_RATIO < left_size )
+  {
+    for( ; rp<right_size; rp++ )
     {
-      if( ++rp == right_size )
-      {
-	right_left = 0;
-	continue;
-      }
-      else
-      {
-	right_doc = set_r->hits[rp].doc_id;
-	right_rank = set_r->hits[rp].ranking;
-	if( !right_rank ) right_rank = left_rank;
-	if( !left_left ) left_rank = right_rank;
-	right_used = 0;
-      }
+      lp = wf_gallop( l, lp, left_size, r[rp].doc_id );
+      if( lp == left_size )
+	break;
+      if( l[lp].doc_id == r[rp].doc_id )
+	EMIT( l[lp], r[rp] );
     }
-
-    if(!right_left || (left_doc <= right_doc))
-    {
-      if( left_doc == right_doc )
-      {	
-	if(left_doc>last)
-	  wf_resultset_add( res, (last = left_doc),
-			    left_rank+right_rank ); 
-      }
-      left_used=1;
-    }
-
-    if(!left_left || (right_doc <= left_doc))
+  }
+  else
+  {
+    /* Plain merge, stepping without branches */
+    while( lp<left_size && rp<right_size )
     {
-      if( right_doc == left_doc )
-      {	
-	if(right_doc>last)
-	  wf_resultset_add( res, (last = right_doc),
-			    left_rank+right_rank );
-      }
-      right_used=1;
+      unsigned INT32 ld = l[lp].doc_id, rd = r[rp].doc_id;
+      if( ld == rd )
+	EMIT( l[lp], r[rp] );
+      lp += (ld <= rd);
+      rp += (rd <= ld);
     }
   }
+#undef EMIT
+
+  d->num_docs = n;
   pop_n_elems( args );
   wf_resultset_push( res );
 }
@@ -657,14 +844,9 @@ static void f_resultset_add_ranking( INT32 args )
   struct object *res = wf_resultset_new();
   struct object *left = Pike_fp->current_object;
   struct object *right;
-  int lp=-1, rp=-1;
-
-  int left_used=1, right_used=1;
-  int left_left=1, right_left=1;
+  int lp, rp=0, n=0;
   int right_size, left_size;
-
-  int left_doc=0, left_rank=0, right_rank=0, right_doc=0, last=-1;
-  ResultSet *set_r, *set_l = T(left)->d;
+  ResultSet *set_r, *set_l = T(left)->d, *d;
 
   get_all_args( "sub", args, "%o", &right );
 
@@ -688,59 +870,22 @@ static void f_resultset_add_ranking( INT32 args )
   
   left_size = set_l->num_docs;
   right_size = set_r->num_docs;
-  
-  while( left_left )
-  {
-    if( left_left && left_used ) /* New from left */
-    {
-      if( ++lp == left_size )
-      {
-	left_left = 0;
-	continue;
-      }
-      else
-      {
-	left_doc = set_l->hits[lp].doc_id;
-	left_rank = set_l->hits[lp].ranking;
-	left_used = 0;
-      }
-    }
+  d = wf_resultset_reserve( res, left_size );
 
-    if( right_left && right_used ) /* New from right */
-    {
-      if( ++rp == right_size )
-      {
-	right_left = 0;
-	if( !left_left )
-	  continue;
-      }
-      else
-      {
-	right_doc = set_r->hits[rp].doc_id;
-	right_rank = set_r->hits[rp].ranking;
-	right_used = 0;
-      }
-    }
-
-
-    if(!right_left || (left_doc <= right_doc))
-    {
-      if( left_doc != right_doc )
-      {	
-	if( left_doc > last )
-	  wf_resultset_add( res, (last = left_doc), left_rank );
-      } else
-	wf_resultset_add( res, (last = left_doc), left_rank+right_rank );
-
-      left_used=1;
-    }
-
-    if( right_doc <= left_doc )
-      right_used=1;
+  for( lp=0; lp<left_size; lp++ )
+  {
+    unsigned INT32 doc = set_l->hits[lp].doc_id;
+    unsigned INT32 rank = set_l->hits[lp].ranking;
+    rp = wf_gallop( set_r->hits, rp, right_size, doc );
+    if( rp < right_size && set_r->hits[rp].doc_id == doc )
+      rank += set_r->hits[rp].ranking;
+    else if( n && d->hits[n-1].doc_id >= doc )
+      continue;
+    d->hits[n].doc_id = doc;
+    d->hits[n++].ranking = rank;
   }
-  if( !left_used )
-    if(left_doc!=last)
-      wf_resultset_add( res, (last = left_doc), left_rank );
+
+  d->num_docs = n;
   pop_n_elems( args );
   wf_resultset_push( res );
 }
@@ -758,14 +903,9 @@ static void f_resultset_sub( INT32 args )
   struct object *res = wf_resultset_new();
   struct object *left = Pike_fp->current_object;
   struct object *right;
-  int lp=-1, rp=-1;
-
-  int left_used=1, right_used=1;
-  int left_left=1, right_left=1;
+  int lp, rp=0, n=0;
   int right_size, left_size;
-
-  int left_doc=0, left_rank=0, right_doc=0, last=-1;
-  ResultSet *set_r, *set_l = T(left)->d;
+  ResultSet *set_r, *set_l = T(left)->d, *d;
 
   get_all_args( "sub", args, "%o", &right );
 
@@ -790,56 +930,20 @@ static void f_resultset_sub( INT32 args )
   
   left_size = set_l->num_docs;
   right_size = set_r->num_docs;
-  
-  while( left_left )
-  {
-    if( left_left && left_used ) /* New from left */
-    {
-      if( ++lp == left_size )
-      {
-	left_left = 0;
-	continue;
-      }
-      else
-      {
-	left_doc = set_l->hits[lp].doc_id;
-	left_rank = set_l->hits[lp].ranking;
-	left_used = 0;
-      }
-    }
-
-    if( right_left && right_used ) /* New from right */
-    {
-      if( ++rp == right_size )
-      {
-	right_left = 0;
-	if( !left_left )
-	  continue;
-      }
-      else
-      {
-	right_doc = set_r->hits[rp].doc_id;
-	right_used = 0;
-      }
-    }
-
+  d = wf_resultset_reserve( res, left_size );
 
-    if(!right_left || (left_doc <= right_doc))
-    {
-      if( left_doc != right_doc )
-      {	
-	if(left_doc>last)
-	  wf_resultset_add( res, (last = left_doc), left_rank );
-      }
-      left_used=1;
-    }
-
-    if( right_doc <= left_doc )
-      right_used=1;
+  for( lp=0; lp<left_size; lp++ )
+  {
+    unsigned INT32 doc = set_l->hits[lp].doc_id;
+    rp = wf_gallop( set_r->hits, rp, right_size, doc );
+    if( rp < right_size && set_r->hits[rp].doc_id == doc )
+      continue;
+    if( n && d->hits[n-1].doc_id >= doc )
+      continue;
+    d->hits[n++] = set_l->hits[lp];
   }
-  if( !left_used )
-    if(left_doc!=last)
-      wf_resultset_add( res, (last = left_doc), left_rank );
+
+  d->num_docs = n;
   pop_n_elems( args );
   wf_resultset_push( res );
 }
@@ -1029,8 +1133,9 @@ void init_resultset_program(void)
     add_function("create",f_resultset_create,
 		 "function(void|array(int|array(int)):void)",0);
 
-    add_function("sort",f_resultset_sort,"function(void:object)",0);
-    add_function("sort_rev",f_resultset_sort_rev,"function(void:object)",0);
+    add_function("sort",f_resultset_sort,"function(void|int:object)",0);
+    add_function("sort_rev",f_resultset_sort_rev,
+		 "function(void|int:object)",0);
     add_function("sort_docid",f_resultset_sort_docid,
 		 "function(void:object)",0);
 
@@ -1043,6 +1148,9 @@ void init_resultset_program(void)
     add_function( "`|", f_resultset_or, "function(object:object)", 0 );
     add_function( "`+", f_resultset_or, "function(object:object)", 0 );
 
+    add_function( "merge", f_resultset_merge,
+		  "function(object...:object)", 0 );
+
     add_function( "sub", f_resultset_sub, "function(object:object)", 0 );
     add_function( "`-", f_resultset_sub, "function(object:object)", 0 );
 
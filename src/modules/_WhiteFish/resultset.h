@@ -36,6 +36,13 @@ void wf_resultset_add  ( struct object *o, unsigned int document,
  * on this set later on.
  */
 
+int wf_resultset_try_add( struct object *o, unsigned int document,
+			  unsigned int weight );
+/* Like wf_resultset_add, but returns 0 instead of throwing an error
+ * when out of memory, so that it can be used without the interpreter
+ * lock.
+ */
+
 void wf_resultset_avg_ranking( struct object *o, int ind, int weight );
 /* Update the ranking element of the given element so that it is
  * (old_value+weight)/2.
@@ -61,6 +68,7 @@ void wf_resultset_clear( struct object *o );
  *  dup()    --> copy
  *  slice(start,num) --> partial (array)
  *  or `| `+
+ *  merge
  *  sub `-
  *  intersect `&
  *  size _sizeof
@@ -11,6 +11,7 @@ RCSID("$Id$");
 #include "array.h"
 #include "module_support.h"
 #include "module.h"
+#include "threads.h"
 
 #include "config.h"
 
@@ -18,6 +19,7 @@ RCSID("$Id$");
 #include "resultset.h"
 #include "blob.h"
 #include "blobs.h"
+#include "buffer.h"
 #include "linkfarm.h"
 
 /* 7.2 compatibility stuff. */
@@ -49,6 +51,18 @@ static void free_stuff( void *_t )
   free( t );
 }
 
+/* Runs X without the interpreter lock if NOLOCK is set. */
+#define MAYBE_UNLOCKED(NOLOCK,X) do {		\
+    if( NOLOCK )				\
+    {						\
+      THREADS_ALLOW();				\
+      X;					\
+      THREADS_DISALLOW();			\
+    }						\
+    else					\
+      X;					\
+  } while(0)
+
 #define OFFSET(X) \
  (X.type == HIT_BODY?X.u.body.pos:X.u.field.pos)
 
@@ -68,7 +82,9 @@ static int _distance_f( int distance )
 }
 
 
-static void handle_hit( Blob **blobs,
+/* Returns 0 if out of memory. Called without the interpreter lock
+ * when the blobs have no feeder. */
+static int handle_hit( Blob **blobs,
 			int nblobs,
 			struct object *res,
 			int docid,
@@ -77,13 +93,17 @@ static void handle_hit( Blob **blobs,
 			double mc, double mp,
 			int cutoff )
 {
-  int i, j, k, end = 0;
-  Hit *hits = malloc( nblobs * sizeof(Hit) );
-  unsigned char *nhits = malloc( nblobs );
-  unsigned char *pos = malloc( nblobs );
+  int i, j, k;
+  Hit *hits = malloc( nblobs * sizeof(Hit) + nblobs*2 );
+  unsigned char *nhits, *pos;
 
   int matrix[65][8];
 
+  if( !hits )
+    return 0;
+  nhits = (unsigned char *)(hits + nblobs);
+  pos = nhits + nblobs;
+
   MEMSET(matrix, 0, sizeof(matrix) );
   MEMSET(hits, 0, nblobs * sizeof(Hit) );
   MEMSET(pos, 0, nblobs );
@@ -112,8 +132,6 @@ static void handle_hit( Blob **blobs,
     }
   }
   
-  free( pos );
-  free( nhits );
   free( hits );
   /* Now we have our nice matrix. Time to do some multiplication */
 
@@ -131,21 +149,56 @@ static void handle_hit( Blob **blobs,
       accum = 32000.0;
     accum_i = (int)(accum *100 ) + 1;
     if( accum > 0.0 )
-      wf_resultset_add( res, docid, accum_i );
+      return wf_resultset_try_add( res, docid, accum_i );
+  }
+  return 1;
+}
+
+static int query_or( Blob **blobs, int nblobs, Blob **tmp,
+		     struct object *res,
+		     double field_c[65], double prox_c[8],
+		     double max_c, double max_p, int cutoff )
+{
+  int i, j;
+
+  /* Main loop: Find the smallest element in the blob array. */
+  while( 1 )
+  {
+    unsigned int min = 0x7fffffff;
+    
+    for( i = 0; i<nblobs; i++ )
+      if( !blobs[i]->eof && ((unsigned int)blobs[i]->docid) < min )
+	min = blobs[i]->docid;
+
+    if( min == 0x7fffffff )
+      break;
+
+    for( j = 0, i = 0; i < nblobs; i++ )
+      if( blobs[i]->docid == min && !blobs[i]->eof )
+	tmp[j++] = blobs[i];
+
+    if( !handle_hit( tmp, j, res, min, &field_c, &prox_c, max_c, max_p,
+		     cutoff ) )
+      return 0;
+    
+    for( i = 0; i<j; i++ )
+      wf_blob_next( tmp[i] );
   }
+  return 1;
 }
 
 static struct object *low_do_query_or( Blob **blobs,
 					  int nblobs,
 					  double field_c[65],
 					  double prox_c[8],
-					  int cutoff)
+					  int cutoff,
+					  int nolock )
 {
   struct object *res = wf_resultset_new();
   struct tofree *__f = malloc( sizeof( struct tofree ) );
   double max_c=0.0, max_p=0.0;
   ONERROR e;
-  int i, j;
+  int i, ok = 1;
   Blob **tmp;
   tmp = malloc( nblobs * sizeof( Blob *) );
 
@@ -170,28 +223,12 @@ static struct object *low_do_query_or( Blob **blobs,
     for( i = 0; i<nblobs; i++ ) /* Forward to first element */
       wf_blob_next( blobs[i] );  
 
-    /* Main loop: Find the smallest element in the blob array. */
-    while( 1 )
-    {
-      unsigned int min = 0x7fffffff;
-    
-      for( i = 0; i<nblobs; i++ )
-	if( !blobs[i]->eof && ((unsigned int)blobs[i]->docid) < min )
-	  min = blobs[i]->docid;
-
-      if( min == 0x7fffffff )
-	break;
-
-      for( j = 0, i = 0; i < nblobs; i++ )
-	if( blobs[i]->docid == min && !blobs[i]->eof )
-	  tmp[j++] = blobs[i];
-
-      handle_hit( tmp, j, res, min, &field_c, &prox_c, max_c, max_p, cutoff );
-    
-      for( i = 0; i<j; i++ )
-	wf_blob_next( tmp[i] );
-    }
+    MAYBE_UNLOCKED( nolock, ok = query_or( blobs, nblobs, tmp, res,
+					    field_c, prox_c, max_c, max_p,
+					    cutoff ) );
   }
+  if( !ok )
+    Pike_error( "Out of memory\n" );
   /* Free workarea and return the result. */
 
   UNSET_ONERROR( e );
@@ -200,7 +237,8 @@ static struct object *low_do_query_or( Blob **blobs,
   return res;
 }
 				
-static void handle_phrase_hit( Blob **blobs,
+/* Returns 0 if out of memory, like handle_hit. */
+static int handle_phrase_hit( Blob **blobs,
 			       int nblobs,
 			       struct object *res,
 			       int docid,
@@ -213,6 +251,8 @@ static void handle_phrase_hit( Blob **blobs,
   int matrix[65];
   double accum = 0.0;
   
+  if( !nhits )
+    return 0;
   MEMSET(matrix, 0, sizeof(matrix) );
 
 
@@ -252,17 +292,75 @@ static void handle_phrase_hit( Blob **blobs,
   free( nhits );  
 
   if( accum > 0.0 )
-    wf_resultset_add( res, docid, (int)(accum*100) );
+    return wf_resultset_try_add( res, docid, (int)(accum*100) );
+  return 1;
+}
+
+/* Moves all blobs forward to the first document that they all
+ * contain. Returns 0 when one of them runs out.
+ *
+ * Each blob is skipped straight to the largest document id seen so
+ * far, instead of stepping the blob with the smallest one, so the
+ * documents of the common words are mostly skipped over without
+ * looking at their hits.
+ */
+static int wf_blob_intersect( Blob **blobs, int nblobs )
+{
+  unsigned int max = 0;
+  int i, same = 0;
+
+  for( i = 0; i<nblobs; i++ )
+    if( blobs[i]->eof )
+      return 0;
+    else if( (unsigned int)wf_blob_docid( blobs[i] ) > max )
+      max = wf_blob_docid( blobs[i] );
+
+  /* Go round until nblobs blobs in a row are at max */
+  for( i = 0; same < nblobs; i = (i+1) % nblobs )
+  {
+    unsigned int d;
+    if( (unsigned int)wf_blob_docid( blobs[i] ) == max )
+    {
+      same++;
+      continue;
+    }
+    d = (unsigned int)wf_blob_skip( blobs[i], max );
+    if( blobs[i]->eof )
+      return 0;
+    if( d == max )
+      same++;
+    else
+    {
+      same = 1;
+      max = d;
+    }
+  }
+  return 1;
+}
+
+static int query_phrase( Blob **blobs, int nblobs, struct object *res,
+			 double field_c[65], double max_c )
+{
+  /* Main loop: Find the next document that is in all blobs. */
+  while( wf_blob_intersect( blobs, nblobs ) )
+  {
+    if( !handle_phrase_hit( blobs, nblobs, res, blobs[0]->docid,
+			    &field_c, max_c ) )
+      return 0;
+    wf_blob_next( blobs[0] );
+  }
+  return 1;
 }
 
 static struct object *low_do_query_phrase( Blob **blobs, int nblobs,
-					   double field_c[65])
+					   double field_c[65],
+					   int nolock )
 {
   struct object *res = wf_resultset_new();
   struct tofree *__f = malloc( sizeof( struct tofree ) );
   double max_c=0.0;
   ONERROR e;
-  int i, j;
+  int i, ok = 1;
   __f->blobs = blobs;
   __f->nblobs = nblobs;
   __f->res = res;
@@ -280,33 +378,11 @@ static struct object *low_do_query_phrase( Blob **blobs, int nblobs,
     for( i = 0; i<nblobs; i++ ) /* Forward to first element */
       wf_blob_next( blobs[i] );
 
-    /* Main loop: Find the smallest element in the blob array. */
-    while( 1 )
-    {
-      unsigned int min = 0x7fffffff;
-    
-      for( i = 0; i<nblobs; i++ )
-	if( blobs[i]->eof )
-	  goto end;
-	else if( ((unsigned int)blobs[i]->docid) < min )
-	  min = blobs[i]->docid;
-
-      if( min == 0x7fffffff )
-	goto end;
-
-      for( j = 0, i = 0; i < nblobs; i++ )
-	if( blobs[i]->docid != min )
-	  goto next;
-
-      handle_phrase_hit( blobs, nblobs, res, min, &field_c, max_c );
-    
-    next:
-      for( i = 0; i<nblobs; i++ )
-	if( blobs[i]->docid == min )
-	  wf_blob_next( blobs[i] );
-    }
+    MAYBE_UNLOCKED( nolock, ok = query_phrase( blobs, nblobs, res,
+						field_c, max_c ) );
   }
-end:
+  if( !ok )
+    Pike_error( "Out of memory\n" );
   /* Free workarea and return the result. */
 
   UNSET_ONERROR( e );
@@ -315,16 +391,32 @@ end:
   return res;
 }
 				
+static int query_and( Blob **blobs, int nblobs, struct object *res,
+		      double field_c[65], double prox_c[8],
+		      double max_c, double max_p, int cutoff )
+{
+  /* Main loop: Find the next document that is in all blobs. */
+  while( wf_blob_intersect( blobs, nblobs ) )
+  {
+    if( !handle_hit( blobs, nblobs, res, blobs[0]->docid, &field_c,&prox_c,
+		     max_c,max_p, cutoff ) )
+      return 0;
+    wf_blob_next( blobs[0] );
+  }
+  return 1;
+}
+
 static struct object *low_do_query_and( Blob **blobs, int nblobs,
 					double field_c[65],
 					double prox_c[8],
-					int cutoff)
+					int cutoff,
+					int nolock )
 {
   struct object *res = wf_resultset_new();
   struct tofree *__f = malloc( sizeof( struct tofree ) );
   double max_c=0.0, max_p=0.0;
   ONERROR e;
-  int i, j;
+  int i, ok = 1;
   __f->blobs = blobs;
   __f->nblobs = nblobs;
   __f->res = res;
@@ -346,34 +438,12 @@ static struct object *low_do_query_and( Blob **blobs, int nblobs,
     for( i = 0; i<nblobs; i++ ) /* Forward to first element */
       wf_blob_next( blobs[i] );
 
-    /* Main loop: Find the smallest element in the blob array. */
-    while( 1 )
-    {
-      unsigned int min = 0x7fffffff;
-    
-      for( i = 0; i<nblobs; i++ )
-	if( blobs[i]->eof )
-	  goto end;
-	else if( ((unsigned int)blobs[i]->docid) < min )
-	  min = blobs[i]->docid;
-
-      if( min == 0x7fffffff )
-	goto end;
-
-      for( j = 0, i = 0; i < nblobs; i++ )
-	if( blobs[i]->docid != min )
-	  goto next;
-
-      handle_hit( blobs, nblobs, res, min, &field_c,&prox_c, max_c,max_p,
-		  cutoff );
-    
-    next:
-      for( i = 0; i<nblobs; i++ )
-	if( blobs[i]->docid == min )
-	  wf_blob_next( blobs[i] );
-    }
+    MAYBE_UNLOCKED( nolock, ok = query_and( blobs, nblobs, res,
+					     field_c, prox_c, max_c, max_p,
+					     cutoff ) );
   }
-end:
+  if( !ok )
+    Pike_error( "Out of memory\n" );
   /* Free workarea and return the result. */
 
   UNSET_ONERROR( e );
@@ -382,6 +452,43 @@ end:
   return res;
 }
 
+/* Makes the Blobs for the words. cb is either the blob feeder, or an
+ * array with the whole blob of each word, in which case *nolock is
+ * set since the query then needs no callbacks. */
+static Blob **make_blobs( struct array *words, struct svalue *cb,
+			  int *nolock )
+{
+  Blob **blobs;
+  int i;
+
+  *nolock = 0;
+  if( cb->type == PIKE_T_ARRAY )
+  {
+    struct array *data = cb->u.array;
+    if( data->size != words->size )
+      Pike_error( "Expected one blob per word.\n" );
+    for( i = 0; i<data->size; i++ )
+      if( data->item[i].type == PIKE_T_STRING ?
+	  data->item[i].u.string->size_shift :
+	  !UNSAFE_IS_ZERO( data->item + i ) )
+	Pike_error( "Bad element %d in blob array, "
+		    "expected 8-bit string or 0.\n", i );
+    *nolock = 1;
+  }
+
+  blobs = malloc( sizeof(Blob *) * words->size );
+  if( !blobs )
+    Pike_error( "Out of memory\n" );
+  for( i = 0; i<words->size; i++ )
+  {
+    blobs[i] = wf_blob_new( *nolock ? NULL : cb,
+			    words->item[i].u.string );
+    if( *nolock && cb->u.array->item[i].type == PIKE_T_STRING )
+      wf_blob_set_data( blobs[i], cb->u.array->item[i].u.string );
+  }
+  return blobs;
+}
+
 /*! @module Search
  */
 
@@ -410,11 +517,16 @@ static void f_do_query_phrase( INT32 args )
  *!     
  *! This function returns a Pike string containing the word hits for a
  *! certain word_id. Call repeatedly until it returns @expr{0@}.
+ *!
+ *! Alternatively an array with the complete blob of each word (or
+ *! @expr{0@} for none). The query then runs without the interpreter
+ *! lock, so several queries can be run in parallel, as
+ *! @[Search.Segments] does.
  */
 {
   double proximity_coefficients[8];
   double field_coefficients[65];
-  int numblobs, i;
+  int numblobs, i, nolock;
   Blob **blobs;
 
   struct svalue *cb;
@@ -437,15 +549,12 @@ static void f_do_query_phrase( INT32 args )
     return;
   }
 
-  blobs = malloc( sizeof(Blob *) * numblobs );
-
-  for( i = 0; i<numblobs; i++ )
-    blobs[i] = wf_blob_new( cb, _words->item[i].u.string );
+  blobs = make_blobs( _words, cb, &nolock );
 
   for( i = 0; i<65; i++ )
     field_coefficients[i] = (double)_field->item[i].u.integer;
 
-  res = low_do_query_phrase(blobs,numblobs, field_coefficients );
+  res = low_do_query_phrase(blobs,numblobs, field_coefficients, nolock );
   pop_n_elems( args );
   wf_resultset_push( res );
 }
@@ -501,11 +610,16 @@ static void f_do_query_and( INT32 args )
  *!     
  *! This function returns a Pike string containing the word hits for a
  *! certain word_id. Call repeatedly until it returns @expr{0@}.
+ *!
+ *! Alternatively an array with the complete blob of each word (or
+ *! @expr{0@} for none). The query then runs without the interpreter
+ *! lock, so several queries can be run in parallel, as
+ *! @[Search.Segments] does.
  */
 {
   double proximity_coefficients[8];
   double field_coefficients[65];
-  int numblobs, i, cutoff;
+  int numblobs, i, cutoff, nolock;
   Blob **blobs;
 
   struct svalue *cb;
@@ -530,10 +644,7 @@ static void f_do_query_and( INT32 args )
     return;
   }
 
-  blobs = malloc( sizeof(Blob *) * numblobs );
-
-  for( i = 0; i<numblobs; i++ )
-    blobs[i] = wf_blob_new( cb, _words->item[i].u.string );
+  blobs = make_blobs( _words, cb, &nolock );
 
   for( i = 0; i<8; i++ )
     proximity_coefficients[i] = (double)_prox->item[i].u.integer;
@@ -544,7 +655,7 @@ static void f_do_query_and( INT32 args )
   res = low_do_query_and(blobs,numblobs,
 			 field_coefficients,
 			 proximity_coefficients,
-			 cutoff );
+			 cutoff, nolock );
 
   pop_n_elems( args );
   wf_resultset_push( res );
@@ -601,11 +712,16 @@ static void f_do_query_or( INT32 args )
  *!     
  *! This function returns a Pike string containing the word hits for a
  *! certain word_id. Call repeatedly until it returns @expr{0@}.
+ *!
+ *! Alternatively an array with the complete blob of each word (or
+ *! @expr{0@} for none). The query then runs without the interpreter
+ *! lock, so several queries can be run in parallel, as
+ *! @[Search.Segments] does.
  */
 {
   double proximity_coefficients[8];
   double field_coefficients[65];
-  int numblobs, i, cutoff;
+  int numblobs, i, cutoff, nolock;
   Blob **blobs;
 
   struct svalue *cb;
@@ -630,10 +746,7 @@ static void f_do_query_or( INT32 args )
     return;
   }
 
-  blobs = malloc( sizeof(Blob *) * numblobs );
-
-  for( i = 0; i<numblobs; i++ )
-    blobs[i] = wf_blob_new( cb, _words->item[i].u.string );
+  blobs = make_blobs( _words, cb, &nolock );
 
   for( i = 0; i<8; i++ )
     proximity_coefficients[i] = (double)_prox->item[i].u.integer;
@@ -644,7 +757,7 @@ static void f_do_query_or( INT32 args )
   res = low_do_query_or(blobs,numblobs,
 			field_coefficients,
 			proximity_coefficients,
-			cutoff );
+			cutoff, nolock );
   pop_n_elems( args );
   wf_resultset_push( res );
 }
@@ -662,17 +775,17 @@ PIKE_MODULE_INIT
 
   add_function( "do_query_or", f_do_query_or,
 		"function(array(string),array(int),array(int),int"
-		",function(string,int:string):object)",
+		",function(string,int:string)|array(string):object)",
 		0 );
 
   add_function( "do_query_and", f_do_query_and,
 		"function(array(string),array(int),array(int),int"
-		",function(string,int:string):object)",
+		",function(string,int:string)|array(string):object)",
 		0 );
 
   add_function( "do_query_phrase", f_do_query_phrase,
 		"function(array(string),array(int)"
-		",function(string,int:string):object)",
+		",function(string,int:string)|array(string):object)",
 		0 );
 }
 
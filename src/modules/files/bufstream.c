@@ -0,0 +1,697 @@
+/*
+|| This file is part of Pike. For copyright information see COPYRIGHT.
+|| Pike is distributed under GPL, LGPL and MPL. See the file COPYING
+|| for more information.
+|| $Id$
+*/
+
+#define NO_PIKE_SHORTHAND
+#include "global.h"
+
+#include "file_machine.h"
+
+#include "fdlib.h"
+#include "interpret.h"
+#include "svalue.h"
+#include "stralloc.h"
+#include "array.h"
+#include "object.h"
+#include "program.h"
+#include "pike_error.h"
+#include "pike_types.h"
+#include "threads.h"
+#include "module_support.h"
+#include "builtin_functions.h"
+#include "file.h"
+
+#ifdef HAVE_SYS_TYPE_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#include <errno.h>
+
+#include "dmalloc.h"
+
+#if !defined(HAVE_WRITEV) && !defined(HAVE_SYS_UIO_H)
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
+#if ! defined(EWOULDBLOCK) && defined(WSAEWOULDBLOCK)
+#define EWOULDBLOCK WSAEWOULDBLOCK
+#endif
+
+/* Minimum amount of free space to offer read(2) in fill(). */
+#define BUFSTREAM_READ_CHUNK	8192
+
+/* Default maximum amount of buffered input. */
+#define BUFSTREAM_MAX_INPUT	(16*1024*1024)
+
+/* Maximum number of iovecs handed to a single writev(2). */
+#define BUFSTREAM_MAX_IOV	64
+
+/*! @module Stdio
+ */
+
+/*! @class BufferedStream
+ *!
+ *! Buffered nonblocking I/O on top of a @[Stdio.File] (or @[Stdio.Fd]).
+ *!
+ *! Incoming data is read into an internal buffer with @[fill()], and
+ *! can then be extracted as lines, delimited records or binary
+ *! integers without first creating a string for every @[Stdio.File()->read()].
+ *!
+ *! Outgoing data is queued with @[write()] and written with
+ *! @tt{writev(2)@} from the write callback of the file, which is
+ *! installed while there is pending output and removed when the queue
+ *! has drained.
+ *!
+ *! @note
+ *!   The file should be in nonblocking mode. The interpreter lock is
+ *!   kept during the I/O calls, since the buffers are shared with
+ *!   other threads.
+ */
+
+struct bufstream
+{
+  struct svalue file;		/* Mapped. */
+  struct svalue drain_cb;	/* Mapped. */
+
+  /* Input buffer. Valid data is in [in_start, in_end). */
+  unsigned char *in_buf;
+  size_t in_size;
+  size_t in_start;
+  size_t in_end;
+  size_t in_max;
+
+  /* Output queue. A ring of out_alloc string pointers, where out_cnt
+   * entries starting at out_first are in use. The first out_offset
+   * bytes of the first string have already been written. */
+  struct pike_string **out_q;
+  int out_first;
+  int out_cnt;
+  int out_alloc;
+  size_t out_offset;
+  size_t out_pending;
+
+  int write_cb_installed;
+  int my_errno;
+};
+
+#undef THIS
+#define THIS ((struct bufstream *)(Pike_fp->current_storage))
+
+static int bufstream_flush_fun_num = -1;
+
+static int bufstream_fd(struct bufstream *bs)
+{
+  int fd;
+  if ((bs->file.type != PIKE_T_OBJECT) || !bs->file.u.object->prog)
+    Pike_error("No file attached to the stream.\n");
+  fd = fd_from_object(bs->file.u.object);
+  if (fd < 0)
+    Pike_error("File not open.\n");
+  return fd;
+}
+
+/* Make room for at least need bytes after in_end. */
+static void bufstream_reserve(struct bufstream *bs, size_t need)
+{
+  size_t len = bs->in_end - bs->in_start;
+
+  if (bs->in_size - bs->in_end >= need) return;
+
+  if (bs->in_start && (bs->in_size - len >= need)) {
+    /* Compacting is enough. */
+    MEMMOVE(bs->in_buf, bs->in_buf + bs->in_start, len);
+  } else {
+    size_t new_size = bs->in_size ? bs->in_size : BUFSTREAM_READ_CHUNK;
+    unsigned char *new_buf;
+    while (new_size - len < need) {
+      if (new_size > (((size_t)-1)>>1))
+	Pike_error("Input buffer too large.\n");
+      new_size <<= 1;
+    }
+    new_buf = xalloc(new_size);
+    if (len) MEMCPY(new_buf, bs->in_buf + bs->in_start, len);
+    if (bs->in_buf) free(bs->in_buf);
+    bs->in_buf = new_buf;
+    bs->in_size = new_size;
+  }
+  bs->in_start = 0;
+  bs->in_end = len;
+}
+
+static void bufstream_consume(struct bufstream *bs, size_t len)
+{
+  bs->in_start += len;
+  if (bs->in_start == bs->in_end)
+    bs->in_start = bs->in_end = 0;
+}
+
+static void bufstream_push_input(struct bufstream *bs, size_t len,
+				 size_t skip)
+{
+  push_string(make_shared_binary_string((char *)bs->in_buf + bs->in_start,
+					len));
+  bufstream_consume(bs, len + skip);
+}
+
+static void bufstream_set_write_cb(struct bufstream *bs, int enable)
+{
+  if (!enable == !bs->write_cb_installed) return;
+  if (enable)
+    ref_push_function(Pike_fp->current_object,
+		      bufstream_flush_fun_num +
+		      Pike_fp->context->identifier_level);
+  else
+    push_int(0);
+  apply(bs->file.u.object, "set_write_callback", 1);
+  pop_stack();
+  bs->write_cb_installed = enable;
+}
+
+/*! @decl void create(Stdio.File|Stdio.Fd file, int|void max_input)
+ *!
+ *! Attach the stream to @[file].
+ *!
+ *! @param max_input
+ *!   The maximum number of bytes kept in the input buffer. Defaults
+ *!   to 16 MB. See @[fill()].
+ */
+static void bufstream_create(INT32 args)
+{
+  struct object *o;
+  INT_TYPE max_input = BUFSTREAM_MAX_INPUT;
+
+  get_all_args("Stdio.BufferedStream->create", args, "%o.%i",
+	       &o, &max_input);
+  if (fd_from_object(o) < 0)
+    SIMPLE_BAD_ARG_ERROR("Stdio.BufferedStream->create", 1,
+			 "an open Stdio.File");
+  if (max_input < 1)
+    SIMPLE_BAD_ARG_ERROR("Stdio.BufferedStream->create", 2, "int(1..)");
+  assign_svalue(&THIS->file, Pike_sp - args);
+  THIS->in_max = max_input;
+  pop_n_elems(args);
+}
+
+/*! @decl int fill(int|void min_space)
+ *!
+ *! Read as much as is currently available from the file into the
+ *! input buffer, making room for at least @[min_space] bytes
+ *! (default 8192).
+ *!
+ *! This is typically called from the read callback of the file.
+ *!
+ *! No more than the maximum given to @[create()] is buffered, so a
+ *! delimiter that never arrives can't make the buffer grow without
+ *! bound.
+ *!
+ *! @returns
+ *!   Returns the number of bytes read, @expr{0@} (zero) at end of
+ *!   file, and @expr{-1@} on error (including when no data was
+ *!   available). @[errno()] tells which.
+ *!
+ *! @throws
+ *!   Throws an error if the input buffer already holds the maximum
+ *!   number of bytes.
+ */
+static void bufstream_fill(INT32 args)
+{
+  struct bufstream *bs = THIS;
+  INT_TYPE want = BUFSTREAM_READ_CHUNK;
+  ptrdiff_t got, total = 0;
+  int fd = bufstream_fd(bs);
+
+  get_all_args("Stdio.BufferedStream->fill", args, ".%i", &want);
+  if (want < 1) want = BUFSTREAM_READ_CHUNK;
+
+  if (bs->in_end - bs->in_start >= bs->in_max)
+    Pike_error("Input buffer full (%ld bytes).\n", (long)bs->in_max);
+  if ((size_t)want > bs->in_max - (bs->in_end - bs->in_start))
+    want = bs->in_max - (bs->in_end - bs->in_start);
+
+  bufstream_reserve(bs, want);
+
+  while (1) {
+    size_t space = bs->in_size - bs->in_end;
+    size_t left = bs->in_max - (bs->in_end - bs->in_start);
+    if (space > left) space = left;
+    got = fd_read(fd, bs->in_buf + bs->in_end, space);
+    if (got < 0) {
+      int e = errno;
+      if (e == EINTR) {
+	check_threads_etc();
+	continue;
+      }
+      bs->my_errno = e;
+      break;
+    }
+    bs->my_errno = 0;
+    if (!got) break;
+    bs->in_end += got;
+    total += got;
+    if ((size_t)got < space || (size_t)got == left) break;
+    /* The buffer filled up; there may be more. */
+    bufstream_reserve(bs, MINIMUM(bs->in_size, left - got));
+  }
+
+  pop_n_elems(args);
+  if (total) push_int(total);
+  else push_int(got < 0 ? -1 : 0);
+}
+
+/*! @decl int avail()
+ *!
+ *! Returns the number of bytes in the input buffer.
+ */
+static void bufstream_avail(INT32 args)
+{
+  pop_n_elems(args);
+  push_int(THIS->in_end - THIS->in_start);
+}
+
+/*! @decl string read(int|void len)
+ *!
+ *! Extract @[len] bytes from the input buffer.
+ *!
+ *! @returns
+ *!   Returns @expr{0@} (zero) if less than @[len] bytes are
+ *!   buffered. Without @[len] the whole buffer is returned.
+ */
+static void bufstream_read(INT32 args)
+{
+  struct bufstream *bs = THIS;
+  size_t avail = bs->in_end - bs->in_start;
+  INT_TYPE len = -1;
+
+  get_all_args("Stdio.BufferedStream->read", args, ".%i", &len);
+  pop_n_elems(args);
+
+  if (len < 0) len = avail;
+  if ((size_t)len > avail) {
+    push_int(0);
+    return;
+  }
+  bufstream_push_input(bs, len, 0);
+}
+
+/*! @decl string read_until(string(8bit) delimiter)
+ *!
+ *! Extract the data up to the first occurrence of @[delimiter]. The
+ *! delimiter is removed from the buffer, but not included in the
+ *! result.
+ *!
+ *! @returns
+ *!   Returns @expr{0@} (zero) if @[delimiter] isn't in the buffer.
+ */
+static void bufstream_read_until(INT32 args)
+{
+  struct bufstream *bs = THIS;
+  struct pike_string *delim;
+  unsigned char *start, *end, *p;
+
+  get_all_args("Stdio.BufferedStream->read_until", args, "%S", &delim);
+  if (!delim->len)
+    SIMPLE_BAD_ARG_ERROR("Stdio.BufferedStream->read_until", 1,
+			 "non-empty string(8bit)");
+
+  start = bs->in_buf + bs->in_start;
+  end = bs->in_buf + bs->in_end;
+  for (p = start; end - p >= delim->len; p++) {
+    p = MEMCHR(p, STR0(delim)[0], end - p);
+    if (!p || (end - p < delim->len)) break;
+    if (!MEMCMP(p, delim->str, delim->len)) {
+      pop_n_elems(args);
+      bufstream_push_input(bs, p - start, delim->len);
+      return;
+    }
+  }
+  pop_n_elems(args);
+  push_int(0);
+}
+
+/*! @decl string read_line()
+ *!
+ *! Extract one line from the input buffer. The terminating
+ *! @expr{"\n"@} or @expr{"\r\n"@} is removed.
+ *!
+ *! @returns
+ *!   Returns @expr{0@} (zero) if there is no complete line in the
+ *!   buffer.
+ */
+static void bufstream_read_line(INT32 args)
+{
+  struct bufstream *bs = THIS;
+  unsigned char *start = bs->in_buf + bs->in_start;
+  unsigned char *nl;
+  size_t len;
+
+  pop_n_elems(args);
+  if (bs->in_end == bs->in_start ||
+      !(nl = MEMCHR(start, '\n', bs->in_end - bs->in_start))) {
+    push_int(0);
+    return;
+  }
+  len = nl - start;
+  if (len && (nl[-1] == '\r')) {
+    bufstream_push_input(bs, len - 1, 2);
+  } else {
+    bufstream_push_input(bs, len, 1);
+  }
+}
+
+static void bufstream_read_int(INT32 args, int bytes)
+{
+  struct bufstream *bs = THIS;
+  unsigned char *p = bs->in_buf + bs->in_start;
+  unsigned INT32 val = 0;
+  int i;
+
+  pop_n_elems(args);
+  if (bs->in_end - bs->in_start < (size_t)bytes) {
+    push_undefined();
+    return;
+  }
+  for (i = 0; i < bytes; i++)
+    val = (val << 8) | p[i];
+  bufstream_consume(bs, bytes);
+  push_int64(val);
+}
+
+/*! @decl int read_int8()
+ *! @decl int read_int16()
+ *! @decl int read_int32()
+ *!
+ *! Extract an unsigned big-endian (network byte order) integer
+ *! from the input buffer.
+ *!
+ *! @returns
+ *!   Returns @[UNDEFINED] if there aren't enough bytes buffered.
+ */
+static void bufstream_read_int8(INT32 args)
+{
+  bufstream_read_int(args, 1);
+}
+
+static void bufstream_read_int16(INT32 args)
+{
+  bufstream_read_int(args, 2);
+}
+
+static void bufstream_read_int32(INT32 args)
+{
+  bufstream_read_int(args, 4);
+}
+
+static void bufstream_enqueue(struct bufstream *bs, struct pike_string *s)
+{
+  if (s->size_shift)
+    Pike_error("Wide strings are not supported.\n");
+  if (!s->len) return;
+  if (bs->out_cnt == bs->out_alloc) {
+    int n = bs->out_alloc ? bs->out_alloc * 2 : 16;
+    struct pike_string **q = xalloc(n * sizeof(struct pike_string *));
+    int i;
+    for (i = 0; i < bs->out_cnt; i++)
+      q[i] = bs->out_q[(bs->out_first + i) % bs->out_alloc];
+    if (bs->out_q) free(bs->out_q);
+    bs->out_q = q;
+    bs->out_first = 0;
+    bs->out_alloc = n;
+  }
+  add_ref(s);
+  bs->out_q[(bs->out_first + bs->out_cnt++) % bs->out_alloc] = s;
+  bs->out_pending += s->len;
+}
+
+/* Returns the number of bytes written, or -1 on error. */
+static ptrdiff_t bufstream_low_flush(struct bufstream *bs)
+{
+  struct iovec iov[BUFSTREAM_MAX_IOV];
+  ptrdiff_t written = 0;
+  int fd = bufstream_fd(bs);
+
+  while (bs->out_cnt) {
+    int cnt = bs->out_cnt, i, short_write;
+    ptrdiff_t res, offered = 0;
+
+    if (cnt > BUFSTREAM_MAX_IOV) cnt = BUFSTREAM_MAX_IOV;
+#ifdef IOV_MAX
+    if (cnt > IOV_MAX) cnt = IOV_MAX;
+#endif
+    for (i = 0; i < cnt; i++) {
+      struct pike_string *s = bs->out_q[(bs->out_first + i) % bs->out_alloc];
+      iov[i].iov_base = s->str;
+      iov[i].iov_len = s->len;
+      offered += s->len;
+    }
+    iov[0].iov_base = ((char *)iov[0].iov_base) + bs->out_offset;
+    iov[0].iov_len -= bs->out_offset;
+    offered -= bs->out_offset;
+
+#ifdef HAVE_WRITEV
+    res = writev(fd, iov, cnt);
+#else
+    res = fd_write(fd, iov[0].iov_base, iov[0].iov_len);
+    offered = iov[0].iov_len;
+#endif
+    if (res < 0) {
+      int e = errno;
+      if (e == EINTR) {
+	check_threads_etc();
+	continue;
+      }
+      bs->my_errno = e;
+      if (e == EWOULDBLOCK) break;
+      return written ? written : -1;
+    }
+    bs->my_errno = 0;
+    written += res;
+    bs->out_pending -= res;
+    short_write = (res < offered);
+
+    /* Release the strings that were completely written. */
+    res += bs->out_offset;
+    while (bs->out_cnt) {
+      struct pike_string *s = bs->out_q[bs->out_first];
+      if (res < s->len) break;
+      res -= s->len;
+      free_string(s);
+      bs->out_first = (bs->out_first + 1) % bs->out_alloc;
+      bs->out_cnt--;
+    }
+    bs->out_offset = res;
+
+    /* Short write; the kernel buffer is full. */
+    if (short_write) break;
+  }
+  if (!bs->out_cnt) bs->out_first = 0;
+  return written;
+}
+
+/*! @decl int flush(mixed|void id)
+ *!
+ *! Write as much of the queued output as possible.
+ *!
+ *! This function is installed as write callback on the file while
+ *! there is pending output. When the queue becomes empty the write
+ *! callback is removed again, and the drain callback (if any) is
+ *! called.
+ *!
+ *! @returns
+ *!   Returns the number of bytes written, or @expr{-1@} on error.
+ *!
+ *! @seealso
+ *!   @[set_drain_callback()]
+ */
+static void bufstream_flush(INT32 args)
+{
+  struct bufstream *bs = THIS;
+  ptrdiff_t written;
+
+  pop_n_elems(args);
+  written = bufstream_low_flush(bs);
+
+  if (written < 0) {
+    bufstream_set_write_cb(bs, 0);
+    push_int(-1);
+    return;
+  }
+  if (bs->out_cnt) {
+    bufstream_set_write_cb(bs, 1);
+  } else {
+    bufstream_set_write_cb(bs, 0);
+    if (!UNSAFE_IS_ZERO(&bs->drain_cb)) {
+      ref_push_object(Pike_fp->current_object);
+      apply_svalue(&bs->drain_cb, 1);
+      pop_stack();
+    }
+  }
+  push_int(written);
+}
+
+/*! @decl int write(string|array(string) data)
+ *!
+ *! Queue @[data] for output.
+ *!
+ *! If the queue was empty an attempt is made to write the data
+ *! directly. Whatever remains is written from the write callback of
+ *! the file.
+ *!
+ *! @returns
+ *!   Returns the number of bytes in the output queue.
+ *!
+ *! @note
+ *!   The strings are not copied; @[data] is referenced until it has
+ *!   been written.
+ */
+static void bufstream_write(INT32 args)
+{
+  struct bufstream *bs = THIS;
+  int was_empty = !bs->out_cnt;
+
+  if (args < 1)
+    SIMPLE_TOO_FEW_ARGS_ERROR("Stdio.BufferedStream->write", 1);
+
+  if (Pike_sp[-args].type == PIKE_T_STRING) {
+    bufstream_enqueue(bs, Pike_sp[-args].u.string);
+  } else if (Pike_sp[-args].type == PIKE_T_ARRAY) {
+    struct array *a = Pike_sp[-args].u.array;
+    INT32 i;
+    if ((a->type_field & ~BIT_STRING) &&
+	(array_fix_type_field(a) & ~BIT_STRING))
+      SIMPLE_BAD_ARG_ERROR("Stdio.BufferedStream->write", 1,
+			   "string|array(string)");
+    for (i = 0; i < a->size; i++)
+      bufstream_enqueue(bs, a->item[i].u.string);
+  } else {
+    SIMPLE_BAD_ARG_ERROR("Stdio.BufferedStream->write", 1,
+			 "string|array(string)");
+  }
+  pop_n_elems(args);
+
+  if (was_empty && bs->out_cnt) {
+    if (bufstream_low_flush(bs) < 0) {
+      push_int(-1);
+      return;
+    }
+    if (bs->out_cnt) bufstream_set_write_cb(bs, 1);
+  }
+  push_int(bs->out_pending);
+}
+
+/*! @decl int query_output_pending()
+ *!
+ *! Returns the number of bytes in the output queue.
+ */
+static void bufstream_query_output_pending(INT32 args)
+{
+  pop_n_elems(args);
+  push_int(THIS->out_pending);
+}
+
+/*! @decl void set_drain_callback(function(Stdio.BufferedStream:void) cb)
+ *!
+ *! Set a callback to be called when the output queue has been
+ *! completely written.
+ */
+static void bufstream_set_drain_callback(INT32 args)
+{
+  if (args < 1)
+    SIMPLE_TOO_FEW_ARGS_ERROR("Stdio.BufferedStream->set_drain_callback", 1);
+  assign_svalue(&THIS->drain_cb, Pike_sp - args);
+  pop_n_elems(args);
+}
+
+/*! @decl int errno()
+ *!
+ *! Returns the error code of the last failed I/O operation.
+ */
+static void bufstream_errno(INT32 args)
+{
+  pop_n_elems(args);
+  push_int(THIS->my_errno);
+}
+
+static void init_bufstream(struct object *o)
+{
+  struct bufstream *bs = THIS;
+  bs->in_buf = NULL;
+  bs->in_size = bs->in_start = bs->in_end = 0;
+  bs->in_max = BUFSTREAM_MAX_INPUT;
+  bs->out_q = NULL;
+  bs->out_first = bs->out_cnt = bs->out_alloc = 0;
+  bs->out_offset = bs->out_pending = 0;
+  bs->write_cb_installed = 0;
+  bs->my_errno = 0;
+  /* map_variable takes care of file and drain_cb. */
+}
+
+static void exit_bufstream(struct object *o)
+{
+  struct bufstream *bs = THIS;
+  if (bs->in_buf) {
+    free(bs->in_buf);
+    bs->in_buf = NULL;
+  }
+  while (bs->out_cnt) {
+    free_string(bs->out_q[bs->out_first]);
+    bs->out_first = (bs->out_first + 1) % bs->out_alloc;
+    bs->out_cnt--;
+  }
+  if (bs->out_q) {
+    free(bs->out_q);
+    bs->out_q = NULL;
+  }
+}
+
+/*! @endclass
+ */
+
+/*! @endmodule
+ */
+
+void init_bufstream_program(void)
+{
+  ptrdiff_t offset;
+  start_new_program();
+  offset = ADD_STORAGE(struct bufstream);
+  MAP_VARIABLE("_file", tObj, ID_PROTECTED,
+	       offset + OFFSETOF(bufstream, file), PIKE_T_MIXED);
+  MAP_VARIABLE("_drain_callback", tMix, ID_PROTECTED,
+	       offset + OFFSETOF(bufstream, drain_cb), PIKE_T_MIXED);
+
+  ADD_FUNCTION("create", bufstream_create,
+	       tFunc(tObj tOr(tVoid,tInt), tVoid), ID_PROTECTED);
+  ADD_FUNCTION("fill", bufstream_fill, tFunc(tOr(tVoid,tInt), tInt), 0);
+  ADD_FUNCTION("avail", bufstream_avail, tFunc(tNone, tInt), 0);
+  ADD_FUNCTION("read", bufstream_read,
+	       tFunc(tOr(tVoid,tInt), tOr(tStr8,tZero)), 0);
+  ADD_FUNCTION("read_until", bufstream_read_until,
+	       tFunc(tStr8, tOr(tStr8,tZero)), 0);
+  ADD_FUNCTION("read_line", bufstream_read_line,
+	       tFunc(tNone, tOr(tStr8,tZero)), 0);
+  ADD_FUNCTION("read_int8", bufstream_read_int8, tFunc(tNone, tInt), 0);
+  ADD_FUNCTION("read_int16", bufstream_read_int16, tFunc(tNone, tInt), 0);
+  ADD_FUNCTION("read_int32", bufstream_read_int32, tFunc(tNone, tInt), 0);
+  ADD_FUNCTION("write", bufstream_write,
+	       tFunc(tOr(tStr,tArr(tStr)), tInt), 0);
+  bufstream_flush_fun_num =
+    ADD_FUNCTION("flush", bufstream_flush, tFunc(tOr(tVoid,tMix), tInt), 0);
+  ADD_FUNCTION("query_output_pending", bufstream_query_output_pending,
+	       tFunc(tNone, tInt), 0);
+  ADD_FUNCTION("set_drain_callback", bufstream_set_drain_callback,
+	       tFunc(tMix, tVoid), 0);
+  ADD_FUNCTION("errno", bufstream_errno, tFunc(tNone, tInt), 0);
+
+  set_init_callback(init_bufstream);
+  set_exit_callback(exit_bufstream);
+
+  end_class("BufferedStream", 0);
+}
@@ -5567,6 +5567,7 @@ void init_files_stat(void);
 void port_setup_program(void);
 void init_sendfile(void);
 void init_udp(void);
+void init_bufstream_program(void);
 
 /*! @decl string _sprintf(int type, void|mapping flags)
  */
@@ -5771,6 +5772,7 @@ PIKE_MODULE_INIT
   port_setup_program();
   init_sendfile();
   init_udp();
+  init_bufstream_program();
 
 #if defined(HAVE_FSETXATTR)
   /*! @decl constant XATTR_CREATE
@@ -64,8 +64,23 @@
 #include <sys/un.h>
 #endif
 
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+
 #include "dmalloc.h"
 
+/* Maximum number of connections accepted per backend event in
+ * dispatch mode, so that a connection storm can't starve the other
+ * callbacks in the backend. */
+#define PORT_DISPATCH_MAX	256
+
+/* Timeout in seconds for TCP_DEFER_ACCEPT in dispatch mode. */
+#define PORT_DEFER_ACCEPT_TIMEOUT	30
+
+/* Maximum number of bytes to read before dispatching. */
+#define PORT_DISPATCH_PEEK_MAX	4096
+
 /*! @module Stdio
  */
 
@@ -78,6 +93,8 @@ struct port
   int my_errno;
   struct svalue accept_callback; /* Mapped. */
   struct svalue id;		/* Mapped. */
+  struct svalue dispatch_callback; /* Mapped. */
+  int dispatch_peek;		/* Bytes to read before dispatching. */
 };
 
 #undef THIS
@@ -577,6 +594,164 @@ static void port_accept(INT32 args)
   stack_pop_n_elems_keep_top(args);
 }
 
+/* Installed as the accept callback while a dispatch callback is set. */
+static int port_accept_dispatch_fun_num = -1;
+static void port_accept_dispatch(INT32 args)
+{
+  struct port *this = THIS;
+  struct object *me = Pike_fp->current_object;
+  int cnt;
+
+  pop_n_elems(args);
+
+  for (cnt = 0; cnt < PORT_DISPATCH_MAX; cnt++) {
+    PIKE_SOCKADDR addr;
+    ACCEPT_SIZE_T len = sizeof(addr);
+    struct object *o;
+    struct my_file *f;
+    struct svalue tmp;
+    int fd, err;
+
+    if (!me->prog || (this->box.fd < 0) ||
+	UNSAFE_IS_ZERO(&this->dispatch_callback))
+      break;
+
+    do {
+#if defined(HAVE_ACCEPT4) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+      fd = accept4(this->box.fd, (struct sockaddr *)&addr, &len,
+		   SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+      fd = fd_accept(this->box.fd, (struct sockaddr *)&addr, &len);
+#endif
+      err = errno;
+    } while (fd < 0 && err == EINTR);
+
+    if (fd < 0) {
+      /* Typically EWOULDBLOCK, ie the accept queue is empty. */
+      this->my_errno = errno = err;
+      break;
+    }
+
+#if !(defined(HAVE_ACCEPT4) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC))
+    set_nonblocking(fd, 1);
+    my_set_close_on_exec(fd, 1);
+#endif
+
+    if (this->dispatch_peek) {
+      char buf[PORT_DISPATCH_PEEK_MAX];
+      ptrdiff_t got;
+      do {
+	got = fd_read(fd, buf, this->dispatch_peek);
+	err = errno;
+      } while (got < 0 && err == EINTR);
+      if (!got || (got < 0 && err != EWOULDBLOCK && err != EAGAIN)) {
+	/* The peer went away before sending anything. */
+	while (fd_close(fd) && errno == EINTR) {}
+	continue;
+      }
+      if (got > 0)
+	push_string(make_shared_binary_string(buf, got));
+      else
+	push_int(0);
+    } else {
+      push_int(0);
+    }
+
+    push_new_fd_object(port_fd_factory_fun_num,
+		       fd, FILE_READ | FILE_WRITE, SOCKET_CAPABILITIES);
+    o = Pike_sp[-1].u.object;
+    f = (struct my_file *)
+      (o->storage + o->prog->inherits[Pike_sp[-1].subtype].storage_offset);
+    f->open_mode |= FILE_NONBLOCKING;
+    if (this->box.backend)
+      change_backend_for_box(&f->box, this->box.backend);
+    push_svalue(&this->id);
+
+    /* Rotate data, file, id into file, id, data. */
+    tmp = Pike_sp[-3];
+    Pike_sp[-3] = Pike_sp[-2];
+    Pike_sp[-2] = Pike_sp[-1];
+    Pike_sp[-1] = tmp;
+
+    apply_svalue(&this->dispatch_callback, 3);
+    pop_stack();
+  }
+  push_int(0);
+}
+
+/*! @decl void set_dispatch_callback( @
+ *!   function(Stdio.Fd, mixed, string:void) dispatch_callback, @
+ *!   int(0..4096)|void peek_bytes)
+ *!
+ *! Accept connections in dispatch mode.
+ *!
+ *! Instead of calling an accept callback that in turn calls
+ *! @[accept()] once per connection, the port drains the accept queue
+ *! by itself whenever it becomes readable, and calls
+ *! @[dispatch_callback] once for every new connection with the
+ *! connection, the id of the port (see @[set_id()]) and the data
+ *! read so far.
+ *!
+ *! The new connections are already in nonblocking mode, close on
+ *! exec, and use the same backend as the port, so only the
+ *! callbacks need to be set.
+ *!
+ *! If @[peek_bytes] is nonzero, an attempt is made to read up to
+ *! that many bytes from the connection before @[dispatch_callback]
+ *! is called; zero is passed if no data had arrived yet. Connections
+ *! that are closed by the peer before sending anything are dropped
+ *! silently. On systems that support @tt{TCP_DEFER_ACCEPT@} the
+ *! kernel is asked to delay the connections until data has arrived.
+ *!
+ *! Setting @[dispatch_callback] to zero turns off dispatch mode,
+ *! and also removes the accept callback.
+ *!
+ *! @note
+ *!   At most @expr{256@} connections are accepted per backend
+ *!   event, to let other callbacks in the same backend run during
+ *!   connection storms.
+ *!
+ *! @seealso
+ *!   @[bind()], @[accept()]
+ */
+static void port_set_dispatch_callback(INT32 args)
+{
+  struct port *p = THIS;
+  struct svalue *cb;
+  INT_TYPE peek = 0;
+
+  get_all_args("Port->set_dispatch_callback", args, "%*.%i", &cb, &peek);
+  if (p->box.fd < 0)
+    Pike_error("Port->set_dispatch_callback(): Port not open.\n");
+  if ((peek < 0) || (peek > PORT_DISPATCH_PEEK_MAX))
+    SIMPLE_BAD_ARG_ERROR("Port->set_dispatch_callback", 2, "int(0..4096)");
+
+  assign_svalue(&p->dispatch_callback, cb);
+  p->dispatch_peek = peek;
+
+  if (UNSAFE_IS_ZERO(cb)) {
+    push_int(0);
+    peek = 0;
+  } else {
+    ref_push_function(Pike_fp->current_object,
+		      port_accept_dispatch_fun_num +
+		      Pike_fp->context->identifier_level);
+  }
+  assign_accept_cb(p, Pike_sp-1);
+  pop_stack();
+
+#if defined(TCP_DEFER_ACCEPT) && defined(IPPROTO_TCP)
+  {
+    /* Just a hint, and not applicable to eg Unix domain sockets. */
+    int secs = peek ? PORT_DEFER_ACCEPT_TIMEOUT : 0;
+    fd_setsockopt(p->box.fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		  (char *)&secs, sizeof(secs));
+  }
+#endif
+
+  pop_n_elems(args);
+}
+
 /*! @decl string query_address()
  *!
  *! Get the address and port of the local socket end-point.
@@ -696,14 +871,15 @@ static void init_port_struct(struct object *o)
 {
   INIT_FD_CALLBACK_BOX(&THIS->box, NULL, o, -1, 0, got_port_event);
   THIS->my_errno=0;
-  /* map_variable takes care of id and accept_callback. */
+  THIS->dispatch_peek=0;
+  /* map_variable takes care of id, accept_callback and dispatch_callback. */
 }
 
 static void exit_port_struct(struct object *o)
 {
   do_close(THIS);
   unhook_fd_callback_box (&THIS->box);
-  /* map_variable takes care of id and accept_callback. */
+  /* map_variable takes care of id, accept_callback and dispatch_callback. */
 }
 
 /*! @endclass
@@ -728,6 +904,8 @@ void port_setup_program(void)
 	       offset + OFFSETOF(port, accept_callback), PIKE_T_MIXED);
   MAP_VARIABLE("_id", tMix, 0,
 	       offset + OFFSETOF(port, id), PIKE_T_MIXED);
+  MAP_VARIABLE("_dispatch_callback", tMix, 0,
+	       offset + OFFSETOF(port, dispatch_callback), PIKE_T_MIXED);
   /* function(int|string,void|mixed,void|string:int) */
   ADD_FUNCTION("bind", port_bind,
 	       tFunc(tOr(tInt,tStr) tOr(tVoid,tMix) tOr(tVoid,tStr),tInt), 0);
@@ -752,6 +930,11 @@ void port_setup_program(void)
     ADD_FUNCTION("fd_factory", port_fd_factory, tFunc(tNone,tObjIs_STDIO_FD),
 		 ID_STATIC);
   ADD_FUNCTION("accept",port_accept,tFunc(tNone,tObjIs_STDIO_FD),0);
+  port_accept_dispatch_fun_num =
+    ADD_FUNCTION("_accept_dispatch", port_accept_dispatch,
+		 tFunc(tOr(tVoid,tMix),tVoid), ID_PROTECTED);
+  ADD_FUNCTION("set_dispatch_callback", port_set_dispatch_callback,
+	       tFunc(tMix tOr(tVoid,tInt),tVoid), 0);
   /* function(void|string|int,void|mixed,void|string:void) */
   ADD_FUNCTION("create", port_create,
 	       tFunc(tOr3(tVoid,tStr,tInt) tOr(tVoid,tMix) tOr(tVoid,tStr),
@@ -0,0 +1,6 @@
+/*
+ * $Id$
+ */
+
+void pike_init_Heap_module(void);
+void pike_exit_Heap_module(void);
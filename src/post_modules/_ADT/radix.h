@@ -0,0 +1,6 @@
+/*
+ * $Id$
+ */
+
+void pike_init_Radix_module(void);
+void pike_exit_Radix_module(void);
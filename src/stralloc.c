@@ -142,6 +142,33 @@ static INLINE int find_magnitude2(const p_wchar2 *s, ptrdiff_t len)
   return 0;
 }
 
+/* Returns the length of the initial run of 7-bit characters in s.
+ *
+ * This is the common fast path for the UTF-8 codecs, so it checks
+ * several machine words per iteration.
+ */
+PMOD_EXPORT ptrdiff_t ascii_prefix_length(const p_wchar0 *s, ptrdiff_t len)
+{
+  const size_t high = (~(size_t)0 / 0xff) * 0x80;
+  const p_wchar0 *p = s, *end = s + len;
+
+  while (end - p >= (ptrdiff_t)(4 * sizeof(size_t))) {
+    size_t w[4];
+    MEMCPY(w, p, sizeof(w));
+    if ((w[0] | w[1] | w[2] | w[3]) & high) break;
+    p += sizeof(w);
+  }
+  while (end - p >= (ptrdiff_t)sizeof(size_t)) {
+    size_t w;
+    MEMCPY(&w, p, sizeof(w));
+    if (w & high) break;
+    p += sizeof(w);
+  }
+  while ((p < end) && !(*p & 0x80)) p++;
+
+  return p - s;
+}
+
 static INLINE int min_magnitude(p_wchar2 c)
 {
   if(c<0) return 2;
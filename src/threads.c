@@ -2492,6 +2492,132 @@ PMOD_EXPORT void th_farm(void (*fun)(void *), void *here)
   new_farmer( fun, here );
 }
 
+/* Parallel loops.
+ *
+ * th_parallel() calls fun(data, i) for i = 0..n-1 on up to threads
+ * threads, counting the calling thread, and returns when all calls
+ * have returned. The indices are handed out in increasing order. The
+ * other threads are helpers that wait in a pool between loops, so a
+ * loop doesn't create any threads once the pool is large enough. It
+ * must be called without the interpreter lock, and fun must not touch
+ * any Pike data.
+ */
+struct th_loop {
+  void (*fun)(void *data, int i);
+  void *data;
+  int n, next;
+  int helpers;			/* Helpers still wanted. */
+  int active;			/* Threads working on the loop. */
+  struct th_loop *queue_next;	/* In loops while helpers are wanted. */
+  COND_T done;
+};
+
+/* Idle helpers above this number exit. */
+#define MAX_IDLE_LOOP_HELPERS	32
+
+static MUTEX_T loop_lock;
+static COND_T loop_work;
+static struct th_loop *loops;
+static int _num_loop_helpers, _num_idle_loop_helpers;
+
+/* Called with loop_lock held. */
+static void th_loop_dequeue(struct th_loop *l)
+{
+  struct th_loop **pp;
+  for (pp = &loops; *pp; pp = &(*pp)->queue_next)
+    if (*pp == l) {
+      *pp = l->queue_next;
+      break;
+    }
+  l->helpers = 0;
+}
+
+/* Called with loop_lock held, which is held again on return. */
+static void th_loop_run(struct th_loop *l)
+{
+  while (l->next < l->n) {
+    int i = l->next++;
+    if (l->next == l->n && l->helpers)
+      th_loop_dequeue(l);
+    mt_unlock(&loop_lock);
+    l->fun(l->data, i);
+    mt_lock(&loop_lock);
+  }
+  if (!--l->active)
+    co_broadcast(&l->done);
+}
+
+static TH_RETURN_TYPE loop_helper(void *arg)
+{
+  mt_lock(&loop_lock);
+  while (1) {
+    struct th_loop *l;
+
+    while (!(l = loops)) {
+      if (_num_idle_loop_helpers >= MAX_IDLE_LOOP_HELPERS) {
+	_num_loop_helpers--;
+	mt_unlock(&loop_lock);
+	return 0;
+      }
+      _num_idle_loop_helpers++;
+      co_wait(&loop_work, &loop_lock);
+      _num_idle_loop_helpers--;
+    }
+
+    if (!--l->helpers)
+      th_loop_dequeue(l);
+    l->active++;
+    th_loop_run(l);
+  }
+  /* NOT_REACHED */
+  return 0;
+}
+
+PMOD_EXPORT void th_parallel(void (*fun)(void *data, int i), void *data,
+			     int n, int threads)
+{
+  struct th_loop l;
+  int i;
+
+  if (threads > n) threads = n;
+  if (threads <= 1) {
+    for (i = 0; i < n; i++)
+      fun(data, i);
+    return;
+  }
+
+  l.fun = fun;
+  l.data = data;
+  l.n = n;
+  l.next = 0;
+  l.helpers = threads - 1;
+  l.active = 1;			/* This thread. */
+  co_init(&l.done);
+
+  mt_lock(&loop_lock);
+  l.queue_next = loops;
+  loops = &l;
+  for (i = _num_idle_loop_helpers; i < l.helpers; i++) {
+    THREAD_T id;
+    if (th_create(&id, loop_helper, NULL))
+      break;
+    _num_loop_helpers++;
+  }
+  co_broadcast(&loop_work);
+
+  th_loop_run(&l);
+  while (l.active)
+    co_wait(&l.done, &loop_lock);
+  mt_unlock(&loop_lock);
+
+  co_destroy(&l.done);
+}
+
+int th_num_loop_helpers(void)
+{
+  return _num_loop_helpers;
+}
+
 /*
  * Glue code.
  */
@@ -2507,6 +2633,8 @@ void low_th_init(void)
   mt_init( & thread_table_lock);
   mt_init( & interleave_lock);
   mt_init( & rosie);
+  mt_init( & loop_lock);
+  co_init( & loop_work);
   co_init( & live_threads_change);
   co_init( & threads_disabled_change);
   thread_table_init();
@@ -109,12 +109,19 @@ void th_cleanup(void);
 int th_num_idle_farmers(void);
 int th_num_farmers(void);
 PMOD_EXPORT void th_farm(void (*fun)(void *), void *here);
+PMOD_EXPORT void th_parallel(void (*fun)(void *data, int i), void *data,
+			     int n, int threads);
+int th_num_loop_helpers(void);
 PMOD_EXPORT void call_with_interpreter(void (*func)(void *ctx), void *ctx);
 PMOD_EXPORT void enable_external_threads(void);
 PMOD_EXPORT void disable_external_threads(void);
 /* Prototypes end here */
 #else
 #define pike_thread_yield()
+#define th_parallel(FUN, DATA, N, THREADS) do {			\
+    int i_;								\
+    for (i_ = 0; i_ < (N); i_++) (FUN)((DATA), i_);			\
+  } while (0)
 
 #endif
 